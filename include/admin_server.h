@@ -0,0 +1,41 @@
+#ifndef ADMIN_SERVER_H
+#define ADMIN_SERVER_H
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+// Metrics in Prometheus text exposition format (version 0.0.4). Reads only
+// atomics and lock-free snapshots; never takes pool_mtx or queue locks.
+std::string render_prometheus_metrics();
+
+// Minimal HTTP listener for operators, separate from the chat port.
+// Serves GET /metrics; everything else gets 404. One request per connection,
+// handled on a single background thread.
+class AdminServer {
+public:
+    AdminServer(const std::string& bind_address, int port);
+    ~AdminServer();
+
+    // Bind and start serving; false if the port could not be opened
+    bool start();
+    void stop();
+
+    int port() const { return bound_port; }  // actual port (useful with port 0)
+
+    AdminServer(const AdminServer&) = delete;
+    AdminServer& operator=(const AdminServer&) = delete;
+
+private:
+    void run();
+    void serve(int client);
+
+    std::string bind_address;
+    int requested_port;
+    int bound_port;
+    int listen_socket;
+    std::atomic<bool> running;
+    std::thread thread;
+};
+
+#endif // ADMIN_SERVER_H
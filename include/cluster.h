@@ -0,0 +1,216 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// What a node does with what its peers send. Called on link reader threads.
+// `node` is the authenticated peer a frame came from; senders are its users.
+class ClusterHandler {
+public:
+    virtual ~ClusterHandler() = default;
+
+    virtual void peer_broadcast(uint16_t node, int64_t timestamp_ms, const std::string& sender,
+                                const std::string& text) = 0;
+    // False if `recipient` is not connected to this node
+    virtual bool peer_private(uint16_t node, const std::string& sender, const std::string& recipient,
+                              const std::string& text) = 0;
+    // `username` came online on, or left, node `node`
+    virtual void peer_presence(uint16_t node, const std::string& username, bool online) = 0;
+    // Users connected to this node, as announced to peers
+    virtual std::vector<std::string> local_users() = 0;
+};
+
+struct PeerAddress {
+    uint16_t node = 0;  // the node id it must say hello with
+    std::string host;   // IPv4 address
+    int port = 0;
+};
+
+// Parses "node@host:port"
+bool parse_peer_address(std::string_view text, PeerAddress& peer);
+
+// Accounts are per node, so a user of another node is known here as
+// "user@node" and never as a local username (which cannot contain '@')
+std::string remote_username(std::string_view username, uint16_t node);
+// Splits "user@node"; false if `name` is not a remote username
+bool split_remote_username(std::string_view name, std::string_view& username, uint16_t& node);
+
+// Reads the cluster's shared secret from `path`, without a trailing newline.
+// False (and logged) if it cannot be read or is under CLUSTER_MIN_SECRET_BYTES.
+bool read_cluster_secret(const std::string& path, std::string& secret);
+
+// Which users are on which other nodes. A node's entries come from its
+// PeerDirectory frames (a full list, sent when its link comes up and every
+// CLUSTER_DIRECTORY_RESYNC_MS) and PeerPresence deltas in between, and are
+// dropped with its link. A user on several nodes is routed to the
+// lowest-numbered one, so every node picks the same route.
+class ClusterDirectory {
+public:
+    // (user, online) for each user whose state on `node` changed
+    std::vector<std::pair<std::string, bool>> replace(uint16_t node, const std::vector<std::string>& users);
+    // False if nothing changed
+    bool add(uint16_t node, const std::string& user);
+    bool remove(uint16_t node, const std::string& user);
+    // The users `node` had
+    std::vector<std::string> drop(uint16_t node);
+
+    // The node `user` is routed to, or 0 if no other node has them
+    uint16_t node_for(std::string_view user) const;
+    // Every (user, node) pair, by user
+    std::vector<std::pair<std::string, uint16_t>> entries() const;
+    size_t size() const;
+
+private:
+    mutable std::mutex mtx;
+    std::map<uint16_t, std::set<std::string, std::less<>>> users_by_node;
+    std::map<std::string, std::set<uint16_t>, std::less<>> nodes_by_user;
+};
+
+struct ClusterStats {
+    size_t peers = 0;
+    size_t peers_up = 0;  // outbound links connected
+    uint64_t frames_sent = 0;
+    uint64_t writes = 0;  // send calls; frames queued together share one
+    uint64_t bytes_sent = 0;
+    uint64_t frames_received = 0;
+    uint64_t frames_dropped = 0;  // link down or its queue full
+    uint64_t links_refused = 0;   // inbound connections that failed the checks in ClusterNode
+    size_t remote_users = 0;
+};
+
+// One server's membership in a peer-to-peer cluster. Every node lists the
+// others with --peer and keeps one persistent TCP link to each, over which
+// it sends (and never receives): broadcasts, private messages for users on
+// that node, and the presence of its own users. A node therefore receives
+// from each peer on the link that peer opened to it. Both directions use the
+// binary protocol's framing and the Peer* frame types in wire_protocol.h.
+//
+// Frames are queued per link and a link's writer thread sends everything
+// queued in one call, so a burst of broadcasts costs one syscall per peer
+// rather than one per message. Each link is one TCP stream, so a peer sees a
+// node's messages in the order the node sent them. Messages are not stored
+// and forwarded: what is sent while a link is down is dropped. Links
+// reconnect every CLUSTER_RECONNECT_MS and announce the node's users again.
+//
+// Only configured peers may link in. A connection is refused unless it comes
+// from the host of a --peer entry, and its hello must carry that entry's
+// node id. Both ends then prove they hold the cluster's shared secret: each
+// returns an HMAC-SHA256 over the other's random nonce and both node ids,
+// and nothing but the handshake is accepted until the proof checks out. At
+// most CLUSTER_MAX_INBOUND_LINKS inbound connections get a reader thread.
+class ClusterNode {
+public:
+    ClusterNode(uint16_t node_id, std::string secret, ClusterHandler& handler);
+    ~ClusterNode();
+
+    // Listens for peers on `bind_address`:`port` (0 picks one) and links to `peers`
+    bool start(const std::string& bind_address, int port, const std::vector<PeerAddress>& peers);
+    void stop();
+    void add_peer(const PeerAddress& peer);
+
+    uint16_t id() const { return node_id; }
+    int port() const { return bound_port; }
+
+    void publish_broadcast(int64_t timestamp_ms, std::string_view sender, std::string_view text);
+    void publish_presence(std::string_view username, bool online);
+    // Sends a private message to the node `recipient` is on, named either
+    // by remote_username() or plainly and looked up in the directory; false
+    // if no other node has them or the link to it is down
+    bool route_private(std::string_view sender, std::string_view recipient, std::string_view text);
+
+    const ClusterDirectory& directory() const { return users; }
+    ClusterStats stats() const;
+
+    ClusterNode(const ClusterNode&) = delete;
+    ClusterNode& operator=(const ClusterNode&) = delete;
+
+private:
+    // An outbound link and its queue
+    struct Link {
+        PeerAddress address;
+        uint16_t peer_id = 0;  // from the peer's first frame back; 0 until known
+        std::mutex mtx;
+        std::condition_variable wake;
+        std::string queued;
+        size_t queued_frames = 0;
+        bool up = false;
+        bool reported_down = false;  // so a dead peer is logged once, not every retry
+        int socket = -1;
+        std::thread writer;
+    };
+
+    // An inbound link as seen by its reader thread
+    struct Inbound {
+        int socket = -1;
+        uint32_t address = 0;      // the peer's IPv4 address, network order
+        uint16_t claimed = 0;      // node id from its hello, until it proved the secret
+        std::string expected;      // the PeerAuth proof that hello calls for
+        uint16_t from = 0;         // the authenticated node, 0 until then
+        uint64_t generation = 0;
+    };
+
+    void accept_loop();
+    void read_loop(int socket, uint32_t address);
+    void write_loop(Link& link);
+    // False if the frame is malformed or unexpected, or the handshake failed
+    bool handle_frame(Inbound& link, uint8_t type, std::string_view payload);
+    bool handle_hello(Inbound& link, std::string_view payload);
+    // Connects and completes the handshake; the socket, or -1
+    int connect_link(Link& link);
+    // True if a configured peer has `address`, and is `node` unless that is 0
+    bool is_peer(uint32_t address, uint16_t node) const;
+    // HMAC-SHA256 under the shared secret of `role`, `nonce` and both ids
+    std::string proof(std::string_view role, std::string_view nonce, uint16_t prover, uint16_t verifier) const;
+    // False if the frame was dropped
+    bool enqueue(Link& link, const std::string& frame);
+    void enqueue_all(const std::string& frame);
+    void node_down(uint16_t node, uint64_t generation);
+
+    const uint16_t node_id;
+    const std::string secret;
+    ClusterHandler& handler;
+    ClusterDirectory users;
+
+    int listen_socket = -1;
+    int bound_port = 0;
+    std::atomic<bool> running{false};
+    std::thread acceptor;
+
+    mutable std::mutex links_mtx;
+    std::vector<std::unique_ptr<Link>> links;
+    std::map<uint16_t, Link*> link_by_node;
+
+    // Inbound links by the node that opened them; a newer link from a node
+    // supersedes the old one, whose loss no longer drops the node's users
+    std::mutex inbound_mtx;
+    std::map<uint16_t, uint64_t> inbound_generation;
+    uint64_t next_generation = 1;
+    std::set<int> inbound_sockets;
+    size_t active_readers = 0;
+    std::condition_variable readers_done;
+
+    std::atomic<uint64_t> frames_sent{0};
+    std::atomic<uint64_t> writes{0};
+    std::atomic<uint64_t> bytes_sent{0};
+    std::atomic<uint64_t> frames_received{0};
+    std::atomic<uint64_t> frames_dropped{0};
+    std::atomic<uint64_t> links_refused{0};
+};
+
+// The node this server belongs to, or nullptr when it runs alone
+ClusterNode* cluster_node();
+void set_cluster_node(ClusterNode* node);
+
+#endif // CLUSTER_H
@@ -6,6 +6,8 @@
 
 // Processes a command message (dispatches to the correct handler)
 void process_command(const Message& msg);
+// Processes a binary frame other than Chat (see wire_protocol.h)
+void process_frame(const Message& msg);
 void handle_stats(const Message& msg);
 void handle_list(const Message& msg);
 void handle_msg(const Message& msg);
@@ -13,6 +15,28 @@ void handle_unknown(const Message& msg);
 void handle_register(const Message& msg);
 void handle_login(const Message& msg);
 void handle_removeuser(const Message& msg);
+void handle_history(const Message& msg);
+void handle_dmhistory(const Message& msg);
+void handle_search(const Message& msg);
+void handle_trace(const Message& msg);
+void handle_top(const Message& msg);
+void handle_capture(const Message& msg);
+void handle_join(const Message& msg);
+void handle_leave(const Message& msg);
+void handle_rooms(const Message& msg);
+void handle_say(const Message& msg);
+void handle_roomhistory(const Message& msg);
+void handle_roombatch(const Message& msg);
+
+// Sends up to `limit` history lines in one write. With resume set, replays
+// the broadcasts after since_seq; otherwise the newest lines.
+void send_history(int socket, bool resume, uint64_t since_seq, size_t limit);
+
+// Delivers a private message a cluster peer routed here from
+// `sender_username`, a remote_username(); false if the recipient is not
+// connected here. Not stored: stored conversations are between local accounts.
+bool deliver_peer_private(const std::string& sender_username, std::string_view recipient,
+                          std::string_view private_message);
 
 
 #endif // COMMAND_PROCESSOR_H
@@ -2,10 +2,30 @@
 #define CONNECTION_POOL_H
 
 #include "constants.h"
+#include "instrumented_mutex.h"
 #include <string>
+#include <string_view>
 #include <chrono>
 #include <vector>
 #include <mutex>
+#include <atomic>
+#include <cstdint>
+
+// Per-connection traffic counters. Updated without pool_mtx by the
+// connection's reader thread and by whichever thread writes to it.
+struct ConnectionTraffic {
+    std::atomic<uint64_t> bytes_in{0};
+    std::atomic<uint64_t> messages_in{0};
+    std::atomic<uint64_t> bytes_out{0};
+    std::atomic<uint64_t> messages_out{0};
+    std::atomic<uint64_t> send_stalls{0};    // writes that found the socket buffer full
+    std::atomic<uint64_t> send_failures{0};
+    std::atomic<int64_t> last_activity_ns{0};  // steady clock, last read or write
+
+    void reset();
+    void record_in(size_t bytes);
+    void record_out(size_t bytes);
+};
 
 // Connection pool structure
 struct Connection {
@@ -13,7 +33,26 @@ struct Connection {
     std::string username;
     bool in_use;
     bool authenticated = false;
+    bool binary = false;  // negotiated the binary protocol (wire_protocol.h)
+    // Changes whenever the socket is detached, so work that outlives a
+    // request can tell its client from a later one given the same descriptor
+    uint64_t generation = 0;
     std::chrono::steady_clock::time_point last_activity;
+    ConnectionTraffic traffic;
+};
+
+// Point-in-time copy of one connection's counters for /top
+struct ConnectionSnapshot {
+    std::string username;
+    int socket;
+    uint64_t bytes_in;
+    uint64_t messages_in;
+    uint64_t bytes_out;
+    uint64_t messages_out;
+    uint64_t send_stalls;
+    uint64_t send_failures;
+    size_t outbound_queued;  // bytes not yet acknowledged by the peer (SIOCOUTQ)
+    double idle_seconds;
 };
 
 // Forward declarations
@@ -21,8 +60,35 @@ void initialize_connection_pool();
 Connection* get_available_connection();
 void release_connection(Connection* conn);
 
+// Lookups over the pool; the caller must hold pool_mtx
+Connection* find_connection_locked(int socket);
+Connection* find_connection_by_username_locked(std::string_view username);
+
+// Username bound to `socket`, or empty if there is none (takes pool_mtx)
+std::string username_for_socket(int socket);
+
+// Generation of the connection bound to `socket`, or 0 if there is none
+// (takes pool_mtx). Compare it under pool_mtx before replying later.
+uint64_t generation_for_socket(int socket);
+
+// Binds a client socket to a pooled connection and resets its counters
+void attach_socket(Connection* conn, int socket);
+
+// Counters for the connection that owns `socket`, or nullptr. Lock-free so
+// every send and receive can account without touching pool_mtx.
+ConnectionTraffic* traffic_for_socket(int socket);
+
+// Switches a connection to the binary protocol; the caller holds pool_mtx
+void set_binary_locked(Connection* conn);
+// Whether `socket` speaks the binary protocol. Lock-free like
+// traffic_for_socket, so replies can pick their encoding cheaply.
+bool is_binary_socket(int socket);
+
+// Counters for every connection in use
+std::vector<ConnectionSnapshot> snapshot_connections();
+
 // Global variables
 extern std::vector<Connection> connection_pool;
-extern std::mutex pool_mtx;
+extern InstrumentedMutex pool_mtx;
 
 #endif // CONNECTION_POOL_H
@@ -7,15 +7,102 @@
 #define MAX_CONNECTIONS 200
 #define CONNECTION_TIMEOUT 30
 
+// Admin HTTP endpoint (GET /metrics, Prometheus format); 0 disables it
+#define ADMIN_PORT 9555
+#define ADMIN_BIND_ADDRESS "127.0.0.1"
+
+// Cluster links (see cluster.h); a server joins a cluster when started with
+// --node-id. A peer that sends nothing for CLUSTER_PEER_TIMEOUT_MS is down.
+// The cluster port listens on CLUSTER_BIND_ADDRESS unless --cluster-bind
+// names another; nodes on other hosts need a routable address there.
+#define CLUSTER_PORT 6555
+#define CLUSTER_BIND_ADDRESS "127.0.0.1"
+#define CLUSTER_MIN_SECRET_BYTES 16
+#define CLUSTER_MAX_INBOUND_LINKS 64  // reader threads; further connections are refused
+#define CLUSTER_HEARTBEAT_MS 1000
+#define CLUSTER_PEER_TIMEOUT_MS 3000
+#define CLUSTER_RECONNECT_MS 500
+#define CLUSTER_DIRECTORY_RESYNC_MS 30000
+#define CLUSTER_MAX_QUEUED_BYTES (8 * 1024 * 1024)  // per link; frames beyond it are dropped
+#define CLUSTER_MAX_FRAME_PAYLOAD (4 * 1024 * 1024)
+
 // Message settings
 #define MAX_MESSAGE_SIZE 4096
 #define MESSAGE_QUEUE_SIZE 2000
 #define MAX_HISTORY_SIZE 1000
+#define HISTORY_SNAPSHOT_COMPACT_RECORDS (4 * MAX_HISTORY_SIZE)
+#define HISTORY_REPLAY_DEFAULT_LIMIT 50
+#define HISTORY_REPLAY_ON_LOGIN 20
+#define WIRE_MAX_FRAME_PAYLOAD (MAX_MESSAGE_SIZE + 256)  // binary frames from clients (see wire_protocol.h)
+
+// Chat rooms: names are '#' and up to ROOM_NAME_MAX_LENGTH - 1 of [A-Za-z0-9_-]
+#define ROOM_NAME_MAX_LENGTH 32
+#define MAX_ROOMS_PER_CONNECTION 32
+#define ROOM_HISTORY_ON_JOIN 20
+// /roombatch: a batched room delivers what it gathered every window of 1 to
+// ROOM_BATCH_MAX_WINDOW_MS, or as soon as ROOM_BATCH_MAX_MESSAGES are waiting
+#define ROOM_BATCH_MAX_WINDOW_MS 50
+#define ROOM_BATCH_MAX_MESSAGES 64
+
+// Message storage: "sqlite" (chat_server.db) or "log" (segmented message log)
+#define MESSAGE_STORE_BACKEND "sqlite"
+#define MESSAGE_LOG_DIR "message_log"
+#define MESSAGE_LOG_SEGMENT_BYTES (64 * 1024 * 1024)
+#define MESSAGE_LOG_INDEX_INTERVAL_BYTES 4096
+#define MESSAGE_LOG_FLUSH_BYTES (64 * 1024)
+#define MESSAGE_LOG_FLUSH_INTERVAL_MS 50
+
+// Retention, applied by the background compactor (0 = unlimited)
+#define BROADCAST_RETENTION_DAYS 0
+#define BROADCAST_RETENTION_MESSAGES 0
+#define PRIVATE_RETENTION_DAYS 0
+#define PRIVATE_RETENTION_MESSAGES 0
+#define COMPACTION_INTERVAL_MS 60000
+#define COMPACTION_MESSAGES_PER_SECOND 5000
+#define COMPACTION_BATCH_ROWS 500
+
+// Search: /search runs on its own executor threads
+#define QUERY_EXECUTOR_THREADS 2
+#define QUERY_EXECUTOR_MAX_PENDING 64
+#define SEARCH_DEFAULT_LIMIT 20
+#define SEARCH_MAX_LIMIT 100
 
 // Performance settings
 #define WORKER_THREADS 4
 #define MAX_RETRY_ATTEMPTS 5
 #define MAX_LATENCY_SAMPLES 1000
+#define TRACE_SAMPLE_EVERY 64  // keep every Nth message trace for /trace
+
+// Parallel fan-out: a broadcast or room message to at least
+// FANOUT_PARALLEL_THRESHOLD recipients is split into chunks of at least
+// FANOUT_MIN_CHUNK sent on FANOUT_THREADS helper threads (0 = always inline)
+#define FANOUT_THREADS 4
+#define FANOUT_PARALLEL_THRESHOLD 512
+#define FANOUT_MIN_CHUNK 128
+
+// Lock instrumentation: build with -DLOCK_INSTRUMENTATION=0 to compile it
+// out; otherwise set_lock_instrumentation() toggles timing at run time
+#ifndef LOCK_INSTRUMENTATION
+#define LOCK_INSTRUMENTATION 1
+#endif
+
+// Flight recorder: per-thread event rings dumped on SIGUSR2 or a crash
+#define FLIGHT_RECORDER_EVENTS_PER_THREAD 4096  // power of two; 32 bytes each
+#define FLIGHT_RECORDER_MAX_THREADS 512
+#define FLIGHT_RECORDER_DUMP_PATH "flight_recorder.bin"
+
+// Logging
+#define LOG_MIN_LEVEL 1  // 0 debug, 1 info, 2 warn, 3 error
+#define LOG_FLUSH_INTERVAL_MS 20
+#define LOG_THREAD_BUFFER_BYTES (64 * 1024)  // per logging thread; full buffers drop
+#define LOG_MAX_LINE_BYTES 2048
+#define LOG_REPEAT_LIMIT 5  // identical lines per second before suppression
+
+// Traffic capture (see traffic_capture.h): files are TRAFFIC_CAPTURE_DIR/<name>.cap
+#define TRAFFIC_CAPTURE_DIR "captures"
+#define TRAFFIC_CAPTURE_ON_STARTUP 0  // 1 captures from startup; admins can /capture at runtime
+#define TRAFFIC_CAPTURE_FLUSH_BYTES (64 * 1024)
+#define TRAFFIC_CAPTURE_PAYLOADS 1  // 0 masks message bytes, keeping lengths and command names
 
 // Socket buffer size (in bytes)
 #define SOCKET_BUFFER_SIZE (256 * 1024)  // 256KB
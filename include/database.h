@@ -1,37 +1,72 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
+#include "message_store.h"
 #include <sqlite3.h>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 
 class Database {
 public:
+    // The server's database, DATABASE_PATH in the working directory
     static Database& getInstance();
 
+    // A database at `path`, created if missing; for tests and benchmarks
+    // that must not touch the server's data
+    explicit Database(const std::string& path);
+    ~Database();
+
     // User management
     bool createUser(const std::string& username, const std::string& password);
     bool authenticateUser(const std::string& username, const std::string& password);
-    bool removeUser(const std::string& username);
+    bool removeUser(std::string_view username);
     bool isAdmin(const std::string& username);
     int getUserID(const std::string& username);  // Returns 0 if user not found
+    // Id of the chat room `name`, creating it on first use; 0 on error
+    int getRoomID(const std::string& name);
 
-    // Message storage
-    bool storeMessage(int sender_id, int receiver_id, const std::string& content);
-    std::vector<std::string> loadRecentMessages(int limit = 1000);  // Load recent broadcast messages
+    // Message storage (used by SqliteMessageStore; callers go through message_store()).
+    // A broadcast relayed from another cluster node has sender_id 0 and its
+    // sender's remote_username() in remote_sender.
+    bool storeMessage(int sender_id, int receiver_id, const std::string& content, uint64_t seq = 0,
+                      uint32_t room_id = 0, const std::string& remote_sender = std::string());
+    std::vector<StoredMessage> loadRecentMessages(int limit = 1000);  // Load recent broadcast messages
+    // Broadcasts with since_seq < seq < before_seq, oldest first
+    std::vector<StoredMessage> loadBroadcastsSince(uint64_t since_seq, uint64_t before_seq, int limit);
+    // Private messages between two users with id < before_id, newest first
+    std::vector<StoredMessage> loadConversation(int user_a, int user_b, uint64_t before_id, int limit);
+    // Messages in a chat room with id < before_id, newest first
+    std::vector<StoredMessage> loadRoomMessages(uint32_t room_id, uint64_t before_id, int limit);
+    // Full-text search (FTS5) over broadcasts and user_id's private messages,
+    // newest first, on the read-only search connection; the cursor is the row id
+    SearchPage searchMessages(int user_id, const std::vector<std::string>& terms, uint64_t before_id, int limit);
+
+    // Retention (used by SqliteMessageStore::removeExpired, on the compaction
+    // connection). Highest broadcast/private row id that is older than
+    // min_created_ms or beyond the newest keep_messages; 0 if none.
+    uint64_t retentionCutoff(bool broadcasts, int64_t min_created_ms, uint64_t keep_messages);
+    // Deletes up to batch_size of the oldest rows with id <= cutoff_id; returns rows deleted or -1
+    int deleteMessagesThrough(bool broadcasts, uint64_t cutoff_id, int batch_size);
 
-private:
-    Database();
-    ~Database();
     Database(const Database&) = delete;
     Database& operator=(const Database&) = delete;
 
+private:
     bool initializeDatabase();
     bool executeQuery(const std::string& query);
+    bool columnExists(const char* table, const char* column);
+    bool initializeSearch();
+    std::vector<StoredMessage> readMessages(sqlite3_stmt* stmt, std::vector<uint64_t>* row_ids = nullptr);
     std::string hashPassword(const std::string& password, const std::string& salt);
     std::string generateSalt();
 
+    const std::string path;
     sqlite3* db;
+    sqlite3* search_db;  // separate connection so searches never wait on writes
+    sqlite3* compact_db;  // background retention deletes
+    bool fts_available;
     static const char* DATABASE_PATH;
     static const int BROADCAST_RECEIVER_ID;  // Use 0 for broadcast messages
 };
@@ -0,0 +1,76 @@
+#ifndef FANOUT_POOL_H
+#define FANOUT_POOL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// One recipient of a fan-out
+struct FanoutTarget {
+    int socket;
+    bool binary;  // gets the frame rather than the text line
+};
+
+struct FanoutResult {
+    std::vector<size_t> failed;  // indexes into the targets, ascending
+    int64_t first_send_ns = 0;   // trace_now() of the first and last
+    int64_t last_send_ns = 0;    // successful send; 0 if none succeeded
+    bool parallel = false;
+};
+
+// Delivers one message to many connections. Small fan-outs run inline on the
+// calling worker, as before. From parallel_threshold targets on, the targets
+// are cut into contiguous chunks (at most one per helper thread plus one,
+// each at least min_chunk long); helpers take chunks from a shared queue and
+// the caller sends one chunk itself, then helps with queued chunks until its
+// own are done.
+//
+// deliver() returns only once every target was tried, and each target is in
+// exactly one chunk, so a recipient never sees two messages of one stream
+// out of order as long as callers serialize their deliveries (broadcast()
+// holds pool_mtx and room messages wait their turn in the room's delivery
+// order, see RoomDelivery). Helpers only call send_to_client, which takes
+// no locks.
+class FanoutPool {
+public:
+    // FANOUT_THREADS helpers, FANOUT_PARALLEL_THRESHOLD and FANOUT_MIN_CHUNK
+    static FanoutPool& instance();
+
+    FanoutPool(size_t threads, size_t parallel_threshold, size_t min_chunk);
+    ~FanoutPool();
+
+    // Sends `frame` to binary targets and `text` to the rest. Failed sends
+    // are counted as SendFailed drops; the caller releases the connections.
+    FanoutResult deliver(const std::vector<FanoutTarget>& targets, const std::string& text,
+                         const std::string& frame);
+
+    size_t thread_count() const { return threads.size(); }
+
+    FanoutPool(const FanoutPool&) = delete;
+    FanoutPool& operator=(const FanoutPool&) = delete;
+
+private:
+    struct Batch;
+    struct Chunk {
+        Batch* batch;
+        size_t begin;
+        size_t end;
+    };
+
+    void run();
+    static void send_chunk(const Chunk& chunk);
+
+    const size_t parallel_threshold;
+    const size_t min_chunk;
+    std::deque<Chunk> chunks;
+    std::vector<std::thread> threads;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopping = false;
+};
+
+#endif // FANOUT_POOL_H
@@ -0,0 +1,48 @@
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <cstdint>
+#include <string>
+
+// Event codes stored in the flight recorder. The values are part of the dump
+// format; keep scripts/decode_flight_recorder.py in sync when adding one.
+enum class FlightEvent : uint16_t {
+    Accept = 1,     // arg: peer IPv4 address (network order)
+    Auth = 2,       // arg: 1 login, 2 registration
+    AuthFailed = 3, // arg: as Auth
+    Enqueue = 4,    // arg: message bytes
+    Dequeue = 5,    // arg: queue wait in ns
+    SendStall = 6,  // arg: bytes still to send
+    Drop = 7,       // arg: DropLane
+    Release = 8,
+};
+
+// One event: 32 bytes, written as-is into the dump
+struct FlightRecord {
+    int64_t time_ns;   // CLOCK_MONOTONIC
+    uint64_t arg;
+    int32_t socket;
+    int32_t tid;
+    uint16_t event;
+    uint16_t reserved[3];
+};
+static_assert(sizeof(FlightRecord) == 32, "dump format expects 32-byte records");
+
+// Always-on binary flight recorder. Every thread writes events into its own
+// fixed ring of FLIGHT_RECORDER_EVENTS_PER_THREAD records: a clock read and
+// one 32-byte store, no locks and no allocation after the thread's first
+// event. Rings of exited threads are handed to new threads, so their newest
+// events survive until overwritten. Dumps write every ring with raw
+// open/write calls, so they are safe to take from a signal handler;
+// scripts/decode_flight_recorder.py turns a dump into a merged timeline.
+void flight_record(FlightEvent event, int socket, uint64_t arg = 0);
+
+// Write all rings to `path`; async-signal-safe. Returns false if the file
+// could not be written.
+bool dump_flight_recorder(const char* path);
+
+// Dump to `path` on SIGUSR2 (the server keeps running) and on SIGSEGV,
+// SIGBUS, SIGFPE, SIGILL and SIGABRT (then re-raise the signal).
+bool install_flight_recorder(const std::string& path);
+
+#endif // FLIGHT_RECORDER_H
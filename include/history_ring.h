@@ -0,0 +1,68 @@
+#ifndef HISTORY_RING_H
+#define HISTORY_RING_H
+
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+// One formatted chat line together with its broadcast sequence number
+struct HistoryEntry {
+    uint64_t seq;
+    std::string text;
+};
+
+using HistoryEntryPtr = std::shared_ptr<const HistoryEntry>;
+
+// Fixed-capacity ring of shared, immutable history entries.
+//
+// Writers claim a sequence number with a single fetch_add and publish their
+// entry into slot (seq % capacity); nothing is ever shifted. Readers read the
+// published watermark and copy the shared pointers for the sequence range
+// still held in the ring, skipping any slot a writer has already recycled for
+// a newer sequence.
+//
+// There is no ring-wide lock, but this is not lock-free: the atomic
+// shared_ptr operations on each slot are guarded by a small pool of hashed
+// mutexes in libstdc++, held only for the pointer copy, and append() waits
+// (yielding) until every earlier sequence number has been published.
+class HistoryRing {
+private:
+    std::vector<HistoryEntryPtr> slots;
+    std::atomic<uint64_t> next_seq;
+    std::atomic<uint64_t> published_seq;
+    uint64_t base_seq;  // last sequence number before the ring was (re)started
+
+public:
+    explicit HistoryRing(size_t capacity);
+
+    // Append a line and return the sequence number it was stamped with
+    uint64_t append(std::string text);
+
+    // Up to `limit` of the newest entries, oldest first
+    std::vector<HistoryEntryPtr> snapshot(size_t limit = std::numeric_limits<size_t>::max()) const;
+
+    // Up to `limit` entries with a sequence number above `seq`, oldest first
+    std::vector<HistoryEntryPtr> since(uint64_t seq, size_t limit) const;
+
+    uint64_t last_seq() const;
+    // Sequence number of the oldest entry the ring can still hold
+    uint64_t oldest_seq() const;
+    size_t size() const;
+    size_t capacity() const;
+
+    // Drop all entries and restart numbering at `last_seq`. Only safe while no
+    // writers are running (startup and tests).
+    void reset(uint64_t last_seq = 0);
+
+    // Reload persisted entries, keeping their sequence numbers; numbering
+    // continues after the newest one. Same restrictions as reset().
+    void restore(std::vector<HistoryEntry> entries);
+
+    HistoryRing(const HistoryRing&) = delete;
+    HistoryRing& operator=(const HistoryRing&) = delete;
+};
+
+#endif // HISTORY_RING_H
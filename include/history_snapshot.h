@@ -0,0 +1,98 @@
+#ifndef HISTORY_SNAPSHOT_H
+#define HISTORY_SNAPSHOT_H
+
+#include "history_ring.h"
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Append-only snapshot of the formatted broadcast history.
+//
+// File layout: an 8-byte header ("CHSN" + uint32 version) followed by
+// records of the form [uint32 length][uint64 seq][bytes][uint32 length],
+// where length is the byte count of the formatted line. The trailing
+// length lets the loader walk backwards from the end of the mapped file, so
+// reading the most recent N messages costs O(N) regardless of how many
+// messages are stored in SQLite. The file is compacted back down to
+// MAX_HISTORY_SIZE records once it grows past HISTORY_SNAPSHOT_COMPACT_RECORDS,
+// which keeps the open-time validation scan bounded as well.
+class HistorySnapshot {
+public:
+    static HistorySnapshot& getInstance();
+
+    explicit HistorySnapshot(const std::string& path);
+    ~HistorySnapshot();
+
+    // True if the file was opened and its header is valid
+    bool isOpen() const;
+    size_t recordCount() const;
+
+    // Append one formatted history line with its broadcast sequence number
+    bool append(uint64_t seq, const std::string& message);
+    // Append several lines, in order, with one write; oversized lines are
+    // skipped
+    bool appendBatch(const std::vector<HistoryEntry>& entries);
+
+    // Map the file and return up to `limit` of the newest records in file order
+    std::vector<HistoryEntry> loadRecent(size_t limit);
+
+    // Replace the snapshot contents (used when rebuilding from the database)
+    bool rebuild(const std::vector<HistoryEntry>& entries);
+
+    HistorySnapshot(const HistorySnapshot&) = delete;
+    HistorySnapshot& operator=(const HistorySnapshot&) = delete;
+
+private:
+    bool openFile();
+    bool writeHeader();
+    bool recover();
+    bool compact();
+    bool writeRecords(const std::string& records, size_t count);
+    bool replaceContents(const std::string& contents, size_t records);
+    void closeFile();
+
+    std::string path;
+    int fd;
+    size_t record_count;
+    mutable std::mutex mtx;
+
+    static const char* SNAPSHOT_PATH;
+};
+
+// Appends broadcasts to a HistorySnapshot on its own thread, in enqueue
+// order, so the broadcast path only queues them; the write, and the
+// periodic compaction with its fsync and rename, happen here. Mirrors
+// StoreWriter (message_store.h).
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(HistorySnapshot& snapshot);
+    ~SnapshotWriter();  // appends what is still queued, then stops
+
+    void enqueue(uint64_t seq, std::string message);
+    // Blocks until every line enqueued before the call was appended
+    void drain();
+
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+private:
+    void run();
+
+    HistorySnapshot& snapshot;
+    std::mutex mtx;
+    std::condition_variable pending_cv;
+    std::condition_variable drained_cv;
+    std::vector<HistoryEntry> pending;
+    uint64_t enqueued;
+    uint64_t appended;
+    bool stopping;
+    std::thread writer;
+};
+
+// The writer for HistorySnapshot::getInstance()
+SnapshotWriter& snapshot_writer();
+
+#endif // HISTORY_SNAPSHOT_H
@@ -0,0 +1,128 @@
+#ifndef INSTRUMENTED_MUTEX_H
+#define INSTRUMENTED_MUTEX_H
+
+#include "constants.h"
+#include "latency_histogram.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Acquisition counters and wait/hold histograms for one named lock. The
+// histograms hold nanoseconds, not the microseconds used elsewhere: most
+// critical sections are far shorter than a microsecond.
+struct LockStats {
+    explicit LockStats(std::string name) : name(std::move(name)) {}
+
+    const std::string name;
+    std::atomic<uint64_t> acquisitions{0};
+    std::atomic<uint64_t> contended{0};  // acquisitions that found the lock held
+    LatencyHistogram wait_ns;
+    LatencyHistogram hold_ns;
+};
+
+struct LockStatsSnapshot {
+    std::string name;
+    uint64_t acquisitions;
+    uint64_t contended;
+    HistogramSnapshot wait_ns;
+    HistogramSnapshot hold_ns;
+};
+
+// Lock timing can be switched off at run time; it starts on unless built with
+// LOCK_INSTRUMENTATION 0. Acquisitions are still counted while it is off.
+void set_lock_instrumentation(bool enabled);
+bool lock_instrumentation_enabled();
+
+// Stats for every named lock, in registration order
+std::vector<LockStatsSnapshot> lock_stats_snapshot();
+
+// Drop-in std::mutex replacement (usable with lock_guard, unique_lock and
+// condition_variable_any) that records contention under a name. Stats are
+// recorded while the lock is held, so recording itself never contends.
+// Mutexes created with the same name share one set of stats. Building with
+// LOCK_INSTRUMENTATION 0 leaves a plain std::mutex behind.
+class InstrumentedMutex {
+public:
+    explicit InstrumentedMutex(const char* name);
+
+    void lock() {
+        if (!timing_enabled()) {
+            mtx.lock();
+            acquired(0, 0);
+            return;
+        }
+        if (mtx.try_lock()) {
+            acquired(now_ns(), 0);
+            return;
+        }
+        const int64_t start = now_ns();
+        mtx.lock();
+        const int64_t now = now_ns();
+        acquired(now, now - start);
+    }
+
+    bool try_lock() {
+        if (!mtx.try_lock()) {
+            return false;
+        }
+        acquired(timing_enabled() ? now_ns() : 0, 0);
+        return true;
+    }
+
+    void unlock() {
+#if LOCK_INSTRUMENTATION
+        if (acquired_at != 0) {
+            stats->hold_ns.record(static_cast<uint64_t>(now_ns() - acquired_at));
+        }
+#endif
+        mtx.unlock();
+    }
+
+    InstrumentedMutex(const InstrumentedMutex&) = delete;
+    InstrumentedMutex& operator=(const InstrumentedMutex&) = delete;
+
+private:
+    friend void set_lock_instrumentation(bool enabled);
+    friend bool lock_instrumentation_enabled();
+
+    static bool timing_enabled() {
+#if LOCK_INSTRUMENTATION
+        return timing.load(std::memory_order_relaxed);
+#else
+        return false;
+#endif
+    }
+
+    static int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Called with the lock held; a zero timestamp means "not timed"
+    void acquired(int64_t at, int64_t waited) {
+#if LOCK_INSTRUMENTATION
+        acquired_at = at;
+        stats->acquisitions.fetch_add(1, std::memory_order_relaxed);
+        if (waited > 0) {
+            stats->contended.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (at != 0) {
+            stats->wait_ns.record(static_cast<uint64_t>(waited));
+        }
+#else
+        (void)at;
+        (void)waited;
+#endif
+    }
+
+    static std::atomic<bool> timing;
+
+    std::mutex mtx;
+    LockStats* stats;
+    int64_t acquired_at = 0;  // owner only
+};
+
+#endif // INSTRUMENTED_MUTEX_H
@@ -0,0 +1,56 @@
+#ifndef INVERTED_INDEX_H
+#define INVERTED_INDEX_H
+
+#include <cstdint>
+#include <functional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Where an indexed message lives and who may see it
+struct IndexedDoc {
+    int64_t timestamp_ms;
+    uint64_t seq;      // sequence number within its log
+    bool is_private;
+    int sender_id;
+    int receiver_id;
+};
+
+// Lowercased search terms: runs of ASCII letters/digits and UTF-8 bytes,
+// de-duplicated and in first-seen order
+std::vector<std::string> tokenize_search_terms(std::string_view text);
+
+// In-memory inverted index: term -> ascending document ids. Document ids are
+// assigned in insertion order, which is chronological for live appends;
+// bulk loads from several sources are put in time order by finishBulkLoad().
+// Searches hold a shared lock, so they run concurrently with each other and
+// only contend with add() for the duration of a postings append.
+class InvertedIndex {
+public:
+    struct Hit {
+        uint64_t doc_id;
+        IndexedDoc doc;
+    };
+
+    // Index a message; returns its document id (ids start at 1)
+    uint64_t add(const IndexedDoc& doc, std::string_view text);
+
+    // Renumber documents by timestamp after loading several sources
+    void finishBulkLoad();
+
+    // Documents containing every term with doc_id < before_id, newest first
+    std::vector<Hit> search(const std::vector<std::string>& terms, uint64_t before_id, size_t limit,
+                            const std::function<bool(const IndexedDoc&)>& visible) const;
+
+    size_t docCount() const;
+    size_t termCount() const;
+
+private:
+    std::vector<IndexedDoc> docs;  // doc_id - 1 -> document
+    std::unordered_map<std::string, std::vector<uint32_t>> postings;
+    mutable std::shared_mutex mtx;
+};
+
+#endif // INVERTED_INDEX_H
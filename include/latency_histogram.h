@@ -0,0 +1,50 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Log-linear ("HDR-style") bucketing of microsecond values: exact below 64,
+// then 32 sub-buckets per power of two (about 3% relative error) up to 2^40 us.
+namespace latency_buckets {
+constexpr unsigned SUB_BITS = 5;
+constexpr uint64_t SUB_COUNT = 1ULL << SUB_BITS;
+constexpr unsigned MAX_EXPONENT = 40 - SUB_BITS;
+constexpr size_t COUNT = (MAX_EXPONENT + 1) * SUB_COUNT + SUB_COUNT;
+
+size_t index_of(uint64_t value);
+uint64_t lower_bound(size_t index);
+uint64_t upper_bound(size_t index);
+}
+
+// Merged, read-only view of one or more histograms
+struct HistogramSnapshot {
+    std::vector<uint64_t> counts = std::vector<uint64_t>(latency_buckets::COUNT, 0);
+    uint64_t count = 0;
+    uint64_t sum = 0;  // microseconds
+    uint64_t max = 0;  // microseconds, exact
+
+    // Value at quantile q (0..1) in microseconds, reported as the bucket midpoint
+    double percentile(double q) const;
+    double mean() const { return count ? static_cast<double>(sum) / count : 0; }
+};
+
+// Fixed-size histogram with wait-free recording: one relaxed atomic add per
+// bucket, count and sum, plus a CAS loop for max that only spins when a new
+// maximum races. Readers merge with merge_into() without stopping writers.
+class LatencyHistogram {
+public:
+    void record(uint64_t value_us);
+    void merge_into(HistogramSnapshot& snapshot) const;
+
+private:
+    std::array<std::atomic<uint64_t>, latency_buckets::COUNT> counts{};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+};
+
+#endif // LATENCY_HISTOGRAM_H
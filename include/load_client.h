@@ -0,0 +1,83 @@
+#ifndef LOAD_CLIENT_H
+#define LOAD_CLIENT_H
+
+#include "latency_histogram.h"
+#include <cstdint>
+#include <functional>
+#include <getopt.h>
+#include <initializer_list>
+#include <netinet/in.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Shared by the loadgen and replay tools: non-blocking text-protocol client
+// connections driven from an epoll reactor, the delivery markers they embed
+// in broadcasts, and their common command line and JSON output.
+
+// Unsent output beyond which a tool skips a send instead of buffering it
+constexpr size_t LOAD_MAX_PENDING_OUTPUT = 4 * 1024 * 1024;
+
+// CLOCK_MONOTONIC in nanoseconds
+int64_t monotonic_ns();
+
+// One connection's buffers. Tools derive their per-connection state from it.
+struct LoadConnection {
+    int fd = -1;
+    std::string input;   // unparsed tail of the receive stream
+    std::string output;  // bytes the socket would not take yet
+    size_t output_offset = 0;
+    bool want_write = false;  // EPOLLOUT is in the registered interest
+
+    size_t pending_output() const { return output.size() - output_offset; }
+};
+
+// Starts a non-blocking connect to `address` and registers it with
+// `epoll_fd` for EPOLLIN | EPOLLOUT (writable once connected), with `conn`
+// as the event data. False if the socket could not be set up; conn.fd is
+// then -1 or, if only the epoll registration failed, still open.
+bool start_connect(int epoll_fd, const sockaddr_in& address, LoadConnection& conn);
+
+// Writes as much queued output as the socket takes; false on a send error
+bool flush_output(LoadConnection& conn);
+
+// Re-registers EPOLLOUT interest when `want_write` changed
+void update_interest(int epoll_fd, LoadConnection& conn, bool want_write);
+
+// Outcome of /register or /login, found anywhere in the text reply stream
+enum class AuthReply { Pending, Ok, RegistrationFailed, Failed };
+AuthReply classify_auth_reply(const std::string& input);
+
+// Broadcasts carry "<marker><n1>|<n2>|...|" with `fields` decimal numbers.
+// Calls `on_marker` for each complete marker in `input` and drops what was
+// scanned, keeping a marker cut off by the end of the read for the next call.
+void parse_delivery_markers(std::string& input, std::string_view marker, int fields,
+                            const std::function<void(const int64_t* values)>& on_marker);
+
+// Appends `  "name": {"count": ..., "p50": ..., ...}` to a JSON result
+void append_percentiles(std::string& out, const char* name, const HistogramSnapshot& histogram);
+
+// The server a tool drives and the account it uses
+struct TargetOptions {
+    std::string host = "127.0.0.1";
+    int port = 5555;
+    std::string user_prefix;
+    std::string password;
+};
+
+// getopt_long table: --host, --port, --user-prefix, --password and --help,
+// then `own`, then the terminator
+std::vector<option> target_long_options(std::initializer_list<option> own);
+// Handles a getopt_long result for one of the target options; false if
+// `opt` is not one of them
+bool parse_target_option(int opt, const char* arg, TargetOptions& target);
+// Usage lines for the target options, given the tool's defaults
+std::string target_usage(const TargetOptions& defaults);
+
+// Resolves --host and --port; prints an error and returns false if invalid
+bool resolve_target(const TargetOptions& target, sockaddr_in& address);
+
+// Raises the descriptor soft limit to the hard limit and returns it
+uint64_t raise_descriptor_limit();
+
+#endif // LOAD_CLIENT_H
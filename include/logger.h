@@ -0,0 +1,97 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+enum class LogLevel : uint8_t { Debug, Info, Warn, Error };
+
+// Asynchronous logger. Each thread appends records to its own lock-free
+// single-producer ring buffer (a clock read and a memcpy); a background
+// thread drains all rings every LOG_FLUSH_INTERVAL_MS, orders the records by
+// time, formats them with a per-second cached "[HH:MM:SS] " prefix and writes
+// them in one fwrite. More than LOG_REPEAT_LIMIT identical lines per second
+// are collapsed into a single "suppressed" note. When a thread's ring is full
+// the record is dropped and counted rather than blocking the caller.
+class Logger {
+public:
+    // Process-wide logger writing to stdout. Never destroyed; an atexit hook
+    // drains it, and anything logged after that is written synchronously.
+    static Logger& instance();
+
+    explicit Logger(FILE* sink, size_t thread_buffer_bytes = 64 * 1024);
+    ~Logger();
+
+    void log(LogLevel level, std::string_view message);
+    void set_level(LogLevel level) { min_level.store(level, std::memory_order_relaxed); }
+    LogLevel level() const { return min_level.load(std::memory_order_relaxed); }
+
+    // Write out everything logged so far (blocks until the flusher has run)
+    void flush();
+    // Drain and stop the flusher; later records are written synchronously
+    void shutdown();
+
+    uint64_t dropped() const { return dropped_count.load(std::memory_order_relaxed); }
+
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+private:
+    struct ThreadBuffer;
+    struct Record {
+        int64_t time_ns;
+        LogLevel level;
+        std::string text;
+    };
+    struct Repeat {
+        LogLevel level;  // the most severe the line was logged at
+        uint32_t count;
+    };
+
+    ThreadBuffer& local_buffer();
+    void run();
+    size_t drain(bool closing);
+    void write_records(std::vector<Record>& records, bool closing);
+    void format_line(std::string& out, const Record& record);
+    void write_direct(LogLevel level, std::string_view message);
+
+    FILE* sink;
+    const size_t buffer_bytes;
+    const uint64_t id;  // keys this logger's per-thread buffers
+    std::atomic<LogLevel> min_level;
+    std::atomic<bool> stopped;
+    std::atomic<uint64_t> dropped_count;
+    uint64_t reported_dropped;
+
+    std::mutex buffers_mtx;  // registration and draining only, never on log()
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+
+    std::mutex flush_mtx;
+    std::condition_variable flush_cv;
+    std::condition_variable flushed_cv;
+    bool stopping;
+    uint64_t flush_requests;
+    uint64_t flushes_done;
+    std::thread flusher;
+
+    std::mutex direct_mtx;  // synchronous writes after shutdown
+
+    // Flusher state; write_direct takes it over once the flusher has exited
+    int64_t cached_second;
+    char cached_prefix[16];
+    int64_t repeat_window;
+    std::unordered_map<std::string, Repeat> repeats;
+};
+
+void log_at(LogLevel level, std::string_view message);
+
+#endif // LOGGER_H
@@ -0,0 +1,47 @@
+#ifndef MESSAGE_COMPACTOR_H
+#define MESSAGE_COMPACTOR_H
+
+#include "message_store.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Background thread that applies the broadcast and private retention
+// policies to a MessageStore every `interval`. Deletion work is paced by a
+// RateLimiter so that a large backlog is drained gradually instead of
+// competing with storeMessage for I/O.
+class MessageCompactor {
+public:
+    MessageCompactor(MessageStore& store, RetentionPolicy broadcasts, RetentionPolicy private_messages,
+                     std::chrono::milliseconds interval, double messages_per_second);
+    ~MessageCompactor();
+
+    void start();
+    void stop();
+
+    // One compaction pass; returns messages removed
+    uint64_t runOnce();
+
+    uint64_t removedTotal() const { return removed_total.load(); }
+
+    MessageCompactor(const MessageCompactor&) = delete;
+    MessageCompactor& operator=(const MessageCompactor&) = delete;
+
+private:
+    void run();
+
+    MessageStore& store;
+    RetentionPolicy broadcasts;
+    RetentionPolicy private_messages;
+    std::chrono::milliseconds interval;
+    double messages_per_second;
+    std::atomic<uint64_t> removed_total;
+    bool running;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::thread thread;
+};
+
+#endif // MESSAGE_COMPACTOR_H
@@ -6,12 +6,13 @@
 #include <atomic>
 #include <condition_variable>
 #include "server.h"  // for Message struct
+#include "instrumented_mutex.h"
 
 class MessageQueue {
 private:
     std::queue<Message> queue;
-    std::mutex mtx;
-    std::condition_variable cv;
+    InstrumentedMutex mtx{"message_queue"};
+    std::condition_variable_any cv;
     const size_t max_size;
     std::atomic<size_t> current_size;
 
@@ -27,6 +28,6 @@ public:
     MessageQueue& operator=(const MessageQueue&) = delete;
 };
 
-extern MessageQueue message_queue;
+extern MessageQueue& message_queue;
 
 #endif // MESSAGE_QUEUE_H
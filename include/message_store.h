@@ -0,0 +1,196 @@
+#ifndef MESSAGE_STORE_H
+#define MESSAGE_STORE_H
+
+#include "history_ring.h"
+#include "inverted_index.h"
+#include "segmented_log.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// A persisted chat message, independent of the storage engine
+struct StoredMessage {
+    uint64_t seq = 0;          // broadcast sequence number, or the private message id
+    int64_t timestamp_ms = 0;  // wall-clock time, milliseconds since the epoch
+    int sender_id = 0;
+    int receiver_id = 0;       // 0 for broadcasts
+    uint32_t room_id = 0;      // chat room (see RoomRegistry), 0 outside rooms
+    std::string sender_name;
+    std::string content;
+};
+
+// One page of search results, newest first. next_before is the cursor for
+// the following page, or 0 when there are no more matches.
+struct SearchPage {
+    std::vector<StoredMessage> messages;
+    uint64_t next_before = 0;
+};
+
+// How long one kind of message (broadcast or private) is kept
+struct RetentionPolicy {
+    int64_t max_age_ms = 0;     // 0 = keep forever
+    uint64_t max_messages = 0;  // newest messages to keep, 0 = unlimited
+
+    bool enabled() const { return max_age_ms > 0 || max_messages > 0; }
+};
+
+class RateLimiter;
+
+// Canonical key of the conversation between two users (order-independent)
+uint64_t conversation_key(int user_a, int user_b);
+
+// Formats a stored message the way broadcast() formats live lines
+HistoryEntry to_history_entry(const StoredMessage& message);
+
+int64_t current_time_ms();
+
+// Storage engine for chat messages. Users and authentication always live in
+// SQLite (see Database); only message persistence is pluggable.
+class MessageStore {
+public:
+    virtual ~MessageStore() = default;
+
+    virtual bool append(const StoredMessage& message) = 0;
+
+    // Newest `limit` broadcasts, oldest first
+    virtual std::vector<StoredMessage> recentBroadcasts(size_t limit) = 0;
+
+    // Broadcasts with since_seq < seq < before_seq, oldest first
+    virtual std::vector<StoredMessage> broadcastsSince(uint64_t since_seq, uint64_t before_seq, size_t limit) = 0;
+
+    // Private messages between two users with an id below before_seq, newest
+    // first (keyset pagination: pass the oldest id returned to get the next page)
+    virtual std::vector<StoredMessage> conversation(int user_a, int user_b, uint64_t before_seq, size_t limit) = 0;
+
+    // Messages in a chat room with an id below before_seq, newest first,
+    // paginated like conversation()
+    virtual std::vector<StoredMessage> roomHistory(uint32_t room_id, uint64_t before_seq, size_t limit) = 0;
+
+    // Messages containing every term of `query` that user_id may read
+    // (broadcasts and their own private messages; never room messages),
+    // newest first. Can be slow;
+    // call it from the QueryExecutor, not from a chat worker.
+    virtual SearchPage search(int user_id, const std::string& query, uint64_t before_cursor, size_t limit) = 0;
+
+    // Delete messages outside the retention policies in bulk steps, charging
+    // each step to `limiter` (in messages). Returns messages removed.
+    // Runs on the compactor thread (see MessageCompactor).
+    virtual uint64_t removeExpired(const RetentionPolicy& broadcasts, const RetentionPolicy& private_messages,
+                                   int64_t now_ms, RateLimiter& limiter) = 0;
+
+    virtual const char* name() const = 0;
+};
+
+// The store selected by MESSAGE_STORE_BACKEND
+MessageStore& message_store();
+
+// Appends messages to a store on one background thread, in the order they
+// were enqueued. fan_out_broadcast() enqueues under its sequencing lock, so
+// broadcasts reach the store in sequence order without that lock being held
+// across a synchronous SQLite insert.
+class StoreWriter {
+public:
+    explicit StoreWriter(MessageStore& store);
+    ~StoreWriter();  // appends what is still queued, then stops
+
+    void enqueue(StoredMessage message);
+    // Blocks until every message enqueued before the call was appended
+    void drain();
+
+    StoreWriter(const StoreWriter&) = delete;
+    StoreWriter& operator=(const StoreWriter&) = delete;
+
+private:
+    void run();
+
+    MessageStore& store;
+    std::mutex mtx;
+    std::condition_variable pending_cv;
+    std::condition_variable drained_cv;
+    std::deque<StoredMessage> pending;
+    uint64_t enqueued;
+    uint64_t appended;
+    bool stopping;
+    std::thread writer;
+};
+
+// The writer for broadcasts into message_store()
+StoreWriter& broadcast_writer();
+
+// Messages in the chat_server.db messages table
+class SqliteMessageStore : public MessageStore {
+public:
+    bool append(const StoredMessage& message) override;
+    std::vector<StoredMessage> recentBroadcasts(size_t limit) override;
+    std::vector<StoredMessage> broadcastsSince(uint64_t since_seq, uint64_t before_seq, size_t limit) override;
+    std::vector<StoredMessage> conversation(int user_a, int user_b, uint64_t before_seq, size_t limit) override;
+    std::vector<StoredMessage> roomHistory(uint32_t room_id, uint64_t before_seq, size_t limit) override;
+    SearchPage search(int user_id, const std::string& query, uint64_t before_cursor, size_t limit) override;
+    uint64_t removeExpired(const RetentionPolicy& broadcasts, const RetentionPolicy& private_messages,
+                           int64_t now_ms, RateLimiter& limiter) override;
+    const char* name() const override { return "sqlite"; }
+};
+
+// Messages in three segmented logs under one directory: broadcast/ keyed by
+// broadcast sequence number, and private/ and room/ with their own
+// numbering. Writes are buffered; a background thread flushes them every
+// MESSAGE_LOG_FLUSH_INTERVAL_MS. Retention drops whole sealed segments; room
+// messages follow the broadcast policy. Private messages are also indexed in
+// memory by conversation key and room messages by room, so a DM thread or
+// room history page is a range lookup plus one sparse index seek per
+// message; both indexes are rebuilt from their logs on open. The broadcast
+// and private logs feed an in-memory inverted index for search, also
+// rebuilt on open.
+class LogMessageStore : public MessageStore {
+public:
+    LogMessageStore(const std::string& directory, SegmentedLogOptions options);
+    ~LogMessageStore() override;
+
+    bool append(const StoredMessage& message) override;
+    std::vector<StoredMessage> recentBroadcasts(size_t limit) override;
+    std::vector<StoredMessage> broadcastsSince(uint64_t since_seq, uint64_t before_seq, size_t limit) override;
+    std::vector<StoredMessage> conversation(int user_a, int user_b, uint64_t before_seq, size_t limit) override;
+    std::vector<StoredMessage> roomHistory(uint32_t room_id, uint64_t before_seq, size_t limit) override;
+    SearchPage search(int user_id, const std::string& query, uint64_t before_cursor, size_t limit) override;
+    uint64_t removeExpired(const RetentionPolicy& broadcasts, const RetentionPolicy& private_messages,
+                           int64_t now_ms, RateLimiter& limiter) override;
+    const char* name() const override { return "log"; }
+
+    bool isOpen() const { return opened; }
+    void flush();
+
+private:
+    static SegmentedLogOptions withDirectory(SegmentedLogOptions options, const std::string& directory);
+    void backgroundLoop();
+    bool appendRecord(const StoredMessage& message);
+    uint64_t dropSegments(SegmentedLog& log, const RetentionPolicy& policy, int64_t now_ms, RateLimiter& limiter);
+    bool readRecord(SegmentedLog& log, uint64_t seq, StoredMessage& message);
+
+    SegmentedLog broadcast_log;
+    SegmentedLog private_log;
+    SegmentedLog room_log;
+    std::unordered_map<uint64_t, std::vector<uint64_t>> conversations;  // key -> ascending ids
+    std::mutex conversations_mtx;
+    std::unordered_map<uint32_t, std::vector<uint64_t>> rooms;  // room id -> ascending ids
+    std::mutex rooms_mtx;
+    InvertedIndex search_index;
+    bool opened;
+    std::atomic<bool> running;
+    std::mutex wake_mtx;
+    std::condition_variable wake_cv;
+    std::thread background;
+};
+
+// Payload encoding used by LogMessageStore. Room messages have no receiver,
+// so the receiver field carries the room id; decode_stored_message leaves it
+// there and LogMessageStore moves it back for room/ records.
+std::string encode_stored_message(const StoredMessage& message);
+bool decode_stored_message(const LogRecordView& record, StoredMessage& message);
+
+#endif // MESSAGE_STORE_H
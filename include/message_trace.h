@@ -0,0 +1,71 @@
+#ifndef MESSAGE_TRACE_H
+#define MESSAGE_TRACE_H
+
+#include "latency_histogram.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// steady_clock nanoseconds; 0 means "stage not reached"
+int64_t trace_now();
+
+// Pipeline timestamps carried by each Message
+struct MessageTrace {
+    int64_t recv_ns = 0;        // recv() returned in handle_client
+    int64_t enqueue_ns = 0;     // pushed onto message_queue
+    int64_t dequeue_ns = 0;     // popped by a worker
+    int64_t persist_ns = 0;     // history ring and snapshot written, store append queued
+    int64_t first_send_ns = 0;  // first recipient write finished
+    int64_t last_send_ns = 0;   // last recipient write finished
+};
+
+// Intervals between consecutive MessageTrace timestamps
+enum class TraceStage {
+    Enqueue,    // recv -> enqueue
+    QueueWait,  // enqueue -> dequeue
+    Persist,    // dequeue -> persist (lookups, sequencing, storage)
+    FirstSend,  // persist -> first recipient write
+    Fanout,     // first -> last recipient write
+    Total,      // recv -> last recipient write
+    Count
+};
+
+const char* trace_stage_name(TraceStage stage);
+
+// Per-stage latency histograms for every traced message, plus a ring of
+// every TRACE_SAMPLE_EVERY-th complete trace. Both are lock-free: histograms
+// use relaxed atomic adds and ring slots are guarded by per-slot sequence
+// counters (a reader retries a slot that was being rewritten).
+class MessageTracer {
+public:
+    static constexpr size_t RING_SIZE = 256;
+
+    explicit MessageTracer(uint64_t sample_every);
+
+    void record(const MessageTrace& trace);
+
+    HistogramSnapshot stage_latency(TraceStage stage) const;  // microseconds
+    std::vector<MessageTrace> recent_samples(size_t limit) const;  // newest first
+    uint64_t traced() const { return traced_count.load(std::memory_order_relaxed); }
+
+    MessageTracer(const MessageTracer&) = delete;
+    MessageTracer& operator=(const MessageTracer&) = delete;
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> version{0};  // odd while being written
+        std::array<std::atomic<int64_t>, 6> stamps{};
+    };
+
+    std::array<LatencyHistogram, static_cast<size_t>(TraceStage::Count)> stages;
+    std::array<Slot, RING_SIZE> ring;
+    std::atomic<uint64_t> traced_count{0};
+    std::atomic<uint64_t> sampled_count{0};
+    const uint64_t sample_every;
+};
+
+extern MessageTracer message_tracer;
+
+#endif // MESSAGE_TRACE_H
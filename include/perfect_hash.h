@@ -0,0 +1,71 @@
+#ifndef PERFECT_HASH_H
+#define PERFECT_HASH_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Seeded FNV-1a, folded so the low bits used for the slot see every byte
+constexpr uint32_t perfect_hash(std::string_view key, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (char c : key) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 16777619u;
+    }
+    return hash ^ (hash >> 15);
+}
+
+// A fixed set of string keys mapped to values with no collisions, built at
+// compile time: the constructor tries seeds until every key lands in its own
+// slot. A lookup is one hash, one slot and one key comparison, and never
+// allocates. Keys are not copied; they must outlive the table (string
+// literals in practice). Declare tables constexpr and static_assert(valid())
+// so a key set with no collision-free seed fails the build.
+template <typename Value, size_t Count, size_t Slots = 4 * Count>
+class PerfectHashTable {
+    static_assert(Count > 0 && Slots >= Count, "need a slot per key");
+
+public:
+    struct Entry {
+        std::string_view key;
+        Value value{};
+    };
+
+    constexpr explicit PerfectHashTable(const std::array<Entry, Count>& entries) {
+        for (uint32_t candidate = 1; candidate <= MAX_SEED; ++candidate) {
+            if (place(entries, candidate)) {
+                seed = candidate;
+                return;
+            }
+        }
+    }
+
+    constexpr bool valid() const { return seed != 0; }
+
+    // The value stored under `key`, or nullptr
+    constexpr const Value* find(std::string_view key) const {
+        const Entry& entry = slots[perfect_hash(key, seed) % Slots];
+        return !entry.key.empty() && entry.key == key ? &entry.value : nullptr;
+    }
+
+private:
+    static constexpr uint32_t MAX_SEED = 1u << 16;
+
+    constexpr bool place(const std::array<Entry, Count>& entries, uint32_t candidate) {
+        slots = {};
+        for (const Entry& entry : entries) {
+            Entry& slot = slots[perfect_hash(entry.key, candidate) % Slots];
+            if (!slot.key.empty()) {
+                return false;
+            }
+            slot = entry;
+        }
+        return true;
+    }
+
+    uint32_t seed = 0;
+    std::array<Entry, Slots> slots{};
+};
+
+#endif // PERFECT_HASH_H
@@ -0,0 +1,43 @@
+#ifndef QUERY_EXECUTOR_H
+#define QUERY_EXECUTOR_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Small thread pool for slow read-only queries (e.g. /search), kept apart
+// from the chat workers so a long query never delays message delivery.
+// The backlog is bounded; submit() refuses work instead of queueing forever.
+class QueryExecutor {
+public:
+    static QueryExecutor& getInstance();
+
+    QueryExecutor(size_t threads, size_t max_pending);
+    ~QueryExecutor();
+
+    // Queue a task; returns false if the backlog is full or shut down
+    bool submit(std::function<void()> task);
+
+    // Finish queued tasks and join the threads
+    void shutdown();
+
+    size_t pending() const;
+
+    QueryExecutor(const QueryExecutor&) = delete;
+    QueryExecutor& operator=(const QueryExecutor&) = delete;
+
+private:
+    void run();
+
+    std::queue<std::function<void()>> tasks;
+    std::vector<std::thread> threads;
+    mutable std::mutex mtx;
+    std::condition_variable cv;
+    const size_t max_pending;
+    bool stopping;
+};
+
+#endif // QUERY_EXECUTOR_H
@@ -0,0 +1,37 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+// Token bucket for background work (e.g. compaction). acquire() may run the
+// bucket into debt and then sleeps until it is repaid, so a caller can charge
+// for work after doing it when the cost is only known afterwards.
+class RateLimiter {
+public:
+    // units_per_second <= 0 disables limiting
+    RateLimiter(double units_per_second, double burst)
+        : rate(units_per_second), burst(burst), tokens(burst), last(std::chrono::steady_clock::now()) {}
+
+    void acquire(double units) {
+        if (rate <= 0) {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        tokens = std::min(burst, tokens + std::chrono::duration<double>(now - last).count() * rate);
+        last = now;
+        tokens -= units;
+        if (tokens < 0) {
+            std::this_thread::sleep_for(std::chrono::duration<double>(-tokens / rate));
+        }
+    }
+
+private:
+    double rate;
+    double burst;
+    double tokens;
+    std::chrono::steady_clock::time_point last;
+};
+
+#endif // RATE_LIMITER_H
@@ -0,0 +1,154 @@
+#ifndef ROOM_REGISTRY_H
+#define ROOM_REGISTRY_H
+
+#include "instrumented_mutex.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+enum class RoomJoin { Joined, AlreadyMember, TooManyRooms };
+
+// One line of /rooms
+struct RoomSummary {
+    std::string name;
+    size_t members;
+    bool joined;
+    uint32_t batch_window_ms;
+};
+
+// A message waiting in a batched room: who sent it, its text line and its
+// encoded RoomBatch entry
+struct RoomBatchEntry {
+    int sender;  // -1 once the sender left the room
+    std::string line;
+    std::string entry;
+};
+
+// Puts a room's deliveries in the order they were claimed. Shared with the
+// deliveries still in flight, so it can outlive the room.
+struct RoomSendOrder {
+    uint64_t claimed = 0;  // guarded by the registry lock
+    std::mutex mtx;
+    std::condition_variable done_cv;
+    uint64_t done = 0;  // deliveries finished, guarded by mtx
+};
+
+struct RoomState {
+    uint32_t id = 0;
+    std::vector<int> members;  // sorted
+    // With a window, messages gather in `batch` and go out together once
+    // batch_due passes; 0 delivers each message as it is sent
+    uint32_t batch_window_ms = 0;
+    std::vector<RoomBatchEntry> batch;
+    std::chrono::steady_clock::time_point batch_due;
+    std::shared_ptr<RoomSendOrder> order = std::make_shared<RoomSendOrder>();
+};
+
+// One delivery to a room, claimed under the registry lock and sent once it
+// is released: the members at claim time and, for a batch, the messages
+// taken from the room. wait_turn() blocks until the room's earlier
+// deliveries are done; destroying the delivery lets the next one go.
+class RoomDelivery {
+public:
+    RoomDelivery() = default;
+    RoomDelivery(RoomDelivery&&) = default;
+    RoomDelivery& operator=(RoomDelivery&&) = delete;
+    ~RoomDelivery();
+
+    void wait_turn();
+
+    std::string room;
+    std::vector<int> members;  // sorted
+    std::vector<RoomBatchEntry> batch;
+
+private:
+    friend RoomDelivery claim_room_delivery(std::string_view name, RoomState& room, bool take_batch);
+
+    std::shared_ptr<RoomSendOrder> order;
+    uint64_t ticket = 0;
+};
+
+// Claims the room's next delivery, moving its batch into it if take_batch.
+// The caller holds the registry lock (inside RoomRegistry::with_members).
+RoomDelivery claim_room_delivery(std::string_view name, RoomState& room, bool take_batch);
+
+// Whether `name` is a valid room name: '#' and then 1 to
+// ROOM_NAME_MAX_LENGTH - 1 of [A-Za-z0-9_-]
+bool valid_room_name(std::string_view name);
+
+// Which connections are in which chat room. Each room keeps its members as a
+// sorted array of sockets, so a room message walks exactly the room's
+// members instead of the whole connection pool; a reverse index from socket
+// to rooms lets a disconnect leave every room without scanning them all.
+// Rooms are created by their first join and forgotten when the last member
+// leaves; the room id (from Database::getRoomID) outlives them and keys the
+// room's stored history.
+//
+// Nothing is sent under the registry lock. A room message claims a
+// RoomDelivery under it, which copies the members and takes the room's next
+// place in its delivery order, and is sent after the lock is released; one
+// slow member holds up only its own room's later deliveries.
+//
+// A room can batch its messages (see /roombatch): they are queued on the
+// room, and take_due_batches() hands each room's batch to the ticker thread,
+// as a delivery, once its window has passed.
+//
+// Membership is per connection, not per user, and is dropped when the
+// connection's socket is detached from the pool, before the descriptor can
+// be reused. Leaving waits for the room's deliveries already claimed, so
+// none of them can write to the descriptor after it is closed.
+class RoomRegistry {
+public:
+    static RoomRegistry& instance();
+
+    RoomJoin join(uint32_t room_id, std::string_view name, int socket);
+    // False if `socket` was not in the room. Both return once the room's
+    // deliveries claimed before the leave are done.
+    bool leave(std::string_view name, int socket);
+    void leave_all(int socket);
+
+    // The room's id if `socket` is a member, otherwise 0
+    uint32_t member_room_id(std::string_view name, int socket) const;
+
+    // Calls fn(room) under the registry lock if `socket` is a member, and
+    // returns false otherwise. fn must not send: it claims a RoomDelivery
+    // for that. fn may queue to the room's batch; the batch is due one
+    // window after its first message.
+    bool with_members(std::string_view name, int socket, const std::function<void(RoomState&)>& fn);
+
+    // Waits until some room's batch is due, then claims a delivery of each
+    // due batch. Runs on a single ticker thread and sleeps while nothing is
+    // batched.
+    std::vector<RoomDelivery> take_due_batches();
+
+    // Every room, by name, marking the ones `socket` is in
+    std::vector<RoomSummary> list(int socket) const;
+
+private:
+    RoomRegistry() = default;
+    RoomRegistry(const RoomRegistry&) = delete;
+    RoomRegistry& operator=(const RoomRegistry&) = delete;
+
+    using InFlight = std::vector<std::pair<std::shared_ptr<RoomSendOrder>, uint64_t>>;
+
+    // Caller holds mtx. Records the room's claimed deliveries in `in_flight`.
+    bool remove_member_locked(std::string_view name, int socket, InFlight& in_flight);
+    // Waits, without mtx, until the recorded deliveries are done
+    static void wait_in_flight(const InFlight& in_flight);
+
+    mutable InstrumentedMutex mtx{"rooms"};
+    std::condition_variable_any batch_opened;
+    std::map<std::string, RoomState, std::less<>> rooms;
+    std::vector<std::string> open_batches;  // rooms with a non-empty batch
+    std::unordered_map<int, std::vector<std::string>> rooms_by_socket;
+};
+
+#endif // ROOM_REGISTRY_H
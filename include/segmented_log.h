@@ -0,0 +1,152 @@
+#ifndef SEGMENTED_LOG_H
+#define SEGMENTED_LOG_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A record as read back from the log. `payload` points into a mapped
+// segment (or a copy of still-buffered bytes) and is only valid inside the
+// visitor callback.
+struct LogRecordView {
+    uint64_t seq;
+    int64_t timestamp_ms;
+    std::string_view payload;
+};
+
+struct SegmentedLogOptions {
+    std::string directory;
+    size_t segment_bytes;         // roll to a new segment past this size
+    size_t index_interval_bytes;  // distance between sparse index entries
+    size_t flush_bytes;           // write buffer size before a write(2)
+};
+
+// Append-only, segmented, checksummed record log.
+//
+// Segments are named after the first sequence number they hold
+// (<base_seq>.log). Each record is [uint32 body length][uint32 crc32][body]
+// with body = [uint64 seq][int64 timestamp_ms][payload]. Sequence numbers are
+// strictly increasing but may have gaps. Every index_interval_bytes a sparse
+// index entry (seq, timestamp, offset, ordinal) is kept in memory; sealed
+// segments also get a <base_seq>.idx file so reopening only has to scan the
+// active segment. Reads go through read-only mmaps of the segment files.
+//
+// Scans take the lock only to snapshot the segments they need (their
+// mappings, shared with the log, and their sizes), then read and run the
+// visitor without it, so appends are never held up by a reader. A scan sees
+// every record appended before it started; records still in the write
+// buffer are copied out under the lock once the scan reaches them. Readers
+// never flush.
+class SegmentedLog {
+public:
+    explicit SegmentedLog(SegmentedLogOptions options);
+    ~SegmentedLog();
+
+    // Load existing segments, dropping a torn or corrupt tail. Must be called
+    // before any other method.
+    bool open();
+
+    // Append a record. seq must be above last_seq(); 0 assigns last_seq() + 1.
+    // Returns the record's sequence number, or 0 on failure.
+    uint64_t append(uint64_t seq, int64_t timestamp_ms, std::string_view payload);
+
+    // Write out buffered records. On a write error the unwritten bytes stay
+    // buffered for the next flush, and readable.
+    bool flush();
+
+    // Visit records with seq > after_seq in order until the visitor returns false
+    void scanFromSeq(uint64_t after_seq, const std::function<bool(const LogRecordView&)>& visitor);
+
+    // Visit the newest `limit` records, oldest first
+    void scanTail(size_t limit, const std::function<bool(const LogRecordView&)>& visitor);
+
+    // Drop up to max_segments of the oldest sealed segments that are entirely
+    // older than min_timestamp_ms (0 = no age limit) or whose removal still
+    // leaves keep_records newer records (0 = no count limit). Returns the
+    // number of records removed.
+    uint64_t dropSegments(int64_t min_timestamp_ms, uint64_t keep_records, size_t max_segments);
+
+    uint64_t firstSeq() const;  // oldest retained record, 0 if empty
+    uint64_t lastSeq() const;
+    size_t segmentCount() const;
+    uint64_t recordCount() const;
+
+    SegmentedLog(const SegmentedLog&) = delete;
+    SegmentedLog& operator=(const SegmentedLog&) = delete;
+
+private:
+    struct IndexEntry {
+        uint64_t seq;
+        int64_t timestamp_ms;
+        uint64_t offset;
+        uint64_t ordinal;  // record number within the segment
+    };
+
+    // A read-only mapping of a segment file, unmapped with its last user, so
+    // a scan can keep reading one the log has since replaced or dropped
+    struct Mapping {
+        Mapping(const char* data, size_t length) : data(data), length(length) {}
+        ~Mapping();
+        Mapping(const Mapping&) = delete;
+        Mapping& operator=(const Mapping&) = delete;
+
+        const char* data;
+        size_t length;
+    };
+
+    struct Segment {
+        uint64_t base_seq = 0;
+        uint64_t last_seq = 0;
+        int64_t max_timestamp_ms = 0;
+        uint64_t size = 0;          // bytes on disk plus buffered bytes (active segment)
+        uint64_t record_count = 0;
+        uint64_t next_index_offset = 0;
+        std::vector<IndexEntry> index;
+        std::shared_ptr<const Mapping> mapped;
+    };
+
+    // What a scan reads of one segment, taken under the lock
+    struct SegmentView {
+        uint64_t base_seq;
+        std::shared_ptr<const Mapping> mapping;  // null or short until needed
+        uint64_t disk_size;     // bytes on disk when the scan started
+        uint64_t size;          // plus the bytes then still buffered
+        uint64_t start_offset;
+        uint64_t skip_records;  // passed over before visiting
+    };
+
+    std::string segmentPath(uint64_t base_seq, const char* extension) const;
+    bool loadSegment(Segment& segment, bool active);
+    bool scanSegment(Segment& segment, int fd);
+    bool writeIndexFile(const Segment& segment) const;
+    bool readIndexFile(Segment& segment) const;
+    bool rollSegment(uint64_t base_seq);
+    bool openActive();
+    bool flushLocked();
+    uint64_t diskSize(const Segment& segment) const;  // size minus what is still buffered
+    std::shared_ptr<const Mapping> mapSegment(Segment& segment);
+    Segment* findSegmentLocked(uint64_t base_seq);
+    void removeOldestSegment();
+    SegmentView viewSegment(const Segment& segment, uint64_t start_offset, uint64_t skip_records) const;
+    // The rest run without the lock and take it only briefly
+    void visitView(SegmentView& view, uint64_t after_seq, const std::function<bool(const LogRecordView&)>& visitor,
+                   bool& keep_going);
+    std::shared_ptr<const Mapping> mapForRead(uint64_t base_seq);
+    std::string readUnflushed(uint64_t base_seq, uint64_t from, uint64_t to);
+
+    SegmentedLogOptions options;
+    std::vector<Segment> segments;  // oldest first; back() is the active segment
+    int active_fd;
+    std::string write_buffer;
+    uint64_t last_seq;
+    mutable std::mutex mtx;
+};
+
+// IEEE CRC-32 of a byte range
+uint32_t crc32(const char* data, size_t length);
+
+#endif // SEGMENTED_LOG_H
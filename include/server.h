@@ -2,7 +2,11 @@
 #define SERVER_H
 
 #include "constants.h"
+#include "history_ring.h"
+#include "message_trace.h"
+#include "wire_protocol.h"
 #include <string>
+#include <string_view>
 #include <chrono>
 #include <mutex>
 #include <vector>
@@ -12,13 +16,15 @@
 // Message structure for the queue
 struct Message {
     int sender_socket;
-    std::string content;
+    std::string content;  // the text line, or a binary frame's payload
+    FrameType frame = FrameType::None;
+    MessageTrace trace{};
 };
 
+class ClusterHandler;
+
 // Server-specific globals
-extern std::mutex history_mtx;
-extern std::mutex console_mtx;
-extern std::vector<std::string> chat_history;
+extern HistoryRing chat_history;
 
 // Function declarations
 void log_message(const std::string& message);
@@ -26,5 +32,22 @@ void process_command(const Message& msg);
 void initialize_connection_pool();
 void handle_client(int client_socket);
 void message_worker();
+// Prefixes a broadcast with its "[HH:MM:SS] " timestamp
+std::string format_broadcast(const std::string& message);
+// Tells binary clients other than `socket` that `username` came or went,
+// and cluster peers once the user's first connection here comes or last goes
+void broadcast_presence(int socket, const std::string& username, bool online);
+// Delivers broadcasts, private messages and presence from cluster peers
+ClusterHandler& server_cluster_handler();
+// Sends `text` from `sender` to the other members of chat room `room` and
+// stores it under the room; false if the sender is not in the room. In a
+// batched room the message is queued for the room's next tick instead.
+bool broadcast_room(int sender, std::string_view room, std::string_view text);
+// Sets the room's batching window in ms (0 turns batching off), first
+// delivering anything already gathered; false if `socket` is not in the room
+bool set_room_batch_window(int socket, std::string_view room, uint32_t window_ms);
+// Delivers batched rooms' messages as their windows pass; runs forever on
+// one thread of its own
+void room_batch_ticker();
 
 #endif // SERVER_H
@@ -1,39 +1,97 @@
 #ifndef SERVER_METRICS_H
 #define SERVER_METRICS_H
 
+#include "latency_histogram.h"
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <map>
 #include <string>
 #include <vector>
 
-#define MAX_LATENCY_SAMPLES 1000
+// Merged per-type counters and latency distribution
+struct MessageTypeStats {
+    std::string type;
+    uint64_t count = 0;
+    HistogramSnapshot latency;  // microseconds
+};
+
+// Where a message was dropped
+enum class DropLane {
+    InboundQueue,  // message_queue full
+    Oversize,      // broadcast above MAX_MESSAGE_SIZE
+    SendFailed,    // a recipient could not be written to
+    Count
+};
 
-// Performance metrics
+const char* drop_lane_name(DropLane lane);
+
+// Performance metrics. Recording is lock-free: each thread writes to its own
+// shard (threads beyond METRICS_SHARDS share shards via atomics), and readers
+// merge all shards on demand. Message type names are interned once per
+// thread, so record_message() is a hash lookup plus a few relaxed atomic adds.
 class ServerMetrics {
+public:
+    static constexpr size_t METRICS_SHARDS = 16;
+    static constexpr size_t MAX_MESSAGE_TYPES = 64;  // further types are counted as "other"
+
 private:
+    struct TypeSlot {
+        std::atomic<uint64_t> count{0};
+        LatencyHistogram latency;
+    };
+
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> messages{0};
+        std::array<std::atomic<TypeSlot*>, MAX_MESSAGE_TYPES> types{};
+    };
+
     std::chrono::steady_clock::time_point start_time;
-    std::map<std::string, size_t> message_types;
-    std::vector<double> message_latencies;
+    std::array<Shard, METRICS_SHARDS> shards;
+    std::array<std::atomic<size_t>, static_cast<size_t>(DropLane::Count)> drops{};
+    LatencyHistogram store_append_latency;
+    LatencyHistogram store_flush_latency;
+    LatencyHistogram fanout_latency;
+    std::atomic<uint64_t> parallel_fanouts{0};
+
+    Shard& local_shard();
+    TypeSlot& slot(Shard& shard, size_t type_id);
 
 public:
-    std::atomic<size_t> total_messages_processed{0};
     std::atomic<size_t> current_connections{0};
     std::atomic<size_t> peak_connections{0};
     std::atomic<size_t> total_bytes_transferred{0};
-    std::atomic<size_t> messages_dropped{0};
+    std::atomic<size_t> messages_dropped{0};  // all lanes
 
     ServerMetrics();
+    ~ServerMetrics();
+    ServerMetrics(const ServerMetrics&) = delete;
+    ServerMetrics& operator=(const ServerMetrics&) = delete;
+
+    // latency in milliseconds; 0 records only the count
     void record_message(const std::string& type, double latency = 0);
     void record_bytes(size_t bytes);
+    void record_drop(DropLane lane);
+    // Message store write and flush latency in milliseconds
+    void record_store_append(double latency);
+    void record_store_flush(double latency);
+    // Time to deliver one broadcast or room message to all of its
+    // recipients, in milliseconds, and whether it was split across threads
+    void record_fanout(double latency, bool parallel);
     void update_connections(size_t count);
     double get_uptime_seconds() const;
+    size_t get_total_messages() const;
     double get_messages_per_second() const;
-    double get_average_latency() const;
-    const std::map<std::string, size_t>& get_message_types() const;
+    double get_average_latency() const;  // milliseconds, over all recorded latencies
+    std::map<std::string, size_t> get_message_types() const;
+    std::vector<MessageTypeStats> get_type_stats() const;
+    size_t get_drops(DropLane lane) const;
+    HistogramSnapshot get_store_append_latency() const;
+    HistogramSnapshot get_store_flush_latency() const;
+    HistogramSnapshot get_fanout_latency() const;
+    uint64_t get_parallel_fanouts() const;
 };
 
 // Global metrics instance
 extern ServerMetrics metrics;
 #endif // SERVER_METRICS_H
-
@@ -2,9 +2,11 @@
 #define SOCKET_UTILS_H
 
 #include "constants.h"
+#include "wire_protocol.h"
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 #include <string>
+#include <sys/types.h>
 
 // Configure socket with appropriate options
 // Parameters:
@@ -21,6 +23,25 @@ bool configure_socket(int socket, bool is_server);
 //   true if successful, false otherwise
 bool set_socket_nonblocking(int socket);
 
+// Write a whole message to a client socket through the current transport
+// Parameters:
+//   socket: The client socket to write to
+//   data: The bytes to send
+//   flags: Extra send() flags (MSG_NOSIGNAL is always added)
+//   max_retries: How many times to wait out a full send buffer before giving up
+// Returns:
+//   The number of bytes written, or -1 if the message could not be written
+//   completely. Bytes, stalls and failures are accounted to the connection's
+//   traffic counters and to the global byte total.
+ssize_t send_to_client(int socket, const std::string& data, int flags = 0, int max_retries = MAX_RETRY_ATTEMPTS);
+
+// Replies to a client in the protocol it speaks: text clients get `text`
+// unchanged, binary clients a CommandReply, Error or AuthResult frame
+// carrying it. Return values are those of send_to_client.
+ssize_t send_reply(int socket, const std::string& text);
+ssize_t send_error(int socket, WireError code, const std::string& text);
+ssize_t send_auth_result(int socket, WireAuth kind, bool ok, const std::string& text);
+
 // Log socket-related errors with consistent formatting
 // Parameters:
 //   operation: The operation that failed (e.g., "setsockopt", "bind", etc.)
@@ -0,0 +1,95 @@
+#ifndef TRAFFIC_CAPTURE_H
+#define TRAFFIC_CAPTURE_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Record kinds in a capture file. The values are part of the file format.
+enum class CaptureEvent : uint8_t {
+    Open = 1,     // a client connected
+    Close = 2,    // the client disconnected
+    Auth = 3,     // /login or /register; data is the username, never the password
+    Message = 4,  // anything else the client sent; data is the raw bytes
+};
+
+enum class CaptureAuth : uint8_t { Login = 1, Register = 2 };
+
+// One decoded capture record
+struct CaptureRecord {
+    int64_t offset_us = 0;    // since the capture started
+    uint32_t connection = 0;  // numbered from 1 in order of Open
+    CaptureEvent event = CaptureEvent::Message;
+    CaptureAuth auth = CaptureAuth::Login;  // Auth only
+    bool auth_ok = false;                   // Auth only
+    std::string data;
+};
+
+// Optional recording of inbound client traffic for the replay tool: when
+// clients connect and disconnect, who authenticated, and every message,
+// timestamped. The file starts with "CHATCAP1" and the capture's wall-clock
+// start time; each record is an event byte followed by varints for the
+// microseconds since the previous record, the connection number and, for
+// Auth and Message, the data length, so a typical chat message costs a few
+// bytes over its own length. Passwords are never written, and with
+// TRAFFIC_CAPTURE_PAYLOADS 0 message bytes are masked too.
+//
+// Recording is off unless start() was called (at startup with
+// TRAFFIC_CAPTURE_ON_STARTUP, or by an admin's /capture start). While off
+// each hook is one relaxed load; while on, records are appended to a buffer
+// under one lock and written out every TRAFFIC_CAPTURE_FLUSH_BYTES.
+// Connections opened before the capture started are not recorded.
+class TrafficCapture {
+public:
+    static TrafficCapture& instance();
+
+    // Starts writing to `path`, replacing any capture in progress. Never
+    // overwrites: fails if `path` already exists.
+    bool start(const std::string& path);
+    // Flushes and closes the file; returns the number of records written
+    uint64_t stop();
+    bool active() const { return recording.load(std::memory_order_relaxed); }
+    std::string path();
+    uint64_t record_count();
+
+    void record_open(int socket);
+    void record_close(int socket);
+    void record_auth(int socket, CaptureAuth kind, const std::string& username, bool ok);
+    void record_message(int socket, const char* data, size_t length);
+
+private:
+    TrafficCapture() = default;
+    TrafficCapture(const TrafficCapture&) = delete;
+    TrafficCapture& operator=(const TrafficCapture&) = delete;
+
+    // Caller holds mtx
+    void append_record(CaptureEvent event, uint32_t connection, const std::string* data, uint8_t auth_flags);
+    void flush_locked(std::unique_lock<std::mutex>& lock);
+
+    std::atomic<bool> recording{false};
+    std::mutex mtx;
+    std::mutex write_mtx;  // keeps buffers in order once swapped out of mtx
+    FILE* file = nullptr;
+    std::string file_path;
+    std::string buffer;
+    int64_t last_us = 0;
+    uint32_t next_connection = 1;
+    uint64_t records = 0;
+    std::unordered_map<int, uint32_t> connections;  // socket -> connection number
+};
+
+// Where the capture called `name` goes: TRAFFIC_CAPTURE_DIR/<name>.cap, with
+// the directory created. Names are 1 to 64 of [A-Za-z0-9_-]; an empty name
+// becomes "traffic-<local date and time>". Returns "" for an invalid name.
+std::string capture_file_path(std::string_view name);
+
+// Reads a whole capture file. Returns false if it is not a capture; a file
+// cut off mid-record (e.g. by a crash) yields the complete records before it.
+bool read_traffic_capture(const std::string& path, std::vector<CaptureRecord>& records,
+                          int64_t* start_realtime_us = nullptr);
+
+#endif // TRAFFIC_CAPTURE_H
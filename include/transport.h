@@ -0,0 +1,110 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include "constants.h"
+#include <sys/types.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// All I/O on client connections goes through a Transport: handle_client's
+// reads, send_to_client's writes, and closing and inspecting a connection in
+// the pool. Connections are still named by an int, which is a file
+// descriptor for SocketTransport and an id handed out by MemoryTransport.
+class Transport {
+public:
+    virtual ~Transport() = default;
+
+    // Prepares a newly accepted connection; false means it should be dropped
+    virtual bool configure(int socket) = 0;
+    // Like send(2) with MSG_NOSIGNAL: bytes written, or -1 with errno set
+    // (EAGAIN while the peer's buffer is full)
+    virtual ssize_t send(int socket, const char* data, size_t length, int flags) = 0;
+    // Like a blocking recv(2): bytes read, 0 once the peer has closed, or -1
+    virtual ssize_t recv(int socket, char* buffer, size_t length) = 0;
+    virtual void close(int socket) = 0;
+    // Bytes written but not yet read by the peer
+    virtual size_t outbound_queued(int socket) = 0;
+    virtual const char* name() const = 0;
+};
+
+// The transport in use; SocketTransport unless replaced
+Transport& transport();
+
+// Routes all connection I/O through `replacement`, or back to sockets when
+// it is nullptr. Meant for tests and benchmarks: swap before any connection
+// is opened, and keep the replacement alive while connections may use it.
+void set_transport(Transport* replacement);
+
+// Kernel sockets
+class SocketTransport : public Transport {
+public:
+    bool configure(int socket) override;
+    ssize_t send(int socket, const char* data, size_t length, int flags) override;
+    ssize_t recv(int socket, char* buffer, size_t length) override;
+    void close(int socket) override;
+    size_t outbound_queued(int socket) override;
+    const char* name() const override { return "socket"; }
+};
+
+// In-process connections without the kernel network stack, so tests and
+// benchmarks can drive the whole server pipeline (handle_client, the message
+// queue, workers, fan-out) from simulated clients in one process. Each
+// client_send() arrives as exactly one server recv(), which keeps tests
+// deterministic. Server-to-client bytes are buffered up to buffer_bytes per
+// connection; past that send() fails with EAGAIN as a full socket would.
+class MemoryTransport : public Transport {
+public:
+    explicit MemoryTransport(size_t buffer_bytes = SOCKET_BUFFER_SIZE);
+
+    bool configure(int socket) override;
+    ssize_t send(int socket, const char* data, size_t length, int flags) override;
+    ssize_t recv(int socket, char* buffer, size_t length) override;
+    void close(int socket) override;
+    size_t outbound_queued(int socket) override;
+    const char* name() const override { return "memory"; }
+
+    // Client side. connect() opens a connection and returns the id the
+    // server sees; hand it to handle_client. Ids are never reused.
+    int connect();
+    // False once the server has closed the connection
+    bool client_send(int socket, const std::string& data);
+    // Everything the server has sent so far, waiting up to `timeout` for the
+    // first byte; empty on timeout, or once the server has closed and
+    // everything was read
+    std::string client_receive(int socket, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+    // Reads until `needle` has arrived; returns everything read, or an empty
+    // string if it did not arrive within `timeout`
+    std::string client_receive_until(int socket, const std::string& needle, std::chrono::milliseconds timeout);
+    // The server's next recv() returns 0
+    void client_close(int socket);
+    bool server_closed(int socket);
+
+    // Connections not yet closed by both sides
+    size_t connection_count();
+
+private:
+    struct Endpoint {
+        std::mutex mtx;
+        std::condition_variable server_readable;
+        std::condition_variable client_readable;
+        std::deque<std::string> inbound;  // client -> server, one entry per client_send
+        std::string outbound;             // server -> client
+        bool client_closed = false;
+        bool server_closed = false;
+    };
+
+    std::shared_ptr<Endpoint> find(int socket);
+    void forget(int socket);
+
+    const size_t buffer_bytes;
+    std::mutex endpoints_mtx;
+    std::unordered_map<int, std::shared_ptr<Endpoint>> endpoints;
+    int next_socket;
+};
+
+#endif // TRANSPORT_H
@@ -0,0 +1,134 @@
+#ifndef WIRE_PROTOCOL_H
+#define WIRE_PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Binary protocol, negotiated per connection alongside the text protocol.
+//
+// A binary client opens with a hello: the four magic bytes "\0CBP" and the
+// highest protocol version it speaks. Text clients never send a NUL, so the
+// first byte tells the two apart. The server answers with the same magic and
+// the version both sides will use; anything before that answer (broadcasts
+// sent while the hello was in flight) is text and can be skipped. From then
+// on both directions carry frames: a type byte, a little-endian u32 payload
+// length, then the payload. Strings inside a payload are a u16 length and
+// the bytes; a last field marked "rest" below is not length-prefixed and
+// runs to the end of the payload. Integers are little-endian.
+//
+// The values below are part of the protocol.
+constexpr uint8_t WIRE_PROTOCOL_VERSION = 1;
+constexpr char WIRE_HELLO_MAGIC[4] = {'\0', 'C', 'B', 'P'};
+constexpr size_t WIRE_HELLO_BYTES = sizeof(WIRE_HELLO_MAGIC) + 1;
+constexpr size_t WIRE_HEADER_BYTES = 5;
+
+enum class FrameType : uint8_t {
+    None = 0,  // not a frame: a text protocol message
+
+    // Client to server
+    Login = 0x01,     // username, password
+    Register = 0x02,  // username, password
+    Chat = 0x03,      // rest
+    Private = 0x04,   // recipient, rest
+    Command = 0x05,   // rest: a text command line such as "/stats"; answered with CommandReply or Error
+
+    // Server to client
+    AuthResult = 0x81,      // u8 WireAuth, u8 ok, rest
+    ChatMessage = 0x82,     // u64 seq, i64 timestamp ms, sender, rest
+    PrivateMessage = 0x83,  // sender, rest
+    CommandReply = 0x84,    // rest
+    Presence = 0x85,        // u8 online, rest: username
+    Error = 0x86,           // u16 WireError, rest
+    RoomMessage = 0x87,     // i64 timestamp ms, room, sender, rest
+    RoomBatch = 0x88,       // room, then to the end: i64 timestamp ms, sender, text (a string) per message
+
+    // Server to server, on cluster links (see cluster.h)
+    PeerHello = 0xC1,      // u16 node id, 16-byte nonce, then 32-byte proof in the reply; first frame each way
+    PeerHeartbeat = 0xC2,  // empty
+    PeerDirectory = 0xC3,  // to the end: username (a string) per user on the node, replacing earlier ones
+    PeerPresence = 0xC4,   // u8 online, rest: username
+    PeerBroadcast = 0xC5,  // i64 timestamp ms, sender, rest
+    PeerPrivate = 0xC6,    // sender, recipient, rest
+    PeerAuth = 0xC7,       // 32-byte proof; the connecting node's second frame
+};
+
+enum class WireAuth : uint8_t { Login = 1, Register = 2 };
+
+enum class WireError : uint16_t {
+    Malformed = 1,
+    UnsupportedVersion = 2,
+    TooLarge = 3,
+    NotAuthenticated = 4,
+    UnknownCommand = 5,
+    BadArguments = 6,
+    PermissionDenied = 7,
+    UserNotFound = 8,
+    Busy = 9,
+    NotMember = 10,  // not in the chat room named
+};
+
+// A decoded frame; the payload points into the buffer it was decoded from
+struct WireFrame {
+    FrameType type = FrameType::None;
+    std::string_view payload;
+};
+
+enum class DecodeStatus { Complete, Incomplete, TooLarge };
+
+// Decodes the frame at the start of `buffer` without copying it. On
+// Complete, `consumed` is the frame's size including the header; frames
+// whose payload exceeds max_payload are TooLarge.
+DecodeStatus decode_frame(std::string_view buffer, WireFrame& frame, size_t& consumed, size_t max_payload);
+
+enum class HelloStatus { Text, Incomplete, Binary };
+
+// Classifies a connection's first bytes: Binary (with the peer's version)
+// for a hello, Incomplete while they are a prefix of one, Text otherwise
+HelloStatus parse_hello(std::string_view opening, uint8_t& version);
+std::string encode_hello(uint8_t version);
+
+// Reads payload fields in order. A read fails, leaving the reader as it
+// was, when the payload is too short.
+class WireReader {
+public:
+    explicit WireReader(std::string_view payload) : rest(payload) {}
+
+    bool read_u8(uint8_t& value);
+    bool read_u16(uint16_t& value);
+    bool read_u64(uint64_t& value);
+    bool read_string(std::string_view& value);
+    // The "rest" field: everything not read yet
+    std::string_view remaining() const { return rest; }
+
+private:
+    std::string_view rest;
+};
+
+std::string encode_frame(FrameType type, std::string_view payload);
+// Login and Register
+std::string encode_credentials(FrameType type, std::string_view username, std::string_view password);
+// Private (peer is the recipient) and PrivateMessage (peer is the sender)
+std::string encode_private(FrameType type, std::string_view peer, std::string_view text);
+std::string encode_chat(uint64_t seq, int64_t timestamp_ms, std::string_view sender, std::string_view text);
+std::string encode_room_message(int64_t timestamp_ms, std::string_view room, std::string_view sender,
+                                std::string_view text);
+// A RoomBatch is its room and the concatenation of one entry per message
+std::string encode_room_batch_entry(int64_t timestamp_ms, std::string_view sender, std::string_view text);
+std::string encode_room_batch(std::string_view room, std::string_view entries);
+std::string encode_auth_result(WireAuth kind, bool ok, std::string_view text);
+std::string encode_presence(bool online, std::string_view username);
+std::string encode_error(WireError code, std::string_view text);
+
+// Cluster link frames
+// `proof` is empty in the connecting node's hello
+std::string encode_peer_hello(uint16_t node_id, std::string_view nonce, std::string_view proof);
+std::string encode_peer_auth(std::string_view proof);
+std::string encode_peer_directory(const std::vector<std::string>& usernames);
+std::string encode_peer_presence(bool online, std::string_view username);
+std::string encode_peer_broadcast(int64_t timestamp_ms, std::string_view sender, std::string_view text);
+std::string encode_peer_private(std::string_view sender, std::string_view recipient, std::string_view text);
+
+#endif // WIRE_PROTOCOL_H
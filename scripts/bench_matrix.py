@@ -0,0 +1,304 @@
+#!/usr/bin/env python3
+"""
+Fan-out benchmark matrix for the chat server.
+
+Sweeps connections x messages/sec x payload size x worker threads. Every
+combination gets a freshly launched server (own port, own working
+directory, so an empty database) driven by loadgen. Records throughput,
+server CPU per message, RSS and delivery-latency percentiles to JSON and
+CSV, and optionally compares against a stored baseline, exiting non-zero
+when a regression threshold is exceeded.
+
+Usage:
+  bench_matrix.py --connections 10,50,150 --rates 500,2000 --payloads 64,512 \\
+                  --workers 1,4 --out bench.json --csv bench.csv
+  bench_matrix.py ... --save-baseline baseline.json
+  bench_matrix.py ... --baseline baseline.json --threshold latency_p99_us=0.3
+"""
+
+import argparse
+import csv
+import datetime
+import itertools
+import json
+import os
+import platform
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+REPO_ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+CLOCK_TICKS = os.sysconf("SC_CLK_TCK")
+
+# Metrics compared against the baseline: name -> (default threshold, True if higher is worse).
+# A threshold is the relative change allowed, e.g. 0.25 = 25% worse.
+REGRESSION_METRICS = {
+    "latency_p50_us": (0.25, True),
+    "latency_p99_us": (0.25, True),
+    "cpu_us_per_delivery": (0.20, True),
+    "peak_rss_kb": (0.25, True),
+    "deliveries_per_s": (0.10, False),
+}
+
+CSV_FIELDS = [
+    "connections", "rate", "payload", "workers", "authenticated", "sent", "achieved_rate", "delivered",
+    "delivery_ratio", "deliveries_per_s", "send_backlogged", "latency_p50_us", "latency_p90_us",
+    "latency_p99_us", "latency_p999_us", "latency_max_us", "cpu_s", "cpu_us_per_message",
+    "cpu_us_per_delivery", "rss_kb", "peak_rss_kb",
+]
+
+
+def int_list(text):
+    return [int(value) for value in text.split(",") if value]
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def wait_for_port(port, timeout, process):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if process.poll() is not None:
+            return False
+        try:
+            with socket.create_connection(("127.0.0.1", port), timeout=0.2):
+                return True
+        except OSError:
+            time.sleep(0.05)
+    return False
+
+
+def cpu_seconds(pid):
+    """User + system CPU time of a process"""
+    with open(f"/proc/{pid}/stat") as f:
+        fields = f.read().rsplit(")", 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / CLOCK_TICKS
+
+
+def memory_kb(pid):
+    """(current RSS, peak RSS) in KiB"""
+    rss = peak = 0
+    with open(f"/proc/{pid}/status") as f:
+        for line in f:
+            if line.startswith("VmRSS:"):
+                rss = int(line.split()[1])
+            elif line.startswith("VmHWM:"):
+                peak = int(line.split()[1])
+    return rss, peak
+
+
+def run_point(args, connections, rate, payload, workers):
+    """Launches a server, drives it with loadgen and returns one result row"""
+    with tempfile.TemporaryDirectory(prefix="bench_matrix_") as workdir:
+        port = free_port()
+        with open(os.path.join(workdir, "server.log"), "w") as log:
+            server = subprocess.Popen([os.path.abspath(args.server), "--port", str(port), "--workers", str(workers),
+                                       "--admin-port", "0"], cwd=workdir, stdout=log, stderr=subprocess.STDOUT)
+        try:
+            if not wait_for_port(port, 10, server):
+                raise RuntimeError("server did not start listening")
+
+            loadgen = subprocess.Popen(
+                [os.path.abspath(args.loadgen), "--port", str(port), "--connections", str(connections),
+                 "--rate", str(rate), "--payload", str(payload), "--duration", str(args.duration),
+                 "--warmup", str(args.warmup), "--drain", str(args.drain), "--threads", str(args.loadgen_threads)],
+                stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True)
+
+            # loadgen reports on stderr once every connection has logged in; the
+            # measured window starts warmup seconds later
+            settled = threading.Event()
+
+            def watch_stderr():
+                for line in loadgen.stderr:
+                    if "settled" in line:
+                        settled.set()
+                    if args.verbose:
+                        sys.stderr.write(line)
+                settled.set()
+
+            watcher = threading.Thread(target=watch_stderr, daemon=True)
+            watcher.start()
+            settled.wait()
+            time.sleep(0.01 + args.warmup)
+            cpu_start = cpu_seconds(server.pid)
+            time.sleep(args.duration)
+            cpu_used = cpu_seconds(server.pid) - cpu_start
+            rss_kb, peak_rss_kb = memory_kb(server.pid)
+
+            output, _ = loadgen.communicate(timeout=args.drain + 60)
+            watcher.join(timeout=5)
+            if loadgen.returncode not in (0, 1) or not output.strip():
+                raise RuntimeError(f"loadgen exited with {loadgen.returncode}")
+            result = json.loads(output)
+        finally:
+            server.terminate()
+            try:
+                server.wait(timeout=10)
+            except subprocess.TimeoutExpired:
+                server.kill()
+                server.wait()
+
+    latency = result["latency_us"]
+    sent = result["sent"]
+    delivered = result["delivered"]
+    return {
+        "connections": connections,
+        "rate": rate,
+        "payload": payload,
+        "workers": workers,
+        "authenticated": result["authenticated"],
+        "sent": sent,
+        "achieved_rate": result["achieved_rate"],
+        "delivered": delivered,
+        "delivery_ratio": result["delivery_ratio"],
+        "deliveries_per_s": delivered / args.duration,
+        "send_backlogged": result["send_backlogged"],
+        "latency_p50_us": latency["p50"],
+        "latency_p90_us": latency["p90"],
+        "latency_p99_us": latency["p99"],
+        "latency_p999_us": latency["p99.9"],
+        "latency_max_us": latency["max"],
+        "cpu_s": cpu_used,
+        "cpu_us_per_message": cpu_used * 1e6 / sent if sent else 0.0,
+        "cpu_us_per_delivery": cpu_used * 1e6 / delivered if delivered else 0.0,
+        "rss_kb": rss_kb,
+        "peak_rss_kb": peak_rss_kb,
+    }
+
+
+def point_key(row):
+    return (row["connections"], row["rate"], row["payload"], row["workers"])
+
+
+def compare(rows, baseline_rows, thresholds, latency_slack_us, min_delivery_ratio):
+    """Returns a list of human-readable regression descriptions"""
+    failures = []
+    baseline = {point_key(row): row for row in baseline_rows}
+    for row in rows:
+        label = "connections={} rate={} payload={} workers={}".format(*point_key(row))
+        if row["delivery_ratio"] < min_delivery_ratio:
+            failures.append(f"{label}: delivery_ratio {row['delivery_ratio']:.4f} < {min_delivery_ratio}")
+        base = baseline.get(point_key(row))
+        if base is None:
+            continue
+        for metric, threshold in thresholds.items():
+            higher_is_worse = REGRESSION_METRICS[metric][1]
+            old, new = base.get(metric), row.get(metric)
+            if old is None or new is None or old <= 0:
+                continue
+            slack = latency_slack_us if metric.startswith("latency_") else 0
+            if higher_is_worse and new > old * (1 + threshold) + slack:
+                failures.append(f"{label}: {metric} {new:.1f} vs baseline {old:.1f} (+{(new / old - 1) * 100:.0f}%, "
+                                f"limit +{threshold * 100:.0f}%)")
+            elif not higher_is_worse and new < old * (1 - threshold):
+                failures.append(f"{label}: {metric} {new:.1f} vs baseline {old:.1f} (-{(1 - new / old) * 100:.0f}%, "
+                                f"limit -{threshold * 100:.0f}%)")
+    return failures
+
+
+def parse_thresholds(specs):
+    thresholds = {name: default for name, (default, _) in REGRESSION_METRICS.items()}
+    for spec in specs:
+        name, _, value = spec.partition("=")
+        if name not in REGRESSION_METRICS or not value:
+            sys.exit(f"--threshold expects METRIC=FRACTION with METRIC one of {', '.join(REGRESSION_METRICS)}")
+        if value == "off":
+            thresholds.pop(name, None)
+        else:
+            thresholds[name] = float(value)
+    return thresholds
+
+
+def git_commit():
+    try:
+        return subprocess.run(["git", "rev-parse", "--short", "HEAD"], cwd=REPO_ROOT, capture_output=True,
+                              text=True, check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Chat server fan-out benchmark matrix")
+    parser.add_argument("--server", default=os.path.join(REPO_ROOT, "build", "server"))
+    parser.add_argument("--loadgen", default=os.path.join(REPO_ROOT, "build", "loadgen"))
+    parser.add_argument("--connections", type=int_list, default=[10, 50, 150])
+    parser.add_argument("--rates", type=int_list, default=[200, 1000])
+    parser.add_argument("--payloads", type=int_list, default=[64, 512])
+    parser.add_argument("--workers", type=int_list, default=[1, 4])
+    parser.add_argument("--duration", type=float, default=10, help="measured seconds per point")
+    parser.add_argument("--warmup", type=float, default=2)
+    parser.add_argument("--drain", type=float, default=2)
+    parser.add_argument("--loadgen-threads", type=int, default=2)
+    parser.add_argument("--out", default="bench_matrix.json", help="JSON results")
+    parser.add_argument("--csv", help="also write results as CSV")
+    parser.add_argument("--baseline", help="compare against this results file")
+    parser.add_argument("--save-baseline", help="also write the results here as the new baseline")
+    parser.add_argument("--threshold", action="append", default=[], metavar="METRIC=FRACTION",
+                        help="allowed relative regression, or 'off' (repeatable); defaults: " +
+                             ", ".join(f"{name}={default}" for name, (default, _) in REGRESSION_METRICS.items()))
+    parser.add_argument("--latency-slack-us", type=float, default=200,
+                        help="latency increases below this many microseconds never fail")
+    parser.add_argument("--min-delivery-ratio", type=float, default=0.99)
+    parser.add_argument("--verbose", action="store_true", help="pass loadgen progress through")
+    args = parser.parse_args()
+
+    thresholds = parse_thresholds(args.threshold)
+    for binary in (args.server, args.loadgen):
+        if not os.access(binary, os.X_OK):
+            sys.exit(f"{binary} not found; build the server and loadgen first")
+
+    points = list(itertools.product(args.connections, args.rates, args.payloads, args.workers))
+    rows = []
+    for index, (connections, rate, payload, workers) in enumerate(points, 1):
+        print(f"[{index}/{len(points)}] connections={connections} rate={rate} payload={payload} workers={workers}",
+              file=sys.stderr)
+        try:
+            row = run_point(args, connections, rate, payload, workers)
+        except (RuntimeError, subprocess.TimeoutExpired, json.JSONDecodeError) as error:
+            print(f"  failed: {error}", file=sys.stderr)
+            continue
+        print(f"  {row['deliveries_per_s']:.0f} deliveries/s, p99 {row['latency_p99_us']:.0f} us, "
+              f"{row['cpu_us_per_delivery']:.2f} cpu us/delivery, peak rss {row['peak_rss_kb']} KiB",
+              file=sys.stderr)
+        rows.append(row)
+
+    results = {
+        "created": datetime.datetime.now().isoformat(timespec="seconds"),
+        "commit": git_commit(),
+        "host": platform.node(),
+        "cpus": os.cpu_count(),
+        "duration_s": args.duration,
+        "rows": rows,
+    }
+    for path in filter(None, (args.out, args.save_baseline)):
+        with open(path, "w") as f:
+            json.dump(results, f, indent=2)
+            f.write("\n")
+    if args.csv:
+        with open(args.csv, "w", newline="") as f:
+            writer = csv.DictWriter(f, fieldnames=CSV_FIELDS)
+            writer.writeheader()
+            writer.writerows(rows)
+
+    baseline_rows, baseline_commit = [], None
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        baseline_rows, baseline_commit = baseline["rows"], baseline.get("commit")
+    failures = compare(rows, baseline_rows, thresholds, args.latency_slack_us, args.min_delivery_ratio)
+    failures += [f"{len(points) - len(rows)} point(s) failed to run"] if len(rows) < len(points) else []
+    for failure in failures:
+        print("REGRESSION " + failure, file=sys.stderr)
+    if failures:
+        sys.exit(1)
+    if args.baseline:
+        print(f"No regressions against {args.baseline} (commit {baseline_commit})", file=sys.stderr)
+
+if __name__ == "__main__":
+    main()
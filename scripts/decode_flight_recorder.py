@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+"""
+Decoder for chat server flight recorder dumps.
+Merges the per-thread event rings into one timeline, oldest first.
+
+Usage: decode_flight_recorder.py [flight_recorder.bin] [--socket FD] [--tid TID] [--last N]
+"""
+
+import argparse
+import datetime
+import socket
+import struct
+import sys
+
+MAGIC = b"CHATFLT1"
+HEADER = struct.Struct("<8sIIIIqq")
+RING_HEADER = struct.Struct("<QII")
+RECORD = struct.Struct("<qQiiH6x")
+
+# Must match FlightEvent in include/flight_recorder.h
+EVENTS = {
+    1: "accept",
+    2: "auth",
+    3: "auth_failed",
+    4: "enqueue",
+    5: "dequeue",
+    6: "send_stall",
+    7: "drop",
+    8: "release",
+}
+
+# Must match DropLane in include/server_metrics.h
+DROP_LANES = {0: "inbound_queue", 1: "oversize", 2: "send_failed"}
+AUTH_KINDS = {1: "login", 2: "register"}
+
+
+def describe(event, arg):
+    """Human-readable form of an event's argument"""
+    if event == 1:
+        return "peer " + socket.inet_ntoa(struct.pack("<I", arg & 0xFFFFFFFF))
+    if event in (2, 3):
+        return AUTH_KINDS.get(arg, str(arg))
+    if event == 4:
+        return f"{arg} bytes"
+    if event == 5:
+        return f"waited {arg / 1000:.1f} us"
+    if event == 6:
+        return f"{arg} bytes pending"
+    if event == 7:
+        return DROP_LANES.get(arg, str(arg))
+    return ""
+
+
+def read_dump(path):
+    """Returns (header fields, list of (time_ns, tid, event, socket, arg))"""
+    with open(path, "rb") as f:
+        data = f.read()
+    if len(data) < HEADER.size:
+        sys.exit(f"{path}: too short for a flight recorder dump")
+    magic, version, record_bytes, capacity, ring_count, monotonic_ns, realtime_ns = HEADER.unpack_from(data, 0)
+    if magic != MAGIC or version != 1 or record_bytes != RECORD.size:
+        sys.exit(f"{path}: not a version 1 flight recorder dump")
+
+    events = []
+    offset = HEADER.size
+    for _ in range(ring_count):
+        if offset + RING_HEADER.size + capacity * RECORD.size > len(data):
+            print("warning: dump is truncated", file=sys.stderr)
+            break
+        head, _index, _claimed = RING_HEADER.unpack_from(data, offset)
+        offset += RING_HEADER.size
+        # The newest `capacity` events survive; slot i holds event i % capacity
+        for sequence in range(max(0, head - capacity), head):
+            time_ns, arg, fd, tid, event = RECORD.unpack_from(data, offset + (sequence % capacity) * RECORD.size)
+            # Slots being written during the dump may be torn; skip obvious garbage
+            if event in EVENTS and 0 < time_ns <= monotonic_ns:
+                events.append((time_ns, tid, event, fd, arg))
+        offset += capacity * RECORD.size
+
+    events.sort(key=lambda e: e[0])
+    return (monotonic_ns, realtime_ns), events
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode a chat server flight recorder dump")
+    parser.add_argument("path", nargs="?", default="flight_recorder.bin")
+    parser.add_argument("--socket", type=int, help="only events for this socket")
+    parser.add_argument("--tid", type=int, help="only events from this thread")
+    parser.add_argument("--last", type=int, help="only the newest N events")
+    args = parser.parse_args()
+
+    (monotonic_ns, realtime_ns), events = read_dump(args.path)
+    if args.socket is not None:
+        events = [e for e in events if e[3] == args.socket]
+    if args.tid is not None:
+        events = [e for e in events if e[1] == args.tid]
+    if args.last:
+        events = events[-args.last:]
+
+    offset_ns = realtime_ns - monotonic_ns
+    print(f"{'time':<26} {'tid':>7} {'event':<12} {'socket':>6}  detail")
+    for time_ns, tid, event, fd, arg in events:
+        wall = datetime.datetime.fromtimestamp((time_ns + offset_ns) // 1000000000)
+        stamp = f"{wall:%Y-%m-%d %H:%M:%S}.{(time_ns + offset_ns) % 1000000000:09d}"
+        print(f"{stamp:<26} {tid:>7} {EVENTS[event]:<12} {fd:>6}  {describe(event, arg)}")
+    print(f"{len(events)} events", file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
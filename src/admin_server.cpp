@@ -0,0 +1,314 @@
+#include "admin_server.h"
+#include "cluster.h"
+#include "constants.h"
+#include "instrumented_mutex.h"
+#include "message_queue.h"
+#include "message_trace.h"
+#include "server_metrics.h"
+#include "server.h"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+// Bucket bounds (seconds) for exported latency histograms. The in-process
+// histograms are much finer; these are summed from them on each scrape.
+const std::vector<double> EXPORT_BUCKETS = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+                                            0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+// Lock waits and holds are mostly well under a microsecond
+const std::vector<double> LOCK_EXPORT_BUCKETS = {1e-7, 2.5e-7, 5e-7, 1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5,
+                                                 5e-5, 1e-4, 1e-3, 1e-2, 0.1, 1};
+
+void append_number(std::string& out, double value) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.9g", value);
+    out += buffer;
+}
+
+void append_header(std::string& out, const char* name, const char* type, const char* help) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+void append_sample(std::string& out, const char* name, const std::string& labels, double value) {
+    out += name;
+    if (!labels.empty()) {
+        out += '{' + labels + '}';
+    }
+    out += ' ';
+    append_number(out, value);
+    out += '\n';
+}
+
+// Cumulative buckets over a HistogramSnapshot, exported in seconds. Values
+// are microseconds unless units_per_second says otherwise.
+void append_histogram(std::string& out, const char* name, const std::string& labels,
+                      const HistogramSnapshot& histogram, double units_per_second = 1e6,
+                      const std::vector<double>& bounds = EXPORT_BUCKETS) {
+    const std::string prefix = labels.empty() ? "" : labels + ",";
+    uint64_t cumulative = 0;
+    size_t bucket = 0;
+    for (double bound : bounds) {
+        const double bound_units = bound * units_per_second;
+        while (bucket < histogram.counts.size() && latency_buckets::upper_bound(bucket) <= bound_units) {
+            cumulative += histogram.counts[bucket++];
+        }
+        char le[32];
+        snprintf(le, sizeof(le), "%g", bound);
+        append_sample(out, (std::string(name) + "_bucket").c_str(), prefix + "le=\"" + le + "\"",
+                      static_cast<double>(cumulative));
+    }
+    append_sample(out, (std::string(name) + "_bucket").c_str(), prefix + "le=\"+Inf\"",
+                  static_cast<double>(histogram.count));
+    append_sample(out, (std::string(name) + "_sum").c_str(), labels, histogram.sum / units_per_second);
+    append_sample(out, (std::string(name) + "_count").c_str(), labels, static_cast<double>(histogram.count));
+}
+
+// Label values may not contain raw quotes, backslashes or newlines
+std::string escape_label(const std::string& value) {
+    std::string escaped;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+}  // namespace
+
+std::string render_prometheus_metrics() {
+    std::string out;
+    out.reserve(16 * 1024);
+
+    append_header(out, "chat_uptime_seconds", "gauge", "Seconds since the server started.");
+    append_sample(out, "chat_uptime_seconds", "", metrics.get_uptime_seconds());
+
+    append_header(out, "chat_messages_total", "counter", "Messages and commands processed.");
+    append_sample(out, "chat_messages_total", "", static_cast<double>(metrics.get_total_messages()));
+
+    std::vector<MessageTypeStats> types = metrics.get_type_stats();
+    append_header(out, "chat_messages_by_type_total", "counter", "Messages processed by type.");
+    for (const auto& type : types) {
+        append_sample(out, "chat_messages_by_type_total", "type=\"" + escape_label(type.type) + "\"",
+                      static_cast<double>(type.count));
+    }
+
+    append_header(out, "chat_connections", "gauge", "Open client connections.");
+    append_sample(out, "chat_connections", "", static_cast<double>(metrics.current_connections.load()));
+    append_header(out, "chat_connections_peak", "gauge", "Highest number of open client connections.");
+    append_sample(out, "chat_connections_peak", "", static_cast<double>(metrics.peak_connections.load()));
+    append_header(out, "chat_connections_max", "gauge", "Connection pool size.");
+    append_sample(out, "chat_connections_max", "", MAX_CONNECTIONS);
+
+    append_header(out, "chat_bytes_transferred_total", "counter", "Bytes sent to clients.");
+    append_sample(out, "chat_bytes_transferred_total", "", static_cast<double>(metrics.total_bytes_transferred.load()));
+
+    append_header(out, "chat_message_queue_depth", "gauge", "Messages waiting for a worker.");
+    append_sample(out, "chat_message_queue_depth", "", static_cast<double>(message_queue.size()));
+    append_header(out, "chat_message_queue_capacity", "gauge", "Message queue capacity.");
+    append_sample(out, "chat_message_queue_capacity", "", MESSAGE_QUEUE_SIZE);
+
+    append_header(out, "chat_messages_dropped_total", "counter", "Messages dropped, by lane.");
+    for (size_t lane = 0; lane < static_cast<size_t>(DropLane::Count); ++lane) {
+        append_sample(out, "chat_messages_dropped_total",
+                      std::string("lane=\"") + drop_lane_name(static_cast<DropLane>(lane)) + "\"",
+                      static_cast<double>(metrics.get_drops(static_cast<DropLane>(lane))));
+    }
+
+    append_header(out, "chat_history_last_seq", "gauge", "Sequence number of the newest broadcast.");
+    append_sample(out, "chat_history_last_seq", "", static_cast<double>(chat_history.last_seq()));
+
+    append_header(out, "chat_message_latency_seconds", "histogram", "Handling latency by message type.");
+    for (const auto& type : types) {
+        if (type.latency.count > 0) {
+            append_histogram(out, "chat_message_latency_seconds", "type=\"" + escape_label(type.type) + "\"",
+                             type.latency);
+        }
+    }
+
+    append_header(out, "chat_stage_latency_seconds", "histogram", "Message pipeline latency by stage.");
+    for (size_t stage = 0; stage < static_cast<size_t>(TraceStage::Count); ++stage) {
+        append_histogram(out, "chat_stage_latency_seconds",
+                         std::string("stage=\"") + trace_stage_name(static_cast<TraceStage>(stage)) + "\"",
+                         message_tracer.stage_latency(static_cast<TraceStage>(stage)));
+    }
+
+    append_header(out, "chat_store_append_latency_seconds", "histogram", "Message store append latency.");
+    append_histogram(out, "chat_store_append_latency_seconds", "", metrics.get_store_append_latency());
+    append_header(out, "chat_store_flush_latency_seconds", "histogram", "Message store flush latency.");
+    append_histogram(out, "chat_store_flush_latency_seconds", "", metrics.get_store_flush_latency());
+    append_header(out, "chat_fanout_latency_seconds", "histogram",
+                  "Time to deliver one broadcast or room message to every recipient.");
+    append_histogram(out, "chat_fanout_latency_seconds", "", metrics.get_fanout_latency());
+    append_header(out, "chat_fanout_parallel_total", "counter", "Fan-outs split across fan-out threads.");
+    append_sample(out, "chat_fanout_parallel_total", "", static_cast<double>(metrics.get_parallel_fanouts()));
+
+    if (const ClusterNode* node = cluster_node()) {
+        const ClusterStats cluster = node->stats();
+        append_header(out, "chat_cluster_peers", "gauge", "Cluster peers, by whether their link is up.");
+        append_sample(out, "chat_cluster_peers", "state=\"up\"", static_cast<double>(cluster.peers_up));
+        append_sample(out, "chat_cluster_peers", "state=\"down\"",
+                      static_cast<double>(cluster.peers - cluster.peers_up));
+        append_header(out, "chat_cluster_remote_users", "gauge", "Users connected to other nodes.");
+        append_sample(out, "chat_cluster_remote_users", "", static_cast<double>(cluster.remote_users));
+        append_header(out, "chat_cluster_frames_total", "counter", "Frames on cluster links.");
+        append_sample(out, "chat_cluster_frames_total", "direction=\"sent\"", static_cast<double>(cluster.frames_sent));
+        append_sample(out, "chat_cluster_frames_total", "direction=\"received\"",
+                      static_cast<double>(cluster.frames_received));
+        append_sample(out, "chat_cluster_frames_total", "direction=\"dropped\"",
+                      static_cast<double>(cluster.frames_dropped));
+        append_header(out, "chat_cluster_links_refused_total", "counter",
+                      "Inbound cluster connections refused: unknown host or node id, wrong secret, or too many.");
+        append_sample(out, "chat_cluster_links_refused_total", "", static_cast<double>(cluster.links_refused));
+        append_header(out, "chat_cluster_writes_total", "counter", "Writes to cluster links; frames share writes.");
+        append_sample(out, "chat_cluster_writes_total", "", static_cast<double>(cluster.writes));
+        append_header(out, "chat_cluster_sent_bytes_total", "counter", "Bytes written to cluster links.");
+        append_sample(out, "chat_cluster_sent_bytes_total", "", static_cast<double>(cluster.bytes_sent));
+    }
+
+    std::vector<LockStatsSnapshot> locks = lock_stats_snapshot();
+    append_header(out, "chat_lock_acquisitions_total", "counter", "Acquisitions by named lock.");
+    for (const auto& lock : locks) {
+        append_sample(out, "chat_lock_acquisitions_total", "lock=\"" + escape_label(lock.name) + "\"",
+                      static_cast<double>(lock.acquisitions));
+    }
+    append_header(out, "chat_lock_contended_total", "counter", "Acquisitions that found the lock held.");
+    for (const auto& lock : locks) {
+        append_sample(out, "chat_lock_contended_total", "lock=\"" + escape_label(lock.name) + "\"",
+                      static_cast<double>(lock.contended));
+    }
+    append_header(out, "chat_lock_wait_seconds", "histogram", "Time spent waiting to acquire a lock.");
+    for (const auto& lock : locks) {
+        append_histogram(out, "chat_lock_wait_seconds", "lock=\"" + escape_label(lock.name) + "\"", lock.wait_ns,
+                         1e9, LOCK_EXPORT_BUCKETS);
+    }
+    append_header(out, "chat_lock_hold_seconds", "histogram", "Time a lock was held.");
+    for (const auto& lock : locks) {
+        append_histogram(out, "chat_lock_hold_seconds", "lock=\"" + escape_label(lock.name) + "\"", lock.hold_ns,
+                         1e9, LOCK_EXPORT_BUCKETS);
+    }
+
+    return out;
+}
+
+AdminServer::AdminServer(const std::string& bind_address, int port)
+    : bind_address(bind_address), requested_port(port), bound_port(0), listen_socket(-1), running(false) {}
+
+AdminServer::~AdminServer() {
+    stop();
+}
+
+bool AdminServer::start() {
+    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket == -1) {
+        log_message("Error: Could not create admin socket: " + std::string(strerror(errno)));
+        return false;
+    }
+    int reuse = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(requested_port));
+    if (inet_pton(AF_INET, bind_address.c_str(), &address.sin_addr) != 1 ||
+        bind(listen_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1 ||
+        listen(listen_socket, 16) == -1) {
+        log_message("Error: Could not open admin port " + bind_address + ":" + std::to_string(requested_port) +
+                    ": " + std::string(strerror(errno)));
+        close(listen_socket);
+        listen_socket = -1;
+        return false;
+    }
+
+    socklen_t length = sizeof(address);
+    getsockname(listen_socket, reinterpret_cast<sockaddr*>(&address), &length);
+    bound_port = ntohs(address.sin_port);
+    running = true;
+    thread = std::thread(&AdminServer::run, this);
+    return true;
+}
+
+void AdminServer::stop() {
+    running = false;
+    if (thread.joinable()) {
+        thread.join();
+    }
+    if (listen_socket != -1) {
+        close(listen_socket);
+        listen_socket = -1;
+    }
+}
+
+void AdminServer::run() {
+    while (running) {
+        // Poll with a timeout so stop() is noticed promptly
+        pollfd pfd{listen_socket, POLLIN, 0};
+        if (poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+        int client = accept(listen_socket, nullptr, nullptr);
+        if (client == -1) {
+            continue;
+        }
+        serve(client);
+        close(client);
+    }
+}
+
+void AdminServer::serve(int client) {
+    // A slow or idle scraper must not stall the listener
+    timeval timeout{1, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+        ssize_t received = recv(client, buffer, sizeof(buffer), 0);
+        if (received <= 0) {
+            break;
+        }
+        request.append(buffer, static_cast<size_t>(received));
+    }
+
+    std::string status = "404 Not Found";
+    std::string content_type = "text/plain";
+    std::string body = "Not found\n";
+    if (request.rfind("GET /metrics ", 0) == 0 || request.rfind("GET /metrics?", 0) == 0) {
+        status = "200 OK";
+        content_type = "text/plain; version=0.0.4; charset=utf-8";
+        body = render_prometheus_metrics();
+    }
+
+    std::string response = "HTTP/1.1 " + status + "\r\nContent-Type: " + content_type +
+                           "\r\nContent-Length: " + std::to_string(body.size()) +
+                           "\r\nConnection: close\r\n\r\n" + body;
+    size_t sent = 0;
+    while (sent < response.size()) {
+        ssize_t n = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            break;
+        }
+        sent += static_cast<size_t>(n);
+    }
+}
@@ -1,30 +1,147 @@
 #include <iostream>
 #include <cstring>
+#include <ctime>
 #include <thread>
+#include <atomic>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <functional>
+#include "wire_protocol.h"
 
 #define PORT 5555
 #define BUFFER_SIZE 1024
+#define MAX_REPLY_PAYLOAD (16 * 1024 * 1024)
 
-void receive_messages(int client_socket, bool& authenticated) {
+static bool send_all(int client_socket, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t result = send(client_socket, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (result <= 0) {
+            return false;
+        }
+        sent += static_cast<size_t>(result);
+    }
+    return true;
+}
+
+static std::string format_time(uint64_t timestamp_ms) {
+    std::time_t seconds = static_cast<std::time_t>(timestamp_ms / 1000);
+    std::tm local;
+    localtime_r(&seconds, &local);
+    char time_buffer[16];
+    std::strftime(time_buffer, sizeof(time_buffer), "%H:%M:%S", &local);
+    return time_buffer;
+}
+
+// Prints one frame from the server; dispatch is on the type byte alone
+static void handle_frame(const WireFrame& frame, std::atomic<bool>& authenticated) {
+    WireReader reader(frame.payload);
+    switch (frame.type) {
+    case FrameType::AuthResult: {
+        uint8_t kind = 0, ok = 0;
+        if (reader.read_u8(kind) && reader.read_u8(ok)) {
+            std::cout << reader.remaining() << std::flush;
+            if (ok) {
+                authenticated = true;
+            }
+        }
+        break;
+    }
+    case FrameType::ChatMessage: {
+        uint64_t seq = 0, timestamp_ms = 0;
+        std::string_view sender;
+        if (reader.read_u64(seq) && reader.read_u64(timestamp_ms) && reader.read_string(sender)) {
+            std::cout << "[" << format_time(timestamp_ms) << "] " << sender << ": " << reader.remaining() << std::endl;
+        }
+        break;
+    }
+    case FrameType::RoomMessage: {
+        uint64_t timestamp_ms = 0;
+        std::string_view room, sender;
+        if (reader.read_u64(timestamp_ms) && reader.read_string(room) && reader.read_string(sender)) {
+            std::cout << "[" << format_time(timestamp_ms) << "] " << room << " " << sender << ": "
+                      << reader.remaining() << std::endl;
+        }
+        break;
+    }
+    case FrameType::RoomBatch: {
+        uint64_t timestamp_ms = 0;
+        std::string_view room, sender, text;
+        if (!reader.read_string(room)) {
+            break;
+        }
+        while (reader.read_u64(timestamp_ms) && reader.read_string(sender) && reader.read_string(text)) {
+            std::cout << "[" << format_time(timestamp_ms) << "] " << room << " " << sender << ": " << text << "\n";
+        }
+        std::cout << std::flush;
+        break;
+    }
+    case FrameType::PrivateMessage: {
+        std::string_view sender;
+        if (reader.read_string(sender)) {
+            std::cout << "(private from " << sender << ") " << reader.remaining() << std::endl;
+        }
+        break;
+    }
+    case FrameType::CommandReply:
+        std::cout << reader.remaining() << std::flush;
+        break;
+    case FrameType::Presence: {
+        uint8_t online = 0;
+        if (reader.read_u8(online)) {
+            std::cout << "* " << reader.remaining() << (online ? " joined" : " left") << std::endl;
+        }
+        break;
+    }
+    case FrameType::Error: {
+        uint16_t code = 0;
+        if (reader.read_u16(code)) {
+            std::cout << "Error " << code << ": " << reader.remaining() << std::flush;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void receive_messages(int client_socket, std::atomic<bool>& authenticated) {
+    std::string pending;
+    bool negotiated = false;
     while (true) {
-        char buffer[BUFFER_SIZE + 1];
+        char buffer[BUFFER_SIZE];
         int bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
         if (bytes_received <= 0) {
             std::cout << "Connection closed." << std::endl;
             break;
-        } else {
-            buffer[bytes_received] = '\0';
-            std::string message(buffer);
-            std::cout << message << std::endl;
-            if (message.find("Login successful!") != std::string::npos ||
-                message.find("Registration successful!") != std::string::npos) {
-                authenticated = true;
+        }
+        pending.append(buffer, bytes_received);
+
+        if (!negotiated) {
+            // Text broadcasts may precede the server's hello; skip them
+            size_t hello = pending.find(std::string_view(WIRE_HELLO_MAGIC, sizeof(WIRE_HELLO_MAGIC)));
+            if (hello == std::string::npos || pending.size() - hello < WIRE_HELLO_BYTES) {
+                continue;
             }
+            pending.erase(0, hello + WIRE_HELLO_BYTES);
+            negotiated = true;
         }
+
+        size_t offset = 0;
+        WireFrame frame;
+        size_t consumed = 0;
+        DecodeStatus status;
+        while ((status = decode_frame(std::string_view(pending).substr(offset), frame, consumed,
+                                      MAX_REPLY_PAYLOAD)) == DecodeStatus::Complete) {
+            handle_frame(frame, authenticated);
+            offset += consumed;
+        }
+        if (status == DecodeStatus::TooLarge) {
+            std::cout << "Protocol error." << std::endl;
+            break;
+        }
+        pending.erase(0, offset);
     }
 }
 
@@ -46,7 +163,14 @@ int main() {
         return 1;
     }
 
-    bool authenticated = false;
+    // Speak the binary protocol
+    if (!send_all(client_socket, encode_hello(WIRE_PROTOCOL_VERSION))) {
+        std::cerr << "Error: Could not reach server." << std::endl;
+        close(client_socket);
+        return 1;
+    }
+
+    std::atomic<bool> authenticated{false};
     std::thread receiver(receive_messages, client_socket, std::ref(authenticated));
 
     // Authentication loop
@@ -63,8 +187,8 @@ int main() {
         std::getline(std::cin, username);
         std::cout << "Password: ";
         std::getline(std::cin, password);
-        std::string command = (choice == "l" ? "/login " : "/register ") + username + " " + password;
-        send(client_socket, command.c_str(), command.length(), 0);
+        send_all(client_socket, encode_credentials(choice == "l" ? FrameType::Login : FrameType::Register,
+                                                   username, password));
         // Wait for server response
         std::this_thread::sleep_for(std::chrono::milliseconds(500));
     }
@@ -76,11 +200,19 @@ int main() {
         if (message == "exit") {
             break;
         }
-        send(client_socket, message.c_str(), message.length(), 0);
+        size_t space = message.find(' ', 5);
+        if (message.compare(0, 5, "/msg ") == 0 && space != std::string::npos) {
+            std::string recipient = message.substr(5, space - 5);
+            send_all(client_socket, encode_private(FrameType::Private, recipient, message.substr(space + 1)));
+        } else if (!message.empty() && message[0] == '/') {
+            send_all(client_socket, encode_frame(FrameType::Command, message));
+        } else {
+            send_all(client_socket, encode_frame(FrameType::Chat, message));
+        }
     }
 
+    shutdown(client_socket, SHUT_RDWR);
     close(client_socket);
     receiver.join();
     return 0;
 }
-
@@ -0,0 +1,785 @@
+#include "cluster.h"
+#include "constants.h"
+#include "wire_protocol.h"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <netinet/in.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Forward declaration of log_message
+void log_message(const std::string& message);
+
+static std::atomic<ClusterNode*> current_node{nullptr};
+
+ClusterNode* cluster_node() {
+    return current_node.load(std::memory_order_acquire);
+}
+
+void set_cluster_node(ClusterNode* node) {
+    current_node.store(node, std::memory_order_release);
+}
+
+// A whole decimal number in [1, 65535]
+static bool parse_u16(std::string_view text, int& value) {
+    auto parsed = std::from_chars(text.data(), text.data() + text.size(), value);
+    return parsed.ec == std::errc() && parsed.ptr == text.data() + text.size() && value > 0 && value < 65536;
+}
+
+bool parse_peer_address(std::string_view text, PeerAddress& peer) {
+    size_t at = text.find('@');
+    size_t colon = text.rfind(':');
+    if (at == std::string_view::npos || colon == std::string_view::npos || colon <= at + 1) {
+        return false;
+    }
+    const std::string host(text.substr(at + 1, colon - at - 1));
+    in_addr address{};
+    int node = 0;
+    int port = 0;
+    if (!parse_u16(text.substr(0, at), node) || inet_pton(AF_INET, host.c_str(), &address) != 1 ||
+        !parse_u16(text.substr(colon + 1), port)) {
+        return false;
+    }
+    peer.node = static_cast<uint16_t>(node);
+    peer.host = host;
+    peer.port = port;
+    return true;
+}
+
+std::string remote_username(std::string_view username, uint16_t node) {
+    return std::string(username) + "@" + std::to_string(node);
+}
+
+bool split_remote_username(std::string_view name, std::string_view& username, uint16_t& node) {
+    size_t at = name.rfind('@');
+    int value = 0;
+    if (at == std::string_view::npos || at == 0 || !parse_u16(name.substr(at + 1), value)) {
+        return false;
+    }
+    username = name.substr(0, at);
+    node = static_cast<uint16_t>(value);
+    return true;
+}
+
+bool read_cluster_secret(const std::string& path, std::string& secret) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        log_message("Error: Could not read cluster secret from " + path);
+        return false;
+    }
+    secret.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    while (!secret.empty() && (secret.back() == '\n' || secret.back() == '\r')) {
+        secret.pop_back();
+    }
+    if (secret.size() < CLUSTER_MIN_SECRET_BYTES) {
+        log_message("Error: Cluster secret in " + path + " is shorter than " +
+                    std::to_string(CLUSTER_MIN_SECRET_BYTES) + " bytes");
+        return false;
+    }
+    return true;
+}
+
+static std::string describe(const PeerAddress& peer) {
+    return std::to_string(peer.node) + "@" + peer.host + ":" + std::to_string(peer.port);
+}
+
+static std::string describe(uint32_t address) {
+    char text[INET_ADDRSTRLEN] = "?";
+    in_addr in{address};
+    inet_ntop(AF_INET, &in, text, sizeof(text));
+    return text;
+}
+
+// Handshake sizes; see ClusterNode
+static constexpr size_t NONCE_BYTES = 16;
+static constexpr size_t PROOF_BYTES = 32;
+
+static std::string random_nonce() {
+    std::string nonce(NONCE_BYTES, '\0');
+    RAND_bytes(reinterpret_cast<unsigned char*>(nonce.data()), static_cast<int>(nonce.size()));
+    return nonce;
+}
+
+static bool same_proof(std::string_view a, std::string_view b) {
+    return a.size() == PROOF_BYTES && b.size() == PROOF_BYTES && CRYPTO_memcmp(a.data(), b.data(), PROOF_BYTES) == 0;
+}
+
+static bool send_all(int socket, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t result = send(socket, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return false;
+        }
+        sent += static_cast<size_t>(result);
+    }
+    return true;
+}
+
+static void set_timeouts(int socket, int milliseconds) {
+    timeval timeout{milliseconds / 1000, (milliseconds % 1000) * 1000};
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    int nodelay = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+}
+
+std::vector<std::pair<std::string, bool>> ClusterDirectory::replace(uint16_t node,
+                                                                    const std::vector<std::string>& users) {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::set<std::string, std::less<>> incoming(users.begin(), users.end());
+    std::set<std::string, std::less<>>& current = users_by_node[node];
+    std::vector<std::pair<std::string, bool>> changed;
+    for (const auto& user : current) {
+        if (incoming.count(user) == 0) {
+            changed.emplace_back(user, false);
+            auto nodes = nodes_by_user.find(user);
+            nodes->second.erase(node);
+            if (nodes->second.empty()) {
+                nodes_by_user.erase(nodes);
+            }
+        }
+    }
+    for (const auto& user : incoming) {
+        if (current.count(user) == 0) {
+            changed.emplace_back(user, true);
+            nodes_by_user[user].insert(node);
+        }
+    }
+    current = std::move(incoming);
+    if (current.empty()) {
+        users_by_node.erase(node);
+    }
+    return changed;
+}
+
+bool ClusterDirectory::add(uint16_t node, const std::string& user) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!users_by_node[node].insert(user).second) {
+        return false;
+    }
+    nodes_by_user[user].insert(node);
+    return true;
+}
+
+bool ClusterDirectory::remove(uint16_t node, const std::string& user) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto users = users_by_node.find(node);
+    if (users == users_by_node.end() || users->second.erase(user) == 0) {
+        return false;
+    }
+    if (users->second.empty()) {
+        users_by_node.erase(users);
+    }
+    auto nodes = nodes_by_user.find(user);
+    nodes->second.erase(node);
+    if (nodes->second.empty()) {
+        nodes_by_user.erase(nodes);
+    }
+    return true;
+}
+
+std::vector<std::string> ClusterDirectory::drop(uint16_t node) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto users = users_by_node.find(node);
+    if (users == users_by_node.end()) {
+        return {};
+    }
+    std::vector<std::string> dropped(users->second.begin(), users->second.end());
+    for (const auto& user : dropped) {
+        auto nodes = nodes_by_user.find(user);
+        nodes->second.erase(node);
+        if (nodes->second.empty()) {
+            nodes_by_user.erase(nodes);
+        }
+    }
+    users_by_node.erase(users);
+    return dropped;
+}
+
+uint16_t ClusterDirectory::node_for(std::string_view user) const {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto nodes = nodes_by_user.find(user);
+    return nodes == nodes_by_user.end() ? 0 : *nodes->second.begin();
+}
+
+std::vector<std::pair<std::string, uint16_t>> ClusterDirectory::entries() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::vector<std::pair<std::string, uint16_t>> all;
+    for (const auto& [user, nodes] : nodes_by_user) {
+        for (uint16_t node : nodes) {
+            all.emplace_back(user, node);
+        }
+    }
+    return all;
+}
+
+size_t ClusterDirectory::size() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return nodes_by_user.size();
+}
+
+ClusterNode::ClusterNode(uint16_t node_id, std::string secret, ClusterHandler& handler)
+    : node_id(node_id), secret(std::move(secret)), handler(handler) {}
+
+ClusterNode::~ClusterNode() {
+    stop();
+}
+
+bool ClusterNode::start(const std::string& bind_address, int port, const std::vector<PeerAddress>& peers) {
+    if (secret.size() < CLUSTER_MIN_SECRET_BYTES) {
+        log_message("Error: Cluster secret must be at least " + std::to_string(CLUSTER_MIN_SECRET_BYTES) + " bytes");
+        return false;
+    }
+    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket == -1) {
+        log_message("Error: Could not create cluster socket: " + std::string(strerror(errno)));
+        return false;
+    }
+    int reuse = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    if (inet_pton(AF_INET, bind_address.c_str(), &address.sin_addr) != 1) {
+        log_message("Error: Invalid cluster bind address " + bind_address);
+        close(listen_socket);
+        listen_socket = -1;
+        return false;
+    }
+    if (bind(listen_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1 ||
+        listen(listen_socket, 16) == -1) {
+        log_message("Error: Could not open cluster port " + std::to_string(port) + ": " + std::string(strerror(errno)));
+        close(listen_socket);
+        listen_socket = -1;
+        return false;
+    }
+    socklen_t length = sizeof(address);
+    getsockname(listen_socket, reinterpret_cast<sockaddr*>(&address), &length);
+    bound_port = ntohs(address.sin_port);
+
+    running = true;
+    acceptor = std::thread(&ClusterNode::accept_loop, this);
+    for (const auto& peer : peers) {
+        add_peer(peer);
+    }
+    return true;
+}
+
+void ClusterNode::add_peer(const PeerAddress& peer) {
+    std::lock_guard<std::mutex> lock(links_mtx);
+    links.push_back(std::make_unique<Link>());
+    Link& link = *links.back();
+    link.address = peer;
+    link.writer = std::thread(&ClusterNode::write_loop, this, std::ref(link));
+}
+
+void ClusterNode::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    if (acceptor.joinable()) {
+        acceptor.join();
+    }
+    close(listen_socket);
+    listen_socket = -1;
+
+    {
+        std::lock_guard<std::mutex> lock(links_mtx);
+        for (auto& link : links) {
+            {
+                std::lock_guard<std::mutex> link_lock(link->mtx);
+                if (link->socket != -1) {
+                    shutdown(link->socket, SHUT_RDWR);  // the writer closes it
+                }
+            }
+            link->wake.notify_all();
+        }
+    }
+    for (auto& link : links) {
+        if (link->writer.joinable()) {
+            link->writer.join();
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(inbound_mtx);
+    for (int socket : inbound_sockets) {
+        shutdown(socket, SHUT_RDWR);
+    }
+    readers_done.wait(lock, [this]() { return active_readers == 0; });
+}
+
+void ClusterNode::accept_loop() {
+    while (running) {
+        // Poll with a timeout so stop() is noticed promptly
+        pollfd pfd{listen_socket, POLLIN, 0};
+        if (poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+        sockaddr_in peer{};
+        socklen_t length = sizeof(peer);
+        int socket = accept(listen_socket, reinterpret_cast<sockaddr*>(&peer), &length);
+        if (socket == -1) {
+            continue;
+        }
+        const uint32_t address = peer.sin_addr.s_addr;
+        if (!is_peer(address, 0)) {
+            log_message("Refused cluster link from " + describe(address) + ": not a configured peer");
+            links_refused.fetch_add(1, std::memory_order_relaxed);
+            close(socket);
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> lock(inbound_mtx);
+            if (active_readers >= CLUSTER_MAX_INBOUND_LINKS) {
+                links_refused.fetch_add(1, std::memory_order_relaxed);
+                close(socket);
+                continue;
+            }
+            inbound_sockets.insert(socket);
+            ++active_readers;
+        }
+        set_timeouts(socket, CLUSTER_PEER_TIMEOUT_MS);
+        std::thread(&ClusterNode::read_loop, this, socket, address).detach();
+    }
+}
+
+bool ClusterNode::is_peer(uint32_t address, uint16_t node) const {
+    std::lock_guard<std::mutex> lock(links_mtx);
+    for (const auto& link : links) {
+        in_addr host{};
+        if ((node == 0 || link->address.node == node) && inet_pton(AF_INET, link->address.host.c_str(), &host) == 1 &&
+            host.s_addr == address) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string ClusterNode::proof(std::string_view role, std::string_view nonce, uint16_t prover,
+                               uint16_t verifier) const {
+    std::string message(role);
+    message.append(nonce);
+    message.append(reinterpret_cast<const char*>(&prover), sizeof(prover));
+    message.append(reinterpret_cast<const char*>(&verifier), sizeof(verifier));
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length = 0;
+    HMAC(EVP_sha256(), secret.data(), static_cast<int>(secret.size()),
+         reinterpret_cast<const unsigned char*>(message.data()), message.size(), digest, &digest_length);
+    return std::string(reinterpret_cast<const char*>(digest), digest_length);
+}
+
+void ClusterNode::read_loop(int socket, uint32_t address) {
+    std::string buffer;
+    char chunk[BUFFER_SIZE];
+    Inbound link;
+    link.socket = socket;
+    link.address = address;
+    uint16_t& from = link.from;
+    auto last_heard = std::chrono::steady_clock::now();
+    bool open = true;
+    while (open && running) {
+        pollfd pfd{socket, POLLIN, 0};
+        int ready = poll(&pfd, 1, 200);
+        auto now = std::chrono::steady_clock::now();
+        if (ready <= 0) {
+            if (ready < 0 && errno != EINTR) {
+                break;
+            }
+            if (now - last_heard > std::chrono::milliseconds(CLUSTER_PEER_TIMEOUT_MS)) {
+                log_message("Cluster node " + std::to_string(from) + " stopped sending");
+                break;
+            }
+            continue;
+        }
+        ssize_t received = recv(socket, chunk, sizeof(chunk), 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            break;
+        }
+        last_heard = now;
+        buffer.append(chunk, static_cast<size_t>(received));
+
+        // Frames are handled straight out of the buffer
+        size_t offset = 0;
+        WireFrame frame;
+        size_t consumed = 0;
+        DecodeStatus status;
+        while ((status = decode_frame(std::string_view(buffer).substr(offset), frame, consumed,
+                                      CLUSTER_MAX_FRAME_PAYLOAD)) == DecodeStatus::Complete) {
+            offset += consumed;
+            frames_received.fetch_add(1, std::memory_order_relaxed);
+            if (!handle_frame(link, static_cast<uint8_t>(frame.type), frame.payload)) {
+                log_message("Closing cluster link from node " + std::to_string(from) + ": unexpected frame");
+                open = false;
+                break;
+            }
+        }
+        if (status == DecodeStatus::TooLarge) {
+            log_message("Closing cluster link from node " + std::to_string(from) + ": frame too large");
+            break;
+        }
+        buffer.erase(0, offset);
+    }
+
+    if (from != 0) {
+        node_down(from, link.generation);
+    }
+    close(socket);
+    std::lock_guard<std::mutex> lock(inbound_mtx);
+    inbound_sockets.erase(socket);
+    if (--active_readers == 0) {
+        readers_done.notify_all();
+    }
+}
+
+// The connecting node's hello: its id and nonce. The reply carries this
+// node's id, a nonce of its own and the proof for the connecting node's
+// nonce, and the PeerAuth that must follow is the proof for ours.
+bool ClusterNode::handle_hello(Inbound& link, std::string_view payload) {
+    WireReader reader(payload);
+    uint16_t peer = 0;
+    if (!reader.read_u16(peer) || reader.remaining().size() != NONCE_BYTES || peer == 0 || peer == node_id) {
+        return false;
+    }
+    if (!is_peer(link.address, peer)) {
+        log_message("Refused cluster link from " + describe(link.address) + ": node " + std::to_string(peer) +
+                    " is not configured there");
+        links_refused.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    const std::string nonce = random_nonce();
+    if (!send_all(link.socket, encode_peer_hello(node_id, nonce, proof("accept", reader.remaining(), node_id, peer)))) {
+        return false;
+    }
+    link.claimed = peer;
+    link.expected = proof("connect", nonce, peer, node_id);
+    return true;
+}
+
+bool ClusterNode::handle_frame(Inbound& link, uint8_t type, std::string_view payload) {
+    WireReader reader(payload);
+    const FrameType frame_type = static_cast<FrameType>(type);
+    uint16_t& from = link.from;
+    if (from == 0) {
+        // Nothing but the handshake until the peer proved the secret
+        if (link.claimed == 0) {
+            return frame_type == FrameType::PeerHello && handle_hello(link, payload);
+        }
+        if (frame_type != FrameType::PeerAuth || !same_proof(payload, link.expected)) {
+            log_message("Refused cluster link from node " + std::to_string(link.claimed) + " at " +
+                        describe(link.address) + ": wrong cluster secret");
+            links_refused.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(inbound_mtx);
+        from = link.claimed;
+        link.generation = next_generation++;
+        inbound_generation[from] = link.generation;
+        return true;
+    }
+
+    switch (frame_type) {
+    case FrameType::PeerHeartbeat:
+        return true;
+    case FrameType::PeerDirectory: {
+        std::vector<std::string> listed;
+        std::string_view username;
+        while (!reader.remaining().empty()) {
+            if (!reader.read_string(username)) {
+                return false;
+            }
+            listed.emplace_back(username);
+        }
+        for (const auto& [user, online] : users.replace(from, listed)) {
+            handler.peer_presence(from, user, online);
+        }
+        return true;
+    }
+    case FrameType::PeerPresence: {
+        uint8_t online = 0;
+        if (!reader.read_u8(online)) {
+            return false;
+        }
+        const std::string username(reader.remaining());
+        if (online ? users.add(from, username) : users.remove(from, username)) {
+            handler.peer_presence(from, username, online != 0);
+        }
+        return true;
+    }
+    case FrameType::PeerBroadcast: {
+        uint64_t timestamp_ms = 0;
+        std::string_view sender;
+        if (!reader.read_u64(timestamp_ms) || !reader.read_string(sender)) {
+            return false;
+        }
+        handler.peer_broadcast(from, static_cast<int64_t>(timestamp_ms), std::string(sender),
+                               std::string(reader.remaining()));
+        return true;
+    }
+    case FrameType::PeerPrivate: {
+        std::string_view sender, recipient;
+        if (!reader.read_string(sender) || !reader.read_string(recipient)) {
+            return false;
+        }
+        const std::string to(recipient);
+        if (!handler.peer_private(from, std::string(sender), to, std::string(reader.remaining()))) {
+            log_message("Private message from node " + std::to_string(from) + " for " + to + ", who is not here");
+        }
+        return true;
+    }
+    default:
+        return true;  // from a newer node; skip it
+    }
+}
+
+void ClusterNode::node_down(uint16_t node, uint64_t generation) {
+    {
+        std::lock_guard<std::mutex> lock(inbound_mtx);
+        auto current = inbound_generation.find(node);
+        if (current == inbound_generation.end() || current->second != generation) {
+            return;  // a newer link from the node took over
+        }
+        inbound_generation.erase(current);
+    }
+    std::vector<std::string> dropped = users.drop(node);
+    log_message("Cluster node " + std::to_string(node) + " is down; dropped " + std::to_string(dropped.size()) +
+                " of its users");
+    for (const auto& user : dropped) {
+        handler.peer_presence(node, user, false);
+    }
+}
+
+int ClusterNode::connect_link(Link& link) {
+    int socket = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (socket == -1) {
+        return -1;
+    }
+    // The send timeout also bounds connect()
+    set_timeouts(socket, CLUSTER_PEER_TIMEOUT_MS);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(link.address.port));
+    inet_pton(AF_INET, link.address.host.c_str(), &address.sin_addr);
+    const std::string nonce = random_nonce();
+    if (connect(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1 ||
+        !send_all(socket, encode_peer_hello(node_id, nonce, ""))) {
+        close(socket);
+        return -1;
+    }
+
+    // Wait for the peer's hello; nothing else comes back on this link
+    const size_t hello_bytes = 2 + NONCE_BYTES + PROOF_BYTES;
+    std::string reply;
+    char chunk[128];
+    WireFrame frame;
+    size_t consumed = 0;
+    DecodeStatus status;
+    while ((status = decode_frame(reply, frame, consumed, hello_bytes)) == DecodeStatus::Incomplete) {
+        ssize_t received = recv(socket, chunk, sizeof(chunk), 0);
+        if (received <= 0) {
+            close(socket);
+            return -1;
+        }
+        reply.append(chunk, static_cast<size_t>(received));
+    }
+    WireReader reader(frame.payload);
+    uint16_t peer = 0;
+    if (status != DecodeStatus::Complete || frame.type != FrameType::PeerHello || !reader.read_u16(peer) ||
+        reader.remaining().size() != NONCE_BYTES + PROOF_BYTES) {
+        close(socket);
+        return -1;
+    }
+    const std::string_view peer_nonce = reader.remaining().substr(0, NONCE_BYTES);
+    const std::string_view peer_proof = reader.remaining().substr(NONCE_BYTES);
+    if (peer != link.address.node || !same_proof(peer_proof, proof("accept", nonce, peer, node_id))) {
+        std::lock_guard<std::mutex> lock(link.mtx);
+        if (!link.reported_down) {
+            log_message("Cluster peer " + describe(link.address) +
+                        (peer != link.address.node ? " answered as node " + std::to_string(peer)
+                                                   : " did not prove the cluster secret"));
+        }
+        close(socket);
+        return -1;
+    }
+    if (!send_all(socket, encode_peer_auth(proof("connect", peer_nonce, node_id, peer)))) {
+        close(socket);
+        return -1;
+    }
+    link.peer_id = peer;
+    return socket;
+}
+
+void ClusterNode::write_loop(Link& link) {
+    const auto heartbeat = std::chrono::milliseconds(CLUSTER_HEARTBEAT_MS);
+    const auto resync = std::chrono::milliseconds(CLUSTER_DIRECTORY_RESYNC_MS);
+    auto last_sent = std::chrono::steady_clock::now();
+    auto last_directory = last_sent;
+    int socket = -1;
+    while (running) {
+        if (socket == -1) {
+            socket = connect_link(link);
+            if (socket == -1) {
+                std::unique_lock<std::mutex> lock(link.mtx);
+                if (!link.reported_down) {
+                    link.reported_down = true;
+                    log_message("Could not link to cluster peer " + describe(link.address) + "; retrying");
+                }
+                link.wake.wait_for(lock, std::chrono::milliseconds(CLUSTER_RECONNECT_MS),
+                                   [this]() { return !running; });
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> lock(links_mtx);
+                link_by_node[link.peer_id] = &link;
+            }
+            // Frames are queued from here on; the directory goes ahead of
+            // them, so deltas queued while it was taken are applied after it
+            {
+                std::lock_guard<std::mutex> lock(link.mtx);
+                link.socket = socket;
+                link.up = true;
+                link.reported_down = false;
+            }
+            std::string directory = encode_peer_directory(handler.local_users());
+            {
+                std::lock_guard<std::mutex> lock(link.mtx);
+                link.queued.insert(0, directory);
+                ++link.queued_frames;
+            }
+            last_directory = std::chrono::steady_clock::now();
+            log_message("Linked to cluster node " + std::to_string(link.peer_id) + " at " + describe(link.address));
+        }
+
+        std::string batch;
+        size_t batch_frames = 0;
+        {
+            std::unique_lock<std::mutex> lock(link.mtx);
+            link.wake.wait_until(lock, last_sent + heartbeat,
+                                 [&]() { return !running || !link.queued.empty(); });
+            if (!running) {
+                break;
+            }
+            batch.swap(link.queued);
+            batch_frames = link.queued_frames;
+            link.queued_frames = 0;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_directory >= resync) {
+            batch.insert(0, encode_peer_directory(handler.local_users()));
+            ++batch_frames;
+            last_directory = now;
+        }
+        if (batch.empty()) {
+            batch = encode_frame(FrameType::PeerHeartbeat, "");
+            batch_frames = 1;
+        }
+
+        if (!send_all(socket, batch)) {
+            log_message("Lost cluster link to node " + std::to_string(link.peer_id) + " at " +
+                        describe(link.address));
+            frames_dropped.fetch_add(batch_frames, std::memory_order_relaxed);
+            std::lock_guard<std::mutex> lock(link.mtx);
+            frames_dropped.fetch_add(link.queued_frames, std::memory_order_relaxed);
+            link.queued.clear();
+            link.queued_frames = 0;
+            link.up = false;
+            link.socket = -1;
+            close(socket);
+            socket = -1;
+            continue;
+        }
+        frames_sent.fetch_add(batch_frames, std::memory_order_relaxed);
+        writes.fetch_add(1, std::memory_order_relaxed);
+        bytes_sent.fetch_add(batch.size(), std::memory_order_relaxed);
+        last_sent = now;
+    }
+
+    std::lock_guard<std::mutex> lock(link.mtx);
+    link.up = false;
+    link.socket = -1;
+    if (socket != -1) {
+        close(socket);
+    }
+}
+
+bool ClusterNode::enqueue(Link& link, const std::string& frame) {
+    {
+        std::lock_guard<std::mutex> lock(link.mtx);
+        if (!link.up || link.queued.size() + frame.size() > CLUSTER_MAX_QUEUED_BYTES) {
+            frames_dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        link.queued += frame;
+        ++link.queued_frames;
+    }
+    link.wake.notify_one();
+    return true;
+}
+
+void ClusterNode::enqueue_all(const std::string& frame) {
+    std::lock_guard<std::mutex> lock(links_mtx);
+    for (auto& link : links) {
+        enqueue(*link, frame);
+    }
+}
+
+void ClusterNode::publish_broadcast(int64_t timestamp_ms, std::string_view sender, std::string_view text) {
+    enqueue_all(encode_peer_broadcast(timestamp_ms, sender, text));
+}
+
+void ClusterNode::publish_presence(std::string_view username, bool online) {
+    enqueue_all(encode_peer_presence(online, username));
+}
+
+bool ClusterNode::route_private(std::string_view sender, std::string_view recipient, std::string_view text) {
+    uint16_t node = 0;
+    if (!split_remote_username(recipient, recipient, node)) {
+        node = users.node_for(recipient);
+    }
+    if (node == 0 || node == node_id) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(links_mtx);
+    auto link = link_by_node.find(node);
+    if (link == link_by_node.end()) {
+        return false;
+    }
+    return enqueue(*link->second, encode_peer_private(sender, recipient, text));
+}
+
+ClusterStats ClusterNode::stats() const {
+    ClusterStats stats;
+    {
+        std::lock_guard<std::mutex> lock(links_mtx);
+        stats.peers = links.size();
+        for (const auto& link : links) {
+            std::lock_guard<std::mutex> link_lock(link->mtx);
+            stats.peers_up += link->up ? 1 : 0;
+        }
+    }
+    stats.frames_sent = frames_sent.load(std::memory_order_relaxed);
+    stats.writes = writes.load(std::memory_order_relaxed);
+    stats.bytes_sent = bytes_sent.load(std::memory_order_relaxed);
+    stats.frames_received = frames_received.load(std::memory_order_relaxed);
+    stats.frames_dropped = frames_dropped.load(std::memory_order_relaxed);
+    stats.links_refused = links_refused.load(std::memory_order_relaxed);
+    stats.remote_users = users.size();
+    return stats;
+}
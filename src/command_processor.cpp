@@ -3,53 +3,103 @@
 #include "connection_pool.h"
 #include "network_handler.h"
 #include "database.h"
+#include "query_executor.h"
+#include "socket_utils.h"
+#include "flight_recorder.h"
+#include "traffic_capture.h"
+#include "perfect_hash.h"
+#include "room_registry.h"
+#include "cluster.h"
 #include <sys/socket.h>
+#include <cstdio>
 #include <cstring>
-#include <unordered_map>
-#include <functional>
 #include <string_view>
+#include <charconv>
 #include <cerrno>
+#include <cstdlib>
+#include <algorithm>
 
-using CommandHandler = std::function<void(const Message&)>;
+using CommandHandler = void (*)(const Message&);
+using CommandTable = PerfectHashTable<CommandHandler, 18>;
 
-static std::unordered_map<std::string, CommandHandler> command_map = {
+// Dispatch is on the command's string_view, so a lookup costs one hash and
+// one comparison and allocates nothing
+static constexpr CommandTable command_table({{
     {"/stats", handle_stats},
     {"/list", handle_list},
     {"/msg", handle_msg},
     {"/register", handle_register},
     {"/login", handle_login},
-    {"/removeuser", handle_removeuser}
+    {"/removeuser", handle_removeuser},
+    {"/history", handle_history},
+    {"/dmhistory", handle_dmhistory},
+    {"/search", handle_search},
+    {"/trace", handle_trace},
+    {"/top", handle_top},
+    {"/capture", handle_capture},
+    {"/join", handle_join},
+    {"/leave", handle_leave},
+    {"/rooms", handle_rooms},
+    {"/say", handle_say},
+    {"/roomhistory", handle_roomhistory},
+    {"/roombatch", handle_roombatch}
+}});
+static_assert(command_table.valid(), "no collision-free seed for the command table");
+
+// Splits command arguments on whitespace, as views into the message
+class CommandArgs {
+public:
+    explicit CommandArgs(std::string_view text) : rest_(text) {}
+
+    // The next word, or empty when there are none left
+    std::string_view next() {
+        skip_space();
+        size_t end = rest_.find_first_of(SPACE);
+        std::string_view word = rest_.substr(0, end);
+        rest_.remove_prefix(word.size());
+        return word;
+    }
+
+    // Everything after the words read so far
+    std::string_view rest() {
+        skip_space();
+        return rest_;
+    }
+
+private:
+    static constexpr const char* SPACE = " \t\r\n";
+
+    void skip_space() {
+        rest_.remove_prefix(std::min(rest_.find_first_not_of(SPACE), rest_.size()));
+    }
+
+    std::string_view rest_;
 };
 
-extern MessageQueue message_queue;
+extern MessageQueue& message_queue;
 
 void process_command(const Message& msg) {
     // Find the connection for this socket
-    Connection* conn = nullptr;
+    bool authenticated = false;
     {
-        std::lock_guard<std::mutex> lock(pool_mtx);
-        for (auto& c : connection_pool) {
-            if (c.in_use && c.socket == msg.sender_socket) {
-                conn = &c;
-                break;
-            }
-        }
+        std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+        Connection* conn = find_connection_locked(msg.sender_socket);
+        if (!conn) return;
+        authenticated = conn->authenticated;
     }
-    if (!conn) return;
 
-    const auto space_pos = msg.content.find(' ');
-    const std::string_view command(msg.content.data(),
-        space_pos == std::string::npos ? msg.content.length() : space_pos);
+    const std::string_view content(msg.content);
+    const std::string_view command = content.substr(0, content.find(' '));
 
     // Only allow /login and /register if not authenticated
-    if (!conn->authenticated && command != "/login" && command != "/register") {
+    if (!authenticated && command != "/login" && command != "/register") {
         std::string reply = "You must log in or register before using chat commands.\n";
-        send(msg.sender_socket, reply.c_str(), reply.length(), 0);
+        send_error(msg.sender_socket, WireError::NotAuthenticated, reply);
         return;
     }
 
-    if (auto it = command_map.find(std::string(command)); it != command_map.end()) {
-        it->second(msg);
+    if (const CommandHandler* handler = command_table.find(command)) {
+        (*handler)(msg);
     } else {
         handle_unknown(msg);
     }
@@ -59,19 +109,60 @@ void process_command(const Message& msg) {
 void handle_stats(const Message& msg) {
     std::string stats = "Server Statistics:\n";
     stats += "Uptime: " + std::to_string(metrics.get_uptime_seconds()) + " seconds\n";
-    stats += "Total Messages: " + std::to_string(metrics.total_messages_processed.load()) + "\n";
+    stats += "Total Messages: " + std::to_string(metrics.get_total_messages()) + "\n";
     stats += "Messages/Second: " + std::to_string(metrics.get_messages_per_second()) + "\n";
     stats += "Current Connections: " + std::to_string(metrics.current_connections.load()) + "\n";
     stats += "Peak Connections: " + std::to_string(metrics.peak_connections.load()) + "\n";
     stats += "Total Data Transferred: " + std::to_string(metrics.total_bytes_transferred.load()) + " bytes\n";
     stats += "Average Message Latency: " + std::to_string(metrics.get_average_latency()) + " ms\n";
     stats += "Messages Dropped: " + std::to_string(metrics.messages_dropped.load()) + "\n";
+    const HistogramSnapshot fanout = metrics.get_fanout_latency();
+    if (fanout.count > 0) {
+        char line[160];
+        snprintf(line, sizeof(line), "Fan-out latency ms: p50 %.3f, p99 %.3f, max %.3f (%llu of %llu parallel)\n",
+                 fanout.percentile(0.50) / 1000.0, fanout.percentile(0.99) / 1000.0, fanout.max / 1000.0,
+                 static_cast<unsigned long long>(metrics.get_parallel_fanouts()),
+                 static_cast<unsigned long long>(fanout.count));
+        stats += line;
+    }
+    if (const ClusterNode* node = cluster_node()) {
+        const ClusterStats cluster = node->stats();
+        stats += "Cluster: node " + std::to_string(node->id()) + ", " + std::to_string(cluster.peers_up) + " of " +
+                 std::to_string(cluster.peers) + " peers linked, " + std::to_string(cluster.remote_users) +
+                 " remote users, " + std::to_string(cluster.frames_sent) + " frames sent in " +
+                 std::to_string(cluster.writes) + " writes, " + std::to_string(cluster.frames_received) +
+                 " received, " + std::to_string(cluster.frames_dropped) + " dropped, " +
+                 std::to_string(cluster.links_refused) + " links refused\n";
+    }
     stats += "Message Types:\n";
-    for (const auto& type : metrics.get_message_types()) {
-        stats += "  " + type.first + ": " + std::to_string(type.second) + "\n";
+    for (const auto& type : metrics.get_type_stats()) {
+        stats += "  " + type.type + ": " + std::to_string(type.count);
+        const HistogramSnapshot& latency = type.latency;
+        if (latency.count > 0) {
+            // Histograms are in microseconds; report milliseconds
+            char line[160];
+            snprintf(line, sizeof(line), " (latency ms p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, max %.3f)",
+                     latency.percentile(0.50) / 1000.0, latency.percentile(0.90) / 1000.0,
+                     latency.percentile(0.99) / 1000.0, latency.percentile(0.999) / 1000.0,
+                     latency.max / 1000.0);
+            stats += line;
+        }
+        stats += "\n";
+    }
+    stats += "Locks:\n";
+    for (const auto& lock : lock_stats_snapshot()) {
+        // Lock histograms are in nanoseconds
+        char line[192];
+        snprintf(line, sizeof(line),
+                 "  %s: %llu acquisitions, %.2f%% contended (wait ns p99 %.0f, max %llu; hold ns p50 %.0f, p99 %.0f)\n",
+                 lock.name.c_str(), static_cast<unsigned long long>(lock.acquisitions),
+                 lock.acquisitions ? 100.0 * lock.contended / lock.acquisitions : 0.0, lock.wait_ns.percentile(0.99),
+                 static_cast<unsigned long long>(lock.wait_ns.max), lock.hold_ns.percentile(0.50),
+                 lock.hold_ns.percentile(0.99));
+        stats += line;
     }
 
-    if (send(msg.sender_socket, stats.c_str(), stats.length(), 0) <= 0) {
+    if (send_reply(msg.sender_socket, stats) <= 0) {
         log_message("Failed to send stats to client " + std::to_string(msg.sender_socket) + ": " + std::string(strerror(errno)));
     }
     metrics.record_message("stats");
@@ -81,76 +172,97 @@ void handle_stats(const Message& msg) {
 void handle_list(const Message& msg) {
     std::string user_list = "Active users:\n";
     {
-        std::lock_guard<std::mutex> lock(pool_mtx);
+        std::lock_guard<InstrumentedMutex> lock(pool_mtx);
         for (const auto& conn : connection_pool) {
             if (conn.in_use) {
                 user_list += conn.username + "\n";
             }
         }
     }
-    if (send(msg.sender_socket, user_list.c_str(), user_list.length(), 0) <= 0) {
+    if (ClusterNode* node = cluster_node()) {
+        for (const auto& [username, on_node] : node->directory().entries()) {
+            user_list += username + " (node " + std::to_string(on_node) + ")\n";
+        }
+    }
+    if (send_reply(msg.sender_socket, user_list) <= 0) {
         log_message("Failed to send user list to client " + std::to_string(msg.sender_socket) + ": " + std::string(strerror(errno)));
     }
     metrics.record_message("list_users");
 }
 
-// Handler for /msg command
-void handle_msg(const Message& msg) {
-    size_t pos = msg.content.find(' ', 5);
-    if (pos != std::string::npos) {
-        std::string recipient = msg.content.substr(5, pos - 5);
-        std::string private_message = msg.content.substr(pos + 1);
-        bool found = false;
-        std::string sender_username;
-        int sender_id = 0;
-        int receiver_id = 0;
-
-        {
-            std::lock_guard<std::mutex> lock(pool_mtx);
-            for (const auto& conn : connection_pool) {
-                if (conn.in_use && conn.socket == msg.sender_socket) {
-                    sender_username = conn.username;
-                    break;
-                }
-            }
-        }
+// Sends a private message to `recipient` if they are connected here
+static bool send_private_here(const std::string& sender_username, std::string_view recipient,
+                              std::string_view private_message) {
+    std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+    const Connection* conn = find_connection_by_username_locked(recipient);
+    if (!conn) {
+        return false;
+    }
+    std::string full_message;
+    if (conn->binary) {
+        full_message = encode_private(FrameType::PrivateMessage, sender_username, private_message);
+    } else {
+        full_message.reserve(16 + sender_username.size() + private_message.size());
+        full_message.append("(private from ").append(sender_username).append(") ").append(private_message);
+    }
+    if (send_to_client(conn->socket, full_message) <= 0) {
+        log_message("Failed to send private message to " + std::string(recipient) + ": " +
+                    std::string(strerror(errno)));
+    }
+    return true;
+}
 
-        // Get sender and receiver IDs from database
-        Database& db = Database::getInstance();
-        if (!sender_username.empty()) {
-            sender_id = db.getUserID(sender_username);
-        }
-        receiver_id = db.getUserID(recipient);
-
-        {
-            std::lock_guard<std::mutex> lock(pool_mtx);
-            for (const auto& conn : connection_pool) {
-                if (conn.in_use && conn.username == recipient) {
-                    std::string full_message = "(private from " + sender_username + ") " + private_message;
-                    if (send(conn.socket, full_message.c_str(), full_message.length(), 0) <= 0) {
-                        log_message("Failed to send private message to " + recipient + ": " + std::string(strerror(errno)));
-                    }
-                    found = true;
-                    break;
-                }
-            }
-        }
+// Stores a private message if both users have accounts here
+static void store_private(const std::string& sender_username, std::string_view recipient,
+                          std::string_view private_message) {
+    Database& db = Database::getInstance();
+    int sender_id = sender_username.empty() ? 0 : db.getUserID(sender_username);
+    int receiver_id = db.getUserID(std::string(recipient));
+    if (sender_id > 0 && receiver_id > 0) {
+        StoredMessage stored;
+        stored.timestamp_ms = current_time_ms();
+        stored.sender_id = sender_id;
+        stored.receiver_id = receiver_id;
+        stored.sender_name = sender_username;
+        stored.content = std::string(private_message);
+        message_store().append(stored);
+    }
+}
 
-        // Store private message in database
-        if (found && sender_id > 0 && receiver_id > 0) {
-            db.storeMessage(sender_id, receiver_id, private_message);
-        }
+// Delivers a private message to `recipient` if they are online, here or on
+// another node of the cluster. Returns false if they are not. Only messages
+// between two users here are stored: a same-named account here is not the
+// user on another node.
+static bool deliver_private(int sender_socket, std::string_view recipient, std::string_view private_message) {
+    std::string sender_username = username_for_socket(sender_socket);
+    if (send_private_here(sender_username, recipient, private_message)) {
+        store_private(sender_username, recipient, private_message);
+        return true;
+    }
+    ClusterNode* node = cluster_node();
+    return node && node->route_private(sender_username, recipient, private_message);
+}
+
+bool deliver_peer_private(const std::string& sender_username, std::string_view recipient,
+                          std::string_view private_message) {
+    return send_private_here(sender_username, recipient, private_message);
+}
 
-        if (!found) {
+// Handler for /msg command
+void handle_msg(const Message& msg) {
+    const std::string_view content(msg.content);
+    size_t pos = content.find(' ', 5);
+    if (pos != std::string_view::npos) {
+        if (!deliver_private(msg.sender_socket, content.substr(5, pos - 5), content.substr(pos + 1))) {
             std::string not_found = "User not found.\n";
-            if (send(msg.sender_socket, not_found.c_str(), not_found.length(), 0) <= 0) {
+            if (send_error(msg.sender_socket, WireError::UserNotFound, not_found) <= 0) {
                 log_message("Failed to send not found message to client " + std::to_string(msg.sender_socket) + ": " + std::string(strerror(errno)));
             }
         }
         metrics.record_message("private");
     } else {
         std::string invalid = "Invalid command format or user does not exist.\n";
-        if (send(msg.sender_socket, invalid.c_str(), invalid.length(), 0) <= 0) {
+        if (send_error(msg.sender_socket, WireError::BadArguments, invalid) <= 0) {
             log_message("Failed to send invalid command message to client " + std::to_string(msg.sender_socket) + ": " + std::string(strerror(errno)));
         }
     }
@@ -159,103 +271,699 @@ void handle_msg(const Message& msg) {
 // Handler for unknown commands
 void handle_unknown(const Message& msg) {
     std::string unknown = "Unknown command.\n";
-    if (send(msg.sender_socket, unknown.c_str(), unknown.length(), 0) <= 0) {
+    if (send_error(msg.sender_socket, WireError::UnknownCommand, unknown) <= 0) {
         log_message("Failed to send unknown command message to client " + std::to_string(msg.sender_socket) + ": " + std::string(strerror(errno)));
     }
     metrics.record_message("unknown_command");
 }
 
+// Logs in or registers a user on `socket`, replies with the outcome and, on
+// success, replays recent history and announces them to binary clients
+static void authenticate(int socket, WireAuth kind, std::string_view username_view, std::string_view password_view) {
+    const bool registering = kind == WireAuth::Register;
+    // The database takes strings; this is the only copy of the arguments
+    const std::string username(username_view);
+    const std::string password(password_view);
+    Database& db = Database::getInstance();
+    // "user@node" names a user of another cluster node
+    const bool valid_name = !registering || username.find('@') == std::string::npos;
+    const bool ok = valid_name &&
+                    (registering ? db.createUser(username, password) : db.authenticateUser(username, password));
+    flight_record(ok ? FlightEvent::Auth : FlightEvent::AuthFailed, socket, static_cast<uint64_t>(kind));
+    TrafficCapture::instance().record_auth(socket, registering ? CaptureAuth::Register : CaptureAuth::Login,
+                                           username, ok);
+    if (!ok) {
+        std::string reply = !valid_name ? "Registration failed (usernames cannot contain '@').\n"
+                            : registering ? "Registration failed (user may already exist).\n"
+                                          : "Login failed.\n";
+        send_auth_result(socket, kind, false, reply);
+        return;
+    }
+
+    // Set authenticated flag before replying, so a command the client sends
+    // as soon as it sees the reply is accepted by whichever worker takes it
+    {
+        std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+        if (Connection* conn = find_connection_locked(socket)) {
+            conn->authenticated = true;
+            conn->username = username;
+        }
+    }
+    std::string reply = registering ? "Registration successful!\n" : "Login successful!\n";
+    send_auth_result(socket, kind, true, reply);
+    send_history(socket, false, 0, HISTORY_REPLAY_ON_LOGIN);
+    broadcast_presence(socket, username, true);
+}
+
 void handle_register(const Message& msg) {
     // Expected format: /register username password
-    size_t first_space = msg.content.find(' ');
-    size_t second_space = msg.content.find(' ', first_space + 1);
-    if (first_space == std::string::npos || second_space == std::string::npos) {
+    const std::string_view content(msg.content);
+    size_t first_space = content.find(' ');
+    size_t second_space = content.find(' ', first_space + 1);
+    if (first_space == std::string_view::npos || second_space == std::string_view::npos) {
         std::string reply = "Usage: /register <username> <password>\n";
-        send(msg.sender_socket, reply.c_str(), reply.length(), 0);
+        send_error(msg.sender_socket, WireError::BadArguments, reply);
         return;
     }
-    std::string username = msg.content.substr(first_space + 1, second_space - first_space - 1);
-    std::string password = msg.content.substr(second_space + 1);
-    Database& db = Database::getInstance();
-    if (db.createUser(username, password)) {
-        std::string reply = "Registration successful!\n";
-        send(msg.sender_socket, reply.c_str(), reply.length(), 0);
-        // Set authenticated flag
-        std::lock_guard<std::mutex> lock(pool_mtx);
-        for (auto& c : connection_pool) {
-            if (c.in_use && c.socket == msg.sender_socket) {
-                c.authenticated = true;
-                c.username = username;
-                break;
-            }
-        }
-    } else {
-        std::string reply = "Registration failed (user may already exist).\n";
-        send(msg.sender_socket, reply.c_str(), reply.length(), 0);
-    }
+    authenticate(msg.sender_socket, WireAuth::Register, content.substr(first_space + 1, second_space - first_space - 1),
+                 content.substr(second_space + 1));
 }
 
 void handle_login(const Message& msg) {
     // Expected format: /login username password
-    size_t first_space = msg.content.find(' ');
-    size_t second_space = msg.content.find(' ', first_space + 1);
-    if (first_space == std::string::npos || second_space == std::string::npos) {
+    const std::string_view content(msg.content);
+    size_t first_space = content.find(' ');
+    size_t second_space = content.find(' ', first_space + 1);
+    if (first_space == std::string_view::npos || second_space == std::string_view::npos) {
         std::string reply = "Usage: /login <username> <password>\n";
-        send(msg.sender_socket, reply.c_str(), reply.length(), 0);
+        send_error(msg.sender_socket, WireError::BadArguments, reply);
         return;
     }
-    std::string username = msg.content.substr(first_space + 1, second_space - first_space - 1);
-    std::string password = msg.content.substr(second_space + 1);
-    Database& db = Database::getInstance();
-    if (db.authenticateUser(username, password)) {
-        std::string reply = "Login successful!\n";
-        send(msg.sender_socket, reply.c_str(), reply.length(), 0);
-        // Set authenticated flag
-        std::lock_guard<std::mutex> lock(pool_mtx);
-        for (auto& c : connection_pool) {
-            if (c.in_use && c.socket == msg.sender_socket) {
-                c.authenticated = true;
-                c.username = username;
-                break;
-            }
+    authenticate(msg.sender_socket, WireAuth::Login, content.substr(first_space + 1, second_space - first_space - 1),
+                 content.substr(second_space + 1));
+}
+
+void process_frame(const Message& msg) {
+    bool authenticated = false;
+    {
+        std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+        Connection* conn = find_connection_locked(msg.sender_socket);
+        if (!conn) return;
+        authenticated = conn->authenticated;
+    }
+
+    // Fields are read in place from the payload; only what outlives the
+    // frame is copied
+    WireReader reader(msg.content);
+    switch (msg.frame) {
+    case FrameType::Login:
+    case FrameType::Register: {
+        const WireAuth kind = msg.frame == FrameType::Login ? WireAuth::Login : WireAuth::Register;
+        std::string_view username, password;
+        if (!reader.read_string(username) || !reader.read_string(password) || username.empty()) {
+            send_error(msg.sender_socket, WireError::BadArguments, "Username and password required.\n");
+            return;
         }
-    } else {
-        std::string reply = "Login failed.\n";
-        send(msg.sender_socket, reply.c_str(), reply.length(), 0);
+        authenticate(msg.sender_socket, kind, username, password);
+        return;
+    }
+    case FrameType::Command:
+        if (msg.content.empty() || msg.content[0] != '/') {
+            send_error(msg.sender_socket, WireError::Malformed, "Commands start with '/'.\n");
+            return;
+        }
+        process_command(msg);
+        return;
+    case FrameType::Private: {
+        if (!authenticated) {
+            send_error(msg.sender_socket, WireError::NotAuthenticated,
+                       "You must log in or register before using chat commands.\n");
+            return;
+        }
+        std::string_view recipient;
+        if (!reader.read_string(recipient) || recipient.empty()) {
+            send_error(msg.sender_socket, WireError::BadArguments, "Recipient required.\n");
+            return;
+        }
+        if (!deliver_private(msg.sender_socket, recipient, reader.remaining())) {
+            send_error(msg.sender_socket, WireError::UserNotFound, "User not found.\n");
+        }
+        metrics.record_message("private");
+        return;
+    }
+    default:
+        send_error(msg.sender_socket, WireError::Malformed,
+                   "Unknown frame type " + std::to_string(static_cast<int>(msg.frame)) + ".\n");
+        metrics.record_message("unknown_command");
+        return;
     }
 }
 
 void handle_removeuser(const Message& msg) {
     // Expected format: /removeuser username
-    size_t first_space = msg.content.find(' ');
-    if (first_space == std::string::npos) {
+    CommandArgs args(msg.content);
+    args.next();  // the command
+    const std::string_view target_username = args.next();
+    if (target_username.empty() || !args.rest().empty()) {
         std::string reply = "Usage: /removeuser <username>\n";
-        send(msg.sender_socket, reply.c_str(), reply.length(), 0);
+        send_error(msg.sender_socket, WireError::BadArguments, reply);
         return;
     }
-    std::string target_username = msg.content.substr(first_space + 1);
     // Find the sender's username
-    std::string sender_username;
-    {
-        std::lock_guard<std::mutex> lock(pool_mtx);
-        for (const auto& c : connection_pool) {
-            if (c.in_use && c.socket == msg.sender_socket) {
-                sender_username = c.username;
-                break;
-            }
-        }
-    }
+    std::string sender_username = username_for_socket(msg.sender_socket);
     Database& db = Database::getInstance();
     if (!db.isAdmin(sender_username)) {
         std::string reply = "Permission denied. Only admins can remove users.\n";
-        send(msg.sender_socket, reply.c_str(), reply.length(), 0);
+        send_error(msg.sender_socket, WireError::PermissionDenied, reply);
         return;
     }
     if (db.removeUser(target_username)) {
-        std::string reply = "User '" + target_username + "' removed successfully.\n";
-        send(msg.sender_socket, reply.c_str(), reply.length(), 0);
+        std::string reply = "User '" + std::string(target_username) + "' removed successfully.\n";
+        send_reply(msg.sender_socket, reply);
+    } else {
+        std::string reply = "Failed to remove user '" + std::string(target_username) + "'.\n";
+        send_reply(msg.sender_socket, reply);
+    }
+}
+
+void send_history(int socket, bool resume, uint64_t since_seq, size_t limit) {
+    if (limit == 0) {
+        return;
+    }
+
+    // Serve from the in-memory ring; only the part of the range that has
+    // already rotated out of it is read from SQLite.
+    std::vector<StoredMessage> older;
+    std::vector<HistoryEntryPtr> recent;
+    if (!resume) {
+        recent = chat_history.snapshot(limit);
     } else {
-        std::string reply = "Failed to remove user '" + target_username + "'.\n";
-        send(msg.sender_socket, reply.c_str(), reply.length(), 0);
+        uint64_t oldest = chat_history.oldest_seq();
+        if (since_seq + 1 < oldest) {
+            older = message_store().broadcastsSince(since_seq, oldest, limit);
+        }
+        if (older.size() < limit) {
+            recent = chat_history.since(since_seq, limit - older.size());
+        }
     }
+
+    std::string reply = "History (" + std::to_string(older.size() + recent.size()) + " messages):\n";
+    for (const auto& message : older) {
+        HistoryEntry entry = to_history_entry(message);
+        reply += "#" + std::to_string(entry.seq) + " " + entry.text + "\n";
+    }
+    for (const auto& entry : recent) {
+        reply += "#" + std::to_string(entry->seq) + " " + entry->text + "\n";
+    }
+    reply += "End of history (latest #" + std::to_string(chat_history.last_seq()) + ")\n";
+
+    if (send_reply(socket, reply) <= 0) {
+        log_message("Failed to send history to client " + std::to_string(socket) + ": " + std::string(strerror(errno)));
+    }
+}
+
+// Parses a non-negative decimal integer argument
+static bool parse_count(std::string_view arg, uint64_t& value) {
+    if (arg.empty() || arg.find_first_not_of("0123456789") != std::string_view::npos) {
+        return false;
+    }
+    if (std::from_chars(arg.data(), arg.data() + arg.size(), value).ec != std::errc()) {
+        value = UINT64_MAX;  // out of range saturates, as strtoull did
+    }
+    return true;
+}
+
+void handle_history(const Message& msg) {
+    // Expected format: /history [since_seq] [limit]
+    CommandArgs args(msg.content);
+    args.next();  // the command
+    const std::string_view since_arg = args.next();
+    const std::string_view limit_arg = args.next();
+    const std::string_view extra = args.next();
+
+    uint64_t since_seq = 0;
+    uint64_t limit = HISTORY_REPLAY_DEFAULT_LIMIT;
+    if ((!since_arg.empty() && !parse_count(since_arg, since_seq)) ||
+        (!limit_arg.empty() && !parse_count(limit_arg, limit)) || !extra.empty()) {
+        std::string reply = "Usage: /history [since_seq] [limit]\n";
+        send_error(msg.sender_socket, WireError::BadArguments, reply);
+        return;
+    }
+
+    limit = std::min<uint64_t>(std::max<uint64_t>(limit, 1), MAX_HISTORY_SIZE);
+    send_history(msg.sender_socket, !since_arg.empty(), since_seq, static_cast<size_t>(limit));
+    metrics.record_message("history");
+}
+
+void handle_dmhistory(const Message& msg) {
+    // Expected format: /dmhistory <username> [before_id] [limit]
+    CommandArgs args(msg.content);
+    args.next();  // the command
+    const std::string_view peer_arg = args.next();
+    const std::string_view before_arg = args.next();
+    const std::string_view limit_arg = args.next();
+    const std::string_view extra = args.next();
+
+    uint64_t before_id = UINT64_MAX;
+    uint64_t limit = HISTORY_REPLAY_DEFAULT_LIMIT;
+    if (peer_arg.empty() || (!before_arg.empty() && !parse_count(before_arg, before_id)) ||
+        (!limit_arg.empty() && !parse_count(limit_arg, limit)) || !extra.empty()) {
+        std::string reply = "Usage: /dmhistory <username> [before_id] [limit]\n";
+        send_error(msg.sender_socket, WireError::BadArguments, reply);
+        return;
+    }
+    limit = std::min<uint64_t>(std::max<uint64_t>(limit, 1), MAX_HISTORY_SIZE);
+
+    const std::string peer(peer_arg);
+    std::string username = username_for_socket(msg.sender_socket);
+    Database& db = Database::getInstance();
+    int user_id = db.getUserID(username);
+    int peer_id = db.getUserID(peer);
+    if (user_id <= 0 || peer_id <= 0) {
+        std::string reply = "User '" + peer + "' not found.\n";
+        send_error(msg.sender_socket, WireError::UserNotFound, reply);
+        return;
+    }
+
+    // Newest first from the store; shown oldest first like /history
+    std::vector<StoredMessage> page =
+        message_store().conversation(user_id, peer_id, before_id, static_cast<size_t>(limit));
+    std::string reply = "Conversation with " + peer + " (" + std::to_string(page.size()) + " messages):\n";
+    for (auto it = page.rbegin(); it != page.rend(); ++it) {
+        HistoryEntry entry = to_history_entry(*it);
+        reply += "#" + std::to_string(entry.seq) + " " + entry.text + "\n";
+    }
+    if (page.size() == limit) {
+        reply += "Older: /dmhistory " + peer + " " + std::to_string(page.back().seq) + " " +
+                 std::to_string(limit) + "\n";
+    } else {
+        reply += "End of conversation\n";
+    }
+
+    if (send_reply(msg.sender_socket, reply) <= 0) {
+        log_message("Failed to send conversation to client " + std::to_string(msg.sender_socket) + ": " +
+                    std::string(strerror(errno)));
+    }
+    metrics.record_message("dmhistory");
+}
+
+void handle_search(const Message& msg) {
+    // Expected format: /search [before:<cursor>] <terms...> [limit]
+    CommandArgs args(msg.content);
+    args.next();  // the command
+    std::string_view word = args.next();
+
+    uint64_t before = UINT64_MAX;
+    uint64_t limit = SEARCH_DEFAULT_LIMIT;
+    bool valid = true;
+    if (word.substr(0, 7) == "before:") {
+        valid = parse_count(word.substr(7), before);
+        word = args.next();
+    }
+    // The terms joined by single spaces; a trailing count after at least one
+    // term is the limit. Each word is held back until the next is seen.
+    std::string query;
+    size_t words = 0;
+    for (std::string_view next = args.next(); !word.empty(); word = next, next = args.next()) {
+        ++words;
+        if (next.empty() && words > 1 && parse_count(word, limit)) {
+            break;
+        }
+        query.append(query.empty() ? "" : " ").append(word);
+    }
+    if (!valid || tokenize_search_terms(query).empty()) {
+        std::string reply = "Usage: /search [before:<cursor>] <terms> [limit]\n";
+        send_error(msg.sender_socket, WireError::BadArguments, reply);
+        return;
+    }
+    limit = std::min<uint64_t>(std::max<uint64_t>(limit, 1), SEARCH_MAX_LIMIT);
+
+    std::string username = username_for_socket(msg.sender_socket);
+    int user_id = Database::getInstance().getUserID(username);
+    int socket = msg.sender_socket;
+    uint64_t generation = generation_for_socket(socket);
+
+    bool queued = QueryExecutor::getInstance().submit([socket, generation, user_id, query, before, limit]() {
+        SearchPage page = message_store().search(user_id, query, before, static_cast<size_t>(limit));
+        std::string reply = "Search results for \"" + query + "\" (" + std::to_string(page.messages.size()) +
+                            " messages):\n";
+        for (const auto& message : page.messages) {
+            reply += (message.receiver_id != 0 ? "(private) " : "") + to_history_entry(message).text + "\n";
+        }
+        if (page.next_before != 0) {
+            reply += "More: /search before:" + std::to_string(page.next_before) + " " + query + " " +
+                     std::to_string(limit) + "\n";
+        } else {
+            reply += "End of results\n";
+        }
+        // The searcher may have left and its descriptor gone to someone else;
+        // pool_mtx keeps the socket from being closed while we write
+        std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+        Connection* conn = find_connection_locked(socket);
+        if (!conn || conn->generation != generation) {
+            return;
+        }
+        if (send_reply(socket, reply) <= 0) {
+            log_message("Failed to send search results to client " + std::to_string(socket) + ": " +
+                        std::string(strerror(errno)));
+        }
+    });
+    if (!queued) {
+        std::string reply = "Search is busy, please try again.\n";
+        send_error(msg.sender_socket, WireError::Busy, reply);
+        return;
+    }
+    metrics.record_message("search");
+}
+
+void handle_trace(const Message& msg) {
+    // Expected format: /trace [samples]
+    CommandArgs args(msg.content);
+    args.next();  // the command
+    const std::string_view samples_arg = args.next();
+    uint64_t samples = 10;
+    if (!samples_arg.empty() && !parse_count(samples_arg, samples)) {
+        std::string reply = "Usage: /trace [samples]\n";
+        send_error(msg.sender_socket, WireError::BadArguments, reply);
+        return;
+    }
+    samples = std::min<uint64_t>(samples, MessageTracer::RING_SIZE);
+
+    std::string username = username_for_socket(msg.sender_socket);
+    if (!Database::getInstance().isAdmin(username)) {
+        std::string reply = "Permission denied. Only admins can view traces.\n";
+        send_error(msg.sender_socket, WireError::PermissionDenied, reply);
+        return;
+    }
+
+    std::string reply = "Message stages (" + std::to_string(message_tracer.traced()) + " traced, us):\n";
+    char line[192];
+    for (size_t stage = 0; stage < static_cast<size_t>(TraceStage::Count); ++stage) {
+        HistogramSnapshot latency = message_tracer.stage_latency(static_cast<TraceStage>(stage));
+        snprintf(line, sizeof(line), "  %-10s n=%llu p50 %.0f, p90 %.0f, p99 %.0f, p99.9 %.0f, max %llu\n",
+                 trace_stage_name(static_cast<TraceStage>(stage)), static_cast<unsigned long long>(latency.count),
+                 latency.percentile(0.50), latency.percentile(0.90), latency.percentile(0.99),
+                 latency.percentile(0.999), static_cast<unsigned long long>(latency.max));
+        reply += line;
+    }
+
+    // Sampled traces as offsets from recv; "-" marks a stage not reached
+    reply += "Recent samples (us after recv: enqueue dequeue persist first_send last_send):\n";
+    for (const auto& trace : message_tracer.recent_samples(static_cast<size_t>(samples))) {
+        reply += " ";
+        for (int64_t stamp : {trace.enqueue_ns, trace.dequeue_ns, trace.persist_ns, trace.first_send_ns,
+                              trace.last_send_ns}) {
+            reply += (stamp > 0 && trace.recv_ns > 0) ? " " + std::to_string((stamp - trace.recv_ns) / 1000) : " -";
+        }
+        reply += "\n";
+    }
+
+    if (send_reply(msg.sender_socket, reply) <= 0) {
+        log_message("Failed to send trace to client " + std::to_string(msg.sender_socket) + ": " +
+                    std::string(strerror(errno)));
+    }
+    metrics.record_message("trace");
+}
+
+void handle_top(const Message& msg) {
+    // Expected format: /top [rows]
+    CommandArgs args(msg.content);
+    args.next();  // the command
+    const std::string_view rows_arg = args.next();
+    uint64_t rows = 10;
+    if (!rows_arg.empty() && (!parse_count(rows_arg, rows) || rows == 0)) {
+        std::string reply = "Usage: /top [rows]\n";
+        send_error(msg.sender_socket, WireError::BadArguments, reply);
+        return;
+    }
+
+    std::string username = username_for_socket(msg.sender_socket);
+    if (!Database::getInstance().isAdmin(username)) {
+        std::string reply = "Permission denied. Only admins can view connection traffic.\n";
+        send_error(msg.sender_socket, WireError::PermissionDenied, reply);
+        return;
+    }
+
+    std::vector<ConnectionSnapshot> connections = snapshot_connections();
+    const size_t shown = std::min<size_t>(rows, connections.size());
+    auto name_of = [](const ConnectionSnapshot& c) {
+        return c.username.empty() ? "(fd " + std::to_string(c.socket) + ")" : c.username;
+    };
+    char line[192];
+
+    std::string reply = "Heaviest senders (" + std::to_string(connections.size()) + " connections):\n";
+    snprintf(line, sizeof(line), "  %-16s %10s %12s %10s %12s %8s\n", "user", "msgs_in", "bytes_in", "msgs_out",
+             "bytes_out", "idle_s");
+    reply += line;
+    std::partial_sort(connections.begin(), connections.begin() + shown, connections.end(),
+                      [](const ConnectionSnapshot& a, const ConnectionSnapshot& b) { return a.bytes_in > b.bytes_in; });
+    for (size_t i = 0; i < shown; ++i) {
+        const auto& c = connections[i];
+        snprintf(line, sizeof(line), "  %-16s %10llu %12llu %10llu %12llu %8.1f\n", name_of(c).c_str(),
+                 static_cast<unsigned long long>(c.messages_in), static_cast<unsigned long long>(c.bytes_in),
+                 static_cast<unsigned long long>(c.messages_out), static_cast<unsigned long long>(c.bytes_out),
+                 c.idle_seconds);
+        reply += line;
+    }
+
+    // A receiver is slow when the kernel holds unacknowledged bytes for it
+    // or its writes keep finding a full send buffer
+    reply += "Slowest receivers:\n";
+    snprintf(line, sizeof(line), "  %-16s %10s %8s %8s %10s %8s\n", "user", "outq_bytes", "stalls", "failed",
+             "msgs_out", "idle_s");
+    reply += line;
+    std::partial_sort(connections.begin(), connections.begin() + shown, connections.end(),
+                      [](const ConnectionSnapshot& a, const ConnectionSnapshot& b) {
+                          if (a.outbound_queued != b.outbound_queued) {
+                              return a.outbound_queued > b.outbound_queued;
+                          }
+                          return a.send_stalls + a.send_failures > b.send_stalls + b.send_failures;
+                      });
+    for (size_t i = 0; i < shown; ++i) {
+        const auto& c = connections[i];
+        snprintf(line, sizeof(line), "  %-16s %10zu %8llu %8llu %10llu %8.1f\n", name_of(c).c_str(),
+                 c.outbound_queued, static_cast<unsigned long long>(c.send_stalls),
+                 static_cast<unsigned long long>(c.send_failures), static_cast<unsigned long long>(c.messages_out),
+                 c.idle_seconds);
+        reply += line;
+    }
+
+    if (send_reply(msg.sender_socket, reply) <= 0) {
+        log_message("Failed to send connection traffic to client " + std::to_string(msg.sender_socket) + ": " +
+                    std::string(strerror(errno)));
+    }
+    metrics.record_message("top");
+}
+
+void handle_capture(const Message& msg) {
+    // Expected format: /capture [start [name] | stop]
+    CommandArgs args(msg.content);
+    args.next();  // the command
+    const std::string_view action = args.next();
+    const std::string_view name = args.next();
+    if ((!action.empty() && action != "start" && action != "stop") || (action != "start" && !name.empty())) {
+        std::string reply = "Usage: /capture [start [name] | stop]\n";
+        send_error(msg.sender_socket, WireError::BadArguments, reply);
+        return;
+    }
+
+    std::string username = username_for_socket(msg.sender_socket);
+    if (!Database::getInstance().isAdmin(username)) {
+        std::string reply = "Permission denied. Only admins can capture traffic.\n";
+        send_error(msg.sender_socket, WireError::PermissionDenied, reply);
+        return;
+    }
+
+    TrafficCapture& capture = TrafficCapture::instance();
+    std::string reply;
+    if (action == "start") {
+        // Captures only ever create new files in TRAFFIC_CAPTURE_DIR
+        const std::string file = capture_file_path(name);
+        if (file.empty()) {
+            reply = "Capture names are up to 64 letters, digits, '_' or '-'.\n";
+            send_error(msg.sender_socket, WireError::BadArguments, reply);
+            return;
+        }
+        reply = capture.start(file) ? "Capturing traffic to " + file + "\n"
+                                    : "Could not create " + file + " (it may already exist).\n";
+    } else if (action == "stop") {
+        std::string path = capture.path();
+        reply = capture.active() ? "Wrote " + std::to_string(capture.stop()) + " records to " + path + "\n"
+                                 : "No capture in progress.\n";
+    } else {
+        reply = capture.active() ? "Capturing to " + capture.path() + ": " + std::to_string(capture.record_count()) +
+                                       " records so far\n"
+                                 : "No capture in progress.\n";
+    }
+    log_message(username + ": " + reply.substr(0, reply.size() - 1));
+    if (send_reply(msg.sender_socket, reply) <= 0) {
+        log_message("Failed to send capture status to client " + std::to_string(msg.sender_socket) + ": " +
+                    std::string(strerror(errno)));
+    }
+    metrics.record_message("capture");
+}
+
+// Sends `reply` followed by a page of the room's history, oldest first
+static void send_room_history(int socket, std::string reply, const std::string& room, uint32_t room_id,
+                              uint64_t before_id, size_t limit) {
+    // Newest first from the store
+    std::vector<StoredMessage> page = message_store().roomHistory(room_id, before_id, limit);
+    reply += "History of " + room + " (" + std::to_string(page.size()) + " messages):\n";
+    for (auto it = page.rbegin(); it != page.rend(); ++it) {
+        HistoryEntry entry = to_history_entry(*it);
+        reply += "#" + std::to_string(entry.seq) + " " + entry.text + "\n";
+    }
+    if (page.size() == limit) {
+        reply += "Older: /roomhistory " + room + " " + std::to_string(page.back().seq) + " " +
+                 std::to_string(limit) + "\n";
+    } else {
+        reply += "End of room history\n";
+    }
+
+    if (send_reply(socket, reply) <= 0) {
+        log_message("Failed to send room history to client " + std::to_string(socket) + ": " +
+                    std::string(strerror(errno)));
+    }
+}
+
+static void send_not_member(int socket, std::string_view room) {
+    std::string reply = "You are not in " + std::string(room) + ".\n";
+    send_error(socket, WireError::NotMember, reply);
+}
+
+void handle_join(const Message& msg) {
+    // Expected format: /join #room
+    CommandArgs args(msg.content);
+    args.next();  // the command
+    const std::string_view room_arg = args.next();
+    if (!valid_room_name(room_arg) || !args.next().empty()) {
+        std::string reply = "Usage: /join #room (up to " + std::to_string(ROOM_NAME_MAX_LENGTH - 1) +
+                            " letters, digits, '_' or '-')\n";
+        send_error(msg.sender_socket, WireError::BadArguments, reply);
+        return;
+    }
+
+    const std::string room(room_arg);
+    const int room_id = Database::getInstance().getRoomID(room);
+    if (room_id <= 0) {
+        std::string reply = "Could not join " + room + ".\n";
+        send_error(msg.sender_socket, WireError::BadArguments, reply);
+        return;
+    }
+    switch (RoomRegistry::instance().join(static_cast<uint32_t>(room_id), room, msg.sender_socket)) {
+    case RoomJoin::AlreadyMember:
+        send_error(msg.sender_socket, WireError::BadArguments, "You are already in " + room + ".\n");
+        return;
+    case RoomJoin::TooManyRooms:
+        send_error(msg.sender_socket, WireError::BadArguments,
+                   "You are in too many rooms (at most " + std::to_string(MAX_ROOMS_PER_CONNECTION) + ").\n");
+        return;
+    case RoomJoin::Joined:
+        break;
+    }
+    send_room_history(msg.sender_socket, "Joined " + room + ".\n", room, static_cast<uint32_t>(room_id), UINT64_MAX,
+                      ROOM_HISTORY_ON_JOIN);
+    metrics.record_message("join");
+}
+
+void handle_leave(const Message& msg) {
+    // Expected format: /leave #room
+    CommandArgs args(msg.content);
+    args.next();  // the command
+    const std::string_view room = args.next();
+    if (room.empty() || !args.next().empty()) {
+        send_error(msg.sender_socket, WireError::BadArguments, "Usage: /leave #room\n");
+        return;
+    }
+    if (!RoomRegistry::instance().leave(room, msg.sender_socket)) {
+        send_not_member(msg.sender_socket, room);
+        return;
+    }
+    send_reply(msg.sender_socket, "Left " + std::string(room) + ".\n");
+    metrics.record_message("leave");
+}
+
+void handle_rooms(const Message& msg) {
+    std::vector<RoomSummary> rooms = RoomRegistry::instance().list(msg.sender_socket);
+    std::string reply = "Rooms (" + std::to_string(rooms.size()) + "):\n";
+    for (const auto& room : rooms) {
+        reply += "  " + room.name + ": " + std::to_string(room.members) + (room.members == 1 ? " member" : " members");
+        if (room.batch_window_ms > 0) {
+            reply += ", batched every " + std::to_string(room.batch_window_ms) + " ms";
+        }
+        reply += room.joined ? " (joined)\n" : "\n";
+    }
+    if (send_reply(msg.sender_socket, reply) <= 0) {
+        log_message("Failed to send room list to client " + std::to_string(msg.sender_socket) + ": " +
+                    std::string(strerror(errno)));
+    }
+    metrics.record_message("list_rooms");
+}
+
+void handle_say(const Message& msg) {
+    // Expected format: /say #room <message>
+    CommandArgs args(msg.content);
+    args.next();  // the command
+    const std::string_view room = args.next();
+    const std::string_view text = args.rest();
+    if (room.empty() || text.empty()) {
+        send_error(msg.sender_socket, WireError::BadArguments, "Usage: /say #room <message>\n");
+        return;
+    }
+    if (text.size() > MAX_MESSAGE_SIZE) {
+        metrics.record_drop(DropLane::Oversize);
+        send_error(msg.sender_socket, WireError::TooLarge, "Message too large.\n");
+        return;
+    }
+    if (!broadcast_room(msg.sender_socket, room, text)) {
+        send_not_member(msg.sender_socket, room);
+    }
+}
+
+void handle_roomhistory(const Message& msg) {
+    // Expected format: /roomhistory #room [before_id] [limit]
+    CommandArgs args(msg.content);
+    args.next();  // the command
+    const std::string_view room = args.next();
+    const std::string_view before_arg = args.next();
+    const std::string_view limit_arg = args.next();
+    const std::string_view extra = args.next();
+
+    uint64_t before_id = UINT64_MAX;
+    uint64_t limit = HISTORY_REPLAY_DEFAULT_LIMIT;
+    if (room.empty() || (!before_arg.empty() && !parse_count(before_arg, before_id)) ||
+        (!limit_arg.empty() && !parse_count(limit_arg, limit)) || !extra.empty()) {
+        std::string reply = "Usage: /roomhistory #room [before_id] [limit]\n";
+        send_error(msg.sender_socket, WireError::BadArguments, reply);
+        return;
+    }
+    limit = std::min<uint64_t>(std::max<uint64_t>(limit, 1), MAX_HISTORY_SIZE);
+
+    // Only members read a room's history
+    const uint32_t room_id = RoomRegistry::instance().member_room_id(room, msg.sender_socket);
+    if (room_id == 0) {
+        send_not_member(msg.sender_socket, room);
+        return;
+    }
+    send_room_history(msg.sender_socket, std::string(), std::string(room), room_id, before_id,
+                      static_cast<size_t>(limit));
+    metrics.record_message("roomhistory");
+}
+
+void handle_roombatch(const Message& msg) {
+    // Expected format: /roombatch #room <ms|off>
+    CommandArgs args(msg.content);
+    args.next();  // the command
+    const std::string_view room = args.next();
+    const std::string_view window_arg = args.next();
+    const std::string_view extra = args.next();
+
+    uint64_t window_ms = 0;
+    if (room.empty() || !extra.empty() ||
+        (window_arg != "off" &&
+         (!parse_count(window_arg, window_ms) || window_ms == 0 || window_ms > ROOM_BATCH_MAX_WINDOW_MS))) {
+        std::string reply = "Usage: /roombatch #room <1-" + std::to_string(ROOM_BATCH_MAX_WINDOW_MS) + " ms|off>\n";
+        send_error(msg.sender_socket, WireError::BadArguments, reply);
+        return;
+    }
+
+    // The window changes delivery for every member, so it is not any one
+    // member's to set
+    std::string username = username_for_socket(msg.sender_socket);
+    if (!Database::getInstance().isAdmin(username)) {
+        std::string reply = "Permission denied. Only admins can change a room's batching.\n";
+        send_error(msg.sender_socket, WireError::PermissionDenied, reply);
+        return;
+    }
+    if (!set_room_batch_window(msg.sender_socket, room, static_cast<uint32_t>(window_ms))) {
+        send_not_member(msg.sender_socket, room);
+        return;
+    }
+
+    std::string reply = window_ms > 0 ? std::string(room) + " now delivers its messages every " +
+                                            std::to_string(window_ms) + " ms.\n"
+                                      : std::string(room) + " now delivers each message at once.\n";
+    log_message(username + ": " + reply.substr(0, reply.size() - 1));
+    send_reply(msg.sender_socket, reply);
+    metrics.record_message("roombatch");
 }
@@ -1,25 +1,161 @@
 #include "connection_pool.h"
 #include "server_metrics.h"
-#include <unistd.h>
+#include "flight_recorder.h"
+#include "transport.h"
+#include "room_registry.h"
 #include <chrono>
 #include <string>
 #include <functional>
 
 // Global variables
 std::vector<Connection> connection_pool(MAX_CONNECTIONS);
-std::mutex pool_mtx;
+InstrumentedMutex pool_mtx("pool");
+
+// Socket descriptor -> traffic counters; descriptors past the end are simply
+// not tracked per connection
+static constexpr int MAX_TRACKED_SOCKETS = 65536;
+static std::atomic<ConnectionTraffic*> traffic_by_socket[MAX_TRACKED_SOCKETS];
+static std::atomic<bool> binary_by_socket[MAX_TRACKED_SOCKETS];
+static uint64_t last_generation = 0;  // guarded by pool_mtx
 
 // Forward declaration of log_message
 void log_message(const std::string& message);
 
+static int64_t steady_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void ConnectionTraffic::reset() {
+    bytes_in.store(0, std::memory_order_relaxed);
+    messages_in.store(0, std::memory_order_relaxed);
+    bytes_out.store(0, std::memory_order_relaxed);
+    messages_out.store(0, std::memory_order_relaxed);
+    send_stalls.store(0, std::memory_order_relaxed);
+    send_failures.store(0, std::memory_order_relaxed);
+    last_activity_ns.store(steady_now_ns(), std::memory_order_relaxed);
+}
+
+void ConnectionTraffic::record_in(size_t bytes) {
+    bytes_in.fetch_add(bytes, std::memory_order_relaxed);
+    messages_in.fetch_add(1, std::memory_order_relaxed);
+    last_activity_ns.store(steady_now_ns(), std::memory_order_relaxed);
+}
+
+void ConnectionTraffic::record_out(size_t bytes) {
+    bytes_out.fetch_add(bytes, std::memory_order_relaxed);
+    messages_out.fetch_add(1, std::memory_order_relaxed);
+    last_activity_ns.store(steady_now_ns(), std::memory_order_relaxed);
+}
+
+// Caller holds pool_mtx. Leaves the socket's rooms and retires the
+// generation before the socket can be closed and its descriptor handed to
+// another client.
+static void detach_socket(Connection* conn) {
+    RoomRegistry::instance().leave_all(conn->socket);
+    conn->generation = ++last_generation;
+    if (conn->socket >= 0 && conn->socket < MAX_TRACKED_SOCKETS) {
+        ConnectionTraffic* expected = &conn->traffic;
+        if (traffic_by_socket[conn->socket].compare_exchange_strong(expected, nullptr)) {
+            binary_by_socket[conn->socket].store(false, std::memory_order_relaxed);
+        }
+    }
+    conn->binary = false;
+}
+
+Connection* find_connection_locked(int socket) {
+    for (auto& conn : connection_pool) {
+        if (conn.in_use && conn.socket == socket) {
+            return &conn;
+        }
+    }
+    return nullptr;
+}
+
+Connection* find_connection_by_username_locked(std::string_view username) {
+    for (auto& conn : connection_pool) {
+        if (conn.in_use && conn.username == username) {
+            return &conn;
+        }
+    }
+    return nullptr;
+}
+
+std::string username_for_socket(int socket) {
+    std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+    Connection* conn = find_connection_locked(socket);
+    return conn ? conn->username : std::string();
+}
+
+uint64_t generation_for_socket(int socket) {
+    std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+    Connection* conn = find_connection_locked(socket);
+    return conn ? conn->generation : 0;
+}
+
+void attach_socket(Connection* conn, int socket) {
+    std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+    detach_socket(conn);
+    conn->traffic.reset();
+    conn->socket = socket;
+    if (socket >= 0 && socket < MAX_TRACKED_SOCKETS) {
+        binary_by_socket[socket].store(false, std::memory_order_relaxed);
+        traffic_by_socket[socket].store(&conn->traffic, std::memory_order_release);
+    }
+}
+
+void set_binary_locked(Connection* conn) {
+    conn->binary = true;
+    if (conn->socket >= 0 && conn->socket < MAX_TRACKED_SOCKETS) {
+        binary_by_socket[conn->socket].store(true, std::memory_order_release);
+    }
+}
+
+bool is_binary_socket(int socket) {
+    if (socket < 0 || socket >= MAX_TRACKED_SOCKETS) {
+        return false;
+    }
+    return binary_by_socket[socket].load(std::memory_order_acquire);
+}
+
+ConnectionTraffic* traffic_for_socket(int socket) {
+    if (socket < 0 || socket >= MAX_TRACKED_SOCKETS) {
+        return nullptr;
+    }
+    return traffic_by_socket[socket].load(std::memory_order_acquire);
+}
+
+std::vector<ConnectionSnapshot> snapshot_connections() {
+    std::vector<ConnectionSnapshot> snapshots;
+    const int64_t now = steady_now_ns();
+    std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+    for (const auto& conn : connection_pool) {
+        if (!conn.in_use || conn.socket < 0) {
+            continue;
+        }
+        const ConnectionTraffic& traffic = conn.traffic;
+        snapshots.push_back(ConnectionSnapshot{
+            conn.username, conn.socket,
+            traffic.bytes_in.load(std::memory_order_relaxed),
+            traffic.messages_in.load(std::memory_order_relaxed),
+            traffic.bytes_out.load(std::memory_order_relaxed),
+            traffic.messages_out.load(std::memory_order_relaxed),
+            traffic.send_stalls.load(std::memory_order_relaxed),
+            traffic.send_failures.load(std::memory_order_relaxed),
+            transport().outbound_queued(conn.socket),
+            static_cast<double>(now - traffic.last_activity_ns.load(std::memory_order_relaxed)) / 1e9});
+    }
+    return snapshots;
+}
+
 void initialize_connection_pool() {
-    std::lock_guard<std::mutex> lock(pool_mtx);
+    std::lock_guard<InstrumentedMutex> lock(pool_mtx);
     // No need to clear and reinitialize since it's already initialized with MAX_CONNECTIONS
     log_message("Connection pool initialized with " + std::to_string(MAX_CONNECTIONS) + " slots");
 }
 
 Connection* get_available_connection() {
-    std::lock_guard<std::mutex> lock(pool_mtx);
+    std::lock_guard<InstrumentedMutex> lock(pool_mtx);
     const auto now = std::chrono::steady_clock::now();
     Connection* stale_connection = nullptr;
 
@@ -31,6 +167,7 @@ Connection* get_available_connection() {
             conn.socket = -1;  // Initialize socket to invalid
             conn.username.clear();  // Clear any old username
             conn.authenticated = false; // Reset authentication
+            conn.binary = false;
             return &conn;
         }
 
@@ -46,7 +183,9 @@ Connection* get_available_connection() {
     if (stale_connection) {
         // Clean up the stale connection
         if (stale_connection->socket != -1) {
-            close(stale_connection->socket);
+            detach_socket(stale_connection);
+            flight_record(FlightEvent::Release, stale_connection->socket);
+            transport().close(stale_connection->socket);
             log_message("Cleaned up stale connection from " + stale_connection->username);
         }
 
@@ -67,9 +206,11 @@ Connection* get_available_connection() {
 void release_connection(Connection* conn) {
     if (!conn) return;
 
-    std::lock_guard<std::mutex> lock(pool_mtx);
+    std::lock_guard<InstrumentedMutex> lock(pool_mtx);
     if (conn->socket != -1) {
-        close(conn->socket);
+        detach_socket(conn);
+        flight_record(FlightEvent::Release, conn->socket);
+        transport().close(conn->socket);
         log_message("Closed socket for connection " + conn->username);
     }
     conn->socket = -1;
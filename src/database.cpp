@@ -11,24 +11,31 @@ const char* Database::DATABASE_PATH = "chat_server.db";
 const int Database::BROADCAST_RECEIVER_ID = 0;
 
 Database& Database::getInstance() {
-    static Database instance;
+    static Database instance(DATABASE_PATH);
     return instance;
 }
 
-Database::Database() : db(nullptr) {
+Database::Database(const std::string& path)
+    : path(path), db(nullptr), search_db(nullptr), compact_db(nullptr), fts_available(false) {
     if (!initializeDatabase()) {
         throw std::runtime_error("Failed to initialize database");
     }
 }
 
 Database::~Database() {
+    if (compact_db) {
+        sqlite3_close(compact_db);
+    }
+    if (search_db) {
+        sqlite3_close(search_db);
+    }
     if (db) {
         sqlite3_close(db);
     }
 }
 
 bool Database::initializeDatabase() {
-    int rc = sqlite3_open(DATABASE_PATH, &db);
+    int rc = sqlite3_open(path.c_str(), &db);
     if (rc) {
         return false;
     }
@@ -70,23 +77,110 @@ bool Database::initializeDatabase() {
     executeQuery(createMessageIndex);  // Non-critical, don't fail if index exists
 
     // Add is_admin column if not present (safe to run multiple times)
-    const char* checkAdminColumn =
-        "SELECT COUNT(*) FROM pragma_table_info('users') WHERE name='is_admin'";
+    if (!columnExists("users", "is_admin")) {
+        const char* addAdminColumn = "ALTER TABLE users ADD COLUMN is_admin INTEGER DEFAULT 0";
+        sqlite3_exec(db, addAdminColumn, nullptr, nullptr, nullptr);
+    }
+
+    // Broadcast sequence numbers. Legacy broadcasts are numbered by row id,
+    // which preserves their order.
+    if (!columnExists("messages", "seq")) {
+        executeQuery("ALTER TABLE messages ADD COLUMN seq INTEGER");
+        executeQuery("UPDATE messages SET seq = id WHERE receiver_id = 0 AND seq IS NULL");
+    }
+    executeQuery("CREATE INDEX IF NOT EXISTS idx_messages_broadcast_seq ON messages(receiver_id, seq);");
+
+    // Conversation key for private messages: the two user ids in canonical
+    // (low, high) order, so either participant finds the same thread
+    if (!columnExists("messages", "conv_lo")) {
+        executeQuery("ALTER TABLE messages ADD COLUMN conv_lo INTEGER");
+        executeQuery("ALTER TABLE messages ADD COLUMN conv_hi INTEGER");
+        executeQuery("UPDATE messages SET conv_lo = MIN(sender_id, receiver_id), "
+                     "conv_hi = MAX(sender_id, receiver_id) WHERE receiver_id != 0");
+    }
+    executeQuery("CREATE INDEX IF NOT EXISTS idx_messages_conversation ON messages(conv_lo, conv_hi, id);");
+
+    // Chat rooms. A room message has receiver_id 0 (so broadcast retention
+    // covers it), no seq, and the room's id in room_id.
+    executeQuery(
+        "CREATE TABLE IF NOT EXISTS rooms ("
+        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "name TEXT UNIQUE NOT NULL,"
+        "created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP"
+        ");");
+    if (!columnExists("messages", "room_id")) {
+        executeQuery("ALTER TABLE messages ADD COLUMN room_id INTEGER");
+    }
+    executeQuery("CREATE INDEX IF NOT EXISTS idx_messages_room ON messages(room_id, id);");
+
+    // Broadcasts from users of other cluster nodes have no account here:
+    // sender_id is 0 and remote_sender names them as "user@node"
+    if (!columnExists("messages", "remote_sender")) {
+        executeQuery("ALTER TABLE messages ADD COLUMN remote_sender TEXT");
+    }
+
+    // WAL lets the search connection read while chat workers write. The
+    // compaction connection writes in short batches; the busy timeout makes
+    // storeMessage wait for a batch instead of failing.
+    executeQuery("PRAGMA journal_mode=WAL");
+    sqlite3_busy_timeout(db, 5000);
+    initializeSearch();  // Non-critical: search falls back to LIKE scans
+    if (sqlite3_open(path.c_str(), &compact_db) == SQLITE_OK) {
+        sqlite3_busy_timeout(compact_db, 5000);
+    } else {
+        sqlite3_close(compact_db);
+        compact_db = nullptr;
+    }
+
+    return true;
+}
+
+bool Database::initializeSearch() {
+    // External-content FTS5 index over messages.content, kept current by
+    // triggers so every insert path feeds it
+    bool existed = false;
     sqlite3_stmt* stmt;
-    bool column_exists = false;
-    if (sqlite3_prepare_v2(db, checkAdminColumn, -1, &stmt, nullptr) == SQLITE_OK) {
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            column_exists = sqlite3_column_int(stmt, 0) > 0;
-        }
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE name = 'messages_fts'", -1, &stmt, nullptr) == SQLITE_OK) {
+        existed = sqlite3_step(stmt) == SQLITE_ROW;
         sqlite3_finalize(stmt);
     }
+    fts_available = executeQuery(
+        "CREATE VIRTUAL TABLE IF NOT EXISTS messages_fts "
+        "USING fts5(content, content='messages', content_rowid='id')");
+    if (fts_available) {
+        executeQuery(
+            "CREATE TRIGGER IF NOT EXISTS messages_fts_insert AFTER INSERT ON messages BEGIN "
+            "INSERT INTO messages_fts(rowid, content) VALUES (new.id, new.content); END");
+        executeQuery(
+            "CREATE TRIGGER IF NOT EXISTS messages_fts_delete AFTER DELETE ON messages BEGIN "
+            "INSERT INTO messages_fts(messages_fts, rowid, content) VALUES ('delete', old.id, old.content); END");
+        if (!existed) {
+            executeQuery("INSERT INTO messages_fts(messages_fts) VALUES ('rebuild')");
+        }
+    }
 
-    if (!column_exists) {
-        const char* addAdminColumn = "ALTER TABLE users ADD COLUMN is_admin INTEGER DEFAULT 0";
-        sqlite3_exec(db, addAdminColumn, nullptr, nullptr, nullptr);
+    if (sqlite3_open_v2(path.c_str(), &search_db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+        sqlite3_close(search_db);
+        search_db = nullptr;
+        return false;
     }
+    sqlite3_busy_timeout(search_db, 1000);
+    return fts_available;
+}
 
-    return true;
+bool Database::columnExists(const char* table, const char* column) {
+    const char* query = "SELECT COUNT(*) FROM pragma_table_info(?) WHERE name = ?";
+    sqlite3_stmt* stmt;
+    bool exists = false;
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, nullptr) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, column, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            exists = sqlite3_column_int(stmt, 0) > 0;
+        }
+        sqlite3_finalize(stmt);
+    }
+    return exists;
 }
 
 bool Database::executeQuery(const std::string& query) {
@@ -182,13 +276,13 @@ bool Database::authenticateUser(const std::string& username, const std::string&
     return CRYPTO_memcmp(stored_hash.c_str(), computed_hash.c_str(), stored_hash.length()) == 0;
 }
 
-bool Database::removeUser(const std::string& username) {
+bool Database::removeUser(std::string_view username) {
     std::string query = "DELETE FROM users WHERE username = ?";
     sqlite3_stmt* stmt;
     if (sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
         return false;
     }
-    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 1, username.data(), static_cast<int>(username.size()), SQLITE_STATIC);
     bool success = sqlite3_step(stmt) == SQLITE_DONE;
     sqlite3_finalize(stmt);
     return success;
@@ -228,12 +322,36 @@ int Database::getUserID(const std::string& username) {
     return user_id;
 }
 
-bool Database::storeMessage(int sender_id, int receiver_id, const std::string& content) {
-    if (sender_id == 0) {
-        return false;  // Invalid sender
+int Database::getRoomID(const std::string& name) {
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO rooms (name) VALUES (?)", -1, &stmt, nullptr) != SQLITE_OK) {
+        return 0;
     }
+    sqlite3_bind_text(stmt, 1, name.c_str(), -1, SQLITE_STATIC);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
 
-    std::string query = "INSERT INTO messages (sender_id, receiver_id, content) VALUES (?, ?, ?)";
+    int room_id = 0;
+    if (sqlite3_prepare_v2(db, "SELECT id FROM rooms WHERE name = ?", -1, &stmt, nullptr) != SQLITE_OK) {
+        return 0;
+    }
+    sqlite3_bind_text(stmt, 1, name.c_str(), -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        room_id = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return room_id;
+}
+
+bool Database::storeMessage(int sender_id, int receiver_id, const std::string& content, uint64_t seq,
+                            uint32_t room_id, const std::string& remote_sender) {
+    if (sender_id == 0 && (remote_sender.empty() || receiver_id != BROADCAST_RECEIVER_ID || room_id > 0)) {
+        return false;  // Invalid sender; only broadcasts come from other nodes
+    }
+
+    std::string query =
+        "INSERT INTO messages (sender_id, receiver_id, content, seq, conv_lo, conv_hi, room_id, remote_sender) "
+        "VALUES (?, ?, ?, ?, ?, ?, ?, ?)";
     sqlite3_stmt* stmt;
 
     if (sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
@@ -243,64 +361,281 @@ bool Database::storeMessage(int sender_id, int receiver_id, const std::string& c
     sqlite3_bind_int(stmt, 1, sender_id);
     sqlite3_bind_int(stmt, 2, receiver_id);
     sqlite3_bind_text(stmt, 3, content.c_str(), -1, SQLITE_STATIC);
+    if (seq > 0) {
+        sqlite3_bind_int64(stmt, 4, static_cast<sqlite3_int64>(seq));
+    } else {
+        sqlite3_bind_null(stmt, 4);
+    }
+    if (receiver_id != BROADCAST_RECEIVER_ID) {
+        sqlite3_bind_int(stmt, 5, std::min(sender_id, receiver_id));
+        sqlite3_bind_int(stmt, 6, std::max(sender_id, receiver_id));
+    } else {
+        sqlite3_bind_null(stmt, 5);
+        sqlite3_bind_null(stmt, 6);
+    }
+    if (room_id > 0) {
+        sqlite3_bind_int64(stmt, 7, room_id);
+    } else {
+        sqlite3_bind_null(stmt, 7);
+    }
+    if (sender_id == 0) {
+        sqlite3_bind_text(stmt, 8, remote_sender.c_str(), -1, SQLITE_STATIC);
+    } else {
+        sqlite3_bind_null(stmt, 8);
+    }
 
     bool success = sqlite3_step(stmt) == SQLITE_DONE;
     sqlite3_finalize(stmt);
     return success;
 }
 
-std::vector<std::string> Database::loadRecentMessages(int limit) {
-    std::vector<std::string> messages;
+// Reads rows of (seq, content, created_at in epoch seconds, username,
+// sender_id, receiver_id[, row id])
+std::vector<StoredMessage> Database::readMessages(sqlite3_stmt* stmt, std::vector<uint64_t>* row_ids) {
+    std::vector<StoredMessage> messages;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const unsigned char* content_ptr = sqlite3_column_text(stmt, 1);
+        const unsigned char* username_ptr = sqlite3_column_text(stmt, 3);
+
+        // Skip rows with null values
+        if (!content_ptr || !username_ptr) {
+            continue;
+        }
+
+        StoredMessage message;
+        message.seq = static_cast<uint64_t>(sqlite3_column_int64(stmt, 0));
+        message.content = reinterpret_cast<const char*>(content_ptr);
+        message.timestamp_ms = sqlite3_column_int64(stmt, 2) * 1000;
+        message.sender_name = reinterpret_cast<const char*>(username_ptr);
+        message.sender_id = sqlite3_column_int(stmt, 4);
+        message.receiver_id = sqlite3_column_int(stmt, 5);
+        messages.push_back(std::move(message));
+        if (row_ids) {
+            row_ids->push_back(static_cast<uint64_t>(sqlite3_column_int64(stmt, 6)));
+        }
+    }
+    sqlite3_finalize(stmt);
+    return messages;
+}
 
+std::vector<StoredMessage> Database::loadRecentMessages(int limit) {
     // Load broadcast messages (receiver_id = 0) ordered by most recent
     std::string query =
-        "SELECT m.content, m.created_at, u.username "
+        "SELECT m.seq, m.content, CAST(strftime('%s', m.created_at) AS INTEGER), "
+        "COALESCE(u.username, m.remote_sender), m.sender_id, m.receiver_id "
         "FROM messages m "
-        "JOIN users u ON m.sender_id = u.id "
-        "WHERE m.receiver_id = ? "
-        "ORDER BY m.created_at DESC "
+        "LEFT JOIN users u ON m.sender_id = u.id "
+        "WHERE m.receiver_id = ? AND m.seq IS NOT NULL "
+        "ORDER BY m.seq DESC "
         "LIMIT ?";
 
     sqlite3_stmt* stmt;
 
     if (sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-        return messages;
+        return {};
     }
 
     sqlite3_bind_int(stmt, 1, BROADCAST_RECEIVER_ID);
     sqlite3_bind_int(stmt, 2, limit);
 
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        const unsigned char* content_ptr = sqlite3_column_text(stmt, 0);
-        const unsigned char* timestamp_ptr = sqlite3_column_text(stmt, 1);
-        const unsigned char* username_ptr = sqlite3_column_text(stmt, 2);
+    std::vector<StoredMessage> messages = readMessages(stmt);
 
-        // Skip rows with null values
-        if (!content_ptr || !timestamp_ptr || !username_ptr) {
-            continue;
-        }
+    // Reverse to get chronological order (oldest first)
+    std::reverse(messages.begin(), messages.end());
 
-        std::string content = reinterpret_cast<const char*>(content_ptr);
-        std::string timestamp = reinterpret_cast<const char*>(timestamp_ptr);
-        std::string username = reinterpret_cast<const char*>(username_ptr);
-
-        // Format: [HH:MM:SS] username: message
-        std::string formatted;
-        if (timestamp.length() >= 19) {
-            // Extract time portion (assuming format like "2024-01-01 12:34:56")
-            std::string time_str = timestamp.substr(11, 8);  // Extract HH:MM:SS
-            formatted = "[" + time_str + "] " + username + ": " + content;
-        } else {
-            formatted = "[" + timestamp + "] " + username + ": " + content;
-        }
+    return messages;
+}
 
-        messages.push_back(formatted);
+std::vector<StoredMessage> Database::loadBroadcastsSince(uint64_t since_seq, uint64_t before_seq, int limit) {
+    // Range scan on idx_messages_broadcast_seq
+    std::string query =
+        "SELECT m.seq, m.content, CAST(strftime('%s', m.created_at) AS INTEGER), "
+        "COALESCE(u.username, m.remote_sender), m.sender_id, m.receiver_id "
+        "FROM messages m "
+        "LEFT JOIN users u ON m.sender_id = u.id "
+        "WHERE m.receiver_id = ? AND m.seq > ? AND m.seq < ? "
+        "ORDER BY m.seq ASC "
+        "LIMIT ?";
+
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        return {};
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_bind_int(stmt, 1, BROADCAST_RECEIVER_ID);
+    sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(since_seq));
+    sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(before_seq));
+    sqlite3_bind_int(stmt, 4, limit);
 
-    // Reverse to get chronological order (oldest first)
-    std::reverse(messages.begin(), messages.end());
+    return readMessages(stmt);
+}
 
+std::vector<StoredMessage> Database::loadConversation(int user_a, int user_b, uint64_t before_id, int limit) {
+    // Bounded range scan on idx_messages_conversation
+    std::string query =
+        "SELECT m.id, m.content, CAST(strftime('%s', m.created_at) AS INTEGER), u.username, "
+        "m.sender_id, m.receiver_id "
+        "FROM messages m "
+        "JOIN users u ON m.sender_id = u.id "
+        "WHERE m.conv_lo = ? AND m.conv_hi = ? AND m.id < ? "
+        "ORDER BY m.id DESC "
+        "LIMIT ?";
+
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        return {};
+    }
+
+    sqlite3_bind_int(stmt, 1, std::min(user_a, user_b));
+    sqlite3_bind_int(stmt, 2, std::max(user_a, user_b));
+    sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(std::min<uint64_t>(before_id, INT64_MAX)));
+    sqlite3_bind_int(stmt, 4, limit);
+
+    return readMessages(stmt);
+}
+
+std::vector<StoredMessage> Database::loadRoomMessages(uint32_t room_id, uint64_t before_id, int limit) {
+    // Bounded range scan on idx_messages_room
+    std::string query =
+        "SELECT m.id, m.content, CAST(strftime('%s', m.created_at) AS INTEGER), u.username, "
+        "m.sender_id, m.receiver_id "
+        "FROM messages m "
+        "JOIN users u ON m.sender_id = u.id "
+        "WHERE m.room_id = ? AND m.id < ? "
+        "ORDER BY m.id DESC "
+        "LIMIT ?";
+
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        return {};
+    }
+
+    sqlite3_bind_int64(stmt, 1, room_id);
+    sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(std::min<uint64_t>(before_id, INT64_MAX)));
+    sqlite3_bind_int(stmt, 3, limit);
+
+    std::vector<StoredMessage> messages = readMessages(stmt);
+    for (auto& message : messages) {
+        message.room_id = room_id;
+    }
     return messages;
 }
+
+SearchPage Database::searchMessages(int user_id, const std::vector<std::string>& terms, uint64_t before_id, int limit) {
+    SearchPage page;
+    sqlite3* conn = search_db ? search_db : db;
+    if (terms.empty() || limit <= 0) {
+        return page;
+    }
+
+    // Each term is quoted, so user input is never parsed as FTS5 syntax;
+    // adjacent terms are ANDed
+    std::string match;
+    std::string query =
+        "SELECT COALESCE(m.seq, m.id), m.content, CAST(strftime('%s', m.created_at) AS INTEGER), "
+        "COALESCE(u.username, m.remote_sender), m.sender_id, m.receiver_id, m.id ";
+    if (fts_available) {
+        for (const auto& term : terms) {
+            std::string quoted;
+            for (char c : term) {
+                quoted += c;
+                if (c == '"') {
+                    quoted += '"';
+                }
+            }
+            match += (match.empty() ? "\"" : " \"") + quoted + "\"";
+        }
+        // Driving from the FTS table walks the postings newest first and
+        // stops at the limit instead of materializing every match
+        query +=
+            "FROM messages_fts f "
+            "JOIN messages m ON m.id = f.rowid "
+            "LEFT JOIN users u ON m.sender_id = u.id "
+            "WHERE messages_fts MATCH ?1 AND f.rowid < ?2 ";
+    } else {
+        query +=
+            "FROM messages m "
+            "LEFT JOIN users u ON m.sender_id = u.id "
+            "WHERE m.id < ?2 ";
+        for (size_t i = 0; i < terms.size(); ++i) {
+            query += "AND m.content LIKE ?" + std::to_string(i + 6) + " ";
+        }
+    }
+    query +=
+        "AND m.room_id IS NULL AND (m.receiver_id = ?3 OR m.sender_id = ?4 OR m.receiver_id = ?4) "
+        "ORDER BY " + std::string(fts_available ? "f.rowid" : "m.id") + " DESC "
+        "LIMIT ?5";
+
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(conn, query.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        return page;
+    }
+
+    if (fts_available) {
+        sqlite3_bind_text(stmt, 1, match.c_str(), -1, SQLITE_TRANSIENT);
+    } else {
+        for (size_t i = 0; i < terms.size(); ++i) {
+            std::string pattern = "%" + terms[i] + "%";
+            sqlite3_bind_text(stmt, static_cast<int>(i + 6), pattern.c_str(), -1, SQLITE_TRANSIENT);
+        }
+    }
+    sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(std::min<uint64_t>(before_id, INT64_MAX)));
+    sqlite3_bind_int(stmt, 3, BROADCAST_RECEIVER_ID);
+    sqlite3_bind_int(stmt, 4, user_id);
+    sqlite3_bind_int(stmt, 5, limit);
+
+    std::vector<uint64_t> row_ids;
+    page.messages = readMessages(stmt, &row_ids);
+    if (static_cast<int>(row_ids.size()) == limit) {
+        page.next_before = row_ids.back();
+    }
+    return page;
+}
+
+uint64_t Database::retentionCutoff(bool broadcasts, int64_t min_created_ms, uint64_t keep_messages) {
+    sqlite3* conn = compact_db ? compact_db : db;
+    const std::string stream = broadcasts ? "receiver_id = 0" : "receiver_id != 0";
+    uint64_t cutoff = 0;
+
+    // Ids grow with created_at, so everything up to the cutoff id is expired
+    if (min_created_ms > 0) {
+        std::string query = "SELECT MAX(id) FROM messages WHERE " + stream +
+                            " AND created_at < datetime(?, 'unixepoch')";
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(conn, query.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, min_created_ms / 1000);
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                cutoff = std::max<uint64_t>(cutoff, sqlite3_column_int64(stmt, 0));
+            }
+            sqlite3_finalize(stmt);
+        }
+    }
+    if (keep_messages > 0) {
+        std::string query = "SELECT id FROM messages WHERE " + stream + " ORDER BY id DESC LIMIT 1 OFFSET ?";
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(conn, query.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(std::min<uint64_t>(keep_messages, INT64_MAX)));
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                cutoff = std::max<uint64_t>(cutoff, sqlite3_column_int64(stmt, 0));
+            }
+            sqlite3_finalize(stmt);
+        }
+    }
+    return cutoff;
+}
+
+int Database::deleteMessagesThrough(bool broadcasts, uint64_t cutoff_id, int batch_size) {
+    sqlite3* conn = compact_db ? compact_db : db;
+    const std::string stream = broadcasts ? "receiver_id = 0" : "receiver_id != 0";
+    std::string query = "DELETE FROM messages WHERE id IN (SELECT id FROM messages WHERE " + stream +
+                        " AND id <= ? ORDER BY id LIMIT ?)";
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(conn, query.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        return -1;
+    }
+    sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(std::min<uint64_t>(cutoff_id, INT64_MAX)));
+    sqlite3_bind_int(stmt, 2, batch_size);
+    int deleted = sqlite3_step(stmt) == SQLITE_DONE ? sqlite3_changes(conn) : -1;
+    sqlite3_finalize(stmt);
+    return deleted;
+}
@@ -0,0 +1,146 @@
+#include "fanout_pool.h"
+#include "constants.h"
+#include "flight_recorder.h"
+#include "message_trace.h"
+#include "server_metrics.h"
+#include "socket_utils.h"
+#include <algorithm>
+
+// A fan-out in progress; lives on the caller's stack until every chunk is done
+struct FanoutPool::Batch {
+    const std::vector<FanoutTarget>* targets;
+    const std::string* text;
+    const std::string* frame;
+    std::mutex mtx;
+    std::condition_variable done;
+    size_t pending_chunks = 0;
+    FanoutResult result;
+};
+
+FanoutPool& FanoutPool::instance() {
+    // Never destroyed, so workers can still broadcast during exit
+    static FanoutPool* pool = new FanoutPool(FANOUT_THREADS, FANOUT_PARALLEL_THRESHOLD, FANOUT_MIN_CHUNK);
+    return *pool;
+}
+
+FanoutPool::FanoutPool(size_t thread_count, size_t parallel_threshold, size_t min_chunk)
+    : parallel_threshold(std::max<size_t>(parallel_threshold, 1)), min_chunk(std::max<size_t>(min_chunk, 1)) {
+    for (size_t i = 0; i < thread_count; ++i) {
+        threads.emplace_back(&FanoutPool::run, this);
+    }
+}
+
+FanoutPool::~FanoutPool() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (auto& thread : threads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+}
+
+void FanoutPool::send_chunk(const Chunk& chunk) {
+    Batch& batch = *chunk.batch;
+    const std::vector<FanoutTarget>& targets = *batch.targets;
+    std::vector<size_t> failed;
+    int64_t first_send_ns = 0;
+    int64_t last_send_ns = 0;
+    for (size_t i = chunk.begin; i < chunk.end; ++i) {
+        const FanoutTarget& target = targets[i];
+        if (send_to_client(target.socket, target.binary ? *batch.frame : *batch.text) < 0) {
+            failed.push_back(i);
+            metrics.record_drop(DropLane::SendFailed);
+            flight_record(FlightEvent::Drop, target.socket, static_cast<uint64_t>(DropLane::SendFailed));
+        } else {
+            last_send_ns = trace_now();
+            if (first_send_ns == 0) {
+                first_send_ns = last_send_ns;
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(batch.mtx);
+    FanoutResult& result = batch.result;
+    result.failed.insert(result.failed.end(), failed.begin(), failed.end());
+    if (first_send_ns != 0) {
+        result.first_send_ns = result.first_send_ns == 0 ? first_send_ns : std::min(result.first_send_ns, first_send_ns);
+        result.last_send_ns = std::max(result.last_send_ns, last_send_ns);
+    }
+    if (--batch.pending_chunks == 0) {
+        batch.done.notify_all();
+    }
+}
+
+FanoutResult FanoutPool::deliver(const std::vector<FanoutTarget>& targets, const std::string& text,
+                                 const std::string& frame) {
+    Batch batch;
+    batch.targets = &targets;
+    batch.text = &text;
+    batch.frame = &frame;
+
+    size_t chunk_count = 1;
+    if (!threads.empty() && targets.size() >= parallel_threshold) {
+        chunk_count = std::min(threads.size() + 1, std::max<size_t>(targets.size() / min_chunk, 1));
+    }
+    batch.pending_chunks = chunk_count;
+    batch.result.parallel = chunk_count > 1;
+    if (chunk_count == 1) {
+        send_chunk(Chunk{&batch, 0, targets.size()});
+        return std::move(batch.result);
+    }
+
+    // Contiguous chunks of near-equal size; the caller keeps the first
+    const size_t base = targets.size() / chunk_count;
+    const size_t extra = targets.size() % chunk_count;
+    Chunk own{&batch, 0, base + (extra > 0 ? 1 : 0)};
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        size_t begin = own.end;
+        for (size_t i = 1; i < chunk_count; ++i) {
+            size_t end = begin + base + (i < extra ? 1 : 0);
+            chunks.push_back(Chunk{&batch, begin, end});
+            begin = end;
+        }
+    }
+    cv.notify_all();
+    send_chunk(own);
+
+    // Help with whatever is still queued (ours or another caller's) rather
+    // than wait idle
+    while (true) {
+        Chunk queued{};
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (chunks.empty()) {
+                break;
+            }
+            queued = chunks.front();
+            chunks.pop_front();
+        }
+        send_chunk(queued);
+    }
+    std::unique_lock<std::mutex> lock(batch.mtx);
+    batch.done.wait(lock, [&batch]() { return batch.pending_chunks == 0; });
+    std::sort(batch.result.failed.begin(), batch.result.failed.end());
+    return std::move(batch.result);
+}
+
+void FanoutPool::run() {
+    while (true) {
+        Chunk chunk{};
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [this]() { return stopping || !chunks.empty(); });
+            if (chunks.empty()) {
+                return;
+            }
+            chunk = chunks.front();
+            chunks.pop_front();
+        }
+        send_chunk(chunk);
+    }
+}
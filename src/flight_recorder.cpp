@@ -0,0 +1,188 @@
+#include "flight_recorder.h"
+#include "constants.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static_assert((FLIGHT_RECORDER_EVENTS_PER_THREAD & (FLIGHT_RECORDER_EVENTS_PER_THREAD - 1)) == 0,
+              "FLIGHT_RECORDER_EVENTS_PER_THREAD must be a power of two");
+
+namespace {
+
+struct FlightRing {
+    std::atomic<uint64_t> head{0};  // events ever written; the owner is the only writer
+    std::atomic<bool> claimed{true};
+    FlightRecord records[FLIGHT_RECORDER_EVENTS_PER_THREAD];
+};
+
+// Dump header, followed by one FlightRingHeader + records per ring
+struct FlightDumpHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_bytes;
+    uint32_t ring_capacity;
+    uint32_t ring_count;
+    int64_t monotonic_ns;  // taken at dump time, to map event times to wall time
+    int64_t realtime_ns;
+};
+
+struct FlightRingHeader {
+    uint64_t head;
+    uint32_t index;
+    uint32_t claimed;
+};
+
+// Rings are never freed, so a dump can read them at any time
+std::atomic<FlightRing*> rings[FLIGHT_RECORDER_MAX_THREADS];
+std::atomic<size_t> ring_count{0};
+
+std::atomic_flag dumping = ATOMIC_FLAG_INIT;
+char dump_path[512];
+
+int64_t clock_ns(clockid_t clock) {
+    timespec now;
+    clock_gettime(clock, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+FlightRing* claim_ring() {
+    // Prefer a ring left behind by an exited thread
+    const size_t count = std::min<size_t>(ring_count.load(std::memory_order_acquire), FLIGHT_RECORDER_MAX_THREADS);
+    for (size_t i = 0; i < count; ++i) {
+        FlightRing* ring = rings[i].load(std::memory_order_acquire);
+        bool expected = false;
+        if (ring && ring->claimed.compare_exchange_strong(expected, true)) {
+            return ring;
+        }
+    }
+    const size_t index = ring_count.fetch_add(1);
+    if (index >= FLIGHT_RECORDER_MAX_THREADS) {
+        return nullptr;  // out of rings: this thread goes unrecorded
+    }
+    FlightRing* ring = new FlightRing();
+    rings[index].store(ring, std::memory_order_release);
+    return ring;
+}
+
+struct RingClaim {
+    FlightRing* ring = claim_ring();
+    int32_t tid = static_cast<int32_t>(syscall(SYS_gettid));
+    ~RingClaim() {
+        if (ring) {
+            ring->claimed.store(false, std::memory_order_release);
+        }
+    }
+};
+
+bool write_all(int fd, const void* data, size_t length) {
+    const char* bytes = static_cast<const char*>(data);
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        bytes += written;
+        length -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+void on_signal(int sig) {
+    const int saved_errno = errno;
+    dump_flight_recorder(dump_path);
+    errno = saved_errno;
+    if (sig != SIGUSR2) {
+        // The handler was installed with SA_RESETHAND; die with the original signal
+        raise(sig);
+    }
+}
+
+}  // namespace
+
+void flight_record(FlightEvent event, int socket, uint64_t arg) {
+    thread_local RingClaim claim;
+    FlightRing* ring = claim.ring;
+    if (!ring) {
+        return;
+    }
+    const uint64_t slot = ring->head.load(std::memory_order_relaxed);
+    FlightRecord& record = ring->records[slot & (FLIGHT_RECORDER_EVENTS_PER_THREAD - 1)];
+    record.time_ns = clock_ns(CLOCK_MONOTONIC);
+    record.arg = arg;
+    record.socket = socket;
+    record.tid = claim.tid;
+    record.event = static_cast<uint16_t>(event);
+    ring->head.store(slot + 1, std::memory_order_release);
+}
+
+bool dump_flight_recorder(const char* path) {
+    // One dump at a time; a crash during a SIGUSR2 dump skips its own
+    if (dumping.test_and_set(std::memory_order_acquire)) {
+        return false;
+    }
+    bool ok = false;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        const size_t count = std::min<size_t>(ring_count.load(std::memory_order_acquire), FLIGHT_RECORDER_MAX_THREADS);
+        FlightDumpHeader header;
+        std::memcpy(header.magic, "CHATFLT1", sizeof(header.magic));
+        header.version = 1;
+        header.record_bytes = sizeof(FlightRecord);
+        header.ring_capacity = FLIGHT_RECORDER_EVENTS_PER_THREAD;
+        header.ring_count = static_cast<uint32_t>(count);
+        header.monotonic_ns = clock_ns(CLOCK_MONOTONIC);
+        header.realtime_ns = clock_ns(CLOCK_REALTIME);
+        ok = write_all(fd, &header, sizeof(header));
+        for (size_t i = 0; ok && i < count; ++i) {
+            FlightRing* ring = rings[i].load(std::memory_order_acquire);
+            // A ring still being allocated is written as empty
+            FlightRingHeader ring_header{ring ? ring->head.load(std::memory_order_acquire) : 0,
+                                         static_cast<uint32_t>(i),
+                                         ring && ring->claimed.load(std::memory_order_relaxed) ? 1u : 0u};
+            ok = write_all(fd, &ring_header, sizeof(ring_header));
+            if (ok && ring) {
+                ok = write_all(fd, ring->records, sizeof(ring->records));
+            } else if (ok) {
+                static const FlightRecord empty[64] = {};
+                for (size_t written = 0; ok && written < FLIGHT_RECORDER_EVENTS_PER_THREAD; written += 64) {
+                    ok = write_all(fd, empty, sizeof(FlightRecord) *
+                                   std::min<size_t>(64, FLIGHT_RECORDER_EVENTS_PER_THREAD - written));
+                }
+            }
+        }
+        ok = close(fd) == 0 && ok;
+    }
+    dumping.clear(std::memory_order_release);
+    return ok;
+}
+
+bool install_flight_recorder(const std::string& path) {
+    if (path.size() >= sizeof(dump_path)) {
+        return false;
+    }
+    std::memcpy(dump_path, path.c_str(), path.size() + 1);
+
+    struct sigaction on_demand {};
+    on_demand.sa_handler = on_signal;
+    sigemptyset(&on_demand.sa_mask);
+    on_demand.sa_flags = SA_RESTART;
+    bool ok = sigaction(SIGUSR2, &on_demand, nullptr) == 0;
+
+    struct sigaction on_crash {};
+    on_crash.sa_handler = on_signal;
+    sigemptyset(&on_crash.sa_mask);
+    on_crash.sa_flags = SA_RESETHAND | SA_NODEFER;
+    for (int sig : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT}) {
+        ok = sigaction(sig, &on_crash, nullptr) == 0 && ok;
+    }
+    return ok;
+}
@@ -0,0 +1,100 @@
+#include "history_ring.h"
+#include <algorithm>
+#include <thread>
+
+HistoryRing::HistoryRing(size_t capacity) : slots(std::max<size_t>(capacity, 1)), next_seq(1), published_seq(0), base_seq(0) {}
+
+uint64_t HistoryRing::append(std::string text) {
+    const uint64_t seq = next_seq.fetch_add(1, std::memory_order_relaxed);
+    auto entry = std::make_shared<const HistoryEntry>(HistoryEntry{seq, std::move(text)});
+    std::atomic_store_explicit(&slots[seq % slots.size()], HistoryEntryPtr(std::move(entry)),
+                               std::memory_order_release);
+
+    // Publish in sequence order so readers never see a gap below the
+    // watermark. The wait spans another writer's slot store; callers that
+    // append under their own lock (fan_out_broadcast) never wait here.
+    uint64_t expected = seq - 1;
+    while (!published_seq.compare_exchange_weak(expected, seq, std::memory_order_release,
+                                                std::memory_order_relaxed)) {
+        expected = seq - 1;
+        std::this_thread::yield();
+    }
+    return seq;
+}
+
+std::vector<HistoryEntryPtr> HistoryRing::snapshot(size_t limit) const {
+    const uint64_t last = published_seq.load(std::memory_order_acquire);
+    const uint64_t count = std::min<uint64_t>({last - base_seq, slots.size(), limit});
+    std::vector<HistoryEntryPtr> entries;
+    entries.reserve(count);
+    for (uint64_t seq = last - count + 1; seq <= last; ++seq) {
+        HistoryEntryPtr entry = std::atomic_load_explicit(&slots[seq % slots.size()],
+                                                          std::memory_order_acquire);
+        // A newer writer may already have recycled this slot
+        if (entry && entry->seq == seq) {
+            entries.push_back(std::move(entry));
+        }
+    }
+    return entries;
+}
+
+std::vector<HistoryEntryPtr> HistoryRing::since(uint64_t seq, size_t limit) const {
+    std::vector<HistoryEntryPtr> entries = snapshot();
+    auto first = std::upper_bound(entries.begin(), entries.end(), seq,
+                                  [](uint64_t value, const HistoryEntryPtr& entry) { return value < entry->seq; });
+    entries.erase(entries.begin(), first);
+    if (entries.size() > limit) {
+        entries.resize(limit);
+    }
+    return entries;
+}
+
+uint64_t HistoryRing::last_seq() const {
+    return published_seq.load(std::memory_order_acquire);
+}
+
+uint64_t HistoryRing::oldest_seq() const {
+    const uint64_t last = published_seq.load(std::memory_order_acquire);
+    return last - std::min<uint64_t>(last - base_seq, slots.size()) + 1;
+}
+
+size_t HistoryRing::size() const {
+    return static_cast<size_t>(std::min<uint64_t>(published_seq.load(std::memory_order_acquire) - base_seq, slots.size()));
+}
+
+size_t HistoryRing::capacity() const {
+    return slots.size();
+}
+
+void HistoryRing::reset(uint64_t last_seq) {
+    for (auto& slot : slots) {
+        std::atomic_store(&slot, HistoryEntryPtr());
+    }
+    base_seq = last_seq;
+    next_seq.store(last_seq + 1);
+    published_seq.store(last_seq);
+}
+
+void HistoryRing::restore(std::vector<HistoryEntry> entries) {
+    std::sort(entries.begin(), entries.end(),
+              [](const HistoryEntry& a, const HistoryEntry& b) { return a.seq < b.seq; });
+    if (entries.size() > slots.size()) {
+        entries.erase(entries.begin(), entries.end() - static_cast<std::ptrdiff_t>(slots.size()));
+    }
+    if (entries.empty()) {
+        reset();
+        return;
+    }
+
+    reset(entries.front().seq - 1);
+    const uint64_t last = entries.back().seq;
+    for (auto& entry : entries) {
+        const uint64_t seq = entry.seq;
+        std::atomic_store(&slots[seq % slots.size()],
+                          HistoryEntryPtr(std::make_shared<const HistoryEntry>(std::move(entry))));
+    }
+    // Sequence gaps (e.g. legacy rows) can stretch the range past capacity
+    base_seq = std::max(base_seq, last > slots.size() ? last - slots.size() : 0);
+    next_seq.store(last + 1);
+    published_seq.store(last);
+}
@@ -0,0 +1,353 @@
+#include "history_snapshot.h"
+#include "constants.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Forward declaration of log_message
+void log_message(const std::string& message);
+
+const char* HistorySnapshot::SNAPSHOT_PATH = "chat_history.snap";
+
+namespace {
+
+const char SNAPSHOT_MAGIC[4] = {'C', 'H', 'S', 'N'};
+const uint32_t SNAPSHOT_VERSION = 2;
+const size_t HEADER_SIZE = sizeof(SNAPSHOT_MAGIC) + sizeof(uint32_t);
+const uint32_t MAX_RECORD_SIZE = MAX_MESSAGE_SIZE * 2;
+const size_t RECORD_OVERHEAD = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+
+struct RecordView {
+    uint64_t seq;
+    const char* data;
+    uint32_t length;
+};
+
+bool write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        length -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+void encode_record(std::string& out, uint64_t seq, const char* data, uint32_t length) {
+    out.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    out.append(reinterpret_cast<const char*>(&seq), sizeof(seq));
+    out.append(data, length);
+    out.append(reinterpret_cast<const char*>(&length), sizeof(length));
+}
+
+std::string encode_header() {
+    std::string header(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.append(reinterpret_cast<const char*>(&SNAPSHOT_VERSION), sizeof(SNAPSHOT_VERSION));
+    return header;
+}
+
+// Walks backwards from `end` over complete records and returns views of up
+// to `limit` of them, newest first.
+std::vector<RecordView> scan_tail(const char* base, size_t end, size_t limit) {
+    std::vector<RecordView> records;
+    records.reserve(limit);
+    size_t offset = end;
+    while (records.size() < limit && offset >= HEADER_SIZE + RECORD_OVERHEAD) {
+        uint32_t length;
+        std::memcpy(&length, base + offset - sizeof(uint32_t), sizeof(length));
+        if (length > MAX_RECORD_SIZE || offset < HEADER_SIZE + RECORD_OVERHEAD + length) {
+            break;
+        }
+        size_t start = offset - RECORD_OVERHEAD - length;
+        uint32_t leading;
+        std::memcpy(&leading, base + start, sizeof(leading));
+        if (leading != length) {
+            break;
+        }
+        RecordView record;
+        std::memcpy(&record.seq, base + start + sizeof(uint32_t), sizeof(record.seq));
+        record.data = base + start + sizeof(uint32_t) + sizeof(uint64_t);
+        record.length = length;
+        records.push_back(record);
+        offset = start;
+    }
+    return records;
+}
+
+} // namespace
+
+HistorySnapshot& HistorySnapshot::getInstance() {
+    static HistorySnapshot instance(SNAPSHOT_PATH);
+    return instance;
+}
+
+HistorySnapshot::HistorySnapshot(const std::string& path) : path(path), fd(-1), record_count(0) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (openFile() && !recover()) {
+        closeFile();
+    }
+}
+
+HistorySnapshot::~HistorySnapshot() {
+    closeFile();
+}
+
+bool HistorySnapshot::isOpen() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return fd != -1;
+}
+
+size_t HistorySnapshot::recordCount() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return record_count;
+}
+
+bool HistorySnapshot::openFile() {
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    return fd != -1;
+}
+
+void HistorySnapshot::closeFile() {
+    if (fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+bool HistorySnapshot::writeHeader() {
+    std::string header = encode_header();
+    return write_all(fd, header.data(), header.size());
+}
+
+// Validates the header and drops a torn record left behind by a crash
+// mid-append. Bounded by the compaction threshold, not the database size.
+bool HistorySnapshot::recover() {
+    record_count = 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    if (size == 0) {
+        return writeHeader();
+    }
+
+    void* mapped = size >= HEADER_SIZE ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (mapped == MAP_FAILED) {
+        return ftruncate(fd, 0) == 0 && writeHeader();
+    }
+    const char* base = static_cast<const char*>(mapped);
+    uint32_t version = 0;
+    std::memcpy(&version, base + sizeof(SNAPSHOT_MAGIC), sizeof(version));
+    if (std::memcmp(base, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || version != SNAPSHOT_VERSION) {
+        munmap(mapped, size);
+        return ftruncate(fd, 0) == 0 && writeHeader();
+    }
+
+    size_t offset = HEADER_SIZE;
+    while (offset + RECORD_OVERHEAD <= size) {
+        uint32_t length, trailing;
+        std::memcpy(&length, base + offset, sizeof(length));
+        if (length > MAX_RECORD_SIZE || offset + RECORD_OVERHEAD + length > size) {
+            break;
+        }
+        std::memcpy(&trailing, base + offset + RECORD_OVERHEAD - sizeof(uint32_t) + length, sizeof(trailing));
+        if (trailing != length) {
+            break;
+        }
+        offset += RECORD_OVERHEAD + length;
+        record_count++;
+    }
+    munmap(mapped, size);
+
+    if (offset < size) {
+        return ftruncate(fd, static_cast<off_t>(offset)) == 0;
+    }
+    return true;
+}
+
+bool HistorySnapshot::append(uint64_t seq, const std::string& message) {
+    if (message.length() > MAX_RECORD_SIZE) {
+        return false;
+    }
+    std::string record;
+    record.reserve(message.length() + RECORD_OVERHEAD);
+    encode_record(record, seq, message.data(), static_cast<uint32_t>(message.length()));
+
+    std::lock_guard<std::mutex> lock(mtx);
+    return writeRecords(record, 1);
+}
+
+bool HistorySnapshot::appendBatch(const std::vector<HistoryEntry>& entries) {
+    std::string records;
+    size_t count = 0;
+    for (const auto& entry : entries) {
+        if (entry.text.length() <= MAX_RECORD_SIZE) {
+            encode_record(records, entry.seq, entry.text.data(), static_cast<uint32_t>(entry.text.length()));
+            count++;
+        }
+    }
+    if (count == 0) {
+        return entries.empty();
+    }
+
+    std::lock_guard<std::mutex> lock(mtx);
+    return writeRecords(records, count) && count == entries.size();
+}
+
+// Appends encoded records and compacts once the file has grown past the
+// threshold. Caller must hold mtx.
+bool HistorySnapshot::writeRecords(const std::string& records, size_t count) {
+    if (fd == -1 || !write_all(fd, records.data(), records.size())) {
+        return false;
+    }
+    record_count += count;
+    if (record_count > HISTORY_SNAPSHOT_COMPACT_RECORDS) {
+        return compact();
+    }
+    return true;
+}
+
+std::vector<HistoryEntry> HistorySnapshot::loadRecent(size_t limit) {
+    std::vector<HistoryEntry> messages;
+    std::lock_guard<std::mutex> lock(mtx);
+    struct stat st;
+    if (fd == -1 || limit == 0 || fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) <= HEADER_SIZE) {
+        return messages;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        return messages;
+    }
+
+    auto records = scan_tail(static_cast<const char*>(mapped), size, limit);
+    messages.reserve(records.size());
+    for (auto it = records.rbegin(); it != records.rend(); ++it) {
+        messages.push_back(HistoryEntry{it->seq, std::string(it->data, it->length)});
+    }
+    munmap(mapped, size);
+    return messages;
+}
+
+bool HistorySnapshot::rebuild(const std::vector<HistoryEntry>& entries) {
+    std::string contents = encode_header();
+    size_t records = 0;
+    for (const auto& entry : entries) {
+        if (entry.text.length() <= MAX_RECORD_SIZE) {
+            encode_record(contents, entry.seq, entry.text.data(), static_cast<uint32_t>(entry.text.length()));
+            records++;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mtx);
+    return replaceContents(contents, records);
+}
+
+// Rewrites the file with only the newest MAX_HISTORY_SIZE records. Caller
+// must hold mtx.
+bool HistorySnapshot::compact() {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    auto records = scan_tail(static_cast<const char*>(mapped), size, MAX_HISTORY_SIZE);
+    std::string contents = encode_header();
+    for (auto it = records.rbegin(); it != records.rend(); ++it) {
+        encode_record(contents, it->seq, it->data, it->length);
+    }
+    munmap(mapped, size);
+    return replaceContents(contents, records.size());
+}
+
+// Writes `contents` to a temporary file and renames it over the snapshot so a
+// crash never leaves a half-written file behind. Caller must hold mtx.
+bool HistorySnapshot::replaceContents(const std::string& contents, size_t records) {
+    std::string tmp_path = path + ".tmp";
+    int tmp_fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (tmp_fd == -1) {
+        return false;
+    }
+    bool ok = write_all(tmp_fd, contents.data(), contents.size()) && fsync(tmp_fd) == 0;
+    close(tmp_fd);
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    closeFile();
+    if (!openFile()) {
+        return false;
+    }
+    record_count = records;
+    return true;
+}
+
+SnapshotWriter::SnapshotWriter(HistorySnapshot& snapshot)
+    : snapshot(snapshot), enqueued(0), appended(0), stopping(false) {
+    writer = std::thread(&SnapshotWriter::run, this);
+}
+
+SnapshotWriter::~SnapshotWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    pending_cv.notify_all();
+    if (writer.joinable()) {
+        writer.join();
+    }
+}
+
+void SnapshotWriter::enqueue(uint64_t seq, std::string message) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        pending.push_back(HistoryEntry{seq, std::move(message)});
+        ++enqueued;
+    }
+    pending_cv.notify_one();
+}
+
+void SnapshotWriter::drain() {
+    std::unique_lock<std::mutex> lock(mtx);
+    const uint64_t target = enqueued;
+    drained_cv.wait(lock, [&] { return appended >= target; });
+}
+
+void SnapshotWriter::run() {
+    std::vector<HistoryEntry> batch;
+    std::unique_lock<std::mutex> lock(mtx);
+    while (true) {
+        pending_cv.wait(lock, [this] { return stopping || !pending.empty(); });
+        if (pending.empty()) {
+            return;  // stopping with nothing left to write
+        }
+        batch.swap(pending);
+        lock.unlock();
+        if (!snapshot.appendBatch(batch)) {
+            log_message("Error: Could not append " + std::to_string(batch.size()) + " lines to the history snapshot");
+        }
+        const size_t written = batch.size();
+        batch.clear();
+        lock.lock();
+        appended += written;
+        drained_cv.notify_all();
+    }
+}
+
+SnapshotWriter& snapshot_writer() {
+    // Built from the snapshot first, so the snapshot outlives the writer
+    static SnapshotWriter writer(HistorySnapshot::getInstance());
+    return writer;
+}
@@ -0,0 +1,56 @@
+#include "instrumented_mutex.h"
+#include <memory>
+
+std::atomic<bool> InstrumentedMutex::timing{LOCK_INSTRUMENTATION != 0};
+
+namespace {
+
+// Function-local so global mutexes can register during static initialization
+struct LockRegistry {
+    std::mutex mtx;
+    std::vector<std::unique_ptr<LockStats>> locks;
+};
+
+LockRegistry& registry() {
+    static LockRegistry* instance = new LockRegistry();  // outlives every global mutex
+    return *instance;
+}
+
+}  // namespace
+
+InstrumentedMutex::InstrumentedMutex(const char* name) {
+    LockRegistry& locks = registry();
+    std::lock_guard<std::mutex> lock(locks.mtx);
+    for (const auto& existing : locks.locks) {
+        if (existing->name == name) {
+            stats = existing.get();
+            return;
+        }
+    }
+    locks.locks.push_back(std::make_unique<LockStats>(name));
+    stats = locks.locks.back().get();
+}
+
+void set_lock_instrumentation(bool enabled) {
+    InstrumentedMutex::timing.store(enabled, std::memory_order_relaxed);
+}
+
+bool lock_instrumentation_enabled() {
+    return LOCK_INSTRUMENTATION && InstrumentedMutex::timing.load(std::memory_order_relaxed);
+}
+
+std::vector<LockStatsSnapshot> lock_stats_snapshot() {
+    std::vector<LockStatsSnapshot> snapshots;
+    LockRegistry& locks = registry();
+    std::lock_guard<std::mutex> lock(locks.mtx);
+    for (const auto& stats : locks.locks) {
+        LockStatsSnapshot snapshot;
+        snapshot.name = stats->name;
+        snapshot.acquisitions = stats->acquisitions.load(std::memory_order_relaxed);
+        snapshot.contended = stats->contended.load(std::memory_order_relaxed);
+        stats->wait_ns.merge_into(snapshot.wait_ns);
+        stats->hold_ns.merge_into(snapshot.hold_ns);
+        snapshots.push_back(std::move(snapshot));
+    }
+    return snapshots;
+}
@@ -0,0 +1,108 @@
+#include "inverted_index.h"
+#include <algorithm>
+#include <cctype>
+#include <mutex>
+#include <numeric>
+
+std::vector<std::string> tokenize_search_terms(std::string_view text) {
+    std::vector<std::string> terms;
+    std::string current;
+    auto finish = [&]() {
+        if (!current.empty()) {
+            if (std::find(terms.begin(), terms.end(), current) == terms.end()) {
+                terms.push_back(current);
+            }
+            current.clear();
+        }
+    };
+    for (char ch : text) {
+        unsigned char c = static_cast<unsigned char>(ch);
+        if (c >= 0x80 || std::isalnum(c)) {
+            current += static_cast<char>(c < 0x80 ? std::tolower(c) : c);
+        } else {
+            finish();
+        }
+    }
+    finish();
+    return terms;
+}
+
+uint64_t InvertedIndex::add(const IndexedDoc& doc, std::string_view text) {
+    std::vector<std::string> terms = tokenize_search_terms(text);
+    std::unique_lock<std::shared_mutex> lock(mtx);
+    docs.push_back(doc);
+    const uint32_t doc_id = static_cast<uint32_t>(docs.size());
+    for (auto& term : terms) {
+        postings[std::move(term)].push_back(doc_id);
+    }
+    return doc_id;
+}
+
+void InvertedIndex::finishBulkLoad() {
+    std::unique_lock<std::shared_mutex> lock(mtx);
+    std::vector<uint32_t> order(docs.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+        return docs[a].timestamp_ms < docs[b].timestamp_ms;
+    });
+
+    std::vector<uint32_t> renumbered(docs.size());
+    std::vector<IndexedDoc> sorted;
+    sorted.reserve(docs.size());
+    for (uint32_t rank = 0; rank < order.size(); ++rank) {
+        renumbered[order[rank]] = rank + 1;
+        sorted.push_back(docs[order[rank]]);
+    }
+    docs = std::move(sorted);
+
+    for (auto& [term, ids] : postings) {
+        for (auto& id : ids) {
+            id = renumbered[id - 1];
+        }
+        std::sort(ids.begin(), ids.end());
+    }
+}
+
+std::vector<InvertedIndex::Hit> InvertedIndex::search(const std::vector<std::string>& terms, uint64_t before_id,
+                                                      size_t limit,
+                                                      const std::function<bool(const IndexedDoc&)>& visible) const {
+    std::vector<Hit> hits;
+    if (terms.empty() || limit == 0) {
+        return hits;
+    }
+
+    std::shared_lock<std::shared_mutex> lock(mtx);
+    std::vector<const std::vector<uint32_t>*> lists;
+    for (const auto& term : terms) {
+        auto it = postings.find(term);
+        if (it == postings.end()) {
+            return hits;
+        }
+        lists.push_back(&it->second);
+    }
+    // Walk the rarest term's postings and probe the others
+    std::sort(lists.begin(), lists.end(), [](const auto* a, const auto* b) { return a->size() < b->size(); });
+
+    const auto& driver = *lists.front();
+    auto end = std::lower_bound(driver.begin(), driver.end(), std::min<uint64_t>(before_id, UINT32_MAX + 1ULL));
+    for (auto it = std::make_reverse_iterator(end); it != driver.rend() && hits.size() < limit; ++it) {
+        const uint32_t doc_id = *it;
+        bool match = std::all_of(lists.begin() + 1, lists.end(), [doc_id](const auto* list) {
+            return std::binary_search(list->begin(), list->end(), doc_id);
+        });
+        if (match && visible(docs[doc_id - 1])) {
+            hits.push_back(Hit{doc_id, docs[doc_id - 1]});
+        }
+    }
+    return hits;
+}
+
+size_t InvertedIndex::docCount() const {
+    std::shared_lock<std::shared_mutex> lock(mtx);
+    return docs.size();
+}
+
+size_t InvertedIndex::termCount() const {
+    std::shared_lock<std::shared_mutex> lock(mtx);
+    return postings.size();
+}
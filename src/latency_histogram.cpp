@@ -0,0 +1,70 @@
+#include "latency_histogram.h"
+#include <algorithm>
+#include <cmath>
+
+namespace latency_buckets {
+
+size_t index_of(uint64_t value) {
+    if (value < 2 * SUB_COUNT) {
+        return static_cast<size_t>(value);
+    }
+    const unsigned msb = 63 - static_cast<unsigned>(__builtin_clzll(value));
+    const unsigned exponent = msb - SUB_BITS;
+    if (exponent > MAX_EXPONENT) {
+        return COUNT - 1;
+    }
+    return static_cast<size_t>(exponent * SUB_COUNT + (value >> exponent));
+}
+
+uint64_t lower_bound(size_t index) {
+    if (index < 2 * SUB_COUNT) {
+        return index;
+    }
+    const uint64_t exponent = index / SUB_COUNT - 1;
+    const uint64_t mantissa = index % SUB_COUNT + SUB_COUNT;
+    return mantissa << exponent;
+}
+
+uint64_t upper_bound(size_t index) {
+    if (index < 2 * SUB_COUNT) {
+        return index;
+    }
+    const uint64_t exponent = index / SUB_COUNT - 1;
+    return lower_bound(index) + (1ULL << exponent) - 1;
+}
+
+}  // namespace latency_buckets
+
+double HistogramSnapshot::percentile(double q) const {
+    if (count == 0) {
+        return 0;
+    }
+    const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * count)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+            double mid = (latency_buckets::lower_bound(i) + latency_buckets::upper_bound(i)) / 2.0;
+            return std::min(mid, static_cast<double>(max));
+        }
+    }
+    return static_cast<double>(max);
+}
+
+void LatencyHistogram::record(uint64_t value_us) {
+    counts[latency_buckets::index_of(value_us)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value_us, std::memory_order_relaxed);
+    uint64_t current = max.load(std::memory_order_relaxed);
+    while (value_us > current && !max.compare_exchange_weak(current, value_us, std::memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::merge_into(HistogramSnapshot& snapshot) const {
+    for (size_t i = 0; i < counts.size(); ++i) {
+        snapshot.counts[i] += counts[i].load(std::memory_order_relaxed);
+    }
+    snapshot.count += count.load(std::memory_order_relaxed);
+    snapshot.sum += sum.load(std::memory_order_relaxed);
+    snapshot.max = std::max(snapshot.max, max.load(std::memory_order_relaxed));
+}
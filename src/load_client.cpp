@@ -0,0 +1,192 @@
+#include "load_client.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+int64_t monotonic_ns() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+bool start_connect(int epoll_fd, const sockaddr_in& address, LoadConnection& conn) {
+    conn.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn.fd < 0) {
+        return false;
+    }
+    int one = 1;
+    setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(conn.fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0 &&
+        errno != EINPROGRESS) {
+        close(conn.fd);
+        conn.fd = -1;
+        return false;
+    }
+    conn.want_write = true;
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    event.data.ptr = &conn;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn.fd, &event) == 0;
+}
+
+bool flush_output(LoadConnection& conn) {
+    while (conn.output_offset < conn.output.size()) {
+        ssize_t written = send(conn.fd, conn.output.data() + conn.output_offset,
+                               conn.output.size() - conn.output_offset, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        conn.output_offset += static_cast<size_t>(written);
+    }
+    if (conn.output_offset == conn.output.size()) {
+        conn.output.clear();
+        conn.output_offset = 0;
+    }
+    return true;
+}
+
+void update_interest(int epoll_fd, LoadConnection& conn, bool want_write) {
+    if (want_write == conn.want_write || conn.fd < 0) {
+        return;
+    }
+    conn.want_write = want_write;
+    uint32_t events = EPOLLIN | EPOLLRDHUP;
+    if (want_write) {
+        events |= EPOLLOUT;
+    }
+    epoll_event event{};
+    event.events = events;
+    event.data.ptr = &conn;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &event);
+}
+
+AuthReply classify_auth_reply(const std::string& input) {
+    if (input.find("successful!") != std::string::npos) {
+        return AuthReply::Ok;
+    }
+    if (input.find("Registration failed") != std::string::npos) {
+        return AuthReply::RegistrationFailed;
+    }
+    if (input.find("failed") != std::string::npos || input.find("must log in") != std::string::npos) {
+        return AuthReply::Failed;
+    }
+    return AuthReply::Pending;
+}
+
+void parse_delivery_markers(std::string& input, std::string_view marker, int fields,
+                            const std::function<void(const int64_t* values)>& on_marker) {
+    int64_t values[4] = {};
+    fields = std::clamp(fields, 1, 4);
+    size_t consumed = 0;
+    size_t position = 0;
+    bool partial = false;
+    while ((position = input.find(marker, position)) != std::string::npos) {
+        char* cursor = input.data() + position + marker.size() - 1;
+        bool malformed = false;
+        for (int i = 0; i < fields; ++i) {
+            values[i] = strtoll(cursor + 1, &cursor, 10);
+            if (*cursor != '|') {
+                malformed = true;
+                break;
+            }
+        }
+        if (*cursor == '\0') {
+            partial = true;  // the rest arrives with the next read
+            break;
+        }
+        if (malformed) {
+            position += 1;
+            continue;
+        }
+        on_marker(values);
+        position = static_cast<size_t>(cursor - input.data()) + 1;
+        consumed = position;
+    }
+    if (partial) {
+        input.erase(0, position);
+    } else {
+        // Keep enough bytes for a marker that straddles this read
+        const size_t keep = marker.size() - 1;
+        input.erase(0, std::max(consumed, input.size() >= keep ? input.size() - keep : 0));
+    }
+}
+
+void append_percentiles(std::string& out, const char* name, const HistogramSnapshot& histogram) {
+    char buffer[512];
+    snprintf(buffer, sizeof(buffer),
+             "  \"%s\": {\"count\": %llu, \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+             "\"p99.9\": %.1f, \"p99.99\": %.1f, \"max\": %llu}",
+             name, static_cast<unsigned long long>(histogram.count), histogram.mean(), histogram.percentile(0.50),
+             histogram.percentile(0.90), histogram.percentile(0.99), histogram.percentile(0.999),
+             histogram.percentile(0.9999), static_cast<unsigned long long>(histogram.max));
+    out += buffer;
+}
+
+std::vector<option> target_long_options(std::initializer_list<option> own) {
+    std::vector<option> options = {
+        {"host", required_argument, nullptr, 'h'},
+        {"port", required_argument, nullptr, 'p'},
+        {"user-prefix", required_argument, nullptr, 'u'},
+        {"password", required_argument, nullptr, 'P'},
+        {"help", no_argument, nullptr, '?'},
+    };
+    options.insert(options.end(), own);
+    options.push_back({nullptr, 0, nullptr, 0});
+    return options;
+}
+
+bool parse_target_option(int opt, const char* arg, TargetOptions& target) {
+    switch (opt) {
+        case 'h': target.host = arg; return true;
+        case 'p': target.port = atoi(arg); return true;
+        case 'u': target.user_prefix = arg; return true;
+        case 'P': target.password = arg; return true;
+        default: return false;
+    }
+}
+
+std::string target_usage(const TargetOptions& defaults) {
+    char buffer[512];
+    snprintf(buffer, sizeof(buffer),
+             "  --host ADDR            server address (%s)\n"
+             "  --port N               server port (%d)\n"
+             "  --user-prefix NAME     prefix for usernames (%s)\n"
+             "  --password PW          password used to register or log in (%s)\n",
+             defaults.host.c_str(), defaults.port, defaults.user_prefix.c_str(), defaults.password.c_str());
+    return buffer;
+}
+
+bool resolve_target(const TargetOptions& target, sockaddr_in& address) {
+    address = sockaddr_in{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(target.port));
+    if (inet_pton(AF_INET, target.host.c_str(), &address.sin_addr) != 1) {
+        fprintf(stderr, "invalid address %s\n", target.host.c_str());
+        return false;
+    }
+    return true;
+}
+
+uint64_t raise_descriptor_limit() {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        return 0;
+    }
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    return static_cast<uint64_t>(limit.rlim_cur);
+}
@@ -0,0 +1,485 @@
+// Open-loop load generator for the chat server.
+//
+// A single process drives many authenticated connections from a few epoll
+// reactors (one thread each). Senders fire on a fixed schedule regardless of
+// how quickly the server answers, and every message carries the time it was
+// *scheduled* to be sent, so end-to-end delivery latency is measured from the
+// schedule rather than from the actual write. A stalled server therefore
+// shows up in the percentiles instead of silently lowering the offered load
+// (coordinated omission). Results are printed to stdout as JSON.
+#include "load_client.h"
+#include "latency_histogram.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+struct Options {
+    TargetOptions target{"127.0.0.1", 5555, "lg", "loadgen"};
+    int connections = 100;
+    int senders = -1;          // -1: every connection sends
+    double rate = 1000;        // messages per second across all senders
+    size_t payload = 64;       // message bytes including the timing header
+    double duration = 10;      // measured seconds
+    double warmup = 2;         // unmeasured seconds before the measurement
+    double drain = 2;          // seconds to wait for late deliveries
+    int threads = 4;
+    double connect_rate = 2000;  // new connections per second
+    double connect_timeout = 60;
+};
+
+// Phases driven by the main thread; reactors poll them
+std::atomic<int64_t> schedule_start_ns{0};  // 0 until every connection is set up
+std::atomic<int64_t> measure_start_ns{0};
+std::atomic<int64_t> measure_end_ns{0};
+std::atomic<bool> stopping{false};
+
+const char MARKER[] = "LG|";
+
+enum class ClientState { Connecting, Registering, LoggingIn, Ready, Failed };
+
+struct Client : LoadConnection {
+    int index = 0;
+    bool sender = false;
+    ClientState state = ClientState::Connecting;
+};
+
+struct Totals {
+    uint64_t connected = 0;
+    uint64_t ready = 0;
+    uint64_t failed = 0;
+    uint64_t sent = 0;          // measured messages written
+    uint64_t delivered = 0;     // measured messages received by some client
+    uint64_t send_backlogged = 0;  // measured sends skipped because output was full; counted as undelivered
+    uint64_t send_errors = 0;
+};
+
+class Reactor {
+public:
+    Reactor(const Options& options, const sockaddr_in& address, int first, int count)
+        : options(options), address(address), first(first), count(count) {}
+
+    void run();
+
+    std::atomic<int> settled{0};  // connections that are ready or failed
+    Totals totals;                // read by main after join
+    LatencyHistogram corrected;   // from scheduled send time, microseconds
+    LatencyHistogram uncorrected; // from actual send time
+
+private:
+    void start_connections(int64_t now);
+    void handle_event(Client& client, uint32_t events);
+    void handle_input(Client& client);
+    void parse_deliveries(Client& client, int64_t received_at);
+    void send_scheduled(Client& client, int64_t intended);
+    void queue_output(Client& client, const std::string& data);
+    void flush_output(Client& client);
+    void fail(Client& client);
+
+    const Options& options;
+    const sockaddr_in address;
+    const int first;
+    const int count;
+    int epoll_fd = -1;
+    int next_to_connect = 0;
+    int64_t connect_started_ns = 0;
+    std::vector<std::unique_ptr<Client>> clients;
+
+    using Due = std::pair<int64_t, Client*>;
+    std::priority_queue<Due, std::vector<Due>, std::greater<Due>> schedule;
+    int64_t send_interval_ns = 0;
+};
+
+void Reactor::run() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        return;
+    }
+    clients.reserve(count);
+    connect_started_ns = monotonic_ns();
+
+    const int total_senders = options.senders < 0 ? options.connections : options.senders;
+    if (total_senders > 0) {
+        send_interval_ns = static_cast<int64_t>(1e9 * total_senders / options.rate);
+    }
+    bool scheduled = false;
+    std::mt19937_64 rng(first);
+
+    epoll_event events[256];
+    while (!stopping.load(std::memory_order_relaxed)) {
+        int64_t now = monotonic_ns();
+        if (next_to_connect < count) {
+            start_connections(now);
+        }
+
+        const int64_t start = schedule_start_ns.load(std::memory_order_acquire);
+        if (start != 0 && !scheduled) {
+            // Spread each sender's first message uniformly over one interval
+            std::uniform_int_distribution<int64_t> offset(0, std::max<int64_t>(send_interval_ns - 1, 0));
+            for (auto& client : clients) {
+                if (client->sender && client->state == ClientState::Ready) {
+                    schedule.push({start + offset(rng), client.get()});
+                }
+            }
+            scheduled = true;
+        }
+        const int64_t end = measure_end_ns.load(std::memory_order_relaxed);
+        while (!schedule.empty() && schedule.top().first <= now) {
+            auto [intended, client] = schedule.top();
+            schedule.pop();
+            if (client->state != ClientState::Ready || (end != 0 && intended >= end)) {
+                continue;
+            }
+            send_scheduled(*client, intended);
+            schedule.push({intended + send_interval_ns, client});
+        }
+
+        int timeout_ms = 5;
+        if (!schedule.empty()) {
+            const int64_t wait_ns = schedule.top().first - monotonic_ns();
+            timeout_ms = static_cast<int>(std::clamp<int64_t>((wait_ns + 999999) / 1000000, 0, 5));
+        }
+        const int ready = epoll_wait(epoll_fd, events, 256, timeout_ms);
+        for (int i = 0; i < ready; ++i) {
+            handle_event(*static_cast<Client*>(events[i].data.ptr), events[i].events);
+        }
+    }
+
+    for (auto& client : clients) {
+        if (client->fd >= 0) {
+            close(client->fd);
+        }
+    }
+    close(epoll_fd);
+}
+
+void Reactor::start_connections(int64_t now) {
+    // Pace connects so the server's accept backlog is not flooded
+    const double per_reactor_rate = options.connect_rate / std::max(options.threads, 1);
+    const int allowed = static_cast<int>((now - connect_started_ns) / 1e9 * per_reactor_rate) + 1;
+    while (next_to_connect < std::min(allowed, count)) {
+        auto client = std::make_unique<Client>();
+        client->index = first + next_to_connect++;
+        const int total_senders = options.senders < 0 ? options.connections : options.senders;
+        client->sender = client->index < total_senders;
+        Client& c = *client;
+        clients.push_back(std::move(client));
+        if (!start_connect(epoll_fd, address, c)) {
+            fail(c);
+        }
+    }
+}
+
+void Reactor::handle_event(Client& client, uint32_t events) {
+    if (client.state == ClientState::Failed) {
+        return;
+    }
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        fail(client);
+        return;
+    }
+    if ((events & EPOLLOUT) && client.state == ClientState::Connecting) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(client.fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+            fail(client);
+            return;
+        }
+        ++totals.connected;
+        client.state = ClientState::Registering;
+        queue_output(client, "/register " + options.target.user_prefix + std::to_string(client.index) + " " +
+                                 options.target.password);
+    }
+    if (events & EPOLLOUT) {
+        flush_output(client);
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP)) {
+        handle_input(client);
+    }
+}
+
+void Reactor::handle_input(Client& client) {
+    char buffer[16384];
+    while (client.state != ClientState::Failed) {
+        ssize_t received = recv(client.fd, buffer, sizeof(buffer), 0);
+        if (received == 0) {
+            fail(client);
+            return;
+        }
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fail(client);
+            }
+            return;
+        }
+        const int64_t received_at = monotonic_ns();
+        client.input.append(buffer, static_cast<size_t>(received));
+
+        if (client.state == ClientState::Registering || client.state == ClientState::LoggingIn) {
+            const AuthReply reply = classify_auth_reply(client.input);
+            if (reply == AuthReply::Ok) {
+                client.state = ClientState::Ready;
+                ++totals.ready;
+                settled.fetch_add(1, std::memory_order_release);
+            } else if (reply == AuthReply::RegistrationFailed && client.state == ClientState::Registering) {
+                // Already registered by an earlier run
+                client.state = ClientState::LoggingIn;
+                client.input.clear();
+                queue_output(client, "/login " + options.target.user_prefix + std::to_string(client.index) + " " +
+                                         options.target.password);
+            } else if (reply != AuthReply::Pending) {
+                fail(client);
+                return;
+            }
+            if (client.state != ClientState::Ready) {
+                continue;
+            }
+            client.input.clear();  // history replay after login is not measured
+            continue;
+        }
+        parse_deliveries(client, received_at);
+    }
+}
+
+void Reactor::parse_deliveries(Client& client, int64_t received_at) {
+    const int64_t begin = measure_start_ns.load(std::memory_order_relaxed);
+    const int64_t end = measure_end_ns.load(std::memory_order_relaxed);
+    // LG|<scheduled ns>|<sent ns>|
+    parse_delivery_markers(client.input, MARKER, 2, [&](const int64_t* values) {
+        const int64_t intended = values[0];
+        if (begin != 0 && intended >= begin && intended < end) {
+            ++totals.delivered;
+            corrected.record(static_cast<uint64_t>(std::max<int64_t>(received_at - intended, 0) / 1000));
+            uncorrected.record(static_cast<uint64_t>(std::max<int64_t>(received_at - values[1], 0) / 1000));
+        }
+    });
+}
+
+void Reactor::send_scheduled(Client& client, int64_t intended) {
+    const int64_t begin = measure_start_ns.load(std::memory_order_relaxed);
+    const int64_t end = measure_end_ns.load(std::memory_order_relaxed);
+    const bool measured = begin != 0 && intended >= begin && intended < end;
+    if (client.pending_output() > LOAD_MAX_PENDING_OUTPUT) {
+        // The server is not reading fast enough. Skipping keeps memory bounded;
+        // the skipped message still counts towards the expected deliveries, so
+        // it lowers the delivery ratio rather than vanishing from the results
+        if (measured) {
+            ++totals.send_backlogged;
+        }
+        return;
+    }
+    std::string message = MARKER + std::to_string(intended) + "|" + std::to_string(monotonic_ns()) + "|";
+    if (message.size() < options.payload) {
+        message.append(options.payload - message.size(), 'x');
+    }
+    if (measured) {
+        ++totals.sent;
+    }
+    queue_output(client, message);
+}
+
+void Reactor::queue_output(Client& client, const std::string& data) {
+    client.output.append(data);
+    flush_output(client);
+}
+
+void Reactor::flush_output(Client& client) {
+    if (!::flush_output(client)) {
+        ++totals.send_errors;
+        fail(client);
+        return;
+    }
+    update_interest(epoll_fd, client, client.state == ClientState::Connecting || !client.output.empty());
+}
+
+void Reactor::fail(Client& client) {
+    if (client.state == ClientState::Failed) {
+        return;
+    }
+    const bool was_setting_up = client.state != ClientState::Ready;
+    client.state = ClientState::Failed;
+    ++totals.failed;
+    if (was_setting_up) {
+        settled.fetch_add(1, std::memory_order_release);
+    }
+    if (client.fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client.fd, nullptr);
+        close(client.fd);
+        client.fd = -1;
+    }
+}
+
+void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "%s"
+            "  --connections N        authenticated connections to open (100)\n"
+            "  --senders N            how many of them send; every broadcast reaches all\n"
+            "                         other connections, so fan-out is connections - 1 (all)\n"
+            "  --rate R               messages per second across all senders (1000)\n"
+            "  --payload BYTES        message size including the timing header (64)\n"
+            "  --duration S           measured seconds (10)\n"
+            "  --warmup S             unmeasured seconds before measuring (2)\n"
+            "  --drain S              seconds to wait for late deliveries (2)\n"
+            "  --threads N            epoll reactor threads (4)\n"
+            "  --connect-rate R       new connections per second (2000)\n"
+            "  --connect-timeout S    give up waiting for logins after S seconds (60)\n",
+            program, target_usage(Options().target).c_str());
+}
+
+bool parse_options(int argc, char** argv, Options& options) {
+    static const std::vector<option> long_options = target_long_options({
+        {"connections", required_argument, nullptr, 'c'},  {"senders", required_argument, nullptr, 's'},
+        {"rate", required_argument, nullptr, 'r'},         {"payload", required_argument, nullptr, 'b'},
+        {"duration", required_argument, nullptr, 'd'},     {"warmup", required_argument, nullptr, 'w'},
+        {"drain", required_argument, nullptr, 'D'},        {"threads", required_argument, nullptr, 't'},
+        {"connect-rate", required_argument, nullptr, 'C'}, {"connect-timeout", required_argument, nullptr, 'T'}});
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options.data(), nullptr)) != -1) {
+        if (parse_target_option(opt, optarg, options.target)) {
+            continue;
+        }
+        switch (opt) {
+            case 'c': options.connections = atoi(optarg); break;
+            case 's': options.senders = atoi(optarg); break;
+            case 'r': options.rate = atof(optarg); break;
+            case 'b': options.payload = static_cast<size_t>(atol(optarg)); break;
+            case 'd': options.duration = atof(optarg); break;
+            case 'w': options.warmup = atof(optarg); break;
+            case 'D': options.drain = atof(optarg); break;
+            case 't': options.threads = atoi(optarg); break;
+            case 'C': options.connect_rate = atof(optarg); break;
+            case 'T': options.connect_timeout = atof(optarg); break;
+            default: return false;
+        }
+    }
+    if (options.connections < 2 || options.threads < 1 || options.rate <= 0 || options.duration <= 0 ||
+        options.connect_rate <= 0 || options.senders > options.connections) {
+        fprintf(stderr, "connections must be >= 2; threads, rate, duration and connect-rate must be positive; "
+                        "senders may not exceed connections\n");
+        return false;
+    }
+    options.threads = std::min(options.threads, options.connections);
+    return true;
+}
+
+void sleep_seconds(double seconds) {
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    // Each connection needs a descriptor; take the hard limit
+    const uint64_t descriptors = raise_descriptor_limit();
+    if (descriptors != 0 && descriptors < static_cast<uint64_t>(options.connections) + 64) {
+        fprintf(stderr, "warning: descriptor limit %llu is below %d connections\n",
+                static_cast<unsigned long long>(descriptors), options.connections);
+    }
+
+    sockaddr_in address;
+    if (!resolve_target(options.target, address)) {
+        return 2;
+    }
+
+    std::vector<std::unique_ptr<Reactor>> reactors;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < options.threads; ++t) {
+        const int first = options.connections * t / options.threads;
+        const int next = options.connections * (t + 1) / options.threads;
+        reactors.push_back(std::make_unique<Reactor>(options, address, first, next - first));
+    }
+    for (auto& reactor : reactors) {
+        threads.emplace_back(&Reactor::run, reactor.get());
+    }
+
+    // Wait for every connection to log in or fail
+    const int64_t setup_deadline = monotonic_ns() + static_cast<int64_t>(options.connect_timeout * 1e9);
+    const int64_t setup_started = monotonic_ns();
+    int settled = 0;
+    while (monotonic_ns() < setup_deadline) {
+        settled = 0;
+        for (auto& reactor : reactors) {
+            settled += reactor->settled.load(std::memory_order_acquire);
+        }
+        if (settled >= options.connections) {
+            break;
+        }
+        sleep_seconds(0.05);
+    }
+    const double setup_seconds = (monotonic_ns() - setup_started) / 1e9;
+    fprintf(stderr, "loadgen: %d/%d connections settled in %.1fs; running %.0fs warmup + %.0fs measured\n", settled,
+            options.connections, setup_seconds, options.warmup, options.duration);
+
+    const int64_t start = monotonic_ns() + 10000000;
+    measure_start_ns.store(start + static_cast<int64_t>(options.warmup * 1e9));
+    measure_end_ns.store(start + static_cast<int64_t>((options.warmup + options.duration) * 1e9));
+    schedule_start_ns.store(start, std::memory_order_release);
+    sleep_seconds(0.01 + options.warmup + options.duration + options.drain);
+    stopping = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    Totals totals;
+    HistogramSnapshot corrected, uncorrected;
+    for (auto& reactor : reactors) {
+        totals.connected += reactor->totals.connected;
+        totals.ready += reactor->totals.ready;
+        totals.failed += reactor->totals.failed;
+        totals.sent += reactor->totals.sent;
+        totals.delivered += reactor->totals.delivered;
+        totals.send_backlogged += reactor->totals.send_backlogged;
+        totals.send_errors += reactor->totals.send_errors;
+        reactor->corrected.merge_into(corrected);
+        reactor->uncorrected.merge_into(uncorrected);
+    }
+
+    // Broadcasts go to every other logged-in connection, including the ones
+    // the schedule called for but output backlog skipped
+    const uint64_t expected = (totals.sent + totals.send_backlogged) * (totals.ready > 0 ? totals.ready - 1 : 0);
+    const int senders = options.senders < 0 ? options.connections : options.senders;
+    std::string out = "{\n";
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer),
+             "  \"connections\": %d,\n  \"senders\": %d,\n  \"threads\": %d,\n  \"target_rate\": %.1f,\n"
+             "  \"payload_bytes\": %zu,\n  \"duration_s\": %.1f,\n  \"setup_s\": %.2f,\n  \"connected\": %llu,\n"
+             "  \"authenticated\": %llu,\n  \"failed\": %llu,\n  \"sent\": %llu,\n  \"achieved_rate\": %.1f,\n"
+             "  \"delivered\": %llu,\n  \"expected_deliveries\": %llu,\n  \"delivery_ratio\": %.4f,\n"
+             "  \"send_backlogged\": %llu,\n  \"send_errors\": %llu,\n",
+             options.connections, senders, options.threads, options.rate, options.payload, options.duration,
+             setup_seconds, static_cast<unsigned long long>(totals.connected),
+             static_cast<unsigned long long>(totals.ready), static_cast<unsigned long long>(totals.failed),
+             static_cast<unsigned long long>(totals.sent), totals.sent / options.duration,
+             static_cast<unsigned long long>(totals.delivered), static_cast<unsigned long long>(expected),
+             expected ? static_cast<double>(totals.delivered) / expected : 0.0,
+             static_cast<unsigned long long>(totals.send_backlogged),
+             static_cast<unsigned long long>(totals.send_errors));
+    out += buffer;
+    append_percentiles(out, "latency_us", corrected);
+    out += ",\n";
+    append_percentiles(out, "uncorrected_latency_us", uncorrected);
+    out += "\n}\n";
+    fputs(out.c_str(), stdout);
+    return totals.ready >= 2 ? 0 : 1;
+}
@@ -0,0 +1,314 @@
+#include "logger.h"
+#include "constants.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+namespace {
+
+struct RecordHeader {
+    int64_t time_ns;
+    uint32_t length;
+    LogLevel level;
+};
+
+std::atomic<uint64_t> next_logger_id{1};
+
+int64_t wall_clock_ns() {
+    // The coarse clock is a vDSO read of the last tick: far cheaper than
+    // CLOCK_REALTIME and precise enough for log ordering
+    timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+const char* level_tag(LogLevel level) {
+    switch (level) {
+        case LogLevel::Debug: return "DEBUG: ";
+        case LogLevel::Warn: return "WARN: ";
+        case LogLevel::Error: return "ERROR: ";
+        default: return "";
+    }
+}
+
+}  // namespace
+
+// Single-producer (owning thread) / single-consumer (flusher) byte ring.
+// head and tail only ever grow; positions are taken modulo the size.
+struct Logger::ThreadBuffer {
+    explicit ThreadBuffer(size_t size) : data(size) {}
+
+    void copy_in(uint64_t position, const void* bytes, size_t length) {
+        const size_t offset = position % data.size();
+        const size_t first = std::min(length, data.size() - offset);
+        std::memcpy(data.data() + offset, bytes, first);
+        std::memcpy(data.data(), static_cast<const char*>(bytes) + first, length - first);
+    }
+
+    void copy_out(uint64_t position, void* bytes, size_t length) const {
+        const size_t offset = position % data.size();
+        const size_t first = std::min(length, data.size() - offset);
+        std::memcpy(bytes, data.data() + offset, first);
+        std::memcpy(static_cast<char*>(bytes) + first, data.data(), length - first);
+    }
+
+    std::vector<char> data;
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    std::atomic<bool> retired{false};  // owning thread exited
+};
+
+Logger& Logger::instance() {
+    static Logger* logger = []() {
+        auto* created = new Logger(stdout, LOG_THREAD_BUFFER_BYTES);
+        created->set_level(static_cast<LogLevel>(LOG_MIN_LEVEL));
+        std::atexit([]() { Logger::instance().shutdown(); });
+        return created;
+    }();
+    return *logger;
+}
+
+Logger::Logger(FILE* sink, size_t thread_buffer_bytes)
+    : sink(sink),
+      buffer_bytes(std::max<size_t>(thread_buffer_bytes, 4096)),
+      id(next_logger_id.fetch_add(1)),
+      min_level(LogLevel::Info),
+      stopped(false),
+      dropped_count(0),
+      reported_dropped(0),
+      stopping(false),
+      flush_requests(0),
+      flushes_done(0),
+      cached_second(-1),
+      repeat_window(-1) {
+    cached_prefix[0] = '\0';
+    flusher = std::thread(&Logger::run, this);
+}
+
+Logger::~Logger() {
+    shutdown();
+}
+
+Logger::ThreadBuffer& Logger::local_buffer() {
+    // Buffers are keyed by logger id rather than address, so a new logger at
+    // a recycled address never inherits a stale buffer
+    struct Holder {
+        std::vector<std::pair<uint64_t, std::shared_ptr<ThreadBuffer>>> buffers;
+        ~Holder() {
+            for (auto& entry : buffers) {
+                entry.second->retired.store(true, std::memory_order_release);
+            }
+        }
+    };
+    thread_local Holder holder;
+    for (auto& entry : holder.buffers) {
+        if (entry.first == id) {
+            return *entry.second;
+        }
+    }
+    auto buffer = std::make_shared<ThreadBuffer>(buffer_bytes);
+    {
+        std::lock_guard<std::mutex> lock(buffers_mtx);
+        buffers.push_back(buffer);
+    }
+    holder.buffers.emplace_back(id, buffer);
+    return *buffer;
+}
+
+void Logger::log(LogLevel level, std::string_view message) {
+    if (level < min_level.load(std::memory_order_relaxed)) {
+        return;
+    }
+    if (stopped.load(std::memory_order_acquire)) {
+        write_direct(level, message);
+        return;
+    }
+
+    RecordHeader header{wall_clock_ns(), static_cast<uint32_t>(std::min<size_t>(message.size(), LOG_MAX_LINE_BYTES)),
+                        level};
+    ThreadBuffer& buffer = local_buffer();
+    const uint64_t head = buffer.head.load(std::memory_order_relaxed);
+    const uint64_t tail = buffer.tail.load(std::memory_order_acquire);
+    const size_t needed = sizeof(header) + header.length;
+    if (head - tail + needed > buffer.data.size()) {
+        dropped_count.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    buffer.copy_in(head, &header, sizeof(header));
+    buffer.copy_in(head + sizeof(header), message.data(), header.length);
+    buffer.head.store(head + needed, std::memory_order_release);
+}
+
+void Logger::flush() {
+    if (stopped.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(direct_mtx);
+        fflush(sink);
+        return;
+    }
+    std::unique_lock<std::mutex> lock(flush_mtx);
+    const uint64_t target = ++flush_requests;
+    flush_cv.notify_one();
+    flushed_cv.wait(lock, [&]() { return flushes_done >= target; });
+}
+
+void Logger::shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(flush_mtx);
+        if (stopping) {
+            return;
+        }
+        stopping = true;
+    }
+    {
+        // New records go straight to the sink, but only once the flusher has
+        // drained what is queued: holding direct_mtx keeps them behind older
+        // records and off format_line while the flusher still uses it
+        std::lock_guard<std::mutex> direct(direct_mtx);
+        stopped.store(true, std::memory_order_release);
+        flush_cv.notify_all();
+        if (flusher.joinable()) {
+            flusher.join();
+        }
+    }
+    {
+        // Release any flush() that raced with the final drain
+        std::lock_guard<std::mutex> lock(flush_mtx);
+        flushes_done = UINT64_MAX;
+    }
+    flushed_cv.notify_all();
+}
+
+void Logger::run() {
+    while (true) {
+        uint64_t target;
+        bool exiting;
+        {
+            std::unique_lock<std::mutex> lock(flush_mtx);
+            flush_cv.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS),
+                              [this]() { return stopping || flush_requests > flushes_done; });
+            target = flush_requests;
+            exiting = stopping;
+        }
+        drain(exiting);
+        {
+            std::lock_guard<std::mutex> lock(flush_mtx);
+            flushes_done = std::max(flushes_done, target);
+        }
+        flushed_cv.notify_all();
+        if (exiting) {
+            return;
+        }
+    }
+}
+
+size_t Logger::drain(bool closing) {
+    std::vector<std::shared_ptr<ThreadBuffer>> snapshot;
+    {
+        std::lock_guard<std::mutex> lock(buffers_mtx);
+        snapshot = buffers;
+    }
+
+    std::vector<Record> records;
+    for (const auto& buffer : snapshot) {
+        // Read retired before head so a buffer is only removed once empty
+        const bool retired = buffer->retired.load(std::memory_order_acquire);
+        const uint64_t head = buffer->head.load(std::memory_order_acquire);
+        uint64_t tail = buffer->tail.load(std::memory_order_relaxed);
+        while (tail < head) {
+            RecordHeader header;
+            buffer->copy_out(tail, &header, sizeof(header));
+            Record record{header.time_ns, header.level, std::string(header.length, '\0')};
+            buffer->copy_out(tail + sizeof(header), record.text.data(), header.length);
+            records.push_back(std::move(record));
+            tail += sizeof(header) + header.length;
+        }
+        buffer->tail.store(tail, std::memory_order_release);
+        if (retired) {
+            std::lock_guard<std::mutex> lock(buffers_mtx);
+            buffers.erase(std::remove(buffers.begin(), buffers.end(), buffer), buffers.end());
+        }
+    }
+
+    // Threads drain independently; restore global time order
+    std::stable_sort(records.begin(), records.end(),
+                     [](const Record& a, const Record& b) { return a.time_ns < b.time_ns; });
+    write_records(records, closing);
+    return records.size();
+}
+
+void Logger::write_records(std::vector<Record>& records, bool closing) {
+    std::string out;
+    auto close_window = [&](int64_t time_ns) {
+        for (const auto& [text, repeat] : repeats) {
+            if (repeat.count > LOG_REPEAT_LIMIT) {
+                format_line(out, Record{time_ns, repeat.level,
+                                        "suppressed " + std::to_string(repeat.count - LOG_REPEAT_LIMIT) +
+                                            " repeats of: " + text});
+            }
+        }
+        repeats.clear();
+    };
+
+    for (const auto& record : records) {
+        const int64_t window = record.time_ns / 1000000000;
+        if (window != repeat_window) {
+            close_window(record.time_ns);
+            repeat_window = window;
+        }
+        Repeat& repeat = repeats.try_emplace(record.text, Repeat{record.level, 0}).first->second;
+        repeat.level = std::max(repeat.level, record.level);
+        if (++repeat.count <= LOG_REPEAT_LIMIT) {
+            format_line(out, record);
+        }
+    }
+    // Report suppressions once their second has passed, even if logging stops
+    if (!repeats.empty() && (closing || wall_clock_ns() / 1000000000 != repeat_window)) {
+        close_window(wall_clock_ns());
+        repeat_window = -1;
+    }
+
+    const uint64_t dropped_now = dropped_count.load(std::memory_order_relaxed);
+    if (dropped_now != reported_dropped) {
+        format_line(out, Record{wall_clock_ns(), LogLevel::Warn,
+                                "log buffer full, dropped " + std::to_string(dropped_now - reported_dropped) +
+                                    " messages"});
+        reported_dropped = dropped_now;
+    }
+
+    if (!out.empty()) {
+        fwrite(out.data(), 1, out.size(), sink);
+        fflush(sink);
+    }
+}
+
+void Logger::format_line(std::string& out, const Record& record) {
+    const int64_t second = record.time_ns / 1000000000;
+    if (second != cached_second) {
+        std::time_t seconds = static_cast<std::time_t>(second);
+        std::tm local;
+        localtime_r(&seconds, &local);
+        std::strftime(cached_prefix, sizeof(cached_prefix), "[%H:%M:%S] ", &local);
+        cached_second = second;
+    }
+    out += cached_prefix;
+    out += level_tag(record.level);
+    out += record.text;
+    out += '\n';
+}
+
+void Logger::write_direct(LogLevel level, std::string_view message) {
+    std::lock_guard<std::mutex> lock(direct_mtx);
+    std::string out;
+    format_line(out, Record{wall_clock_ns(), level, std::string(message)});
+    fwrite(out.data(), 1, out.size(), sink);
+    fflush(sink);
+}
+
+void log_at(LogLevel level, std::string_view message) {
+    Logger::instance().log(level, message);
+}
+
+void log_message(const std::string& message) {
+    Logger::instance().log(LogLevel::Info, message);
+}
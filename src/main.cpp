@@ -5,51 +5,199 @@
 #include "command_processor.h"
 #include "socket_utils.h"
 #include "database.h"
+#include "history_snapshot.h"
+#include "message_store.h"
+#include "message_compactor.h"
+#include "admin_server.h"
+#include "logger.h"
+#include "flight_recorder.h"
+#include "traffic_capture.h"
 #include "server.h"
+#include "cluster.h"
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <thread>
 #include <vector>
 #include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <mutex>
 #include "constants.h"
 
 
-int main() {
+struct ServerOptions {
+    int port = PORT;
+    int workers = WORKER_THREADS;
+    int admin_port = ADMIN_PORT;  // 0 disables the admin endpoint
+    int node_id = 0;              // 0 runs alone, outside any cluster
+    int cluster_port = CLUSTER_PORT;
+    std::string cluster_bind = CLUSTER_BIND_ADDRESS;
+    std::string cluster_secret_file;  // required with --node-id
+    std::vector<PeerAddress> peers;
+};
+
+static void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --port N          chat port (%d)\n"
+            "  --workers N       message worker threads (%d)\n"
+            "  --admin-port N    metrics endpoint port, 0 to disable (%d)\n"
+            "  --node-id N       join a cluster as node N (1-65535)\n"
+            "  --cluster-port N  port cluster peers link to (%d)\n"
+            "  --cluster-bind ADDR\n"
+            "                    address the cluster port listens on (%s)\n"
+            "  --cluster-secret-file PATH\n"
+            "                    file holding the secret every node shares; required with --node-id\n"
+            "  --peer N@HOST:PORT\n"
+            "                    node N's cluster port; repeat for each node\n",
+            program, PORT, WORKER_THREADS, ADMIN_PORT, CLUSTER_PORT, CLUSTER_BIND_ADDRESS);
+}
+
+static bool parse_options(int argc, char** argv, ServerOptions& options) {
+    static const option long_options[] = {
+        {"port", required_argument, nullptr, 'p'},       {"workers", required_argument, nullptr, 'w'},
+        {"admin-port", required_argument, nullptr, 'a'}, {"node-id", required_argument, nullptr, 'n'},
+        {"cluster-port", required_argument, nullptr, 'c'}, {"peer", required_argument, nullptr, 'e'},
+        {"cluster-bind", required_argument, nullptr, 'b'}, {"cluster-secret-file", required_argument, nullptr, 's'},
+        {"help", no_argument, nullptr, '?'},             {nullptr, 0, nullptr, 0}};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'p': options.port = atoi(optarg); break;
+            case 'w': options.workers = atoi(optarg); break;
+            case 'a': options.admin_port = atoi(optarg); break;
+            case 'n': options.node_id = atoi(optarg); break;
+            case 'c': options.cluster_port = atoi(optarg); break;
+            case 'b': options.cluster_bind = optarg; break;
+            case 's': options.cluster_secret_file = optarg; break;
+            case 'e': {
+                PeerAddress peer;
+                if (!parse_peer_address(optarg, peer)) {
+                    return false;
+                }
+                options.peers.push_back(peer);
+                break;
+            }
+            default: return false;
+        }
+    }
+    return optind == argc && options.port > 0 && options.port < 65536 && options.workers > 0 &&
+           options.admin_port >= 0 && options.admin_port < 65536 && options.node_id >= 0 &&
+           options.node_id < 65536 && options.cluster_port > 0 && options.cluster_port < 65536 &&
+           (options.node_id > 0 || options.peers.empty()) &&
+           (options.node_id == 0 || !options.cluster_secret_file.empty());
+}
+
+int main(int argc, char** argv) {
+    ServerOptions options;
+    if (!parse_options(argc, argv, options)) {
+        usage(argv[0]);
+        return 2;
+    }
+
     try {
-        // Initialize database and load recent messages
-        Database& db = Database::getInstance();
-        std::vector<std::string> recent_messages = db.loadRecentMessages(MAX_HISTORY_SIZE);
-        
-        // Load recent messages into in-memory chat history
-        {
-            std::lock_guard<std::mutex> lock(history_mtx);
-            chat_history = recent_messages;
+        if (install_flight_recorder(FLIGHT_RECORDER_DUMP_PATH)) {
+            log_message("Flight recorder dumps to " + std::string(FLIGHT_RECORDER_DUMP_PATH) + " on SIGUSR2 or crash");
+        } else {
+            log_at(LogLevel::Warn, "Could not install flight recorder signal handlers");
+        }
+
+        if (TRAFFIC_CAPTURE_ON_STARTUP) {
+            const std::string capture_path = capture_file_path("");
+            if (TrafficCapture::instance().start(capture_path)) {
+                log_message("Capturing client traffic to " + capture_path);
+            }
+        }
+
+        // Initialize database and load recent messages. The mmap'd snapshot is
+        // the fast path; the message store is only queried to rebuild a
+        // missing snapshot.
+        Database::getInstance();
+        MessageStore& store = message_store();
+        log_message("Using " + std::string(store.name()) + " message store");
+        HistorySnapshot& snapshot = HistorySnapshot::getInstance();
+        std::vector<HistoryEntry> recent_messages;
+        if (snapshot.recordCount() > 0) {
+            recent_messages = snapshot.loadRecent(MAX_HISTORY_SIZE);
+            log_message("Loaded " + std::to_string(recent_messages.size()) + " recent messages from history snapshot");
+        } else {
+            for (const auto& message : store.recentBroadcasts(MAX_HISTORY_SIZE)) {
+                recent_messages.push_back(to_history_entry(message));
+            }
+            if (!snapshot.rebuild(recent_messages)) {
+                log_at(LogLevel::Warn, "Could not rebuild history snapshot");
+            }
+            log_message("Loaded " + std::to_string(recent_messages.size()) + " recent messages from " + store.name() + " store");
+        }
+
+        // Load recent messages into in-memory chat history, keeping their
+        // sequence numbers so clients can resume across restarts
+        chat_history.restore(std::move(recent_messages));
+
+        // Retention runs in the background, paced so it never competes with
+        // message persistence for I/O
+        RetentionPolicy broadcast_retention;
+        broadcast_retention.max_age_ms = static_cast<int64_t>(BROADCAST_RETENTION_DAYS) * 24 * 3600 * 1000;
+        broadcast_retention.max_messages = BROADCAST_RETENTION_MESSAGES;
+        RetentionPolicy private_retention;
+        private_retention.max_age_ms = static_cast<int64_t>(PRIVATE_RETENTION_DAYS) * 24 * 3600 * 1000;
+        private_retention.max_messages = PRIVATE_RETENTION_MESSAGES;
+        static MessageCompactor compactor(store, broadcast_retention, private_retention,
+                                          std::chrono::milliseconds(COMPACTION_INTERVAL_MS),
+                                          COMPACTION_MESSAGES_PER_SECOND);
+        compactor.start();
+        if (broadcast_retention.enabled() || private_retention.enabled()) {
+            log_message("Started message compactor");
         }
-        log_message("Loaded " + std::to_string(recent_messages.size()) + " recent messages from database");
         
+        if (options.admin_port > 0) {
+            static AdminServer admin(ADMIN_BIND_ADDRESS, options.admin_port);
+            if (admin.start()) {
+                log_message("Serving metrics on http://" + std::string(ADMIN_BIND_ADDRESS) + ":" +
+                            std::to_string(admin.port()) + "/metrics");
+            }
+        }
+
         initialize_connection_pool();
         log_message("Initialized connection pool with " + std::to_string(MAX_CONNECTIONS) + " slots");
 
         // Start worker threads
         std::vector<std::thread> workers;
-        for (int i = 0; i < WORKER_THREADS; i++) {
+        for (int i = 0; i < options.workers; i++) {
             workers.emplace_back(message_worker);
         }
-        log_message("Started " + std::to_string(WORKER_THREADS) + " worker threads");
+        log_message("Started " + std::to_string(options.workers) + " worker threads");
+        std::thread(room_batch_ticker).detach();
+
+        if (options.node_id > 0) {
+            std::string secret;
+            if (!read_cluster_secret(options.cluster_secret_file, secret)) {
+                return 1;
+            }
+            static ClusterNode node(static_cast<uint16_t>(options.node_id), std::move(secret), server_cluster_handler());
+            if (!node.start(options.cluster_bind, options.cluster_port, options.peers)) {
+                return 1;
+            }
+            set_cluster_node(&node);
+            log_message("Cluster node " + std::to_string(options.node_id) + " listening for peers on " +
+                        options.cluster_bind + ":" + std::to_string(node.port()) + " with " +
+                        std::to_string(options.peers.size()) + " peers");
+        }
 
         int server_socket = socket(AF_INET, SOCK_STREAM, 0);
         if (server_socket == -1) {
-            log_message("Error: Could not create socket: " + std::string(strerror(errno)));
+            log_at(LogLevel::Error, "Could not create socket: " + std::string(strerror(errno)));
             return 1;
         }
         log_message("Created server socket");
 
         // Use socket_utils to configure the socket
         if (!configure_socket(server_socket, true)) {
-            log_message("Error: Could not configure server socket");
+            log_at(LogLevel::Error, "Could not configure server socket");
             close(server_socket);
             return 1;
         }
@@ -58,24 +206,24 @@ int main() {
         sockaddr_in server_address;
         server_address.sin_family = AF_INET;
         server_address.sin_addr.s_addr = INADDR_ANY;
-        server_address.sin_port = htons(PORT);
+        server_address.sin_port = htons(static_cast<uint16_t>(options.port));
 
         if (bind(server_socket, (sockaddr*)&server_address, sizeof(server_address)) == -1) {
-            log_message("Error: Could not bind to port " + std::to_string(PORT) + ": " + std::string(strerror(errno)));
+            log_at(LogLevel::Error, "Could not bind to port " + std::to_string(options.port) + ": " + std::string(strerror(errno)));
             close(server_socket);
             return 1;
         }
-        log_message("Bound to port " + std::to_string(PORT));
+        log_message("Bound to port " + std::to_string(options.port));
 
         if (listen(server_socket, SOMAXCONN) == -1) {
-            log_message("Error: Could not listen on port " + std::to_string(PORT) + ": " + std::string(strerror(errno)));
+            log_at(LogLevel::Error, "Could not listen on port " + std::to_string(options.port) + ": " + std::string(strerror(errno)));
             close(server_socket);
             return 1;
         }
 
-        log_message("Server is listening on port " + std::to_string(PORT) + "...");
+        log_message("Server is listening on port " + std::to_string(options.port) + "...");
         log_message("Maximum concurrent connections: " + std::to_string(MAX_CONNECTIONS));
-        log_message("Worker threads: " + std::to_string(WORKER_THREADS));
+        log_message("Worker threads: " + std::to_string(options.workers));
 
         while (true) {
             try {
@@ -83,10 +231,11 @@ int main() {
                 socklen_t client_address_size = sizeof(client_address);
                 int client_socket = accept(server_socket, (sockaddr*)&client_address, &client_address_size);
                 if (client_socket == -1) {
-                    log_message("Error: Could not accept incoming connection: " + std::string(strerror(errno)));
+                    log_at(LogLevel::Error, "Could not accept incoming connection: " + std::string(strerror(errno)));
                     continue;
                 }
 
+                flight_record(FlightEvent::Accept, client_socket, client_address.sin_addr.s_addr);
                 char client_ip[INET_ADDRSTRLEN];
                 inet_ntop(AF_INET, &client_address.sin_addr, client_ip, INET_ADDRSTRLEN);
                 log_message("New connection from " + std::string(client_ip) + ":" + std::to_string(ntohs(client_address.sin_port)));
@@ -102,10 +251,10 @@ int main() {
         close(server_socket);
         return 0;
     } catch (const std::exception& e) {
-        log_message("Fatal exception: " + std::string(e.what()));
+        log_at(LogLevel::Error, "Fatal exception: " + std::string(e.what()));
         return 1;
     } catch (...) {
-        log_message("Unknown fatal exception");
+        log_at(LogLevel::Error, "Unknown fatal exception");
         return 1;
     }
 }
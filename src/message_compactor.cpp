@@ -0,0 +1,61 @@
+#include "message_compactor.h"
+#include "rate_limiter.h"
+#include <string>
+
+// Forward declaration of log_message
+void log_message(const std::string& message);
+
+MessageCompactor::MessageCompactor(MessageStore& store, RetentionPolicy broadcasts, RetentionPolicy private_messages,
+                                   std::chrono::milliseconds interval, double messages_per_second)
+    : store(store),
+      broadcasts(broadcasts),
+      private_messages(private_messages),
+      interval(interval),
+      messages_per_second(messages_per_second),
+      removed_total(0),
+      running(false) {}
+
+MessageCompactor::~MessageCompactor() {
+    stop();
+}
+
+void MessageCompactor::start() {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (running || (!broadcasts.enabled() && !private_messages.enabled())) {
+        return;
+    }
+    running = true;
+    thread = std::thread(&MessageCompactor::run, this);
+}
+
+void MessageCompactor::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        running = false;
+    }
+    cv.notify_all();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+uint64_t MessageCompactor::runOnce() {
+    // Burst of one second's budget, so a pass starts promptly and then paces itself
+    RateLimiter limiter(messages_per_second, messages_per_second);
+    uint64_t removed = store.removeExpired(broadcasts, private_messages, current_time_ms(), limiter);
+    removed_total += removed;
+    return removed;
+}
+
+void MessageCompactor::run() {
+    std::unique_lock<std::mutex> lock(mtx);
+    while (running) {
+        lock.unlock();
+        uint64_t removed = runOnce();
+        if (removed > 0) {
+            log_message("Compaction removed " + std::to_string(removed) + " expired messages");
+        }
+        lock.lock();
+        cv.wait_for(lock, interval, [this]() { return !running; });
+    }
+}
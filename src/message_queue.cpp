@@ -1,14 +1,17 @@
 #include "message_queue.h"
 
-MessageQueue message_queue(MESSAGE_QUEUE_SIZE);
+// Never destroyed: workers block in pop() for the life of the process, and
+// destroying a condition variable with waiters hangs exit
+MessageQueue& message_queue = *new MessageQueue(MESSAGE_QUEUE_SIZE);
 
 MessageQueue::MessageQueue(size_t size) : max_size(size), current_size(0) {}
 
 bool MessageQueue::push(Message msg) {
-    std::lock_guard<std::mutex> lock(mtx);
+    std::lock_guard<InstrumentedMutex> lock(mtx);
     if (current_size >= max_size) {
         return false;
     }
+    msg.trace.enqueue_ns = trace_now();
     queue.push(std::move(msg));
     ++current_size;
     cv.notify_one();
@@ -16,11 +19,12 @@ bool MessageQueue::push(Message msg) {
 }
 
 Message MessageQueue::pop() {
-    std::unique_lock<std::mutex> lock(mtx);
+    std::unique_lock<InstrumentedMutex> lock(mtx);
     cv.wait(lock, [this]() { return !queue.empty(); });
     Message msg = std::move(queue.front());
     queue.pop();
     current_size--;
+    msg.trace.dequeue_ns = trace_now();
     return msg;
 }
 
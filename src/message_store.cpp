@@ -0,0 +1,475 @@
+#include "message_store.h"
+#include "constants.h"
+#include "database.h"
+#include "rate_limiter.h"
+#include "server_metrics.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <sys/stat.h>
+
+// Forward declaration of log_message
+void log_message(const std::string& message);
+
+int64_t current_time_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+uint64_t conversation_key(int user_a, int user_b) {
+    uint32_t lo = static_cast<uint32_t>(std::min(user_a, user_b));
+    uint32_t hi = static_cast<uint32_t>(std::max(user_a, user_b));
+    return (static_cast<uint64_t>(lo) << 32) | hi;
+}
+
+HistoryEntry to_history_entry(const StoredMessage& message) {
+    // Format: [HH:MM:SS] username: message
+    std::time_t seconds = static_cast<std::time_t>(message.timestamp_ms / 1000);
+    std::tm local;
+    localtime_r(&seconds, &local);
+    char time_buffer[20];
+    std::strftime(time_buffer, sizeof(time_buffer), "[%H:%M:%S] ", &local);
+    return HistoryEntry{message.seq, time_buffer + message.sender_name + ": " + message.content};
+}
+
+MessageStore& message_store() {
+    static std::unique_ptr<MessageStore> store = []() -> std::unique_ptr<MessageStore> {
+        if (std::strcmp(MESSAGE_STORE_BACKEND, "log") == 0) {
+            SegmentedLogOptions options;
+            options.segment_bytes = MESSAGE_LOG_SEGMENT_BYTES;
+            options.index_interval_bytes = MESSAGE_LOG_INDEX_INTERVAL_BYTES;
+            options.flush_bytes = MESSAGE_LOG_FLUSH_BYTES;  // retention is MessageCompactor's
+            auto log_store = std::make_unique<LogMessageStore>(MESSAGE_LOG_DIR, options);
+            if (log_store->isOpen()) {
+                return log_store;
+            }
+            log_message("Error: Could not open message log in " + std::string(MESSAGE_LOG_DIR) + ", using SQLite");
+        }
+        return std::make_unique<SqliteMessageStore>();
+    }();
+    return *store;
+}
+
+StoreWriter::StoreWriter(MessageStore& store)
+    : store(store), enqueued(0), appended(0), stopping(false) {
+    writer = std::thread(&StoreWriter::run, this);
+}
+
+StoreWriter::~StoreWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    pending_cv.notify_all();
+    if (writer.joinable()) {
+        writer.join();
+    }
+}
+
+void StoreWriter::enqueue(StoredMessage message) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        pending.push_back(std::move(message));
+        ++enqueued;
+    }
+    pending_cv.notify_one();
+}
+
+void StoreWriter::drain() {
+    std::unique_lock<std::mutex> lock(mtx);
+    const uint64_t target = enqueued;
+    drained_cv.wait(lock, [&] { return appended >= target; });
+}
+
+void StoreWriter::run() {
+    std::deque<StoredMessage> batch;
+    std::unique_lock<std::mutex> lock(mtx);
+    while (true) {
+        pending_cv.wait(lock, [this] { return stopping || !pending.empty(); });
+        if (pending.empty()) {
+            return;  // stopping with nothing left to write
+        }
+        batch.swap(pending);
+        lock.unlock();
+        for (const StoredMessage& message : batch) {
+            if (!store.append(message)) {
+                log_message("Error: Could not persist broadcast " + std::to_string(message.seq));
+            }
+        }
+        const size_t written = batch.size();
+        batch.clear();
+        lock.lock();
+        appended += written;
+        drained_cv.notify_all();
+    }
+}
+
+StoreWriter& broadcast_writer() {
+    // Built from message_store() first, so the store outlives the writer
+    static StoreWriter writer(message_store());
+    return writer;
+}
+
+// --- SQLite ---
+
+bool SqliteMessageStore::append(const StoredMessage& message) {
+    // Each insert is its own transaction, so append latency is flush latency
+    auto start = std::chrono::steady_clock::now();
+    bool stored = Database::getInstance().storeMessage(message.sender_id, message.receiver_id, message.content,
+                                                       message.seq, message.room_id,
+                                                       message.sender_id == 0 ? message.sender_name : std::string());
+    double latency = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    metrics.record_store_append(latency);
+    metrics.record_store_flush(latency);
+    return stored;
+}
+
+std::vector<StoredMessage> SqliteMessageStore::recentBroadcasts(size_t limit) {
+    return Database::getInstance().loadRecentMessages(static_cast<int>(limit));
+}
+
+std::vector<StoredMessage> SqliteMessageStore::broadcastsSince(uint64_t since_seq, uint64_t before_seq, size_t limit) {
+    return Database::getInstance().loadBroadcastsSince(since_seq, before_seq, static_cast<int>(limit));
+}
+
+std::vector<StoredMessage> SqliteMessageStore::conversation(int user_a, int user_b, uint64_t before_seq, size_t limit) {
+    return Database::getInstance().loadConversation(user_a, user_b, before_seq, static_cast<int>(limit));
+}
+
+std::vector<StoredMessage> SqliteMessageStore::roomHistory(uint32_t room_id, uint64_t before_seq, size_t limit) {
+    return Database::getInstance().loadRoomMessages(room_id, before_seq, static_cast<int>(limit));
+}
+
+uint64_t SqliteMessageStore::removeExpired(const RetentionPolicy& broadcasts, const RetentionPolicy& private_messages,
+                                          int64_t now_ms, RateLimiter& limiter) {
+    Database& db = Database::getInstance();
+    uint64_t removed = 0;
+    for (bool broadcast : {true, false}) {
+        const RetentionPolicy& policy = broadcast ? broadcasts : private_messages;
+        if (!policy.enabled()) {
+            continue;
+        }
+        int64_t min_created_ms = policy.max_age_ms > 0 ? now_ms - policy.max_age_ms : 0;
+        uint64_t cutoff_id = db.retentionCutoff(broadcast, min_created_ms, policy.max_messages);
+        // Short batches keep the write lock free for storeMessage between them
+        while (cutoff_id > 0) {
+            int deleted = db.deleteMessagesThrough(broadcast, cutoff_id, COMPACTION_BATCH_ROWS);
+            removed += static_cast<uint64_t>(std::max(deleted, 0));
+            limiter.acquire(std::max(deleted, 0));
+            if (deleted < COMPACTION_BATCH_ROWS) {
+                break;
+            }
+        }
+    }
+    return removed;
+}
+
+SearchPage SqliteMessageStore::search(int user_id, const std::string& query, uint64_t before_cursor, size_t limit) {
+    return Database::getInstance().searchMessages(user_id, tokenize_search_terms(query), before_cursor,
+                                                  static_cast<int>(limit));
+}
+
+// --- Segmented log ---
+
+std::string encode_stored_message(const StoredMessage& message) {
+    uint16_t name_length = static_cast<uint16_t>(std::min<size_t>(message.sender_name.size(), UINT16_MAX));
+    std::string payload;
+    payload.reserve(2 * sizeof(int32_t) + sizeof(name_length) + name_length + message.content.size());
+    int32_t sender_id = message.sender_id;
+    int32_t receiver_id = message.room_id != 0 ? static_cast<int32_t>(message.room_id) : message.receiver_id;
+    payload.append(reinterpret_cast<const char*>(&sender_id), sizeof(sender_id));
+    payload.append(reinterpret_cast<const char*>(&receiver_id), sizeof(receiver_id));
+    payload.append(reinterpret_cast<const char*>(&name_length), sizeof(name_length));
+    payload.append(message.sender_name.data(), name_length);
+    payload.append(message.content);
+    return payload;
+}
+
+bool decode_stored_message(const LogRecordView& record, StoredMessage& message) {
+    const size_t fixed = 2 * sizeof(int32_t) + sizeof(uint16_t);
+    if (record.payload.size() < fixed) {
+        return false;
+    }
+    const char* p = record.payload.data();
+    int32_t sender_id, receiver_id;
+    uint16_t name_length;
+    std::memcpy(&sender_id, p, sizeof(sender_id));
+    std::memcpy(&receiver_id, p + sizeof(int32_t), sizeof(receiver_id));
+    std::memcpy(&name_length, p + 2 * sizeof(int32_t), sizeof(name_length));
+    if (record.payload.size() < fixed + name_length) {
+        return false;
+    }
+    message.seq = record.seq;
+    message.timestamp_ms = record.timestamp_ms;
+    message.sender_id = sender_id;
+    message.receiver_id = receiver_id;
+    message.sender_name.assign(p + fixed, name_length);
+    message.content.assign(p + fixed + name_length, record.payload.size() - fixed - name_length);
+    return true;
+}
+
+SegmentedLogOptions LogMessageStore::withDirectory(SegmentedLogOptions options, const std::string& directory) {
+    options.directory = directory;
+    return options;
+}
+
+LogMessageStore::LogMessageStore(const std::string& directory, SegmentedLogOptions options)
+    : broadcast_log(withDirectory(options, directory + "/broadcast")),
+      private_log(withDirectory(options, directory + "/private")),
+      room_log(withDirectory(options, directory + "/room")),
+      opened(false),
+      running(true) {
+    mkdir(directory.c_str(), 0755);
+    opened = broadcast_log.open() && private_log.open() && room_log.open();
+    if (opened) {
+        broadcast_log.scanFromSeq(0, [this](const LogRecordView& record) {
+            StoredMessage message;
+            if (decode_stored_message(record, message)) {
+                search_index.add(IndexedDoc{record.timestamp_ms, record.seq, false, message.sender_id, 0},
+                                 message.content);
+            }
+            return true;
+        });
+        private_log.scanFromSeq(0, [this](const LogRecordView& record) {
+            StoredMessage message;
+            if (decode_stored_message(record, message)) {
+                conversations[conversation_key(message.sender_id, message.receiver_id)].push_back(record.seq);
+                search_index.add(IndexedDoc{record.timestamp_ms, record.seq, true, message.sender_id,
+                                            message.receiver_id}, message.content);
+            }
+            return true;
+        });
+        room_log.scanFromSeq(0, [this](const LogRecordView& record) {
+            StoredMessage message;
+            if (decode_stored_message(record, message)) {
+                rooms[static_cast<uint32_t>(message.receiver_id)].push_back(record.seq);
+            }
+            return true;
+        });
+        search_index.finishBulkLoad();
+    }
+    background = std::thread(&LogMessageStore::backgroundLoop, this);
+}
+
+LogMessageStore::~LogMessageStore() {
+    {
+        std::lock_guard<std::mutex> lock(wake_mtx);
+        running = false;
+    }
+    wake_cv.notify_all();
+    if (background.joinable()) {
+        background.join();
+    }
+    flush();
+}
+
+void LogMessageStore::backgroundLoop() {
+    std::unique_lock<std::mutex> lock(wake_mtx);
+    while (running) {
+        wake_cv.wait_for(lock, std::chrono::milliseconds(MESSAGE_LOG_FLUSH_INTERVAL_MS));
+        flush();
+    }
+}
+
+void LogMessageStore::flush() {
+    auto start = std::chrono::steady_clock::now();
+    broadcast_log.flush();
+    private_log.flush();
+    room_log.flush();
+    metrics.record_store_flush(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+}
+
+bool LogMessageStore::append(const StoredMessage& message) {
+    auto start = std::chrono::steady_clock::now();
+    bool stored = appendRecord(message);
+    metrics.record_store_append(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    return stored;
+}
+
+bool LogMessageStore::appendRecord(const StoredMessage& message) {
+    std::string payload = encode_stored_message(message);
+    if (message.room_id != 0) {
+        // Not searchable: the index has no notion of room membership
+        std::lock_guard<std::mutex> lock(rooms_mtx);
+        uint64_t seq = room_log.append(0, message.timestamp_ms, payload);
+        if (seq == 0) {
+            return false;
+        }
+        rooms[message.room_id].push_back(seq);
+        return true;
+    }
+    if (message.receiver_id == 0) {
+        if (broadcast_log.append(message.seq, message.timestamp_ms, payload) == 0) {
+            return false;
+        }
+        search_index.add(IndexedDoc{message.timestamp_ms, message.seq, false, message.sender_id, 0},
+                         message.content);
+        return true;
+    }
+    // Index under conversations_mtx so ids land in each thread in log order
+    std::lock_guard<std::mutex> lock(conversations_mtx);
+    uint64_t seq = private_log.append(0, message.timestamp_ms, payload);
+    if (seq == 0) {
+        return false;
+    }
+    conversations[conversation_key(message.sender_id, message.receiver_id)].push_back(seq);
+    search_index.add(IndexedDoc{message.timestamp_ms, seq, true, message.sender_id, message.receiver_id},
+                     message.content);
+    return true;
+}
+
+// Drops ids below `first` (the oldest record retention kept) from each
+// thread of an id index, and threads left empty
+template <typename Key>
+static void trim_threads(std::unordered_map<Key, std::vector<uint64_t>>& threads, uint64_t first) {
+    for (auto it = threads.begin(); it != threads.end();) {
+        auto& ids = it->second;
+        ids.erase(ids.begin(), std::lower_bound(ids.begin(), ids.end(), first));
+        it = ids.empty() ? threads.erase(it) : std::next(it);
+    }
+}
+
+uint64_t LogMessageStore::removeExpired(const RetentionPolicy& broadcasts, const RetentionPolicy& private_messages,
+                                       int64_t now_ms, RateLimiter& limiter) {
+    uint64_t removed = dropSegments(broadcast_log, broadcasts, now_ms, limiter);
+    uint64_t removed_private = dropSegments(private_log, private_messages, now_ms, limiter);
+    uint64_t removed_room = dropSegments(room_log, broadcasts, now_ms, limiter);
+    if (removed_private > 0) {
+        // Search index entries for dropped records are skipped when their
+        // lookup comes back empty
+        std::lock_guard<std::mutex> lock(conversations_mtx);
+        trim_threads(conversations, private_log.firstSeq());
+    }
+    if (removed_room > 0) {
+        std::lock_guard<std::mutex> lock(rooms_mtx);
+        trim_threads(rooms, room_log.firstSeq());
+    }
+    return removed + removed_private + removed_room;
+}
+
+// One segment per step: unlinking is cheap, but the rate limit still spreads
+// the page cache and directory churn of a large backlog over time
+uint64_t LogMessageStore::dropSegments(SegmentedLog& log, const RetentionPolicy& policy, int64_t now_ms,
+                                       RateLimiter& limiter) {
+    if (!policy.enabled()) {
+        return 0;
+    }
+    int64_t min_timestamp_ms = policy.max_age_ms > 0 ? now_ms - policy.max_age_ms : 0;
+    uint64_t removed = 0;
+    while (uint64_t records = log.dropSegments(min_timestamp_ms, policy.max_messages, 1)) {
+        removed += records;
+        limiter.acquire(static_cast<double>(records));
+    }
+    return removed;
+}
+
+// Point lookup through the sparse index; false once retention dropped the record
+bool LogMessageStore::readRecord(SegmentedLog& log, uint64_t seq, StoredMessage& message) {
+    bool found = false;
+    log.scanFromSeq(seq - 1, [&](const LogRecordView& record) {
+        found = record.seq == seq && decode_stored_message(record, message);
+        return false;
+    });
+    return found;
+}
+
+std::vector<StoredMessage> LogMessageStore::recentBroadcasts(size_t limit) {
+    std::vector<StoredMessage> messages;
+    messages.reserve(limit);
+    broadcast_log.scanTail(limit, [&messages](const LogRecordView& record) {
+        StoredMessage message;
+        if (decode_stored_message(record, message)) {
+            messages.push_back(std::move(message));
+        }
+        return true;
+    });
+    return messages;
+}
+
+std::vector<StoredMessage> LogMessageStore::broadcastsSince(uint64_t since_seq, uint64_t before_seq, size_t limit) {
+    std::vector<StoredMessage> messages;
+    broadcast_log.scanFromSeq(since_seq, [&](const LogRecordView& record) {
+        if (record.seq >= before_seq || messages.size() >= limit) {
+            return false;
+        }
+        StoredMessage message;
+        if (decode_stored_message(record, message)) {
+            messages.push_back(std::move(message));
+        }
+        return true;
+    });
+    return messages;
+}
+
+std::vector<StoredMessage> LogMessageStore::conversation(int user_a, int user_b, uint64_t before_seq, size_t limit) {
+    std::vector<uint64_t> ids;
+    {
+        std::lock_guard<std::mutex> lock(conversations_mtx);
+        auto it = conversations.find(conversation_key(user_a, user_b));
+        if (it == conversations.end()) {
+            return {};
+        }
+        const auto& thread = it->second;
+        auto end = std::lower_bound(thread.begin(), thread.end(), before_seq);
+        auto begin = end - static_cast<std::ptrdiff_t>(std::min<size_t>(limit, end - thread.begin()));
+        ids.assign(begin, end);
+    }
+
+    std::vector<StoredMessage> messages;
+    messages.reserve(ids.size());
+    for (auto id = ids.rbegin(); id != ids.rend(); ++id) {
+        StoredMessage message;
+        if (readRecord(private_log, *id, message)) {
+            messages.push_back(std::move(message));
+        }
+    }
+    return messages;
+}
+
+std::vector<StoredMessage> LogMessageStore::roomHistory(uint32_t room_id, uint64_t before_seq, size_t limit) {
+    std::vector<uint64_t> ids;
+    {
+        std::lock_guard<std::mutex> lock(rooms_mtx);
+        auto it = rooms.find(room_id);
+        if (it == rooms.end()) {
+            return {};
+        }
+        const auto& thread = it->second;
+        auto end = std::lower_bound(thread.begin(), thread.end(), before_seq);
+        auto begin = end - static_cast<std::ptrdiff_t>(std::min<size_t>(limit, end - thread.begin()));
+        ids.assign(begin, end);
+    }
+
+    std::vector<StoredMessage> messages;
+    messages.reserve(ids.size());
+    for (auto id = ids.rbegin(); id != ids.rend(); ++id) {
+        StoredMessage message;
+        if (readRecord(room_log, *id, message)) {
+            message.room_id = room_id;
+            message.receiver_id = 0;
+            messages.push_back(std::move(message));
+        }
+    }
+    return messages;
+}
+
+SearchPage LogMessageStore::search(int user_id, const std::string& query, uint64_t before_cursor, size_t limit) {
+    auto hits = search_index.search(tokenize_search_terms(query), before_cursor, limit, [user_id](const IndexedDoc& doc) {
+        return !doc.is_private || doc.sender_id == user_id || doc.receiver_id == user_id;
+    });
+
+    SearchPage page;
+    for (const auto& hit : hits) {
+        StoredMessage message;
+        if (readRecord(hit.doc.is_private ? private_log : broadcast_log, hit.doc.seq, message)) {
+            page.messages.push_back(std::move(message));
+        }
+    }
+    if (hits.size() == limit) {
+        page.next_before = hits.back().doc_id;
+    }
+    return page;
+}
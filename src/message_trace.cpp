@@ -0,0 +1,89 @@
+#include "message_trace.h"
+#include "constants.h"
+#include <algorithm>
+#include <chrono>
+
+MessageTracer message_tracer(TRACE_SAMPLE_EVERY);
+
+int64_t trace_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+const char* trace_stage_name(TraceStage stage) {
+    switch (stage) {
+        case TraceStage::Enqueue: return "enqueue";
+        case TraceStage::QueueWait: return "queue_wait";
+        case TraceStage::Persist: return "persist";
+        case TraceStage::FirstSend: return "first_send";
+        case TraceStage::Fanout: return "fanout";
+        case TraceStage::Total: return "total";
+        default: return "unknown";
+    }
+}
+
+MessageTracer::MessageTracer(uint64_t sample_every) : sample_every(sample_every ? sample_every : 1) {}
+
+void MessageTracer::record(const MessageTrace& trace) {
+    auto stage = [this](TraceStage which, int64_t from, int64_t to) {
+        if (from > 0 && to >= from) {
+            stages[static_cast<size_t>(which)].record(static_cast<uint64_t>((to - from) / 1000));
+        }
+    };
+    stage(TraceStage::Enqueue, trace.recv_ns, trace.enqueue_ns);
+    stage(TraceStage::QueueWait, trace.enqueue_ns, trace.dequeue_ns);
+    stage(TraceStage::Persist, trace.dequeue_ns, trace.persist_ns);
+    stage(TraceStage::FirstSend, trace.persist_ns, trace.first_send_ns);
+    stage(TraceStage::Fanout, trace.first_send_ns, trace.last_send_ns);
+    stage(TraceStage::Total, trace.recv_ns, trace.last_send_ns);
+
+    if (traced_count.fetch_add(1, std::memory_order_relaxed) % sample_every != 0) {
+        return;
+    }
+    Slot& slot = ring[sampled_count.fetch_add(1, std::memory_order_relaxed) % RING_SIZE];
+    uint64_t version = slot.version.load(std::memory_order_relaxed);
+    // Two writers lapping the ring onto the same slot: skip rather than wait
+    if ((version & 1) || !slot.version.compare_exchange_strong(version, version + 1, std::memory_order_acquire)) {
+        return;
+    }
+    const int64_t stamps[] = {trace.recv_ns, trace.enqueue_ns, trace.dequeue_ns,
+                              trace.persist_ns, trace.first_send_ns, trace.last_send_ns};
+    for (size_t i = 0; i < slot.stamps.size(); ++i) {
+        slot.stamps[i].store(stamps[i], std::memory_order_relaxed);
+    }
+    slot.version.store(version + 2, std::memory_order_release);
+}
+
+HistogramSnapshot MessageTracer::stage_latency(TraceStage stage) const {
+    HistogramSnapshot snapshot;
+    stages[static_cast<size_t>(stage)].merge_into(snapshot);
+    return snapshot;
+}
+
+std::vector<MessageTrace> MessageTracer::recent_samples(size_t limit) const {
+    std::vector<MessageTrace> samples;
+    const uint64_t written = sampled_count.load(std::memory_order_acquire);
+    const uint64_t available = std::min<uint64_t>(written, RING_SIZE);
+    for (uint64_t i = 0; i < available && samples.size() < limit; ++i) {
+        const Slot& slot = ring[(written - 1 - i) % RING_SIZE];
+        for (int attempt = 0; attempt < 4; ++attempt) {
+            uint64_t before = slot.version.load(std::memory_order_acquire);
+            if (before == 0) {
+                break;
+            }
+            if (before & 1) {
+                continue;
+            }
+            int64_t stamps[6];
+            for (size_t s = 0; s < 6; ++s) {
+                stamps[s] = slot.stamps[s].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.version.load(std::memory_order_relaxed) == before) {
+                samples.push_back(MessageTrace{stamps[0], stamps[1], stamps[2], stamps[3], stamps[4], stamps[5]});
+                break;
+            }
+        }
+    }
+    return samples;
+}
@@ -2,8 +2,12 @@
 #include "connection_pool.h"
 #include "message_queue.h"
 #include "server_metrics.h"
-#include "socket_utils.h"
 #include "server.h"
+#include "flight_recorder.h"
+#include "transport.h"
+#include "traffic_capture.h"
+#include "socket_utils.h"
+#include "wire_protocol.h"
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -13,17 +17,96 @@
 #include <iostream>
 #include <chrono>
 #include <thread>
+#include <algorithm>
+#include <string_view>
+
+// Queues one inbound message for the workers
+static void enqueue_message(Connection* conn, Message msg, size_t bytes) {
+    const int socket = msg.sender_socket;
+    if (message_queue.push(std::move(msg))) {
+        flight_record(FlightEvent::Enqueue, socket, static_cast<uint64_t>(bytes));
+    } else {
+        metrics.record_drop(DropLane::InboundQueue);
+        flight_record(FlightEvent::Drop, socket, static_cast<uint64_t>(DropLane::InboundQueue));
+        log_message("Message queue full, dropping message from " + conn->username);
+    }
+}
+
+// Credentials stay out of captures; the login and register handlers record
+// the outcome instead
+static bool carries_credentials(std::string_view command) {
+    return command.compare(0, 7, "/login ") == 0 || command.compare(0, 10, "/register ") == 0;
+}
+
+// Records a binary frame as the text message it stands for, so captures
+// replay the same whatever protocol the client spoke
+static void capture_frame(TrafficCapture& capture, int socket, const WireFrame& frame) {
+    if (!capture.active()) {
+        return;
+    }
+    if (frame.type == FrameType::Chat ||
+        (frame.type == FrameType::Command && !carries_credentials(frame.payload))) {
+        capture.record_message(socket, frame.payload.data(), frame.payload.size());
+    } else if (frame.type == FrameType::Private) {
+        WireReader reader(frame.payload);
+        std::string_view recipient;
+        if (reader.read_string(recipient)) {
+            std::string line = "/msg " + std::string(recipient) + " " + std::string(reader.remaining());
+            capture.record_message(socket, line.data(), line.size());
+        }
+    }
+}
 
-extern std::vector<std::string> chat_history;
-extern std::mutex history_mtx;
-extern std::mutex console_mtx;
+// Queues every complete frame in `data`, parsed in place. A frame split
+// across reads is kept in `pending` until the rest arrives. Returns false if
+// the client sent a frame too large to accept and must be disconnected.
+static bool enqueue_frames(Connection* conn, int socket, std::string_view data, std::string& pending,
+                           int64_t received_at) {
+    if (!pending.empty()) {
+        pending.append(data);
+        data = pending;
+    }
+    size_t offset = 0;
+    while (offset < data.size()) {
+        WireFrame frame;
+        size_t consumed = 0;
+        DecodeStatus status = decode_frame(data.substr(offset), frame, consumed, WIRE_MAX_FRAME_PAYLOAD);
+        if (status == DecodeStatus::Incomplete) {
+            break;
+        }
+        if (status == DecodeStatus::TooLarge) {
+            metrics.record_drop(DropLane::Oversize);
+            send_error(socket, WireError::TooLarge, "Frame too large.\n");
+            return false;
+        }
+        capture_frame(TrafficCapture::instance(), socket, frame);
 
-void log_message(const std::string& message) {
-    std::lock_guard<std::mutex> lock(console_mtx);
-    std::time_t now = std::time(nullptr);
-    char time_buffer[20];
-    std::strftime(time_buffer, sizeof(time_buffer), "[%H:%M:%S] ", std::localtime(&now));
-    std::cout << time_buffer << message << std::endl;
+        Message msg;
+        msg.sender_socket = socket;
+        msg.frame = frame.type;
+        msg.content.assign(frame.payload.data(), frame.payload.size());
+        msg.trace.recv_ns = received_at;
+        enqueue_message(conn, std::move(msg), consumed);
+        offset += consumed;
+    }
+    if (pending.empty()) {
+        pending.assign(data.substr(offset));
+    } else {
+        pending.erase(0, offset);
+    }
+    return true;
+}
+
+// Answers a binary hello. The reply goes out under pool_mtx together with
+// the switch, so no text broadcast can follow it.
+static bool accept_hello(Connection* conn, int socket, uint8_t version) {
+    if (version == 0) {
+        send_to_client(socket, encode_error(WireError::UnsupportedVersion, "Unsupported protocol version.\n"));
+        return false;
+    }
+    std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+    set_binary_locked(conn);
+    return send_to_client(socket, encode_hello(std::min(version, WIRE_PROTOCOL_VERSION))) > 0;
 }
 
 void handle_client(int client_socket) {
@@ -31,23 +114,30 @@ void handle_client(int client_socket) {
         Connection* conn = get_available_connection();
         if (!conn) {
             log_message("No available connections in pool");
-            close(client_socket);
+            transport().close(client_socket);
             return;
         }
 
-        if (!configure_socket(client_socket, false)) {
+        if (!transport().configure(client_socket)) {
             log_message("Error: Could not configure client socket");
             release_connection(conn);
             return;
         }
 
-        conn->socket = client_socket;
+        attach_socket(conn, client_socket);
+        TrafficCapture& capture = TrafficCapture::instance();
+        capture.record_open(client_socket);
         metrics.update_connections(metrics.current_connections.load() + 1);
         log_message("New connection accepted. Current connections: " + std::to_string(metrics.current_connections.load()));
 
+        // The first bytes decide the protocol: a binary hello, or text
+        enum class Protocol { Unknown, Text, Binary } protocol = Protocol::Unknown;
+        std::string pending;  // a hello or binary frame cut short by the last read
+
         while (true) {
             char buffer[BUFFER_SIZE];
-            int bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
+            ssize_t bytes_received = transport().recv(client_socket, buffer, BUFFER_SIZE - 1);
+            const int64_t received_at = trace_now();
             if (bytes_received <= 0) {
                 if (bytes_received == 0) {
                     log_message("Client " + conn->username + " disconnected normally");
@@ -57,30 +147,83 @@ void handle_client(int client_socket) {
                 break;
             }
             buffer[bytes_received] = '\0';
+            conn->traffic.record_in(static_cast<size_t>(bytes_received));
+            std::string_view data(buffer, static_cast<size_t>(bytes_received));
+
+            if (protocol == Protocol::Unknown) {
+                std::string_view opening = data;
+                if (!pending.empty()) {
+                    pending.append(data);
+                    opening = pending;
+                }
+                uint8_t version = 0;
+                HelloStatus hello = parse_hello(opening, version);
+                if (hello == HelloStatus::Incomplete) {
+                    if (pending.empty()) {
+                        pending.assign(data);
+                    }
+                    continue;
+                }
+                if (hello == HelloStatus::Binary) {
+                    if (!accept_hello(conn, client_socket, version)) {
+                        break;
+                    }
+                    protocol = Protocol::Binary;
+                    // Frames may follow the hello in the same read
+                    if (pending.empty()) {
+                        data.remove_prefix(WIRE_HELLO_BYTES);
+                    } else {
+                        pending.erase(0, WIRE_HELLO_BYTES);
+                        data = std::string_view();
+                    }
+                } else {
+                    protocol = Protocol::Text;
+                    pending.clear();
+                }
+            }
+
+            if (protocol == Protocol::Binary) {
+                if (!enqueue_frames(conn, client_socket, data, pending, received_at)) {
+                    break;
+                }
+                continue;
+            }
+
             std::string message(buffer);
+            if (!carries_credentials(message)) {
+                capture.record_message(client_socket, buffer, static_cast<size_t>(bytes_received));
+            }
 
             Message msg;
             msg.sender_socket = client_socket;
             msg.content = message;
+            msg.trace.recv_ns = received_at;
+            enqueue_message(conn, std::move(msg), static_cast<size_t>(bytes_received));
+        }
 
-            if (!message_queue.push(msg)) {
-                metrics.messages_dropped++;
-                log_message("Message queue full, dropping message from " + conn->username);
+        std::string departed;
+        {
+            std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+            if (conn->authenticated) {
+                departed = conn->username;
             }
         }
-
+        if (!departed.empty()) {
+            broadcast_presence(client_socket, departed, false);
+        }
+        capture.record_close(client_socket);
         metrics.update_connections(metrics.current_connections.load() - 1);
         log_message("Connection closed. Current connections: " + std::to_string(metrics.current_connections.load()));
         release_connection(conn);
     } catch (const std::exception& e) {
         log_message("Exception in handle_client: " + std::string(e.what()));
         if (client_socket != -1) {
-            close(client_socket);
+            transport().close(client_socket);
         }
     } catch (...) {
         log_message("Unknown exception in handle_client");
         if (client_socket != -1) {
-            close(client_socket);
+            transport().close(client_socket);
         }
     }
 }
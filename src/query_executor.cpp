@@ -0,0 +1,63 @@
+#include "query_executor.h"
+#include "constants.h"
+
+QueryExecutor& QueryExecutor::getInstance() {
+    static QueryExecutor instance(QUERY_EXECUTOR_THREADS, QUERY_EXECUTOR_MAX_PENDING);
+    return instance;
+}
+
+QueryExecutor::QueryExecutor(size_t thread_count, size_t max_pending) : max_pending(max_pending), stopping(false) {
+    for (size_t i = 0; i < thread_count; ++i) {
+        threads.emplace_back(&QueryExecutor::run, this);
+    }
+}
+
+QueryExecutor::~QueryExecutor() {
+    shutdown();
+}
+
+bool QueryExecutor::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (stopping || tasks.size() >= max_pending) {
+            return false;
+        }
+        tasks.push(std::move(task));
+    }
+    cv.notify_one();
+    return true;
+}
+
+void QueryExecutor::shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (auto& thread : threads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+}
+
+size_t QueryExecutor::pending() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return tasks.size();
+}
+
+void QueryExecutor::run() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop();
+        }
+        task();
+    }
+}
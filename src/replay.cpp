@@ -0,0 +1,443 @@
+// Replays a traffic capture (see traffic_capture.h) against a chat server.
+//
+// Every captured connection is opened, authenticated and fed its messages at
+// the captured offsets divided by --speed, or as fast as the server answers
+// with --speed 0. A connection's events stay in order: after an /login or
+// /register its later events wait for the reply, as the original client did.
+// Captured usernames get --user-prefix and all log in with --password, since
+// captures hold no passwords; failed captured logins are replayed as logins
+// with a wrong password. Broadcast messages are tagged "RP|<scheduled ns>|"
+// so deliveries to the other replayed connections give end-to-end latency
+// from the schedule. Results are printed to stdout as JSON.
+#include "load_client.h"
+#include "latency_histogram.h"
+#include "traffic_capture.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+struct Options {
+    TargetOptions target{"127.0.0.1", 5555, "rp_", "replay"};
+    double speed = 1;  // 0: as fast as possible
+    double drain = 2;  // seconds to wait for deliveries after the last event
+    std::string capture;
+};
+
+const char MARKER[] = "RP|";
+
+enum class AuthState { None, Registering, LoggingIn, FailingLogin };
+
+struct Connection : LoadConnection {
+    bool connected = false;
+    bool closing = false;  // close once output is flushed
+    AuthState auth = AuthState::None;
+    std::string username;
+    std::deque<std::pair<const CaptureRecord*, int64_t>> held;  // events waiting for an auth reply
+};
+
+struct Totals {
+    uint64_t events = 0;
+    uint64_t connections = 0;
+    uint64_t connect_failures = 0;
+    uint64_t auth_ok = 0;
+    uint64_t auth_failed = 0;
+    uint64_t messages = 0;
+    uint64_t commands = 0;
+    uint64_t bytes = 0;
+    uint64_t delivered = 0;
+    uint64_t skipped = 0;        // events for connections that never opened or already failed
+    uint64_t send_backlogged = 0;
+    uint64_t disconnects = 0;    // closed by the server
+};
+
+class Replayer {
+public:
+    Replayer(const Options& options, const sockaddr_in& address, const std::vector<CaptureRecord>& records)
+        : options(options), address(address), records(records) {}
+
+    bool run();
+
+    Totals totals;
+    LatencyHistogram latency;       // broadcast delivery from scheduled send, microseconds
+    LatencyHistogram schedule_lag;  // dispatch time past schedule, microseconds
+    double elapsed_seconds = 0;
+
+private:
+    void dispatch(const CaptureRecord& record, int64_t intended);
+    void deliver(Connection& conn, const CaptureRecord& record, int64_t intended);
+    void handle_event(Connection& conn, uint32_t events);
+    void handle_input(Connection& conn);
+    void parse_deliveries(Connection& conn, int64_t received_at);
+    void auth_finished(Connection& conn, bool ok);
+    void queue_output(Connection& conn, const std::string& data);
+    void flush_output(Connection& conn);
+    void close_connection(Connection& conn);
+    int64_t scheduled_at(const CaptureRecord& record) const;
+
+    const Options& options;
+    const sockaddr_in address;
+    const std::vector<CaptureRecord>& records;
+    int epoll_fd = -1;
+    int64_t start_ns = 0;
+    std::unordered_map<uint32_t, std::unique_ptr<Connection>> connections;
+    size_t awaiting_auth = 0;
+};
+
+int64_t Replayer::scheduled_at(const CaptureRecord& record) const {
+    if (options.speed <= 0) {
+        return start_ns;
+    }
+    return start_ns + static_cast<int64_t>(record.offset_us * 1000 / options.speed);
+}
+
+bool Replayer::run() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        return false;
+    }
+    start_ns = monotonic_ns();
+    size_t next = 0;
+    int64_t drain_until = 0;
+    epoll_event events[256];
+    while (true) {
+        const int64_t now = monotonic_ns();
+        while (next < records.size() && scheduled_at(records[next]) <= now) {
+            const int64_t intended = scheduled_at(records[next]);
+            if (options.speed > 0) {
+                schedule_lag.record(static_cast<uint64_t>((now - intended) / 1000));
+            }
+            dispatch(records[next++], intended);
+        }
+        if (next == records.size() && awaiting_auth == 0 && drain_until == 0) {
+            drain_until = now + static_cast<int64_t>(options.drain * 1e9);
+            elapsed_seconds = (now - start_ns) / 1e9;
+        }
+        if (drain_until != 0 && now >= drain_until) {
+            break;
+        }
+
+        int timeout_ms = 5;
+        if (next < records.size()) {
+            const int64_t wait_ns = scheduled_at(records[next]) - monotonic_ns();
+            // Round down and spin out the last millisecond, so events go out on time
+            timeout_ms = static_cast<int>(std::clamp<int64_t>(wait_ns / 1000000, 0, 5));
+        }
+        const int ready = epoll_wait(epoll_fd, events, 256, timeout_ms);
+        for (int i = 0; i < ready; ++i) {
+            handle_event(*static_cast<Connection*>(events[i].data.ptr), events[i].events);
+        }
+    }
+
+    for (auto& entry : connections) {
+        if (entry.second->fd >= 0) {
+            close(entry.second->fd);
+        }
+    }
+    close(epoll_fd);
+    return true;
+}
+
+void Replayer::dispatch(const CaptureRecord& record, int64_t intended) {
+    ++totals.events;
+    if (record.event == CaptureEvent::Open) {
+        auto conn = std::make_unique<Connection>();
+        Connection& c = *conn;
+        connections[record.connection] = std::move(conn);
+        ++totals.connections;
+        if (!start_connect(epoll_fd, address, c)) {
+            ++totals.connect_failures;
+            close_connection(c);
+        }
+        return;
+    }
+
+    auto it = connections.find(record.connection);
+    if (it == connections.end() || it->second->fd < 0) {
+        ++totals.skipped;
+        return;
+    }
+    Connection& conn = *it->second;
+    if (conn.auth != AuthState::None) {
+        conn.held.emplace_back(&record, intended);
+        return;
+    }
+    deliver(conn, record, intended);
+}
+
+void Replayer::deliver(Connection& conn, const CaptureRecord& record, int64_t intended) {
+    switch (record.event) {
+        case CaptureEvent::Auth:
+            conn.username = options.target.user_prefix + record.data;
+            if (record.auth_ok) {
+                // The replayed user may not exist yet; registration falls back to login
+                conn.auth = AuthState::Registering;
+                queue_output(conn, "/register " + conn.username + " " + options.target.password);
+            } else {
+                conn.auth = AuthState::FailingLogin;
+                queue_output(conn, "/login " + conn.username + " not-" + options.target.password);
+            }
+            ++awaiting_auth;
+            conn.input.clear();
+            break;
+        case CaptureEvent::Message: {
+            if (conn.pending_output() > LOAD_MAX_PENDING_OUTPUT) {
+                ++totals.send_backlogged;
+                return;
+            }
+            std::string message = record.data;
+            if (!message.empty() && message[0] == '/') {
+                ++totals.commands;
+            } else {
+                // Tag broadcasts, overwriting their start so the size stays the same
+                std::string tag = MARKER + std::to_string(intended) + "|";
+                message.replace(0, std::min(tag.size(), message.size()), tag);
+                ++totals.messages;
+            }
+            totals.bytes += message.size();
+            queue_output(conn, message);
+            break;
+        }
+        case CaptureEvent::Close:
+            conn.closing = true;
+            if (conn.output.empty()) {
+                close_connection(conn);
+            }
+            break;
+        case CaptureEvent::Open:
+            break;
+    }
+}
+
+void Replayer::handle_event(Connection& conn, uint32_t events) {
+    if (conn.fd < 0) {
+        return;
+    }
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        if (!conn.connected) {
+            ++totals.connect_failures;
+        } else {
+            ++totals.disconnects;
+        }
+        close_connection(conn);
+        return;
+    }
+    if ((events & EPOLLOUT) && !conn.connected) {
+        conn.connected = true;
+    }
+    if (events & EPOLLOUT) {
+        flush_output(conn);
+    }
+    if (conn.fd >= 0 && (events & (EPOLLIN | EPOLLRDHUP))) {
+        handle_input(conn);
+    }
+}
+
+void Replayer::handle_input(Connection& conn) {
+    char buffer[16384];
+    while (conn.fd >= 0) {
+        ssize_t received = recv(conn.fd, buffer, sizeof(buffer), 0);
+        if (received == 0) {
+            ++totals.disconnects;
+            close_connection(conn);
+            return;
+        }
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                ++totals.disconnects;
+                close_connection(conn);
+            }
+            return;
+        }
+        const int64_t received_at = monotonic_ns();
+        conn.input.append(buffer, static_cast<size_t>(received));
+
+        if (conn.auth == AuthState::None) {
+            parse_deliveries(conn, received_at);
+            continue;
+        }
+        const AuthReply reply = classify_auth_reply(conn.input);
+        if (reply == AuthReply::Ok) {
+            auth_finished(conn, true);
+        } else if (reply == AuthReply::RegistrationFailed && conn.auth == AuthState::Registering) {
+            conn.auth = AuthState::LoggingIn;
+            conn.input.clear();
+            queue_output(conn, "/login " + conn.username + " " + options.target.password);
+        } else if (reply != AuthReply::Pending) {
+            auth_finished(conn, conn.auth == AuthState::FailingLogin);
+        }
+    }
+}
+
+void Replayer::auth_finished(Connection& conn, bool as_captured) {
+    if (as_captured) {
+        ++totals.auth_ok;
+    } else {
+        ++totals.auth_failed;
+    }
+    conn.auth = AuthState::None;
+    conn.input.clear();  // history replay after login is not measured
+    --awaiting_auth;
+    while (!conn.held.empty() && conn.auth == AuthState::None && conn.fd >= 0) {
+        auto [record, intended] = conn.held.front();
+        conn.held.pop_front();
+        deliver(conn, *record, intended);
+    }
+}
+
+void Replayer::parse_deliveries(Connection& conn, int64_t received_at) {
+    // RP|<scheduled ns>|
+    parse_delivery_markers(conn.input, MARKER, 1, [&](const int64_t* values) {
+        const int64_t intended = values[0];
+        if (intended >= start_ns) {
+            ++totals.delivered;
+            latency.record(static_cast<uint64_t>(std::max<int64_t>(received_at - intended, 0) / 1000));
+        }
+    });
+}
+
+void Replayer::queue_output(Connection& conn, const std::string& data) {
+    conn.output.append(data);
+    if (conn.connected) {
+        flush_output(conn);
+    }
+}
+
+void Replayer::flush_output(Connection& conn) {
+    if (!::flush_output(conn)) {
+        ++totals.disconnects;
+        close_connection(conn);
+        return;
+    }
+    if (conn.output.empty() && conn.closing) {
+        close_connection(conn);
+        return;
+    }
+    update_interest(epoll_fd, conn, !conn.connected || !conn.output.empty());
+}
+
+void Replayer::close_connection(Connection& conn) {
+    if (conn.fd < 0) {
+        return;
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn.fd, nullptr);
+    close(conn.fd);
+    conn.fd = -1;
+    if (conn.auth != AuthState::None) {
+        conn.auth = AuthState::None;
+        --awaiting_auth;
+        ++totals.auth_failed;
+    }
+    totals.skipped += conn.held.size();
+    conn.held.clear();
+}
+
+void usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options] CAPTURE\n"
+            "%s"
+            "  --speed X              replay at X times the captured pace; 0 replays as fast\n"
+            "                         as the server answers (1)\n"
+            "  --drain S              seconds to wait for deliveries after the last event (2)\n",
+            program, target_usage(Options().target).c_str());
+}
+
+bool parse_options(int argc, char** argv, Options& options) {
+    static const std::vector<option> long_options = target_long_options({
+        {"speed", required_argument, nullptr, 's'}, {"drain", required_argument, nullptr, 'D'}});
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options.data(), nullptr)) != -1) {
+        if (parse_target_option(opt, optarg, options.target)) {
+            continue;
+        }
+        switch (opt) {
+            case 's': options.speed = strcmp(optarg, "max") == 0 ? 0 : atof(optarg); break;
+            case 'D': options.drain = atof(optarg); break;
+            default: return false;
+        }
+    }
+    if (optind != argc - 1 || options.speed < 0 || options.drain < 0) {
+        return false;
+    }
+    options.capture = argv[optind];
+    return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    std::vector<CaptureRecord> records;
+    int64_t captured_at_us = 0;
+    if (!read_traffic_capture(options.capture, records, &captured_at_us)) {
+        fprintf(stderr, "%s is not a traffic capture\n", options.capture.c_str());
+        return 2;
+    }
+    const double captured_seconds = records.empty() ? 0 : records.back().offset_us / 1e6;
+
+    raise_descriptor_limit();
+
+    sockaddr_in address;
+    if (!resolve_target(options.target, address)) {
+        return 2;
+    }
+
+    char pace[32] = "max speed";
+    if (options.speed > 0) {
+        snprintf(pace, sizeof(pace), "%gx", options.speed);
+    }
+    fprintf(stderr, "replay: %zu events over %.1fs captured; replaying at %s\n", records.size(), captured_seconds, pace);
+    Replayer replayer(options, address, records);
+    if (!replayer.run()) {
+        return 1;
+    }
+
+    const Totals& totals = replayer.totals;
+    HistogramSnapshot latency, lag;
+    replayer.latency.merge_into(latency);
+    replayer.schedule_lag.merge_into(lag);
+    const double elapsed = std::max(replayer.elapsed_seconds, 1e-9);
+
+    std::string out = "{\n";
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer),
+             "  \"capture\": \"%s\",\n  \"captured_at_us\": %lld,\n  \"captured_s\": %.3f,\n  \"speed\": %.2f,\n"
+             "  \"elapsed_s\": %.3f,\n  \"events\": %llu,\n  \"connections\": %llu,\n  \"connect_failures\": %llu,\n"
+             "  \"auth_as_captured\": %llu,\n  \"auth_mismatched\": %llu,\n  \"messages\": %llu,\n"
+             "  \"commands\": %llu,\n  \"bytes_sent\": %llu,\n  \"achieved_rate\": %.1f,\n  \"delivered\": %llu,\n"
+             "  \"skipped\": %llu,\n  \"send_backlogged\": %llu,\n  \"server_disconnects\": %llu,\n",
+             options.capture.c_str(), static_cast<long long>(captured_at_us), captured_seconds, options.speed,
+             replayer.elapsed_seconds, static_cast<unsigned long long>(totals.events),
+             static_cast<unsigned long long>(totals.connections),
+             static_cast<unsigned long long>(totals.connect_failures),
+             static_cast<unsigned long long>(totals.auth_ok), static_cast<unsigned long long>(totals.auth_failed),
+             static_cast<unsigned long long>(totals.messages), static_cast<unsigned long long>(totals.commands),
+             static_cast<unsigned long long>(totals.bytes), (totals.messages + totals.commands) / elapsed,
+             static_cast<unsigned long long>(totals.delivered), static_cast<unsigned long long>(totals.skipped),
+             static_cast<unsigned long long>(totals.send_backlogged),
+             static_cast<unsigned long long>(totals.disconnects));
+    out += buffer;
+    append_percentiles(out, "latency_us", latency);
+    out += ",\n";
+    append_percentiles(out, "schedule_lag_us", lag);
+    out += "\n}\n";
+    fputs(out.c_str(), stdout);
+    return totals.connect_failures == 0 ? 0 : 1;
+}
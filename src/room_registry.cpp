@@ -0,0 +1,217 @@
+#include "room_registry.h"
+#include "constants.h"
+#include <algorithm>
+
+bool valid_room_name(std::string_view name) {
+    if (name.size() < 2 || name.size() > ROOM_NAME_MAX_LENGTH || name[0] != '#') {
+        return false;
+    }
+    return std::all_of(name.begin() + 1, name.end(), [](char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-';
+    });
+}
+
+RoomDelivery::~RoomDelivery() {
+    if (!order) {
+        return;
+    }
+    wait_turn();
+    {
+        std::lock_guard<std::mutex> lock(order->mtx);
+        order->done = ticket + 1;
+    }
+    order->done_cv.notify_all();
+}
+
+void RoomDelivery::wait_turn() {
+    std::unique_lock<std::mutex> lock(order->mtx);
+    order->done_cv.wait(lock, [this]() { return order->done == ticket; });
+}
+
+RoomDelivery claim_room_delivery(std::string_view name, RoomState& room, bool take_batch) {
+    RoomDelivery delivery;
+    delivery.room = std::string(name);
+    delivery.members = room.members;
+    if (take_batch) {
+        delivery.batch = std::move(room.batch);
+        room.batch.clear();
+        room.batch_due = {};
+    }
+    delivery.order = room.order;
+    delivery.ticket = room.order->claimed++;
+    return delivery;
+}
+
+RoomRegistry& RoomRegistry::instance() {
+    // Never destroyed: sockets are still detached from the pool during exit
+    static RoomRegistry* registry = new RoomRegistry();
+    return *registry;
+}
+
+RoomJoin RoomRegistry::join(uint32_t room_id, std::string_view name, int socket) {
+    std::lock_guard<InstrumentedMutex> lock(mtx);
+    auto room = rooms.find(name);
+    if (room == rooms.end()) {
+        room = rooms.emplace(std::string(name), RoomState{}).first;
+        room->second.id = room_id;
+    }
+    std::vector<int>& members = room->second.members;
+    auto position = std::lower_bound(members.begin(), members.end(), socket);
+    if (position != members.end() && *position == socket) {
+        return RoomJoin::AlreadyMember;
+    }
+    std::vector<std::string>& joined = rooms_by_socket[socket];
+    if (joined.size() >= MAX_ROOMS_PER_CONNECTION) {
+        if (members.empty()) {
+            rooms.erase(room);
+        }
+        return RoomJoin::TooManyRooms;
+    }
+    members.insert(position, socket);
+    joined.push_back(room->first);
+    return RoomJoin::Joined;
+}
+
+bool RoomRegistry::leave(std::string_view name, int socket) {
+    InFlight in_flight;
+    {
+        std::lock_guard<InstrumentedMutex> lock(mtx);
+        if (!remove_member_locked(name, socket, in_flight)) {
+            return false;
+        }
+        auto joined = rooms_by_socket.find(socket);
+        if (joined != rooms_by_socket.end()) {
+            auto& names = joined->second;
+            names.erase(std::find(names.begin(), names.end(), name));
+            if (names.empty()) {
+                rooms_by_socket.erase(joined);
+            }
+        }
+    }
+    wait_in_flight(in_flight);
+    return true;
+}
+
+void RoomRegistry::leave_all(int socket) {
+    InFlight in_flight;
+    {
+        std::lock_guard<InstrumentedMutex> lock(mtx);
+        auto joined = rooms_by_socket.find(socket);
+        if (joined == rooms_by_socket.end()) {
+            return;
+        }
+        for (const auto& name : joined->second) {
+            remove_member_locked(name, socket, in_flight);
+        }
+        rooms_by_socket.erase(joined);
+    }
+    wait_in_flight(in_flight);
+}
+
+void RoomRegistry::wait_in_flight(const InFlight& in_flight) {
+    for (const auto& [order, claimed] : in_flight) {
+        std::unique_lock<std::mutex> lock(order->mtx);
+        order->done_cv.wait(lock, [&]() { return order->done >= claimed; });
+    }
+}
+
+bool RoomRegistry::remove_member_locked(std::string_view name, int socket, InFlight& in_flight) {
+    auto room = rooms.find(name);
+    if (room == rooms.end()) {
+        return false;
+    }
+    std::vector<int>& members = room->second.members;
+    auto position = std::lower_bound(members.begin(), members.end(), socket);
+    if (position == members.end() || *position != socket) {
+        return false;
+    }
+    members.erase(position);
+    if (room->second.order->claimed > 0) {
+        in_flight.emplace_back(room->second.order, room->second.order->claimed);
+    }
+    for (auto& entry : room->second.batch) {
+        if (entry.sender == socket) {
+            entry.sender = -1;  // the socket may be reused before the batch goes out
+        }
+    }
+    if (members.empty()) {
+        rooms.erase(room);
+    }
+    return true;
+}
+
+uint32_t RoomRegistry::member_room_id(std::string_view name, int socket) const {
+    std::lock_guard<InstrumentedMutex> lock(mtx);
+    auto room = rooms.find(name);
+    if (room == rooms.end() ||
+        !std::binary_search(room->second.members.begin(), room->second.members.end(), socket)) {
+        return 0;
+    }
+    return room->second.id;
+}
+
+bool RoomRegistry::with_members(std::string_view name, int socket, const std::function<void(RoomState&)>& fn) {
+    std::lock_guard<InstrumentedMutex> lock(mtx);
+    auto room = rooms.find(name);
+    if (room == rooms.end() ||
+        !std::binary_search(room->second.members.begin(), room->second.members.end(), socket)) {
+        return false;
+    }
+    RoomState& state = room->second;
+    fn(state);
+    if (!state.batch.empty() && state.batch_due == std::chrono::steady_clock::time_point{}) {
+        state.batch_due = std::chrono::steady_clock::now() + std::chrono::milliseconds(state.batch_window_ms);
+        open_batches.push_back(room->first);
+        batch_opened.notify_one();
+    } else if (state.batch.empty()) {
+        state.batch_due = {};
+    }
+    return true;
+}
+
+std::vector<RoomDelivery> RoomRegistry::take_due_batches() {
+    std::unique_lock<InstrumentedMutex> lock(mtx);
+    while (true) {
+        const auto now = std::chrono::steady_clock::now();
+        auto next_due = std::chrono::steady_clock::time_point::max();
+        std::vector<RoomDelivery> due;
+        for (size_t i = 0; i < open_batches.size();) {
+            auto room = rooms.find(open_batches[i]);
+            if (room == rooms.end() || room->second.batch.empty()) {
+                // The room emptied, or its batch went out early
+                open_batches[i] = std::move(open_batches.back());
+                open_batches.pop_back();
+                continue;
+            }
+            RoomState& state = room->second;
+            if (state.batch_due > now) {
+                next_due = std::min(next_due, state.batch_due);
+                ++i;
+                continue;
+            }
+            due.push_back(claim_room_delivery(room->first, state, true));
+            open_batches[i] = std::move(open_batches.back());
+            open_batches.pop_back();
+        }
+        if (!due.empty()) {
+            return due;
+        }
+        if (next_due == std::chrono::steady_clock::time_point::max()) {
+            batch_opened.wait(lock);
+        } else {
+            batch_opened.wait_until(lock, next_due);
+        }
+    }
+}
+
+std::vector<RoomSummary> RoomRegistry::list(int socket) const {
+    std::lock_guard<InstrumentedMutex> lock(mtx);
+    std::vector<RoomSummary> summaries;
+    summaries.reserve(rooms.size());
+    for (const auto& [name, room] : rooms) {
+        summaries.push_back(RoomSummary{name, room.members.size(),
+                                        std::binary_search(room.members.begin(), room.members.end(), socket),
+                                        room.batch_window_ms});
+    }
+    return summaries;
+}
@@ -0,0 +1,612 @@
+#include "segmented_log.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const size_t RECORD_HEADER_SIZE = 2 * sizeof(uint32_t);
+const size_t BODY_HEADER_SIZE = sizeof(uint64_t) + sizeof(int64_t);
+const uint32_t INDEX_MAGIC = 0x58494843;  // "CHIX"
+
+bool write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        length -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+template <typename T>
+void put(std::string& out, const T& value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T get(const char* data) {
+    T value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+// Visits the complete records in [offset, end) of a segment's bytes at
+// `base`, passing over `skip` of them first. Returns the offset of the first
+// record left unvisited.
+uint64_t visit_records(const char* base, uint64_t offset, uint64_t end, uint64_t& skip, uint64_t after_seq,
+                       const std::function<bool(const LogRecordView&)>& visitor, bool& keep_going) {
+    while (keep_going && offset + RECORD_HEADER_SIZE + BODY_HEADER_SIZE <= end) {
+        uint32_t body_length = get<uint32_t>(base + offset);
+        if (offset + RECORD_HEADER_SIZE + body_length > end) {
+            break;  // the rest was not on disk yet
+        }
+        if (skip > 0) {
+            --skip;
+        } else {
+            const char* body = base + offset + RECORD_HEADER_SIZE;
+            LogRecordView record{get<uint64_t>(body), get<int64_t>(body + sizeof(uint64_t)),
+                                 std::string_view(body + BODY_HEADER_SIZE, body_length - BODY_HEADER_SIZE)};
+            if (record.seq > after_seq) {
+                keep_going = visitor(record);
+            }
+        }
+        offset += RECORD_HEADER_SIZE + body_length;
+    }
+    return offset;
+}
+
+} // namespace
+
+uint32_t crc32(const char* data, size_t length) {
+    static const auto table = [] {
+        std::vector<uint32_t> entries(256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            entries[i] = c;
+        }
+        return entries;
+    }();
+
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < length; ++i) {
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+SegmentedLog::SegmentedLog(SegmentedLogOptions options)
+    : options(std::move(options)), active_fd(-1), last_seq(0) {}
+
+SegmentedLog::~SegmentedLog() {
+    std::lock_guard<std::mutex> lock(mtx);
+    flushLocked();
+    if (active_fd != -1) {
+        close(active_fd);
+    }
+}
+
+SegmentedLog::Mapping::~Mapping() {
+    munmap(const_cast<char*>(data), length);
+}
+
+std::string SegmentedLog::segmentPath(uint64_t base_seq, const char* extension) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%020llu", static_cast<unsigned long long>(base_seq));
+    return options.directory + "/" + name + extension;
+}
+
+bool SegmentedLog::open() {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (mkdir(options.directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        return false;
+    }
+
+    DIR* dir = opendir(options.directory.c_str());
+    if (!dir) {
+        return false;
+    }
+    std::vector<uint64_t> bases;
+    while (dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.size() == 24 && name.compare(20, 4, ".log") == 0 &&
+            name.find_first_not_of("0123456789") == 20) {
+            bases.push_back(std::stoull(name.substr(0, 20)));
+        }
+    }
+    closedir(dir);
+    std::sort(bases.begin(), bases.end());
+
+    segments.clear();
+    for (size_t i = 0; i < bases.size(); ++i) {
+        Segment segment;
+        segment.base_seq = bases[i];
+        segment.last_seq = bases[i] - 1;
+        bool active = i + 1 == bases.size();
+        if (!loadSegment(segment, active)) {
+            return false;
+        }
+        if (segment.record_count > 0) {
+            last_seq = std::max(last_seq, segment.last_seq);
+        }
+        segments.push_back(std::move(segment));
+    }
+    return segments.empty() || openActive();
+}
+
+bool SegmentedLog::openActive() {
+    active_fd = ::open(segmentPath(segments.back().base_seq, ".log").c_str(),
+                       O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    return active_fd != -1;
+}
+
+// Sealed segments load from their .idx file when it matches; everything else
+// (and the active segment, which may have a torn tail) is rescanned.
+bool SegmentedLog::loadSegment(Segment& segment, bool active) {
+    if (!active && readIndexFile(segment)) {
+        return true;
+    }
+    int fd = ::open(segmentPath(segment.base_seq, ".log").c_str(), active ? O_RDWR : O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    bool ok = scanSegment(segment, fd);
+    struct stat st;
+    if (ok && active && fstat(fd, &st) == 0 && static_cast<uint64_t>(st.st_size) > segment.size) {
+        ok = ftruncate(fd, static_cast<off_t>(segment.size)) == 0;
+    }
+    close(fd);
+    if (ok && !active) {
+        writeIndexFile(segment);
+    }
+    return ok;
+}
+
+bool SegmentedLog::scanSegment(Segment& segment, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    segment.size = 0;
+    segment.record_count = 0;
+    segment.index.clear();
+    segment.next_index_offset = 0;
+    if (size == 0) {
+        return true;
+    }
+
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    const char* base = static_cast<const char*>(mapped);
+    uint64_t offset = 0;
+    while (offset + RECORD_HEADER_SIZE + BODY_HEADER_SIZE <= size) {
+        uint32_t body_length = get<uint32_t>(base + offset);
+        uint32_t checksum = get<uint32_t>(base + offset + sizeof(uint32_t));
+        const char* body = base + offset + RECORD_HEADER_SIZE;
+        if (body_length < BODY_HEADER_SIZE || offset + RECORD_HEADER_SIZE + body_length > size ||
+            crc32(body, body_length) != checksum) {
+            break;
+        }
+        uint64_t seq = get<uint64_t>(body);
+        int64_t timestamp_ms = get<int64_t>(body + sizeof(uint64_t));
+        if (seq <= segment.last_seq && segment.record_count > 0) {
+            break;
+        }
+        if (offset >= segment.next_index_offset) {
+            segment.index.push_back(IndexEntry{seq, timestamp_ms, offset, segment.record_count});
+            segment.next_index_offset = offset + options.index_interval_bytes;
+        }
+        segment.last_seq = seq;
+        segment.max_timestamp_ms = std::max(segment.max_timestamp_ms, timestamp_ms);
+        segment.record_count++;
+        offset += RECORD_HEADER_SIZE + body_length;
+    }
+    munmap(mapped, size);
+    segment.size = offset;
+    return true;
+}
+
+bool SegmentedLog::writeIndexFile(const Segment& segment) const {
+    std::string contents;
+    put(contents, INDEX_MAGIC);
+    put(contents, segment.base_seq);
+    put(contents, segment.last_seq);
+    put(contents, segment.max_timestamp_ms);
+    put(contents, segment.size);
+    put(contents, segment.record_count);
+    put(contents, static_cast<uint64_t>(segment.index.size()));
+    for (const auto& entry : segment.index) {
+        put(contents, entry.seq);
+        put(contents, entry.timestamp_ms);
+        put(contents, entry.offset);
+        put(contents, entry.ordinal);
+    }
+    put(contents, crc32(contents.data(), contents.size()));
+
+    int fd = ::open(segmentPath(segment.base_seq, ".idx").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    bool ok = write_all(fd, contents.data(), contents.size());
+    close(fd);
+    return ok;
+}
+
+bool SegmentedLog::readIndexFile(Segment& segment) const {
+    int fd = ::open(segmentPath(segment.base_seq, ".idx").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    std::string contents;
+    char chunk[4096];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+        contents.append(chunk, static_cast<size_t>(n));
+    }
+    close(fd);
+
+    const size_t fixed = sizeof(uint32_t) + 6 * sizeof(uint64_t);
+    const size_t entry_size = 4 * sizeof(uint64_t);
+    if (contents.size() < fixed + sizeof(uint32_t) ||
+        crc32(contents.data(), contents.size() - sizeof(uint32_t)) !=
+            get<uint32_t>(contents.data() + contents.size() - sizeof(uint32_t)) ||
+        get<uint32_t>(contents.data()) != INDEX_MAGIC) {
+        return false;
+    }
+    const char* p = contents.data() + sizeof(uint32_t);
+    if (get<uint64_t>(p) != segment.base_seq) {
+        return false;
+    }
+    uint64_t count = get<uint64_t>(p + 5 * sizeof(uint64_t));
+    if (contents.size() != fixed + count * entry_size + sizeof(uint32_t)) {
+        return false;
+    }
+
+    struct stat st;
+    uint64_t size = get<uint64_t>(p + 3 * sizeof(uint64_t));
+    if (stat(segmentPath(segment.base_seq, ".log").c_str(), &st) != 0 || static_cast<uint64_t>(st.st_size) != size) {
+        return false;
+    }
+
+    segment.last_seq = get<uint64_t>(p + sizeof(uint64_t));
+    segment.max_timestamp_ms = get<int64_t>(p + 2 * sizeof(uint64_t));
+    segment.size = size;
+    segment.record_count = get<uint64_t>(p + 4 * sizeof(uint64_t));
+    segment.index.clear();
+    p = contents.data() + fixed;
+    for (uint64_t i = 0; i < count; ++i, p += entry_size) {
+        segment.index.push_back(IndexEntry{get<uint64_t>(p), get<int64_t>(p + 8), get<uint64_t>(p + 16),
+                                           get<uint64_t>(p + 24)});
+    }
+    return true;
+}
+
+// Seals the active segment (fsync + index file) and starts a new one.
+// Caller must hold mtx.
+bool SegmentedLog::rollSegment(uint64_t base_seq) {
+    if (!segments.empty()) {
+        if (!flushLocked()) {
+            return false;
+        }
+        fsync(active_fd);
+        close(active_fd);
+        active_fd = -1;
+        writeIndexFile(segments.back());
+    }
+    Segment segment;
+    segment.base_seq = base_seq;
+    segment.last_seq = base_seq - 1;
+    segments.push_back(std::move(segment));
+    return openActive();
+}
+
+uint64_t SegmentedLog::append(uint64_t seq, int64_t timestamp_ms, std::string_view payload) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (seq == 0) {
+        seq = last_seq + 1;
+    } else if (seq <= last_seq) {
+        return 0;
+    }
+
+    const size_t body_length = BODY_HEADER_SIZE + payload.size();
+    const size_t record_length = RECORD_HEADER_SIZE + body_length;
+    if (segments.empty() ||
+        (segments.back().record_count > 0 && segments.back().size + record_length > options.segment_bytes)) {
+        if (!rollSegment(seq)) {
+            return 0;
+        }
+    }
+
+    // A backlog left by a failed flush must reach the file before more is
+    // buffered behind it
+    if (write_buffer.size() >= options.flush_bytes && !flushLocked()) {
+        return 0;
+    }
+
+    Segment& segment = segments.back();
+    if (segment.size >= segment.next_index_offset) {
+        segment.index.push_back(IndexEntry{seq, timestamp_ms, segment.size, segment.record_count});
+        segment.next_index_offset = segment.size + options.index_interval_bytes;
+    }
+
+    const size_t header_at = write_buffer.size();
+    put(write_buffer, static_cast<uint32_t>(body_length));
+    put(write_buffer, static_cast<uint32_t>(0));
+    put(write_buffer, seq);
+    put(write_buffer, timestamp_ms);
+    write_buffer.append(payload.data(), payload.size());
+    uint32_t checksum = crc32(write_buffer.data() + header_at + RECORD_HEADER_SIZE, body_length);
+    std::memcpy(&write_buffer[header_at + sizeof(uint32_t)], &checksum, sizeof(checksum));
+
+    segment.size += record_length;
+    segment.record_count++;
+    segment.last_seq = seq;
+    segment.max_timestamp_ms = std::max(segment.max_timestamp_ms, timestamp_ms);
+    last_seq = seq;
+
+    if (write_buffer.size() >= options.flush_bytes) {
+        flushLocked();  // on failure the record stays buffered for the next flush
+    }
+    return seq;
+}
+
+bool SegmentedLog::flush() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return flushLocked();
+}
+
+bool SegmentedLog::flushLocked() {
+    if (write_buffer.empty() || active_fd == -1) {
+        return true;
+    }
+    // Only what reached the file leaves the buffer: segment.size already
+    // counts the rest, and readers take it from the buffer past diskSize()
+    size_t written = 0;
+    while (written < write_buffer.size()) {
+        ssize_t result = write(active_fd, write_buffer.data() + written, write_buffer.size() - written);
+        if (result < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        written += static_cast<size_t>(result);
+    }
+    write_buffer.erase(0, written);
+    return write_buffer.empty();
+}
+
+uint64_t SegmentedLog::diskSize(const Segment& segment) const {
+    return &segment == &segments.back() ? segment.size - write_buffer.size() : segment.size;
+}
+
+// Caller must hold mtx. The active segment is mapped up to its roll size at
+// once, so the file grows into the mapping and appends rarely need a new one;
+// a mapping is only replaced once the file outgrows it.
+std::shared_ptr<const SegmentedLog::Mapping> SegmentedLog::mapSegment(Segment& segment) {
+    const uint64_t size = diskSize(segment);
+    if (segment.mapped && segment.mapped->length >= size) {
+        return segment.mapped;
+    }
+    if (size == 0) {
+        return nullptr;
+    }
+    uint64_t length = size;
+    if (&segment == &segments.back()) {
+        length = std::max<uint64_t>(size, options.segment_bytes);
+    }
+    int fd = ::open(segmentPath(segment.base_seq, ".log").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return nullptr;
+    }
+    void* mapped = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return nullptr;
+    }
+    // Scans still reading the old mapping keep it alive
+    segment.mapped = std::make_shared<const Mapping>(static_cast<const char*>(mapped), length);
+    return segment.mapped;
+}
+
+// Caller must hold mtx
+SegmentedLog::Segment* SegmentedLog::findSegmentLocked(uint64_t base_seq) {
+    auto segment = std::lower_bound(segments.begin(), segments.end(), base_seq,
+                                    [](const Segment& s, uint64_t seq) { return s.base_seq < seq; });
+    return segment != segments.end() && segment->base_seq == base_seq ? &*segment : nullptr;
+}
+
+// Caller must hold mtx
+SegmentedLog::SegmentView SegmentedLog::viewSegment(const Segment& segment, uint64_t start_offset,
+                                                    uint64_t skip_records) const {
+    return SegmentView{segment.base_seq, segment.mapped, diskSize(segment), segment.size, start_offset, skip_records};
+}
+
+std::shared_ptr<const SegmentedLog::Mapping> SegmentedLog::mapForRead(uint64_t base_seq) {
+    std::lock_guard<std::mutex> lock(mtx);
+    Segment* segment = findSegmentLocked(base_seq);
+    return segment ? mapSegment(*segment) : nullptr;
+}
+
+// Copies bytes [from, to) of a segment, taking whatever has not reached the
+// file yet from the write buffer
+std::string SegmentedLog::readUnflushed(uint64_t base_seq, uint64_t from, uint64_t to) {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::string bytes;
+    Segment* segment = findSegmentLocked(base_seq);
+    if (!segment) {
+        return bytes;  // dropped by retention
+    }
+    const uint64_t disk = diskSize(*segment);
+    if (from < disk) {
+        std::shared_ptr<const Mapping> mapping = mapSegment(*segment);
+        if (!mapping) {
+            return bytes;
+        }
+        bytes.append(mapping->data + from, std::min(to, disk) - from);
+    }
+    if (to > disk && segment == &segments.back()) {
+        const uint64_t buffered_from = std::max(from, disk);
+        bytes.append(write_buffer, buffered_from - disk, to - buffered_from);
+    }
+    return bytes;
+}
+
+void SegmentedLog::visitView(SegmentView& view, uint64_t after_seq,
+                             const std::function<bool(const LogRecordView&)>& visitor, bool& keep_going) {
+    uint64_t offset = view.start_offset;
+    uint64_t skip = view.skip_records;
+    if (offset < view.disk_size) {
+        if (!view.mapping || view.mapping->length < view.disk_size) {
+            view.mapping = mapForRead(view.base_seq);
+        }
+        if (!view.mapping) {
+            return;
+        }
+        offset = visit_records(view.mapping->data, offset, std::min<uint64_t>(view.disk_size, view.mapping->length),
+                               skip, after_seq, visitor, keep_going);
+    }
+    if (keep_going && offset < view.size) {
+        // Buffered when the scan started, and maybe written out since
+        std::string bytes = readUnflushed(view.base_seq, offset, view.size);
+        visit_records(bytes.data(), 0, bytes.size(), skip, after_seq, visitor, keep_going);
+    }
+}
+
+void SegmentedLog::scanFromSeq(uint64_t after_seq, const std::function<bool(const LogRecordView&)>& visitor) {
+    std::vector<SegmentView> views;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        // Last segment starting at or before the first wanted sequence number
+        auto segment = std::upper_bound(segments.begin(), segments.end(), after_seq + 1,
+                                        [](uint64_t seq, const Segment& s) { return seq < s.base_seq; });
+        if (segment != segments.begin()) {
+            --segment;
+        }
+        for (bool first = true; segment != segments.end(); ++segment, first = false) {
+            uint64_t start_offset = 0;
+            if (first) {
+                auto entry = std::upper_bound(segment->index.begin(), segment->index.end(), after_seq + 1,
+                                              [](uint64_t seq, const IndexEntry& e) { return seq < e.seq; });
+                if (entry != segment->index.begin()) {
+                    start_offset = std::prev(entry)->offset;
+                }
+            }
+            views.push_back(viewSegment(*segment, start_offset, 0));
+        }
+    }
+
+    bool keep_going = true;
+    for (size_t i = 0; i < views.size() && keep_going; ++i) {
+        visitView(views[i], after_seq, visitor, keep_going);
+    }
+}
+
+void SegmentedLog::scanTail(size_t limit, const std::function<bool(const LogRecordView&)>& visitor) {
+    std::vector<SegmentView> views;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (limit == 0 || segments.empty()) {
+            return;
+        }
+
+        // Find the segment and ordinal of the first record to return
+        size_t first = segments.size() - 1;
+        uint64_t remaining = limit;
+        while (first > 0 && segments[first].record_count < remaining) {
+            remaining -= segments[first].record_count;
+            --first;
+        }
+        const Segment& start = segments[first];
+        uint64_t start_ordinal = start.record_count > remaining ? start.record_count - remaining : 0;
+
+        // Jump to the closest index entry; the scan skips forward to the ordinal
+        auto entry = std::upper_bound(start.index.begin(), start.index.end(), start_ordinal,
+                                      [](uint64_t ordinal, const IndexEntry& e) { return ordinal < e.ordinal; });
+        uint64_t offset = 0;
+        uint64_t ordinal = 0;
+        if (entry != start.index.begin()) {
+            offset = std::prev(entry)->offset;
+            ordinal = std::prev(entry)->ordinal;
+        }
+        views.push_back(viewSegment(start, offset, start_ordinal - ordinal));
+        for (size_t i = first + 1; i < segments.size(); ++i) {
+            views.push_back(viewSegment(segments[i], 0, 0));
+        }
+    }
+
+    bool keep_going = true;
+    for (size_t i = 0; i < views.size() && keep_going; ++i) {
+        visitView(views[i], 0, visitor, keep_going);
+    }
+}
+
+uint64_t SegmentedLog::dropSegments(int64_t min_timestamp_ms, uint64_t keep_records, size_t max_segments) {
+    std::lock_guard<std::mutex> lock(mtx);
+    uint64_t total = 0;
+    for (const auto& segment : segments) {
+        total += segment.record_count;
+    }
+    uint64_t removed = 0;
+    for (size_t dropped = 0; dropped < max_segments && segments.size() > 1; ++dropped) {
+        const Segment& oldest = segments.front();
+        bool too_old = min_timestamp_ms > 0 && oldest.max_timestamp_ms < min_timestamp_ms;
+        bool over_count = keep_records > 0 && total - oldest.record_count >= keep_records;
+        if (!too_old && !over_count) {
+            break;
+        }
+        total -= oldest.record_count;
+        removed += oldest.record_count;
+        removeOldestSegment();
+    }
+    return removed;
+}
+
+void SegmentedLog::removeOldestSegment() {
+    Segment& oldest = segments.front();
+    unlink(segmentPath(oldest.base_seq, ".log").c_str());
+    unlink(segmentPath(oldest.base_seq, ".idx").c_str());
+    segments.erase(segments.begin());
+}
+
+uint64_t SegmentedLog::firstSeq() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    for (const auto& segment : segments) {
+        if (segment.record_count > 0) {
+            return segment.index.empty() ? segment.base_seq : segment.index.front().seq;
+        }
+    }
+    return 0;
+}
+
+uint64_t SegmentedLog::lastSeq() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return last_seq;
+}
+
+size_t SegmentedLog::segmentCount() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return segments.size();
+}
+
+uint64_t SegmentedLog::recordCount() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    uint64_t count = 0;
+    for (const auto& segment : segments) {
+        count += segment.record_count;
+    }
+    return count;
+}
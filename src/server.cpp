@@ -5,6 +5,14 @@
 #include "message_queue.h"
 #include "server_metrics.h"
 #include "database.h"
+#include "history_snapshot.h"
+#include "message_store.h"
+#include "logger.h"
+#include "flight_recorder.h"
+#include "command_processor.h"
+#include "room_registry.h"
+#include "fanout_pool.h"
+#include "cluster.h"
 #include <iostream>
 #include <cstring>
 #include <thread>
@@ -18,58 +26,150 @@
 #include <chrono>
 #include <atomic>
 #include <map>
+#include <optional>
 #include <queue>
 #include <condition_variable>
+#include <algorithm>
 
 // Only these globals are defined here:
-std::mutex history_mtx;
-std::mutex console_mtx;
-std::vector<std::string> chat_history;
+HistoryRing chat_history(MAX_HISTORY_SIZE);
+static InstrumentedMutex sequence_mtx("history_sequence");
 
-bool send_with_retry(int socket, const std::string& message, int max_retries = MAX_RETRY_ATTEMPTS) {
-    for (int retry_count = 0; retry_count < max_retries; ++retry_count) {
-        int result = send(socket, message.c_str(), static_cast<ssize_t>(message.length()), 0);
-        if (result > 0) {
-            return true;  // Success
+std::string format_broadcast(const std::string& message) {
+    std::time_t now = std::time(nullptr);
+    std::tm local;
+    localtime_r(&now, &local);
+    char time_buffer[20];
+    size_t prefix_length = std::strftime(time_buffer, sizeof(time_buffer), "[%H:%M:%S] ", &local);
+
+    // Pre-allocate the timed message
+    std::string timed_message;
+    timed_message.reserve(prefix_length + message.length());
+    timed_message.append(time_buffer, prefix_length);
+    timed_message += message;
+    return timed_message;
+}
+
+// Stamps, stores and sends one broadcast to every connection here but
+// `sender`, and passes it on to the cluster unless it is `remote`. A remote
+// broadcast came from a cluster peer: sender is -1, and sender_username is a
+// remote_username(), stored as such and never looked up as a local account.
+static void fan_out_broadcast(int sender, const std::string& sender_username, const std::string& message,
+                              const std::string& message_content, int64_t timestamp_ms, MessageTrace* trace,
+                              bool remote) {
+    std::string timed_message = format_broadcast(message);
+
+    // Look up the sender's user ID before taking the sequencing lock
+    int sender_id = 0;
+    if (!remote && !sender_username.empty()) {
+        sender_id = Database::getInstance().getUserID(sender_username);
+    }
+    const bool persist = sender_id > 0 || remote;
+
+    // Persisted broadcasts have receiver_id 0, and remote ones sender_id 0;
+    // the sequence number is filled in below. Built before taking the
+    // sequencing lock.
+    StoredMessage stored;
+    if (persist) {
+        stored.timestamp_ms = timestamp_ms;
+        stored.sender_id = sender_id;
+        stored.sender_name = sender_username;
+        stored.content = message_content;
+    }
+
+    // Stamp the broadcast with its sequence number and hand it to the stores
+    // in one critical section, so every store sees broadcasts in sequence
+    // order. Both store appends only queue; broadcast_writer() and
+    // snapshot_writer() do the writes off this lock. Readers of chat_history
+    // are never blocked.
+    uint64_t seq = 0;
+    {
+        std::lock_guard<InstrumentedMutex> lock(sequence_mtx);
+        seq = chat_history.append(timed_message);
+        snapshot_writer().enqueue(seq, timed_message);
+        if (persist) {
+            stored.seq = seq;
+            broadcast_writer().enqueue(std::move(stored));
+        }
+
+        // Queued in sequence order, so peers see this node's broadcasts in
+        // the order its own clients do
+        ClusterNode* node = cluster_node();
+        if (!remote && node) {
+            node->publish_broadcast(timestamp_ms, sender_username, message_content);
         }
+    }
+    if (trace) {
+        trace->persist_ns = trace_now();
+    }
+
+    // Track failed connections for batch cleanup
+    std::vector<Connection*> failed_connections;
+
+    // Binary clients get a ChatMessage frame, encoded once for all of them
+    std::string chat_frame;
 
-        if (errno == EPIPE) {
-            return false;  // Client disconnected
+    // Send to all active connections. pool_mtx is held until every recipient
+    // was tried, which keeps broadcasts in order for each of them.
+    {
+        static thread_local std::vector<FanoutTarget> targets;
+        static thread_local std::vector<Connection*> recipients;
+        targets.clear();
+        recipients.clear();
+        std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+        for (auto& conn : connection_pool) {
+            if (!conn.in_use || conn.socket == sender) {
+                continue;
+            }
+            if (conn.binary && chat_frame.empty()) {
+                chat_frame = encode_chat(seq, timestamp_ms, sender_username, message_content);
+            }
+            targets.push_back(FanoutTarget{conn.socket, conn.binary});
+            recipients.push_back(&conn);
         }
 
-        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            return false;  // Unrecoverable error
+        auto fanout_start = std::chrono::steady_clock::now();
+        FanoutResult sent = FanoutPool::instance().deliver(targets, timed_message, chat_frame);
+        auto fanout_end = std::chrono::steady_clock::now();
+        metrics.record_fanout(std::chrono::duration<double, std::milli>(fanout_end - fanout_start).count(),
+                              sent.parallel);
+
+        auto failed = sent.failed.begin();
+        for (size_t i = 0; i < recipients.size(); ++i) {
+            if (failed != sent.failed.end() && *failed == i) {
+                failed_connections.push_back(recipients[i]);
+                log_message("Failed to broadcast to client " + recipients[i]->username);
+                ++failed;
+            } else {
+                recipients[i]->last_activity = fanout_end;
+            }
+        }
+        if (trace && sent.first_send_ns != 0) {
+            trace->first_send_ns = sent.first_send_ns;
+            trace->last_send_ns = sent.last_send_ns;
         }
+    }
 
-        // Wait before retry
-        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    // Cleanup failed connections
+    for (auto* conn : failed_connections) {
+        release_connection(conn);
     }
-    return false;  // Max retries reached
 }
 
-void broadcast(int sender, const std::string& message) {
+void broadcast(int sender, const std::string& message, MessageTrace* trace = nullptr) {
     auto start = std::chrono::steady_clock::now();
 
     // Check message size
     if (message.length() > MAX_MESSAGE_SIZE) {
-        log_message("Message too large, dropping broadcast");
-        metrics.messages_dropped++;
+        log_at(LogLevel::Warn, "Message too large, dropping broadcast");
+        metrics.record_drop(DropLane::Oversize);
+        flight_record(FlightEvent::Drop, sender, static_cast<uint64_t>(DropLane::Oversize));
         return;
     }
 
-    // Get sender username and user ID for database storage
-    std::string sender_username;
-    int sender_id = 0;
-    {
-        std::lock_guard<std::mutex> lock(pool_mtx);
-        for (const auto& conn : connection_pool) {
-            if (conn.in_use && conn.socket == sender) {
-                sender_username = conn.username;
-                break;
-            }
-        }
-    }
-    
+    // Get sender username for database storage
+    std::string sender_username = username_for_socket(sender);
+
     // Extract message content (remove username prefix if present)
     std::string message_content = message;
     size_t colon_pos = message.find(": ");
@@ -77,87 +177,320 @@ void broadcast(int sender, const std::string& message) {
         // Message format is "username: content", extract just content
         message_content = message.substr(colon_pos + 2);
     }
-    
-    // Get user ID from database
-    if (!sender_username.empty()) {
-        Database& db = Database::getInstance();
-        sender_id = db.getUserID(sender_username);
-        
-        // Store message in database (receiver_id = 0 for broadcast)
-        if (sender_id > 0) {
-            db.storeMessage(sender_id, 0, message_content);
+
+    metrics.record_message("broadcast");
+
+    fan_out_broadcast(sender, sender_username, message, message_content, current_time_ms(), trace, false);
+
+    auto end = std::chrono::steady_clock::now();
+    double latency = std::chrono::duration<double, std::milli>(end - start).count();
+    metrics.record_message("broadcast", latency);
+}
+
+// Tells binary clients other than `socket` that `username` came or went;
+// true if another connection here is still logged in as them
+static bool notify_presence(int socket, const std::string& username, bool online) {
+    const std::string frame = encode_presence(online, username);
+    bool still_here = false;
+    std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+    for (auto& conn : connection_pool) {
+        if (!conn.in_use || !conn.authenticated || conn.socket == socket) {
+            continue;
+        }
+        still_here = still_here || conn.username == username;
+        if (conn.binary) {
+            send_to_client(conn.socket, frame);
         }
     }
+    return still_here;
+}
 
-    // Pre-allocate the timed message
-    std::string timed_message;
-    {
-        std::time_t now = std::time(nullptr);
-        char time_buffer[20];
-        std::strftime(time_buffer, sizeof(time_buffer), "[%H:%M:%S] ", std::localtime(&now));
-        timed_message.reserve(strlen(time_buffer) + message.length());
-        timed_message += time_buffer;
-        timed_message += message;
+void broadcast_presence(int socket, const std::string& username, bool online) {
+    const bool still_here = notify_presence(socket, username, online);
+    // Peers track users, not connections: they hear when a user's first
+    // connection here logs in and when their last one leaves
+    ClusterNode* node = cluster_node();
+    if (node && (online || !still_here)) {
+        node->publish_presence(username, online);
     }
+}
 
-    metrics.record_message("broadcast");
-    metrics.record_bytes(timed_message.length() * (metrics.current_connections.load() - 1));
+namespace {
 
-    // Store in chat history (in-memory for fast access)
-    {
-        std::lock_guard<std::mutex> lock(history_mtx);
-        chat_history.push_back(timed_message);
-        if (chat_history.size() > MAX_HISTORY_SIZE) {
-            chat_history.erase(chat_history.begin());
+// Hands what cluster peers send to this server's clients. Their users are
+// shown here by remote_username(), so they cannot pass for local accounts.
+class ServerClusterHandler : public ClusterHandler {
+public:
+    void peer_broadcast(uint16_t node, int64_t timestamp_ms, const std::string& sender,
+                        const std::string& text) override {
+        auto start = std::chrono::steady_clock::now();
+        if (text.size() > MAX_MESSAGE_SIZE) {
+            metrics.record_drop(DropLane::Oversize);
+            return;
         }
+        const std::string remote_sender = remote_username(sender, node);
+        fan_out_broadcast(-1, remote_sender, remote_sender + ": " + text, text, timestamp_ms, nullptr, true);
+        auto end = std::chrono::steady_clock::now();
+        metrics.record_message("peer_broadcast", std::chrono::duration<double, std::milli>(end - start).count());
     }
 
-    // Track failed connections for batch cleanup
-    std::vector<Connection*> failed_connections;
-    failed_connections.reserve(8);  // Reserve space for potential failures
+    bool peer_private(uint16_t node, const std::string& sender, const std::string& recipient,
+                      const std::string& text) override {
+        metrics.record_message("peer_private");
+        return deliver_peer_private(remote_username(sender, node), recipient, text);
+    }
 
-    // Send to all active connections
-    {
-        std::lock_guard<std::mutex> lock(pool_mtx);
-        for (auto& conn : connection_pool) {
-            if (!conn.in_use || conn.socket == sender) {
-                continue;
+    void peer_presence(uint16_t node, const std::string& username, bool online) override {
+        notify_presence(-1, remote_username(username, node), online);
+    }
+
+    std::vector<std::string> local_users() override {
+        std::vector<std::string> users;
+        {
+            std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+            for (const auto& conn : connection_pool) {
+                if (conn.in_use && conn.authenticated) {
+                    users.push_back(conn.username);
+                }
             }
+        }
+        std::sort(users.begin(), users.end());
+        users.erase(std::unique(users.begin(), users.end()), users.end());
+        return users;
+    }
+};
 
-            if (!send_with_retry(conn.socket, timed_message)) {
-                failed_connections.push_back(&conn);
-                log_message("Failed to broadcast to client " + conn.username);
-            } else {
-                conn.last_activity = std::chrono::steady_clock::now();
+}  // namespace
+
+ClusterHandler& server_cluster_handler() {
+    static ServerClusterHandler handler;
+    return handler;
+}
+
+// Releases connections whose sockets failed during a room delivery; called
+// once the delivery is done, since releasing waits for it
+static void release_room_failures(const std::vector<int>& failed_sockets) {
+    for (int socket : failed_sockets) {
+        Connection* conn = nullptr;
+        std::string username;
+        {
+            std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+            if ((conn = find_connection_locked(socket))) {
+                username = conn->username;
             }
         }
+        if (conn) {
+            log_message("Failed to send room message to client " + username);
+            release_connection(conn);
+        }
     }
+}
 
-    // Cleanup failed connections
-    for (auto* conn : failed_connections) {
-        release_connection(conn);
+// Delivers a batch taken from a room: one write per member, the text lines
+// or one RoomBatch frame. Members that sent part of the batch get it without
+// their own messages.
+static void flush_room_batch(RoomDelivery& room, std::vector<int>& failed_sockets) {
+    room.wait_turn();
+    const std::string& name = room.room;
+    auto start = std::chrono::steady_clock::now();
+    std::string lines;
+    std::string entries;
+    std::vector<int> senders;
+    for (const auto& message : room.batch) {
+        lines += message.line;
+        entries += message.entry;
+        if (message.sender >= 0) {
+            senders.push_back(message.sender);
+        }
+    }
+    std::sort(senders.begin(), senders.end());
+    senders.erase(std::unique(senders.begin(), senders.end()), senders.end());
+
+    static thread_local std::vector<FanoutTarget> targets;
+    targets.clear();
+    std::string frame;
+    for (int socket : room.members) {
+        if (std::binary_search(senders.begin(), senders.end(), socket)) {
+            continue;
+        }
+        const bool binary = is_binary_socket(socket);
+        if (binary && frame.empty()) {
+            frame = encode_room_batch(name, entries);
+        }
+        targets.push_back(FanoutTarget{socket, binary});
+    }
+    FanoutResult sent = FanoutPool::instance().deliver(targets, lines, frame);
+    for (size_t failed : sent.failed) {
+        failed_sockets.push_back(targets[failed].socket);
+    }
+
+    // Senders are few per batch; each gets the others' messages on its own
+    for (int socket : senders) {
+        if (!std::binary_search(room.members.begin(), room.members.end(), socket)) {
+            continue;
+        }
+        const bool binary = is_binary_socket(socket);
+        std::string others;
+        for (const auto& message : room.batch) {
+            if (message.sender != socket) {
+                others += binary ? message.entry : message.line;
+            }
+        }
+        if (others.empty()) {
+            continue;
+        }
+        if (send_to_client(socket, binary ? encode_room_batch(name, others) : others) < 0) {
+            metrics.record_drop(DropLane::SendFailed);
+            flight_record(FlightEvent::Drop, socket, static_cast<uint64_t>(DropLane::SendFailed));
+            failed_sockets.push_back(socket);
+        }
     }
 
     auto end = std::chrono::steady_clock::now();
-    double latency = std::chrono::duration<double, std::milli>(end - start).count();
-    metrics.record_message("broadcast", latency);
+    metrics.record_fanout(std::chrono::duration<double, std::milli>(end - start).count(), sent.parallel);
+    metrics.record_message("room_batch", std::chrono::duration<double, std::milli>(end - start).count());
+}
+
+bool broadcast_room(int sender, std::string_view room, std::string_view text) {
+    auto start = std::chrono::steady_clock::now();
+    const std::string sender_username = username_for_socket(sender);
+    const int64_t timestamp_ms = current_time_ms();
+
+    std::string line;
+    line.reserve(room.size() + sender_username.size() + text.size() + 3);
+    line.append(room).append(" ").append(sender_username).append(": ").append(text);
+    const std::string timed_message = format_broadcast(line);
+    std::string room_frame;
+
+    // Only the room's members are visited. They are copied under the
+    // registry lock and sent to after it; a member leaving (or its socket
+    // being closed) waits for the delivery instead.
+    uint32_t room_id = 0;
+    bool batched = false;
+    std::optional<RoomDelivery> delivery;
+    bool member = RoomRegistry::instance().with_members(room, sender, [&](RoomState& state) {
+        room_id = state.id;
+        if (state.batch_window_ms > 0) {
+            // Text lines are concatenated, so each must end its line
+            RoomBatchEntry queued{sender, timed_message, encode_room_batch_entry(timestamp_ms, sender_username, text)};
+            if (queued.line.empty() || queued.line.back() != '\n') {
+                queued.line += '\n';
+            }
+            state.batch.push_back(std::move(queued));
+            batched = true;
+            if (state.batch.size() >= ROOM_BATCH_MAX_MESSAGES) {
+                delivery.emplace(claim_room_delivery(room, state, true));
+            }
+            return;
+        }
+        delivery.emplace(claim_room_delivery(room, state, false));
+    });
+    if (!member) {
+        return false;
+    }
+
+    std::vector<int> failed_sockets;
+    if (delivery && batched) {
+        flush_room_batch(*delivery, failed_sockets);
+    } else if (delivery) {
+        static thread_local std::vector<FanoutTarget> targets;
+        targets.clear();
+        for (int socket : delivery->members) {
+            if (socket == sender) {
+                continue;
+            }
+            const bool binary = is_binary_socket(socket);
+            if (binary && room_frame.empty()) {
+                room_frame = encode_room_message(timestamp_ms, room, sender_username, text);
+            }
+            targets.push_back(FanoutTarget{socket, binary});
+        }
+
+        delivery->wait_turn();
+        auto fanout_start = std::chrono::steady_clock::now();
+        FanoutResult sent = FanoutPool::instance().deliver(targets, timed_message, room_frame);
+        metrics.record_fanout(
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - fanout_start).count(),
+            sent.parallel);
+        for (size_t failed : sent.failed) {
+            failed_sockets.push_back(targets[failed].socket);
+        }
+    }
+    // The next delivery to the room may start; nothing below sends to it
+    delivery.reset();
+
+    // Two messages sent to one room at the same moment may be stored in the
+    // other order from delivery.
+    const int sender_id = Database::getInstance().getUserID(sender_username);
+    if (sender_id > 0) {
+        StoredMessage stored;
+        stored.timestamp_ms = timestamp_ms;
+        stored.sender_id = sender_id;
+        stored.room_id = room_id;
+        stored.sender_name = sender_username;
+        stored.content = std::string(text);
+        message_store().append(stored);
+    }
+
+    release_room_failures(failed_sockets);
+
+    auto end = std::chrono::steady_clock::now();
+    metrics.record_message("room", std::chrono::duration<double, std::milli>(end - start).count());
+    return true;
+}
+
+bool set_room_batch_window(int socket, std::string_view room, uint32_t window_ms) {
+    std::optional<RoomDelivery> delivery;
+    bool member = RoomRegistry::instance().with_members(room, socket, [&](RoomState& state) {
+        // Whatever was gathered under the old window goes out first, so
+        // nothing overtakes it
+        if (!state.batch.empty()) {
+            delivery.emplace(claim_room_delivery(room, state, true));
+        }
+        state.batch_window_ms = window_ms;
+    });
+    std::vector<int> failed_sockets;
+    if (delivery) {
+        flush_room_batch(*delivery, failed_sockets);
+        delivery.reset();
+    }
+    release_room_failures(failed_sockets);
+    return member;
+}
+
+void room_batch_ticker() {
+    while (true) {
+        try {
+            std::vector<int> failed_sockets;
+            {
+                std::vector<RoomDelivery> due = RoomRegistry::instance().take_due_batches();
+                for (RoomDelivery& room : due) {
+                    flush_room_batch(room, failed_sockets);
+                }
+            }
+            release_room_failures(failed_sockets);
+        } catch (const std::exception& e) {
+            log_message("Exception in room batch ticker: " + std::string(e.what()));
+        }
+    }
 }
 
 void message_worker() {
     while (true) {
         try {
             Message msg = message_queue.pop();
+            flight_record(FlightEvent::Dequeue, msg.sender_socket,
+                          static_cast<uint64_t>(msg.trace.dequeue_ns - msg.trace.enqueue_ns));
             auto start = std::chrono::steady_clock::now();
 
-            // Check if sender is still connected
+            // Check if sender is still connected, and who it is
             bool sender_connected = false;
+            std::string username;
             {
-                std::lock_guard<std::mutex> lock(pool_mtx);
-                for (const auto& conn : connection_pool) {
-                    if (conn.in_use && conn.socket == msg.sender_socket) {
-                        sender_connected = true;
-                        break;
-                    }
+                std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+                if (Connection* conn = find_connection_locked(msg.sender_socket)) {
+                    sender_connected = true;
+                    username = conn->username;
                 }
             }
 
@@ -167,31 +500,24 @@ void message_worker() {
             }
 
             // Process message in batches for better performance
-            if (msg.content[0] == '/') {
+            if (msg.frame == FrameType::None && msg.content[0] == '/') {
                 // Handle commands
                 process_command(msg);
-            } else {
+            } else if (msg.frame == FrameType::None || msg.frame == FrameType::Chat) {
                 // Handle regular messages
-                std::string username;
-                {
-                    std::lock_guard<std::mutex> lock(pool_mtx);
-                    for (const auto& conn : connection_pool) {
-                        if (conn.socket == msg.sender_socket) {
-                            username = conn.username;
-                            break;
-                        }
-                    }
-                }
-                broadcast(msg.sender_socket, username + ": " + msg.content);
+                broadcast(msg.sender_socket, username + ": " + msg.content, &msg.trace);
+            } else {
+                process_frame(msg);
             }
+            message_tracer.record(msg.trace);
 
             auto end = std::chrono::steady_clock::now();
             double latency = std::chrono::duration<double, std::milli>(end - start).count();
             metrics.record_message("processing", latency);
         } catch (const std::exception& e) {
-            log_message("Exception in message worker: " + std::string(e.what()));
+            log_at(LogLevel::Error, "Exception in message worker: " + std::string(e.what()));
         } catch (...) {
-            log_message("Unknown exception in message worker");
+            log_at(LogLevel::Error, "Unknown exception in message worker");
         }
     }
 }
@@ -1,29 +1,159 @@
 #include "server_metrics.h"
 #include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <unordered_map>
 
-// Global metrics instance
+namespace {
+
+// Process-wide registry of message type names. Names are only ever
+// appended, so readers can walk [0, type_count) without a lock.
+std::array<std::string, ServerMetrics::MAX_MESSAGE_TYPES> type_names;
+std::atomic<size_t> type_count{0};
+std::mutex registry_mtx;
+
+size_t register_type(const std::string& type) {
+    std::lock_guard<std::mutex> lock(registry_mtx);
+    const size_t count = type_count.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < count; ++i) {
+        if (type_names[i] == type) {
+            return i;
+        }
+    }
+    if (count == ServerMetrics::MAX_MESSAGE_TYPES - 1) {
+        // Last slot is the overflow bucket
+        type_names[count] = "other";
+        type_count.store(count + 1, std::memory_order_release);
+        return count;
+    }
+    if (count == ServerMetrics::MAX_MESSAGE_TYPES) {
+        return count - 1;
+    }
+    type_names[count] = type;
+    type_count.store(count + 1, std::memory_order_release);
+    return count;
+}
+
+size_t type_id(const std::string& type) {
+    thread_local std::unordered_map<std::string, size_t> cache;
+    auto it = cache.find(type);
+    if (it != cache.end()) {
+        return it->second;
+    }
+    size_t id = register_type(type);
+    cache.emplace(type, id);
+    return id;
+}
+
+}  // namespace
+
+const char* drop_lane_name(DropLane lane) {
+    switch (lane) {
+        case DropLane::InboundQueue: return "inbound_queue";
+        case DropLane::Oversize: return "oversize";
+        case DropLane::SendFailed: return "send_failed";
+        default: return "unknown";
+    }
+}
+
+// Global metrics instance (defined after the registry so it is destroyed first)
 ServerMetrics metrics;
 
 ServerMetrics::ServerMetrics() : start_time(std::chrono::steady_clock::now()) {}
 
+ServerMetrics::~ServerMetrics() {
+    for (auto& shard : shards) {
+        for (auto& slot : shard.types) {
+            delete slot.load();
+        }
+    }
+}
+
+ServerMetrics::Shard& ServerMetrics::local_shard() {
+    static std::atomic<size_t> next_shard{0};
+    thread_local size_t shard_index = next_shard.fetch_add(1, std::memory_order_relaxed) % METRICS_SHARDS;
+    return shards[shard_index];
+}
+
+ServerMetrics::TypeSlot& ServerMetrics::slot(Shard& shard, size_t type_id) {
+    TypeSlot* existing = shard.types[type_id].load(std::memory_order_acquire);
+    if (existing) {
+        return *existing;
+    }
+    // First use of this type on this shard; a racing thread may win the install
+    auto* fresh = new TypeSlot();
+    if (shard.types[type_id].compare_exchange_strong(existing, fresh, std::memory_order_acq_rel)) {
+        return *fresh;
+    }
+    delete fresh;
+    return *existing;
+}
+
 void ServerMetrics::record_message(const std::string& type, double latency) {
-    total_messages_processed++;
-    message_types[type]++;
+    Shard& shard = local_shard();
+    TypeSlot& type_slot = slot(shard, type_id(type));
+    shard.messages.fetch_add(1, std::memory_order_relaxed);
+    type_slot.count.fetch_add(1, std::memory_order_relaxed);
     if (latency > 0) {
-        if (message_latencies.size() >= MAX_LATENCY_SAMPLES) {
-            message_latencies.erase(message_latencies.begin());
-        }
-        message_latencies.push_back(latency);
+        type_slot.latency.record(static_cast<uint64_t>(std::llround(latency * 1000.0)));
     }
 }
 
 void ServerMetrics::record_bytes(size_t bytes) {
-    total_bytes_transferred += bytes;
+    total_bytes_transferred.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void ServerMetrics::record_drop(DropLane lane) {
+    drops[static_cast<size_t>(lane)].fetch_add(1, std::memory_order_relaxed);
+    messages_dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ServerMetrics::record_store_append(double latency) {
+    store_append_latency.record(static_cast<uint64_t>(std::llround(latency * 1000.0)));
+}
+
+void ServerMetrics::record_store_flush(double latency) {
+    store_flush_latency.record(static_cast<uint64_t>(std::llround(latency * 1000.0)));
+}
+
+void ServerMetrics::record_fanout(double latency, bool parallel) {
+    fanout_latency.record(static_cast<uint64_t>(std::llround(latency * 1000.0)));
+    if (parallel) {
+        parallel_fanouts.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+size_t ServerMetrics::get_drops(DropLane lane) const {
+    return drops[static_cast<size_t>(lane)].load(std::memory_order_relaxed);
+}
+
+HistogramSnapshot ServerMetrics::get_store_append_latency() const {
+    HistogramSnapshot snapshot;
+    store_append_latency.merge_into(snapshot);
+    return snapshot;
+}
+
+HistogramSnapshot ServerMetrics::get_store_flush_latency() const {
+    HistogramSnapshot snapshot;
+    store_flush_latency.merge_into(snapshot);
+    return snapshot;
+}
+
+HistogramSnapshot ServerMetrics::get_fanout_latency() const {
+    HistogramSnapshot snapshot;
+    fanout_latency.merge_into(snapshot);
+    return snapshot;
+}
+
+uint64_t ServerMetrics::get_parallel_fanouts() const {
+    return parallel_fanouts.load(std::memory_order_relaxed);
 }
 
 void ServerMetrics::update_connections(size_t count) {
     current_connections = count;
-    peak_connections = std::max(peak_connections.load(), count);
+    size_t peak = peak_connections.load();
+    while (count > peak && !peak_connections.compare_exchange_weak(peak, count)) {
+    }
 }
 
 double ServerMetrics::get_uptime_seconds() const {
@@ -31,19 +161,53 @@ double ServerMetrics::get_uptime_seconds() const {
     return std::chrono::duration<double>(now - start_time).count();
 }
 
+size_t ServerMetrics::get_total_messages() const {
+    size_t total = 0;
+    for (const auto& shard : shards) {
+        total += shard.messages.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
 double ServerMetrics::get_messages_per_second() const {
-    return total_messages_processed.load() / get_uptime_seconds();
+    return get_total_messages() / get_uptime_seconds();
 }
 
 double ServerMetrics::get_average_latency() const {
-    if (message_latencies.empty()) return 0;
-    double sum = 0;
-    for (double latency : message_latencies) {
-        sum += latency;
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    for (const auto& stats : get_type_stats()) {
+        count += stats.latency.count;
+        sum += stats.latency.sum;
     }
-    return sum / message_latencies.size();
+    return count ? static_cast<double>(sum) / count / 1000.0 : 0;
 }
 
-const std::map<std::string, size_t>& ServerMetrics::get_message_types() const {
-    return message_types;
+std::map<std::string, size_t> ServerMetrics::get_message_types() const {
+    std::map<std::string, size_t> types;
+    for (const auto& stats : get_type_stats()) {
+        types[stats.type] = stats.count;
+    }
+    return types;
+}
+
+std::vector<MessageTypeStats> ServerMetrics::get_type_stats() const {
+    const size_t count = type_count.load(std::memory_order_acquire);
+    std::vector<MessageTypeStats> stats(count);
+    for (size_t id = 0; id < count; ++id) {
+        stats[id].type = type_names[id];
+    }
+    for (const auto& shard : shards) {
+        for (size_t id = 0; id < count; ++id) {
+            const TypeSlot* type_slot = shard.types[id].load(std::memory_order_acquire);
+            if (type_slot) {
+                stats[id].count += type_slot->count.load(std::memory_order_relaxed);
+                type_slot->latency.merge_into(stats[id].latency);
+            }
+        }
+    }
+    // Types registered by other instances (e.g. in tests) but unused here
+    stats.erase(std::remove_if(stats.begin(), stats.end(), [](const MessageTypeStats& s) { return s.count == 0; }),
+                stats.end());
+    return stats;
 }
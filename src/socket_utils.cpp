@@ -1,11 +1,17 @@
 #include "socket_utils.h"
 #include "constants.h"
+#include "connection_pool.h"
+#include "server_metrics.h"
+#include "flight_recorder.h"
+#include "transport.h"
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <iostream>
 #include <vector>
+#include <chrono>
+#include <thread>
 #include <netinet/in.h>  // Add this for IPPROTO_TCP
 #include <netinet/tcp.h> // Add this for TCP_NODELAY
 
@@ -63,6 +69,68 @@ bool set_socket_nonblocking(int socket) {
     return true;
 }
 
+ssize_t send_to_client(int socket, const std::string& data, int flags, int max_retries) {
+    ConnectionTraffic* traffic = traffic_for_socket(socket);
+    size_t sent = 0;
+    int retries = 0;
+    while (sent < data.size()) {
+        ssize_t result = transport().send(socket, data.data() + sent, data.size() - sent, flags);
+        if (result > 0) {
+            sent += static_cast<size_t>(result);
+            continue;
+        }
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && retries++ < max_retries) {
+            // The peer is not draining its socket; wait before retrying
+            if (traffic) {
+                traffic->send_stalls.fetch_add(1, std::memory_order_relaxed);
+            }
+            flight_record(FlightEvent::SendStall, socket, data.size() - sent);
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            continue;
+        }
+        break;  // disconnected, unrecoverable error or out of retries
+    }
+
+    if (sent > 0) {
+        metrics.record_bytes(sent);
+    }
+    if (sent == data.size()) {
+        if (traffic) {
+            traffic->record_out(sent);
+        }
+        return static_cast<ssize_t>(sent);
+    }
+    if (traffic) {
+        traffic->bytes_out.fetch_add(sent, std::memory_order_relaxed);
+        traffic->send_failures.fetch_add(1, std::memory_order_relaxed);
+    }
+    return -1;
+}
+
+ssize_t send_reply(int socket, const std::string& text) {
+    if (is_binary_socket(socket)) {
+        return send_to_client(socket, encode_frame(FrameType::CommandReply, text));
+    }
+    return send_to_client(socket, text);
+}
+
+ssize_t send_error(int socket, WireError code, const std::string& text) {
+    if (is_binary_socket(socket)) {
+        return send_to_client(socket, encode_error(code, text));
+    }
+    return send_to_client(socket, text);
+}
+
+ssize_t send_auth_result(int socket, WireAuth kind, bool ok, const std::string& text) {
+    if (is_binary_socket(socket)) {
+        return send_to_client(socket, encode_auth_result(kind, ok, text));
+    }
+    return send_to_client(socket, text);
+}
+
 void log_socket_error(const std::string& operation, const std::string& error) {
     std::string error_msg = "Socket error during " + operation + ": " + error;
     if (errno != 0) {
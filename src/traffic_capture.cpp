@@ -0,0 +1,286 @@
+#include "traffic_capture.h"
+#include "constants.h"
+#include "logger.h"
+#include <chrono>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char CAPTURE_MAGIC[8] = {'C', 'H', 'A', 'T', 'C', 'A', 'P', '1'};
+
+static int64_t steady_now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void append_varint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+static bool read_varint(const std::string& in, size_t& pos, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (pos >= in.size()) {
+            return false;
+        }
+        uint8_t byte = static_cast<uint8_t>(in[pos++]);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+TrafficCapture& TrafficCapture::instance() {
+    // Never destroyed, so handler threads can still record during exit; the
+    // file is completed by the atexit hook
+    static TrafficCapture* capture = []() {
+        auto* created = new TrafficCapture();
+        std::atexit([]() { TrafficCapture::instance().stop(); });
+        return created;
+    }();
+    return *capture;
+}
+
+bool TrafficCapture::start(const std::string& path) {
+    stop();
+    // O_EXCL: a capture must never truncate an existing file
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0640);
+    FILE* opened = fd >= 0 ? fdopen(fd, "wb") : nullptr;
+    if (!opened) {
+        log_at(LogLevel::Error, "Could not open traffic capture " + path + ": " + std::string(strerror(errno)));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    const int64_t realtime_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+
+    std::lock_guard<std::mutex> lock(mtx);
+    file = opened;
+    file_path = path;
+    buffer.assign(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    buffer.append(reinterpret_cast<const char*>(&realtime_us), sizeof(realtime_us));
+    last_us = steady_now_us();
+    next_connection = 1;
+    records = 0;
+    connections.clear();
+    recording.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+uint64_t TrafficCapture::stop() {
+    std::unique_lock<std::mutex> lock(mtx);
+    if (!file) {
+        return 0;
+    }
+    recording.store(false, std::memory_order_relaxed);
+    FILE* closing = file;
+    file = nullptr;
+    connections.clear();
+    const uint64_t written = records;
+    std::string pending;
+    pending.swap(buffer);
+
+    std::lock_guard<std::mutex> write_lock(write_mtx);
+    lock.unlock();
+    bool written_ok = fwrite(pending.data(), 1, pending.size(), closing) == pending.size();
+    if (fclose(closing) != 0 || !written_ok) {
+        log_at(LogLevel::Warn, "Traffic capture write failed: " + std::string(strerror(errno)));
+    }
+    return written;
+}
+
+std::string capture_file_path(std::string_view name) {
+    std::string file_name(name);
+    if (file_name.empty()) {
+        std::time_t now = std::time(nullptr);
+        std::tm local;
+        localtime_r(&now, &local);
+        char stamp[32];
+        std::strftime(stamp, sizeof(stamp), "traffic-%Y%m%d-%H%M%S", &local);
+        file_name = stamp;
+    }
+    const bool valid = file_name.size() <= 64 && std::all_of(file_name.begin(), file_name.end(), [](char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-';
+    });
+    if (!valid) {
+        return "";
+    }
+    if (mkdir(TRAFFIC_CAPTURE_DIR, 0750) != 0 && errno != EEXIST) {
+        log_at(LogLevel::Error, "Could not create " + std::string(TRAFFIC_CAPTURE_DIR) + ": " +
+                                    std::string(strerror(errno)));
+    }
+    return std::string(TRAFFIC_CAPTURE_DIR) + "/" + file_name + ".cap";
+}
+
+std::string TrafficCapture::path() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return file_path;
+}
+
+uint64_t TrafficCapture::record_count() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return records;
+}
+
+void TrafficCapture::append_record(CaptureEvent event, uint32_t connection, const std::string* data,
+                                   uint8_t auth_flags) {
+    const int64_t now = steady_now_us();
+    buffer.push_back(static_cast<char>(event));
+    append_varint(buffer, static_cast<uint64_t>(std::max<int64_t>(now - last_us, 0)));
+    append_varint(buffer, connection);
+    if (event == CaptureEvent::Auth) {
+        buffer.push_back(static_cast<char>(auth_flags));
+    }
+    if (data) {
+        append_varint(buffer, data->size());
+        buffer += *data;
+    }
+    last_us = std::max(now, last_us);
+    ++records;
+}
+
+// Writes the buffer outside mtx; write_mtx is taken before mtx is released
+// so buffers reach the file in the order they were filled. Returns with
+// `lock` released.
+void TrafficCapture::flush_locked(std::unique_lock<std::mutex>& lock) {
+    std::string pending;
+    pending.swap(buffer);
+    FILE* out = file;
+    std::lock_guard<std::mutex> write_lock(write_mtx);
+    lock.unlock();
+    if (out && !pending.empty()) {
+        if (fwrite(pending.data(), 1, pending.size(), out) != pending.size() || fflush(out) != 0) {
+            log_at(LogLevel::Warn, "Traffic capture write failed: " + std::string(strerror(errno)));
+        }
+    }
+}
+
+void TrafficCapture::record_open(int socket) {
+    if (!active()) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(mtx);
+    if (!file) {
+        return;
+    }
+    uint32_t connection = next_connection++;
+    connections[socket] = connection;
+    append_record(CaptureEvent::Open, connection, nullptr, 0);
+}
+
+void TrafficCapture::record_close(int socket) {
+    if (!active()) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(mtx);
+    auto it = connections.find(socket);
+    if (!file || it == connections.end()) {
+        return;
+    }
+    append_record(CaptureEvent::Close, it->second, nullptr, 0);
+    connections.erase(it);
+    if (buffer.size() >= TRAFFIC_CAPTURE_FLUSH_BYTES) {
+        flush_locked(lock);
+    }
+}
+
+void TrafficCapture::record_auth(int socket, CaptureAuth kind, const std::string& username, bool ok) {
+    if (!active()) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(mtx);
+    auto it = connections.find(socket);
+    if (!file || it == connections.end()) {
+        return;
+    }
+    append_record(CaptureEvent::Auth, it->second, &username, static_cast<uint8_t>(kind) | (ok ? 0x80 : 0));
+}
+
+void TrafficCapture::record_message(int socket, const char* data, size_t length) {
+    if (!active()) {
+        return;
+    }
+    std::string content(data, length);
+    if (!TRAFFIC_CAPTURE_PAYLOADS) {
+        // Keep a command's name so the replayed command mix is the same
+        size_t keep = !content.empty() && content[0] == '/' ? std::min(content.find(' '), content.size()) : 0;
+        std::fill(content.begin() + keep, content.end(), 'x');
+    }
+    std::unique_lock<std::mutex> lock(mtx);
+    auto it = connections.find(socket);
+    if (!file || it == connections.end()) {
+        return;
+    }
+    append_record(CaptureEvent::Message, it->second, &content, 0);
+    if (buffer.size() >= TRAFFIC_CAPTURE_FLUSH_BYTES) {
+        flush_locked(lock);
+    }
+}
+
+bool read_traffic_capture(const std::string& path, std::vector<CaptureRecord>& records, int64_t* start_realtime_us) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    const size_t header_bytes = sizeof(CAPTURE_MAGIC) + sizeof(int64_t);
+    if (data.size() < header_bytes || memcmp(data.data(), CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0) {
+        return false;
+    }
+    if (start_realtime_us) {
+        memcpy(start_realtime_us, data.data() + sizeof(CAPTURE_MAGIC), sizeof(int64_t));
+    }
+
+    records.clear();
+    size_t pos = header_bytes;
+    int64_t offset_us = 0;
+    while (pos < data.size()) {
+        CaptureRecord record;
+        uint8_t event = static_cast<uint8_t>(data[pos++]);
+        if (event < static_cast<uint8_t>(CaptureEvent::Open) || event > static_cast<uint8_t>(CaptureEvent::Message)) {
+            return false;
+        }
+        record.event = static_cast<CaptureEvent>(event);
+        uint64_t delta = 0, connection = 0;
+        if (!read_varint(data, pos, delta) || !read_varint(data, pos, connection)) {
+            break;
+        }
+        if (record.event == CaptureEvent::Auth) {
+            if (pos >= data.size()) {
+                break;
+            }
+            uint8_t flags = static_cast<uint8_t>(data[pos++]);
+            record.auth = static_cast<CaptureAuth>(flags & 0x7F);
+            record.auth_ok = (flags & 0x80) != 0;
+        }
+        if (record.event == CaptureEvent::Auth || record.event == CaptureEvent::Message) {
+            uint64_t length = 0;
+            if (!read_varint(data, pos, length) || length > data.size() - pos) {
+                break;
+            }
+            record.data.assign(data, pos, length);
+            pos += length;
+        }
+        offset_us += static_cast<int64_t>(delta);
+        record.offset_us = offset_us;
+        record.connection = static_cast<uint32_t>(connection);
+        records.push_back(std::move(record));
+    }
+    return true;
+}
@@ -0,0 +1,224 @@
+#include "transport.h"
+#include "socket_utils.h"
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/sockios.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+
+static SocketTransport socket_transport;
+static std::atomic<Transport*> current_transport{&socket_transport};
+
+Transport& transport() {
+    return *current_transport.load(std::memory_order_acquire);
+}
+
+void set_transport(Transport* replacement) {
+    current_transport.store(replacement ? replacement : &socket_transport, std::memory_order_release);
+}
+
+// --- Sockets ---
+
+bool SocketTransport::configure(int socket) {
+    return configure_socket(socket, false);
+}
+
+ssize_t SocketTransport::send(int socket, const char* data, size_t length, int flags) {
+    return ::send(socket, data, length, flags | MSG_NOSIGNAL);
+}
+
+ssize_t SocketTransport::recv(int socket, char* buffer, size_t length) {
+    return ::recv(socket, buffer, length, 0);
+}
+
+void SocketTransport::close(int socket) {
+    ::close(socket);
+}
+
+size_t SocketTransport::outbound_queued(int socket) {
+    int queued = 0;
+    if (ioctl(socket, SIOCOUTQ, &queued) != 0) {
+        return 0;
+    }
+    return static_cast<size_t>(queued);
+}
+
+// --- In memory ---
+
+// Well above stdio and test descriptors, and below the per-socket traffic
+// table's limit for the first ~64k connections
+static constexpr int MEMORY_TRANSPORT_FIRST_SOCKET = 1000;
+
+MemoryTransport::MemoryTransport(size_t buffer_bytes)
+    : buffer_bytes(buffer_bytes), next_socket(MEMORY_TRANSPORT_FIRST_SOCKET) {}
+
+std::shared_ptr<MemoryTransport::Endpoint> MemoryTransport::find(int socket) {
+    std::lock_guard<std::mutex> lock(endpoints_mtx);
+    auto it = endpoints.find(socket);
+    return it == endpoints.end() ? nullptr : it->second;
+}
+
+void MemoryTransport::forget(int socket) {
+    std::lock_guard<std::mutex> lock(endpoints_mtx);
+    endpoints.erase(socket);
+}
+
+int MemoryTransport::connect() {
+    std::lock_guard<std::mutex> lock(endpoints_mtx);
+    int socket = next_socket++;
+    endpoints[socket] = std::make_shared<Endpoint>();
+    return socket;
+}
+
+bool MemoryTransport::configure(int socket) {
+    return find(socket) != nullptr;
+}
+
+ssize_t MemoryTransport::send(int socket, const char* data, size_t length, int) {
+    auto endpoint = find(socket);
+    if (!endpoint) {
+        errno = EBADF;
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(endpoint->mtx);
+    if (endpoint->client_closed || endpoint->server_closed) {
+        errno = EPIPE;
+        return -1;
+    }
+    size_t room = buffer_bytes > endpoint->outbound.size() ? buffer_bytes - endpoint->outbound.size() : 0;
+    if (room == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t written = std::min(room, length);
+    endpoint->outbound.append(data, written);
+    endpoint->client_readable.notify_all();
+    return static_cast<ssize_t>(written);
+}
+
+ssize_t MemoryTransport::recv(int socket, char* buffer, size_t length) {
+    auto endpoint = find(socket);
+    if (!endpoint) {
+        errno = EBADF;
+        return -1;
+    }
+    std::unique_lock<std::mutex> lock(endpoint->mtx);
+    endpoint->server_readable.wait(lock, [&]() {
+        return !endpoint->inbound.empty() || endpoint->client_closed || endpoint->server_closed;
+    });
+    if (endpoint->inbound.empty()) {
+        return 0;
+    }
+    std::string& chunk = endpoint->inbound.front();
+    size_t read = std::min(length, chunk.size());
+    std::copy(chunk.data(), chunk.data() + read, buffer);
+    if (read == chunk.size()) {
+        endpoint->inbound.pop_front();
+    } else {
+        chunk.erase(0, read);
+    }
+    return static_cast<ssize_t>(read);
+}
+
+void MemoryTransport::close(int socket) {
+    auto endpoint = find(socket);
+    if (!endpoint) {
+        return;
+    }
+    bool both_closed;
+    {
+        std::lock_guard<std::mutex> lock(endpoint->mtx);
+        endpoint->server_closed = true;
+        both_closed = endpoint->client_closed;
+        endpoint->server_readable.notify_all();
+        endpoint->client_readable.notify_all();
+    }
+    if (both_closed) {
+        forget(socket);
+    }
+}
+
+size_t MemoryTransport::outbound_queued(int socket) {
+    auto endpoint = find(socket);
+    if (!endpoint) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(endpoint->mtx);
+    return endpoint->outbound.size();
+}
+
+bool MemoryTransport::client_send(int socket, const std::string& data) {
+    auto endpoint = find(socket);
+    if (!endpoint) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(endpoint->mtx);
+    if (endpoint->server_closed || endpoint->client_closed) {
+        return false;
+    }
+    endpoint->inbound.push_back(data);
+    endpoint->server_readable.notify_one();
+    return true;
+}
+
+std::string MemoryTransport::client_receive(int socket, std::chrono::milliseconds timeout) {
+    auto endpoint = find(socket);
+    if (!endpoint) {
+        return std::string();
+    }
+    std::unique_lock<std::mutex> lock(endpoint->mtx);
+    endpoint->client_readable.wait_for(lock, timeout, [&]() {
+        return !endpoint->outbound.empty() || endpoint->server_closed;
+    });
+    std::string received;
+    received.swap(endpoint->outbound);
+    return received;
+}
+
+std::string MemoryTransport::client_receive_until(int socket, const std::string& needle, std::chrono::milliseconds timeout) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::string received;
+    while (true) {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        received += client_receive(socket, std::max(remaining, std::chrono::milliseconds(0)));
+        if (received.find(needle) != std::string::npos) {
+            return received;
+        }
+        if (remaining.count() <= 0 || server_closed(socket)) {
+            return std::string();
+        }
+    }
+}
+
+void MemoryTransport::client_close(int socket) {
+    auto endpoint = find(socket);
+    if (!endpoint) {
+        return;
+    }
+    bool both_closed;
+    {
+        std::lock_guard<std::mutex> lock(endpoint->mtx);
+        endpoint->client_closed = true;
+        both_closed = endpoint->server_closed;
+        endpoint->server_readable.notify_all();
+    }
+    if (both_closed) {
+        forget(socket);
+    }
+}
+
+bool MemoryTransport::server_closed(int socket) {
+    auto endpoint = find(socket);
+    if (!endpoint) {
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(endpoint->mtx);
+    return endpoint->server_closed;
+}
+
+size_t MemoryTransport::connection_count() {
+    std::lock_guard<std::mutex> lock(endpoints_mtx);
+    return endpoints.size();
+}
@@ -0,0 +1,262 @@
+#include "wire_protocol.h"
+#include <algorithm>
+#include <cstring>
+
+// Appends the low `bytes` bytes of value, little-endian, in one append
+static void append_le(std::string& out, uint64_t value, size_t bytes) {
+    char encoded[8];
+    for (size_t i = 0; i < bytes; ++i) {
+        encoded[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+    }
+    out.append(encoded, bytes);
+}
+
+static void append_u16(std::string& out, uint16_t value) {
+    append_le(out, value, 2);
+}
+
+static void append_u32(std::string& out, uint32_t value) {
+    append_le(out, value, 4);
+}
+
+static void append_u64(std::string& out, uint64_t value) {
+    append_le(out, value, 8);
+}
+
+// Strings longer than a u16 length can describe are cut short
+static void append_string(std::string& out, std::string_view value) {
+    value = value.substr(0, UINT16_MAX);
+    append_u16(out, static_cast<uint16_t>(value.size()));
+    out.append(value);
+}
+
+static uint64_t load_le(const char* data, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; ++i) {
+        value |= static_cast<uint64_t>(static_cast<uint8_t>(data[i])) << (8 * i);
+    }
+    return value;
+}
+
+// Starts a frame whose payload will be payload_bytes long
+static std::string begin_frame(FrameType type, size_t payload_bytes) {
+    std::string frame;
+    frame.reserve(WIRE_HEADER_BYTES + payload_bytes);
+    frame.push_back(static_cast<char>(type));
+    append_u32(frame, static_cast<uint32_t>(payload_bytes));
+    return frame;
+}
+
+DecodeStatus decode_frame(std::string_view buffer, WireFrame& frame, size_t& consumed, size_t max_payload) {
+    if (buffer.size() < WIRE_HEADER_BYTES) {
+        return DecodeStatus::Incomplete;
+    }
+    const uint64_t length = load_le(buffer.data() + 1, 4);
+    if (length > max_payload) {
+        return DecodeStatus::TooLarge;
+    }
+    if (buffer.size() - WIRE_HEADER_BYTES < length) {
+        return DecodeStatus::Incomplete;
+    }
+    frame.type = static_cast<FrameType>(buffer[0]);
+    frame.payload = buffer.substr(WIRE_HEADER_BYTES, length);
+    consumed = WIRE_HEADER_BYTES + length;
+    return DecodeStatus::Complete;
+}
+
+HelloStatus parse_hello(std::string_view opening, uint8_t& version) {
+    const size_t compared = std::min(opening.size(), sizeof(WIRE_HELLO_MAGIC));
+    if (compared == 0) {
+        return HelloStatus::Incomplete;
+    }
+    if (memcmp(opening.data(), WIRE_HELLO_MAGIC, compared) != 0) {
+        return HelloStatus::Text;
+    }
+    if (opening.size() < WIRE_HELLO_BYTES) {
+        return HelloStatus::Incomplete;
+    }
+    version = static_cast<uint8_t>(opening[sizeof(WIRE_HELLO_MAGIC)]);
+    return HelloStatus::Binary;
+}
+
+std::string encode_hello(uint8_t version) {
+    std::string hello(WIRE_HELLO_MAGIC, sizeof(WIRE_HELLO_MAGIC));
+    hello.push_back(static_cast<char>(version));
+    return hello;
+}
+
+bool WireReader::read_u8(uint8_t& value) {
+    if (rest.empty()) {
+        return false;
+    }
+    value = static_cast<uint8_t>(rest[0]);
+    rest.remove_prefix(1);
+    return true;
+}
+
+bool WireReader::read_u16(uint16_t& value) {
+    if (rest.size() < 2) {
+        return false;
+    }
+    value = static_cast<uint16_t>(load_le(rest.data(), 2));
+    rest.remove_prefix(2);
+    return true;
+}
+
+bool WireReader::read_u64(uint64_t& value) {
+    if (rest.size() < 8) {
+        return false;
+    }
+    value = load_le(rest.data(), 8);
+    rest.remove_prefix(8);
+    return true;
+}
+
+bool WireReader::read_string(std::string_view& value) {
+    if (rest.size() < 2) {
+        return false;
+    }
+    const size_t length = static_cast<size_t>(load_le(rest.data(), 2));
+    if (rest.size() - 2 < length) {
+        return false;
+    }
+    value = rest.substr(2, length);
+    rest.remove_prefix(2 + length);
+    return true;
+}
+
+std::string encode_frame(FrameType type, std::string_view payload) {
+    std::string frame = begin_frame(type, payload.size());
+    frame.append(payload);
+    return frame;
+}
+
+std::string encode_credentials(FrameType type, std::string_view username, std::string_view password) {
+    username = username.substr(0, UINT16_MAX);
+    password = password.substr(0, UINT16_MAX);
+    std::string frame = begin_frame(type, 4 + username.size() + password.size());
+    append_string(frame, username);
+    append_string(frame, password);
+    return frame;
+}
+
+std::string encode_private(FrameType type, std::string_view peer, std::string_view text) {
+    peer = peer.substr(0, UINT16_MAX);
+    std::string frame = begin_frame(type, 2 + peer.size() + text.size());
+    append_string(frame, peer);
+    frame.append(text);
+    return frame;
+}
+
+std::string encode_chat(uint64_t seq, int64_t timestamp_ms, std::string_view sender, std::string_view text) {
+    sender = sender.substr(0, UINT16_MAX);
+    std::string frame = begin_frame(FrameType::ChatMessage, 18 + sender.size() + text.size());
+    append_u64(frame, seq);
+    append_u64(frame, static_cast<uint64_t>(timestamp_ms));
+    append_string(frame, sender);
+    frame.append(text);
+    return frame;
+}
+
+std::string encode_room_message(int64_t timestamp_ms, std::string_view room, std::string_view sender,
+                                std::string_view text) {
+    room = room.substr(0, UINT16_MAX);
+    sender = sender.substr(0, UINT16_MAX);
+    std::string frame = begin_frame(FrameType::RoomMessage, 12 + room.size() + sender.size() + text.size());
+    append_u64(frame, static_cast<uint64_t>(timestamp_ms));
+    append_string(frame, room);
+    append_string(frame, sender);
+    frame.append(text);
+    return frame;
+}
+
+std::string encode_room_batch_entry(int64_t timestamp_ms, std::string_view sender, std::string_view text) {
+    sender = sender.substr(0, UINT16_MAX);
+    text = text.substr(0, UINT16_MAX);
+    std::string entry;
+    entry.reserve(12 + sender.size() + text.size());
+    append_u64(entry, static_cast<uint64_t>(timestamp_ms));
+    append_string(entry, sender);
+    append_string(entry, text);
+    return entry;
+}
+
+std::string encode_room_batch(std::string_view room, std::string_view entries) {
+    room = room.substr(0, UINT16_MAX);
+    std::string frame = begin_frame(FrameType::RoomBatch, 2 + room.size() + entries.size());
+    append_string(frame, room);
+    frame.append(entries);
+    return frame;
+}
+
+std::string encode_auth_result(WireAuth kind, bool ok, std::string_view text) {
+    std::string frame = begin_frame(FrameType::AuthResult, 2 + text.size());
+    frame.push_back(static_cast<char>(kind));
+    frame.push_back(ok ? 1 : 0);
+    frame.append(text);
+    return frame;
+}
+
+std::string encode_presence(bool online, std::string_view username) {
+    std::string frame = begin_frame(FrameType::Presence, 1 + username.size());
+    frame.push_back(online ? 1 : 0);
+    frame.append(username);
+    return frame;
+}
+
+std::string encode_error(WireError code, std::string_view text) {
+    std::string frame = begin_frame(FrameType::Error, 2 + text.size());
+    append_u16(frame, static_cast<uint16_t>(code));
+    frame.append(text);
+    return frame;
+}
+
+std::string encode_peer_hello(uint16_t node_id, std::string_view nonce, std::string_view proof) {
+    std::string frame = begin_frame(FrameType::PeerHello, 2 + nonce.size() + proof.size());
+    append_u16(frame, node_id);
+    frame.append(nonce);
+    frame.append(proof);
+    return frame;
+}
+
+std::string encode_peer_auth(std::string_view proof) {
+    return encode_frame(FrameType::PeerAuth, proof);
+}
+
+std::string encode_peer_directory(const std::vector<std::string>& usernames) {
+    size_t payload_bytes = 0;
+    for (const auto& username : usernames) {
+        payload_bytes += 2 + std::min<size_t>(username.size(), UINT16_MAX);
+    }
+    std::string frame = begin_frame(FrameType::PeerDirectory, payload_bytes);
+    for (const auto& username : usernames) {
+        append_string(frame, username);
+    }
+    return frame;
+}
+
+std::string encode_peer_presence(bool online, std::string_view username) {
+    std::string frame = begin_frame(FrameType::PeerPresence, 1 + username.size());
+    frame.push_back(online ? 1 : 0);
+    frame.append(username);
+    return frame;
+}
+
+std::string encode_peer_broadcast(int64_t timestamp_ms, std::string_view sender, std::string_view text) {
+    sender = sender.substr(0, UINT16_MAX);
+    std::string frame = begin_frame(FrameType::PeerBroadcast, 10 + sender.size() + text.size());
+    append_u64(frame, static_cast<uint64_t>(timestamp_ms));
+    append_string(frame, sender);
+    frame.append(text);
+    return frame;
+}
+
+std::string encode_peer_private(std::string_view sender, std::string_view recipient, std::string_view text) {
+    sender = sender.substr(0, UINT16_MAX);
+    recipient = recipient.substr(0, UINT16_MAX);
+    std::string frame = begin_frame(FrameType::PeerPrivate, 4 + sender.size() + recipient.size() + text.size());
+    append_string(frame, sender);
+    append_string(frame, recipient);
+    frame.append(text);
+    return frame;
+}
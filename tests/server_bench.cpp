@@ -0,0 +1,349 @@
+#include <benchmark/benchmark.h>
+#include "server.h"
+#include "connection_pool.h"
+#include "message_queue.h"
+#include "server_metrics.h"
+#include "database.h"
+#include "history_ring.h"
+#include "constants.h"
+#include "transport.h"
+#include "network_handler.h"
+#include "wire_protocol.h"
+#include "perfect_hash.h"
+#include "fanout_pool.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <filesystem>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <mutex>
+
+// Microbenchmarks for the server's per-message hot paths. Run with
+//   ./server_bench --benchmark_format=json --benchmark_out=server_bench.json
+// (or `cmake --build . --target run_benchmarks`) and diff the JSON between
+// releases; benchmark names and arguments are stable across versions.
+
+namespace {
+
+const int BENCH_SOCKET_BASE = 1000;
+
+// Fills the first `count` pool slots with authenticated connections
+// "bench_user_<i>" on sockets BENCH_SOCKET_BASE + i
+void fill_connection_pool(int count) {
+    std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        Connection& conn = connection_pool[i];
+        conn.in_use = i < count;
+        conn.authenticated = i < count;
+        conn.socket = i < count ? BENCH_SOCKET_BASE + i : -1;
+        conn.username = i < count ? "bench_user_" + std::to_string(i) : "";
+    }
+}
+
+} // namespace
+
+// One push and one pop per iteration on a shared queue; with more threads
+// every operation contends for the queue lock
+static void BM_MessageQueuePushPop(benchmark::State& state) {
+    static MessageQueue queue(MESSAGE_QUEUE_SIZE);
+    Message msg;
+    msg.sender_socket = BENCH_SOCKET_BASE;
+    msg.content = "hello from the benchmark";
+    for (auto _ : state) {
+        if (!queue.push(msg)) {
+            state.SkipWithError("queue full");
+            break;
+        }
+        benchmark::DoNotOptimize(queue.pop());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_MessageQueuePushPop)->Threads(1)->Threads(2)->Threads(4)->Threads(8)->UseRealTime();
+
+// Worst case: the connection sits in the last occupied slot
+static void BM_FindConnectionBySocket(benchmark::State& state) {
+    int occupied = static_cast<int>(state.range(0));
+    fill_connection_pool(occupied);
+    int socket = BENCH_SOCKET_BASE + occupied - 1;
+    for (auto _ : state) {
+        std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+        benchmark::DoNotOptimize(find_connection_locked(socket));
+    }
+}
+BENCHMARK(BM_FindConnectionBySocket)->Arg(10)->Arg(MAX_CONNECTIONS / 2)->Arg(MAX_CONNECTIONS);
+
+static void BM_FindConnectionByUsername(benchmark::State& state) {
+    int occupied = static_cast<int>(state.range(0));
+    fill_connection_pool(occupied);
+    std::string username = "bench_user_" + std::to_string(occupied - 1);
+    for (auto _ : state) {
+        std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+        benchmark::DoNotOptimize(find_connection_by_username_locked(username));
+    }
+}
+BENCHMARK(BM_FindConnectionByUsername)->Arg(10)->Arg(MAX_CONNECTIONS / 2)->Arg(MAX_CONNECTIONS);
+
+static void BM_UsernameForSocket(benchmark::State& state) {
+    fill_connection_pool(MAX_CONNECTIONS);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(username_for_socket(BENCH_SOCKET_BASE + MAX_CONNECTIONS - 1));
+    }
+}
+BENCHMARK(BM_UsernameForSocket);
+
+static void BM_FormatBroadcast(benchmark::State& state) {
+    std::string message = "bench_user_0: " + std::string(state.range(0), 'x');
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(format_broadcast(message));
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(message.size()));
+}
+BENCHMARK(BM_FormatBroadcast)->Arg(16)->Arg(256)->Arg(MAX_MESSAGE_SIZE / 2);
+
+// The binary counterpart of format_broadcast
+static void BM_EncodeChatFrame(benchmark::State& state) {
+    std::string text(state.range(0), 'x');
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(encode_chat(12345, 1700000000000, "bench_user_0", text));
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(text.size()));
+}
+BENCHMARK(BM_EncodeChatFrame)->Arg(16)->Arg(256)->Arg(MAX_MESSAGE_SIZE / 2);
+
+// Splitting a receive buffer of private-message frames into fields, against
+// parsing the same messages as "/msg" lines
+static void BM_ParsePrivateFrames(benchmark::State& state) {
+    std::string buffer;
+    while (buffer.size() + 64 < BUFFER_SIZE) {
+        buffer += encode_private(FrameType::Private, "bench_user_1", "a private message of some length");
+    }
+    for (auto _ : state) {
+        std::string_view rest = buffer;
+        WireFrame frame;
+        size_t consumed = 0;
+        while (decode_frame(rest, frame, consumed, WIRE_MAX_FRAME_PAYLOAD) == DecodeStatus::Complete) {
+            WireReader reader(frame.payload);
+            std::string_view recipient;
+            reader.read_string(recipient);
+            benchmark::DoNotOptimize(recipient);
+            benchmark::DoNotOptimize(reader.remaining());
+            rest.remove_prefix(consumed);
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(buffer.size()));
+}
+BENCHMARK(BM_ParsePrivateFrames);
+
+static void BM_ParsePrivateText(benchmark::State& state) {
+    std::vector<std::string> lines;
+    size_t bytes = 0;
+    while (bytes + 64 < BUFFER_SIZE) {
+        lines.push_back("/msg bench_user_1 a private message of some length");
+        bytes += lines.back().size();
+    }
+    for (auto _ : state) {
+        for (const auto& line : lines) {
+            // As handle_msg does
+            size_t pos = line.find(' ', 5);
+            std::string recipient = line.substr(5, pos - 5);
+            std::string private_message = line.substr(pos + 1);
+            benchmark::DoNotOptimize(recipient);
+            benchmark::DoNotOptimize(private_message);
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(bytes));
+}
+BENCHMARK(BM_ParsePrivateText);
+
+// Command lookup as process_command did it (a std::string key built for an
+// unordered_map) and as it does now
+static const char* const BENCH_COMMANDS[] = {"/stats", "/list", "/msg", "/register", "/login", "/removeuser",
+                                            "/history", "/dmhistory", "/search", "/trace", "/top", "/capture"};
+
+static void BM_CommandLookupUnorderedMap(benchmark::State& state) {
+    std::unordered_map<std::string, int> commands;
+    for (int i = 0; i < 12; ++i) {
+        commands[BENCH_COMMANDS[i]] = i;
+    }
+    const std::string line = "/history 100 20";
+    for (auto _ : state) {
+        std::string_view command = std::string_view(line).substr(0, line.find(' '));
+        benchmark::DoNotOptimize(commands.find(std::string(command)));
+    }
+}
+BENCHMARK(BM_CommandLookupUnorderedMap);
+
+static void BM_CommandLookupPerfectHash(benchmark::State& state) {
+    using Table = PerfectHashTable<int, 12>;
+    static constexpr Table commands({{{"/stats", 0}, {"/list", 1}, {"/msg", 2}, {"/register", 3}, {"/login", 4},
+                                      {"/removeuser", 5}, {"/history", 6}, {"/dmhistory", 7}, {"/search", 8},
+                                      {"/trace", 9}, {"/top", 10}, {"/capture", 11}}});
+    const std::string line = "/history 100 20";
+    for (auto _ : state) {
+        std::string_view command = std::string_view(line).substr(0, line.find(' '));
+        benchmark::DoNotOptimize(commands.find(command));
+    }
+}
+BENCHMARK(BM_CommandLookupPerfectHash);
+
+static void BM_RecordMessage(benchmark::State& state) {
+    for (auto _ : state) {
+        metrics.record_message("broadcast", 0.25);
+    }
+}
+BENCHMARK(BM_RecordMessage)->Threads(1)->Threads(4)->UseRealTime();
+
+// The database benchmarks run on their own file in a scratch directory,
+// removed at exit, so they never write into the server's chat_server.db
+class ScratchDatabase {
+public:
+    ScratchDatabase()
+        : directory(std::filesystem::temp_directory_path() / ("chat_bench_" + std::to_string(getpid()))) {
+        std::filesystem::create_directories(directory);
+        db = std::make_unique<Database>((directory / "bench.db").string());
+    }
+    ~ScratchDatabase() {
+        db.reset();
+        std::error_code error;
+        std::filesystem::remove_all(directory, error);
+    }
+    Database& get() { return *db; }
+
+private:
+    std::filesystem::path directory;
+    std::unique_ptr<Database> db;
+};
+
+static Database& bench_database() {
+    static ScratchDatabase scratch;
+    return scratch.get();
+}
+
+static void BM_DatabaseGetUserID(benchmark::State& state) {
+    Database& db = bench_database();
+    db.createUser("bench_db_user", "bench_password");
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.getUserID("bench_db_user"));
+    }
+}
+BENCHMARK(BM_DatabaseGetUserID);
+
+static void BM_DatabaseStoreMessage(benchmark::State& state) {
+    Database& db = bench_database();
+    db.createUser("bench_db_user", "bench_password");
+    int sender_id = db.getUserID("bench_db_user");
+    std::string content(state.range(0), 'x');
+    for (auto _ : state) {
+        if (!db.storeMessage(sender_id, 0, content)) {
+            state.SkipWithError("storeMessage failed");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DatabaseStoreMessage)->Arg(64)->Arg(1024);
+
+static void BM_HistoryAppend(benchmark::State& state) {
+    HistoryRing history(MAX_HISTORY_SIZE);
+    std::string text = "[12:00:00] bench_user_0: " + std::string(state.range(0), 'x');
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(history.append(text));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_HistoryAppend)->Arg(64)->Arg(1024);
+
+// The whole pipeline over MemoryTransport: one client broadcasts, and each
+// iteration waits until every other client has received the message
+static void BM_BroadcastPipeline(benchmark::State& state) {
+    static MemoryTransport memory;
+    static std::once_flag workers_started;
+    std::call_once(workers_started, []() {
+        for (int i = 0; i < WORKER_THREADS; ++i) {
+            std::thread(message_worker).detach();
+        }
+    });
+    fill_connection_pool(0);
+    set_transport(&memory);
+
+    std::vector<int> clients;
+    for (int i = 0; i <= state.range(0); ++i) {
+        std::string user = "bench_pipe_" + std::to_string(i);
+        Database::getInstance().createUser(user, "bench_password");
+        int client = memory.connect();
+        std::thread(handle_client, client).detach();
+        memory.client_send(client, "/login " + user + " bench_password");
+        if (memory.client_receive_until(client, "Login successful!", std::chrono::seconds(10)).empty()) {
+            state.SkipWithError("login failed");
+        }
+        clients.push_back(client);
+    }
+
+    uint64_t sequence = 0;
+    for (auto _ : state) {
+        if (state.error_occurred()) {
+            break;
+        }
+        std::string text = "pipeline message " + std::to_string(++sequence);
+        memory.client_send(clients[0], text);
+        for (size_t i = 1; i < clients.size(); ++i) {
+            if (memory.client_receive_until(clients[i], text, std::chrono::seconds(10)).empty()) {
+                state.SkipWithError("broadcast not delivered");
+                break;
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));  // deliveries
+
+    for (int client : clients) {
+        memory.client_close(client);
+    }
+    while (memory.connection_count() > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    set_transport(nullptr);
+}
+BENCHMARK(BM_BroadcastPipeline)->Arg(1)->Arg(16)->Arg(128)->UseRealTime();
+
+// Every send is a write(2) to /dev/null: a real system call per recipient
+// without sockets, so fan-out cost is dominated by per-send overhead as it is
+// in production
+class DevNullTransport : public Transport {
+public:
+    DevNullTransport() : fd(open("/dev/null", O_WRONLY)) {}
+    ~DevNullTransport() override { ::close(fd); }
+    bool configure(int) override { return true; }
+    ssize_t send(int, const char* data, size_t length, int) override { return write(fd, data, length); }
+    ssize_t recv(int, char*, size_t) override { return 0; }
+    void close(int) override {}
+    size_t outbound_queued(int) override { return 0; }
+    const char* name() const override { return "devnull"; }
+
+private:
+    int fd;
+};
+
+// One message to range(0) recipients on range(1) helper threads (0 = inline)
+static void BM_FanoutDeliver(benchmark::State& state) {
+    static DevNullTransport devnull;
+    set_transport(&devnull);
+    FanoutPool pool(static_cast<size_t>(state.range(1)), FANOUT_PARALLEL_THRESHOLD, FANOUT_MIN_CHUNK);
+    std::vector<FanoutTarget> targets;
+    for (int i = 0; i < state.range(0); ++i) {
+        targets.push_back(FanoutTarget{100000 + i, i % 4 == 0});  // ids past the per-socket tables
+    }
+    const std::string text = format_broadcast("bench_user: fan-out message");
+    const std::string frame = encode_chat(1, 0, "bench_user", "fan-out message");
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(pool.deliver(targets, text, frame));
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));  // deliveries
+    set_transport(nullptr);
+}
+BENCHMARK(BM_FanoutDeliver)->ArgsProduct({{1024, 16384}, {0, 2, 4}})->UseRealTime();
+
+BENCHMARK_MAIN();
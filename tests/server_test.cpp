@@ -1,6 +1,38 @@
 // tests/server_test.cpp
 #include <gtest/gtest.h>
 #include "server.h"
+#include "history_snapshot.h"
+#include "command_processor.h"
+#include "connection_pool.h"
+#include "message_store.h"
+#include "segmented_log.h"
+#include "query_executor.h"
+#include "database.h"
+#include "message_compactor.h"
+#include "rate_limiter.h"
+#include "server_metrics.h"
+#include "admin_server.h"
+#include "message_queue.h"
+#include "logger.h"
+#include "socket_utils.h"
+#include "flight_recorder.h"
+#include "transport.h"
+#include "network_handler.h"
+#include "traffic_capture.h"
+#include "wire_protocol.h"
+#include "perfect_hash.h"
+#include "room_registry.h"
+#include "fanout_pool.h"
+#include "cluster.h"
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <iterator>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <csignal>
+#include <cstring>
 #include <thread>
 #include <chrono>
 
@@ -11,14 +43,12 @@ protected:
         initialize_connection_pool();
 
         // Clear chat history
-        std::lock_guard<std::mutex> lock(history_mtx);
-        chat_history.clear();
+        chat_history.reset();
     }
 
     void TearDown() override {
         // Clean up after each test
-        std::lock_guard<std::mutex> lock(history_mtx);
-        chat_history.clear();
+        chat_history.reset();
     }
 };
 
@@ -31,12 +61,33 @@ TEST_F(ServerTest, LogMessageTest) {
 // Test chat history
 TEST_F(ServerTest, ChatHistoryTest) {
     std::string test_message = "Test chat message";
-    {
-        std::lock_guard<std::mutex> lock(history_mtx);
-        chat_history.push_back(test_message);
-        EXPECT_EQ(chat_history.back(), test_message);
-        EXPECT_EQ(chat_history.size(), 1);
+    uint64_t seq = chat_history.append(test_message);
+    auto entries = chat_history.snapshot();
+    ASSERT_EQ(entries.size(), 1);
+    EXPECT_EQ(entries.back()->text, test_message);
+    EXPECT_EQ(entries.back()->seq, seq);
+    EXPECT_EQ(chat_history.size(), 1);
+}
+
+// Test history ring wrap-around keeps only the newest entries in order
+TEST_F(ServerTest, HistoryRingWrapTest) {
+    HistoryRing ring(4);
+    for (int i = 1; i <= 10; ++i) {
+        ring.append("line " + std::to_string(i));
+    }
+    EXPECT_EQ(ring.size(), 4);
+    EXPECT_EQ(ring.last_seq(), 10);
+
+    auto entries = ring.snapshot();
+    ASSERT_EQ(entries.size(), 4);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        EXPECT_EQ(entries[i]->seq, 7 + i);
+        EXPECT_EQ(entries[i]->text, "line " + std::to_string(7 + i));
     }
+
+    auto newest = ring.snapshot(2);
+    ASSERT_EQ(newest.size(), 2);
+    EXPECT_EQ(newest[0]->seq, 9);
 }
 
 // Test command processing
@@ -94,8 +145,7 @@ TEST_F(ServerTest, ConcurrentHistoryAccessTest) {
     for (int i = 0; i < NUM_THREADS; ++i) {
         threads.emplace_back([i]() {
             std::string msg = "Message from thread " + std::to_string(i);
-            std::lock_guard<std::mutex> lock(history_mtx);
-            chat_history.push_back(msg);
+            chat_history.append(msg);
         });
     }
 
@@ -103,8 +153,11 @@ TEST_F(ServerTest, ConcurrentHistoryAccessTest) {
         thread.join();
     }
 
-    std::lock_guard<std::mutex> lock(history_mtx);
     EXPECT_EQ(chat_history.size(), NUM_THREADS);
+    auto entries = chat_history.snapshot();
+    for (size_t i = 1; i < entries.size(); ++i) {
+        EXPECT_EQ(entries[i]->seq, entries[i - 1]->seq + 1);
+    }
 }
 
 // Test console mutex
@@ -131,6 +184,1997 @@ TEST_F(ServerTest, MessageSizeLimitTest) {
     EXPECT_NO_THROW(process_command(large_msg));
 }
 
+// Test history snapshot round trip, torn-write recovery and the async writer
+TEST_F(ServerTest, HistorySnapshotTest) {
+    const std::string path = "test_history.snap";
+    unlink(path.c_str());
+    {
+        HistorySnapshot snapshot(path);
+        ASSERT_TRUE(snapshot.isOpen());
+        EXPECT_TRUE(snapshot.append(1, "[10:00:00] alice: one"));
+        EXPECT_TRUE(snapshot.append(2, "[10:00:01] bob: two"));
+        EXPECT_TRUE(snapshot.append(3, "[10:00:02] alice: three"));
+    }
+
+    // Simulate a crash in the middle of an append
+    FILE* file = fopen(path.c_str(), "ab");
+    ASSERT_NE(file, nullptr);
+    uint32_t torn_length = 100;
+    fwrite(&torn_length, sizeof(torn_length), 1, file);
+    fwrite("partial", 1, 7, file);
+    fclose(file);
+
+    HistorySnapshot reopened(path);
+    EXPECT_EQ(reopened.recordCount(), 3);
+    std::vector<HistoryEntry> recent = reopened.loadRecent(2);
+    ASSERT_EQ(recent.size(), 2);
+    EXPECT_EQ(recent[0].seq, 2);
+    EXPECT_EQ(recent[0].text, "[10:00:01] bob: two");
+    EXPECT_EQ(recent[1].seq, 3);
+    EXPECT_EQ(recent[1].text, "[10:00:02] alice: three");
+
+    EXPECT_TRUE(reopened.rebuild({HistoryEntry{7, "[09:00:00] carol: rebuilt"}}));
+    recent = reopened.loadRecent(MAX_HISTORY_SIZE);
+    ASSERT_EQ(recent.size(), 1);
+    EXPECT_EQ(recent[0].seq, 7);
+    EXPECT_EQ(recent[0].text, "[09:00:00] carol: rebuilt");
+
+    // The writer appends off the caller's thread, in enqueue order, and is
+    // caught up after drain()
+    {
+        SnapshotWriter writer(reopened);
+        for (uint64_t seq = 8; seq <= 20; ++seq) {
+            writer.enqueue(seq, "[09:00:01] dave: queued " + std::to_string(seq));
+        }
+        writer.drain();
+        EXPECT_EQ(reopened.recordCount(), 14u);
+        writer.enqueue(21, "[09:00:02] dave: last");
+    }
+    recent = reopened.loadRecent(3);
+    ASSERT_EQ(recent.size(), 3);
+    EXPECT_EQ(recent[0].seq, 19);
+    EXPECT_EQ(recent[1].text, "[09:00:01] dave: queued 20");
+    EXPECT_EQ(recent[2].seq, 21);
+    unlink(path.c_str());
+}
+
+// Test /history resumes after a sequence number and honours the limit
+TEST_F(ServerTest, HistoryReplayTest) {
+    chat_history.restore({HistoryEntry{10, "[10:00:00] alice: a"}, HistoryEntry{11, "[10:00:01] bob: b"}});
+    chat_history.append("[10:00:02] alice: c");
+    chat_history.append("[10:00:03] bob: d");
+    EXPECT_EQ(chat_history.last_seq(), 13);
+
+    int sv[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    Connection* conn = get_available_connection();
+    ASSERT_NE(conn, nullptr);
+    {
+        std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+        conn->socket = sv[0];
+        conn->username = "history_tester";
+        conn->authenticated = true;
+    }
+
+    process_command(Message{sv[0], "/history 10 2"});
+    char buffer[BUFFER_SIZE];
+    ssize_t received = recv(sv[1], buffer, sizeof(buffer) - 1, 0);
+    ASSERT_GT(received, 0);
+    std::string reply(buffer, static_cast<size_t>(received));
+    EXPECT_NE(reply.find("#11 [10:00:01] bob: b"), std::string::npos);
+    EXPECT_NE(reply.find("#12 [10:00:02] alice: c"), std::string::npos);
+    EXPECT_EQ(reply.find("#10 "), std::string::npos);
+    EXPECT_EQ(reply.find("#13 "), std::string::npos);
+    EXPECT_NE(reply.find("latest #13"), std::string::npos);
+
+    release_connection(conn);
+    close(sv[1]);
+}
+
+static SegmentedLogOptions test_log_options(const std::string& directory) {
+    SegmentedLogOptions options;
+    options.directory = directory;
+    options.segment_bytes = 512;
+    options.index_interval_bytes = 128;
+    options.flush_bytes = 256;
+    return options;
+}
+
+// Test segment rotation, indexed reads, reopen and corruption handling
+TEST_F(ServerTest, SegmentedLogTest) {
+    const std::string dir = "test_segmented_log";
+    std::filesystem::remove_all(dir);
+    {
+        SegmentedLog log(test_log_options(dir));
+        ASSERT_TRUE(log.open());
+        for (uint64_t seq = 1; seq <= 100; ++seq) {
+            ASSERT_EQ(log.append(seq * 2, 1000 + seq, "payload " + std::to_string(seq)), seq * 2);
+        }
+        EXPECT_EQ(log.append(10, 0, "out of order"), 0);
+        EXPECT_GT(log.segmentCount(), 5);
+        EXPECT_EQ(log.recordCount(), 100);
+    }
+
+    SegmentedLog log(test_log_options(dir));
+    ASSERT_TRUE(log.open());
+    EXPECT_EQ(log.lastSeq(), 200);
+    EXPECT_EQ(log.recordCount(), 100);
+
+    std::vector<uint64_t> seqs;
+    log.scanFromSeq(101, [&seqs](const LogRecordView& record) {
+        seqs.push_back(record.seq);
+        return seqs.size() < 3;
+    });
+    EXPECT_EQ(seqs, (std::vector<uint64_t>{102, 104, 106}));
+
+    std::vector<std::string> tail;
+    log.scanTail(2, [&tail](const LogRecordView& record) {
+        tail.emplace_back(record.payload);
+        return true;
+    });
+    EXPECT_EQ(tail, (std::vector<std::string>{"payload 99", "payload 100"}));
+
+    // Whole sealed segments go while at least 30 newer records remain
+    const uint64_t removed = log.dropSegments(0, 30, SIZE_MAX);
+    EXPECT_GT(removed, 0u);
+    EXPECT_EQ(log.recordCount(), 100 - removed);
+    EXPECT_GE(log.recordCount(), 30u);
+    uint64_t oldest = 0;
+    log.scanFromSeq(0, [&oldest](const LogRecordView& record) {
+        oldest = record.seq;
+        return false;
+    });
+    EXPECT_GT(oldest, 2);
+    std::filesystem::remove_all(dir);
+
+    // Scans run alongside appends and see every record appended before they
+    // started, in order, across buffered bytes and segment rolls
+    const std::string busy_dir = "test_segmented_log_busy";
+    std::filesystem::remove_all(busy_dir);
+    {
+        SegmentedLog busy(test_log_options(busy_dir));
+        ASSERT_TRUE(busy.open());
+        std::atomic<bool> done{false};
+        std::thread writer([&]() {
+            for (uint64_t seq = 1; seq <= 2000; ++seq) {
+                busy.append(seq, 1000, "busy " + std::to_string(seq));
+            }
+            done = true;
+        });
+        bool ordered = true;
+        while (!done) {
+            const uint64_t appended = busy.lastSeq();
+            uint64_t expected = 1;
+            busy.scanFromSeq(0, [&](const LogRecordView& record) {
+                ordered = ordered && record.seq == expected && record.payload == "busy " + std::to_string(expected);
+                ++expected;
+                return ordered;
+            });
+            ordered = ordered && expected > appended;
+        }
+        writer.join();
+        EXPECT_TRUE(ordered);
+        EXPECT_EQ(busy.recordCount(), 2000u);
+    }
+    std::filesystem::remove_all(busy_dir);
+}
+
+// Test a failed flush keeps the unwritten records, readable from the buffer
+TEST_F(ServerTest, SegmentedLogWriteFailureTest) {
+    const std::string dir = "test_segmented_log_failure";
+    std::filesystem::remove_all(dir);
+    SegmentedLogOptions options = test_log_options(dir);
+    options.segment_bytes = 4096;
+    options.flush_bytes = 4096;
+    {
+        SegmentedLog log(options);
+        ASSERT_TRUE(log.open());
+        for (uint64_t seq = 1; seq <= 10; ++seq) {
+            ASSERT_EQ(log.append(seq, 1000 + seq, "record " + std::to_string(seq)), seq);  // 32 bytes each
+        }
+
+        // Past RLIMIT_FSIZE writes fail with EFBIG; the flush stops 4 bytes
+        // into the fourth record
+        rlimit saved;
+        ASSERT_EQ(getrlimit(RLIMIT_FSIZE, &saved), 0);
+        auto previous = signal(SIGXFSZ, SIG_IGN);
+        rlimit limited = saved;
+        limited.rlim_cur = 100;
+        ASSERT_EQ(setrlimit(RLIMIT_FSIZE, &limited), 0);
+        EXPECT_FALSE(log.flush());
+        // Readers do not write: the record cut at the file end and the rest
+        // come from the buffer
+        std::vector<uint64_t> seqs;
+        log.scanFromSeq(0, [&seqs](const LogRecordView& record) {
+            seqs.push_back(record.seq);
+            return true;
+        });
+        std::vector<std::string> tail;
+        log.scanTail(2, [&tail](const LogRecordView& record) {
+            tail.emplace_back(record.payload);
+            return true;
+        });
+        setrlimit(RLIMIT_FSIZE, &saved);
+        signal(SIGXFSZ, previous);
+        EXPECT_EQ(seqs, (std::vector<uint64_t>{1, 2, 3, 4, 5, 6, 7, 8, 9, 10}));
+        EXPECT_EQ(tail, (std::vector<std::string>{"record 9", "record 10"}));
+        EXPECT_EQ(std::filesystem::file_size(dir + "/00000000000000000001.log"), 100u);
+
+        EXPECT_TRUE(log.flush());
+        seqs.clear();
+        log.scanFromSeq(0, [&seqs](const LogRecordView& record) {
+            seqs.push_back(record.seq);
+            return true;
+        });
+        EXPECT_EQ(seqs.size(), 10u);
+    }
+    SegmentedLog log(options);
+    ASSERT_TRUE(log.open());
+    EXPECT_EQ(log.recordCount(), 10u);
+    EXPECT_EQ(log.lastSeq(), 10u);
+    std::filesystem::remove_all(dir);
+}
+
+// Test a corrupt record at the tail of the active segment is dropped on open
+TEST_F(ServerTest, SegmentedLogCorruptionTest) {
+    const std::string dir = "test_segmented_log_crc";
+    std::filesystem::remove_all(dir);
+    {
+        SegmentedLog log(test_log_options(dir));
+        ASSERT_TRUE(log.open());
+        log.append(1, 1, "first");
+        log.append(2, 2, "second");
+    }
+    std::string path = dir + "/00000000000000000001.log";
+    FILE* file = fopen(path.c_str(), "r+b");
+    ASSERT_NE(file, nullptr);
+    fseek(file, -1, SEEK_END);
+    fputc('X', file);
+    fclose(file);
+
+    SegmentedLog log(test_log_options(dir));
+    ASSERT_TRUE(log.open());
+    EXPECT_EQ(log.lastSeq(), 1);
+    EXPECT_EQ(log.append(2, 3, "second again"), 2);
+    std::filesystem::remove_all(dir);
+}
+
+// Test the log-backed message store round trip
+TEST_F(ServerTest, LogMessageStoreTest) {
+    const std::string dir = "test_message_log";
+    std::filesystem::remove_all(dir);
+    LogMessageStore store(dir, test_log_options(""));
+    ASSERT_TRUE(store.isOpen());
+    for (uint64_t seq = 1; seq <= 20; ++seq) {
+        StoredMessage message;
+        message.seq = seq;
+        message.timestamp_ms = current_time_ms();
+        message.sender_id = 1;
+        message.sender_name = "alice";
+        message.content = "hello " + std::to_string(seq);
+        ASSERT_TRUE(store.append(message));
+    }
+
+    auto recent = store.recentBroadcasts(3);
+    ASSERT_EQ(recent.size(), 3);
+    EXPECT_EQ(recent[0].seq, 18);
+    EXPECT_EQ(recent[2].content, "hello 20");
+    EXPECT_EQ(recent[2].sender_name, "alice");
+
+    auto range = store.broadcastsSince(5, 9, 10);
+    ASSERT_EQ(range.size(), 3);
+    EXPECT_EQ(range.front().seq, 6);
+    EXPECT_EQ(range.back().seq, 8);
+
+    // StoreWriter appends in enqueue order off the caller's thread; drain()
+    // waits for everything enqueued so far
+    {
+        StoreWriter writer(store);
+        for (uint64_t seq = 21; seq <= 120; ++seq) {
+            StoredMessage message;
+            message.seq = seq;
+            message.timestamp_ms = current_time_ms();
+            message.sender_id = 1;
+            message.sender_name = "alice";
+            message.content = "queued " + std::to_string(seq);
+            writer.enqueue(std::move(message));
+        }
+        writer.drain();
+        auto queued = store.broadcastsSince(20, UINT64_MAX, 200);
+        ASSERT_EQ(queued.size(), 100u);
+        for (size_t i = 0; i < queued.size(); ++i) {
+            EXPECT_EQ(queued[i].seq, 21 + i);
+        }
+        StoredMessage last;
+        last.seq = 121;
+        last.timestamp_ms = current_time_ms();
+        last.sender_id = 1;
+        last.content = "written on shutdown";
+        writer.enqueue(std::move(last));
+    }
+    EXPECT_EQ(store.recentBroadcasts(1).at(0).content, "written on shutdown");
+    std::filesystem::remove_all(dir);
+}
+
+// Test that conversation history pages newest first per pair, on the log and on SQLite
+TEST_F(ServerTest, ConversationHistoryTest) {
+    const std::string dir = "test_conversation_log";
+    std::filesystem::remove_all(dir);
+    {
+        LogMessageStore store(dir, test_log_options(""));
+        ASSERT_TRUE(store.isOpen());
+        // Interleave two threads: alice(1) <-> bob(2) and alice(1) <-> carol(3)
+        for (int i = 0; i < 30; ++i) {
+            StoredMessage message;
+            message.timestamp_ms = current_time_ms();
+            message.sender_id = (i % 2 == 0) ? 1 : 2;
+            message.receiver_id = (i % 3 == 0) ? 3 : (message.sender_id == 1 ? 2 : 1);
+            message.sender_name = "user" + std::to_string(message.sender_id);
+            message.content = "dm " + std::to_string(i);
+            ASSERT_TRUE(store.append(message));
+        }
+
+        auto page = store.conversation(2, 1, UINT64_MAX, 5);
+        ASSERT_EQ(page.size(), 5);
+        for (size_t i = 1; i < page.size(); ++i) {
+            EXPECT_GT(page[i - 1].seq, page[i].seq);
+        }
+        for (const auto& message : page) {
+            EXPECT_EQ(conversation_key(message.sender_id, message.receiver_id), conversation_key(1, 2));
+        }
+
+        auto next = store.conversation(1, 2, page.back().seq, 100);
+        EXPECT_LT(next.front().seq, page.back().seq);
+        EXPECT_EQ(page.size() + next.size(), 20u);
+        EXPECT_EQ(store.conversation(3, 2, UINT64_MAX, 10).size(), 5u);
+    }
+
+    // The conversation index is rebuilt from the private log
+    LogMessageStore reopened(dir, test_log_options(""));
+    auto all = reopened.conversation(1, 2, UINT64_MAX, 100);
+    EXPECT_EQ(all.size(), 20u);
+    EXPECT_EQ(reopened.conversation(1, 4, UINT64_MAX, 10).size(), 0u);
+    std::filesystem::remove_all(dir);
+
+    // SQLite: the (conv_lo, conv_hi) range scan, on a scratch database whose
+    // one legacy row predates the conversation columns
+    const std::filesystem::path db_dir = std::filesystem::temp_directory_path() /
+                                         ("chat_conversation_test_" + std::to_string(getpid()));
+    std::filesystem::remove_all(db_dir);
+    std::filesystem::create_directories(db_dir);
+    const std::string db_path = (db_dir / "conversation.db").string();
+    sqlite3* legacy = nullptr;
+    ASSERT_EQ(sqlite3_open(db_path.c_str(), &legacy), SQLITE_OK);
+    ASSERT_EQ(sqlite3_exec(legacy,
+                           "CREATE TABLE users (id INTEGER PRIMARY KEY AUTOINCREMENT, username TEXT UNIQUE NOT NULL, "
+                           "password_hash TEXT NOT NULL, salt TEXT NOT NULL, "
+                           "created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP);"
+                           "CREATE TABLE messages (id INTEGER PRIMARY KEY AUTOINCREMENT, sender_id INTEGER NOT NULL, "
+                           "receiver_id INTEGER NOT NULL, content TEXT NOT NULL, "
+                           "created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP);"
+                           "INSERT INTO users (username, password_hash, salt) VALUES ('dm_a', 'x', 'x'), "
+                           "('dm_b', 'x', 'x'), ('dm_c', 'x', 'x');"
+                           "INSERT INTO messages (sender_id, receiver_id, content) VALUES (2, 1, 'legacy');",
+                           nullptr, nullptr, nullptr),
+              SQLITE_OK);
+    sqlite3_close(legacy);
+    {
+        Database db(db_path);
+        for (int i = 0; i < 30; ++i) {
+            const int sender = (i % 2 == 0) ? 1 : 2;
+            const int receiver = (i % 3 == 0) ? 3 : (sender == 1 ? 2 : 1);
+            ASSERT_TRUE(db.storeMessage(sender, receiver, "dm " + std::to_string(i)));
+        }
+        ASSERT_TRUE(db.storeMessage(1, 0, "broadcast", 1));
+
+        auto page = db.loadConversation(2, 1, UINT64_MAX, 5);
+        ASSERT_EQ(page.size(), 5u);
+        EXPECT_EQ(page.front().content, "dm 29");
+        for (size_t i = 0; i < page.size(); ++i) {
+            EXPECT_EQ(conversation_key(page[i].sender_id, page[i].receiver_id), conversation_key(1, 2));
+            if (i > 0) {
+                EXPECT_GT(page[i - 1].seq, page[i].seq);
+            }
+        }
+        auto rest = db.loadConversation(1, 2, page.back().seq, 100);
+        ASSERT_FALSE(rest.empty());
+        EXPECT_LT(rest.front().seq, page.back().seq);
+        EXPECT_EQ(page.size() + rest.size(), 21u);
+        EXPECT_EQ(rest.back().content, "legacy");
+        EXPECT_EQ(rest.back().sender_name, "dm_b");
+        EXPECT_EQ(db.loadConversation(3, 1, UINT64_MAX, 100).size(), 5u);
+        EXPECT_EQ(db.loadConversation(2, 3, UINT64_MAX, 100).size(), 5u);
+        EXPECT_TRUE(db.loadConversation(1, 4, UINT64_MAX, 100).empty());
+    }
+    std::filesystem::remove_all(db_dir);
+}
+
+// Test that /search finds only messages the requester may see, on SQLite and the log index
+TEST_F(ServerTest, MessageSearchTest) {
+    EXPECT_EQ(tokenize_search_terms("Hello, WORLD hello 42"), (std::vector<std::string>{"hello", "world", "42"}));
+
+    // SQLite: FTS5 fed by the insert trigger
+    Database& db = Database::getInstance();
+    db.createUser("search_a", "pw");
+    db.createUser("search_b", "pw");
+    int a = db.getUserID("search_a");
+    int b = db.getUserID("search_b");
+    const std::string token = "needle" + std::to_string(current_time_ms());
+    ASSERT_TRUE(db.storeMessage(a, 0, "public " + token));
+    ASSERT_TRUE(db.storeMessage(a, b, "private " + token));
+    SqliteMessageStore sqlite_store;
+    EXPECT_EQ(sqlite_store.search(b, token, UINT64_MAX, 10).messages.size(), 2u);
+    SearchPage outsider = sqlite_store.search(b + 1000, token, UINT64_MAX, 10);
+    ASSERT_EQ(outsider.messages.size(), 1u);
+    EXPECT_EQ(outsider.messages[0].content, "public " + token);
+    SearchPage paged = sqlite_store.search(b, token, UINT64_MAX, 1);
+    ASSERT_NE(paged.next_before, 0u);
+    EXPECT_EQ(sqlite_store.search(b, token, paged.next_before, 1).messages[0].content, "public " + token);
+
+    // Results for a client that left do not reach the next owner of its descriptor
+    db.createUser("search_c", "pw");
+    std::mutex gate_mtx;
+    std::unique_lock<std::mutex> gate(gate_mtx);
+    for (int i = 0; i < QUERY_EXECUTOR_THREADS; ++i) {
+        ASSERT_TRUE(QueryExecutor::getInstance().submit([&]() { std::lock_guard<std::mutex> lock(gate_mtx); }));
+    }
+    int sv[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    const int reused = sv[0];
+    Connection* searcher = get_available_connection();
+    ASSERT_NE(searcher, nullptr);
+    attach_socket(searcher, reused);
+    {
+        std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+        searcher->username = "search_b";
+        searcher->authenticated = true;
+    }
+    process_command(Message{reused, "/search " + token});
+    release_connection(searcher);  // closes `reused`
+    close(sv[1]);
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    if (sv[0] != reused) {
+        ASSERT_EQ(dup2(sv[0], reused), reused);
+        close(sv[0]);
+    }
+    Connection* next_owner = get_available_connection();
+    ASSERT_NE(next_owner, nullptr);
+    attach_socket(next_owner, reused);
+    {
+        std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+        next_owner->username = "search_c";
+        next_owner->authenticated = true;
+    }
+    process_command(Message{reused, "/search " + token});
+    gate.unlock();
+    std::string received;
+    timeval timeout{0, 200000};
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char chunk[BUFFER_SIZE];
+    ssize_t n;
+    while ((n = recv(sv[1], chunk, sizeof(chunk), 0)) > 0) {
+        received.append(chunk, static_cast<size_t>(n));
+    }
+    EXPECT_NE(received.find("Search results for \"" + token + "\" (1 messages)"), std::string::npos);
+    EXPECT_EQ(received.find("private " + token), std::string::npos);
+    release_connection(next_owner);
+    close(sv[1]);
+
+    const std::string dir = "test_search_log";
+    std::filesystem::remove_all(dir);
+    {
+        LogMessageStore store(dir, test_log_options(""));
+        ASSERT_TRUE(store.isOpen());
+        for (uint64_t i = 1; i <= 12; ++i) {
+            StoredMessage message;
+            message.seq = i;
+            message.timestamp_ms = current_time_ms();
+            message.sender_id = 1;
+            message.sender_name = "alice";
+            message.content = (i % 2 == 0 ? "deploy the release " : "lunch plans ") + std::to_string(i);
+            ASSERT_TRUE(store.append(message));
+        }
+        StoredMessage secret;
+        secret.timestamp_ms = current_time_ms();
+        secret.sender_id = 1;
+        secret.receiver_id = 2;
+        secret.sender_name = "alice";
+        secret.content = "private release notes";
+        ASSERT_TRUE(store.append(secret));
+
+        // Private messages are only visible to their participants
+        EXPECT_EQ(store.search(2, "release", UINT64_MAX, 100).messages.size(), 7u);
+        EXPECT_EQ(store.search(3, "release", UINT64_MAX, 100).messages.size(), 6u);
+        EXPECT_EQ(store.search(3, "RELEASE deploy", UINT64_MAX, 100).messages.size(), 6u);
+        EXPECT_TRUE(store.search(3, "release lunch", UINT64_MAX, 100).messages.empty());
+
+        // Keyset pagination walks newest to oldest without overlap
+        SearchPage first = store.search(3, "deploy", UINT64_MAX, 4);
+        ASSERT_EQ(first.messages.size(), 4u);
+        EXPECT_EQ(first.messages.front().content, "deploy the release 12");
+        ASSERT_NE(first.next_before, 0u);
+        SearchPage second = store.search(3, "deploy", first.next_before, 4);
+        ASSERT_EQ(second.messages.size(), 2u);
+        EXPECT_EQ(second.messages.back().content, "deploy the release 2");
+        EXPECT_EQ(second.next_before, 0u);
+    }
+
+    // The index is rebuilt from both logs on open
+    LogMessageStore reopened(dir, test_log_options(""));
+    EXPECT_EQ(reopened.search(2, "release", UINT64_MAX, 100).messages.size(), 7u);
+    std::filesystem::remove_all(dir);
+}
+
+// Test that the query executor refuses work beyond its bounded backlog
+TEST_F(ServerTest, QueryExecutorTest) {
+    QueryExecutor executor(2, 4);
+    std::atomic<int> done{0};
+    std::mutex gate_mtx;
+    std::unique_lock<std::mutex> gate(gate_mtx);
+    // Two tasks block the threads; the backlog then fills at max_pending
+    for (int i = 0; i < 2; ++i) {
+        ASSERT_TRUE(executor.submit([&]() { std::lock_guard<std::mutex> lock(gate_mtx); ++done; }));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_TRUE(executor.submit([&]() { ++done; }));
+    }
+    EXPECT_FALSE(executor.submit([&]() { ++done; }));
+    gate.unlock();
+    executor.shutdown();
+    EXPECT_EQ(done.load(), 6);
+}
+
+// Test that retention expires messages by count and by age, on the log and on SQLite
+TEST_F(ServerTest, MessageRetentionTest) {
+    const std::string dir = "test_retention_log";
+    std::filesystem::remove_all(dir);
+    LogMessageStore store(dir, test_log_options(""));
+    ASSERT_TRUE(store.isOpen());
+    const int64_t start = current_time_ms();
+    for (uint64_t i = 1; i <= 60; ++i) {
+        StoredMessage message;
+        message.seq = i;
+        message.timestamp_ms = start + static_cast<int64_t>(i) * 1000;
+        message.sender_id = 1;
+        message.sender_name = "alice";
+        message.content = "broadcast number " + std::to_string(i);
+        ASSERT_TRUE(store.append(message));
+        message.receiver_id = 2;
+        message.content = "private number " + std::to_string(i);
+        ASSERT_TRUE(store.append(message));
+    }
+    store.flush();
+
+    // Count limit on private messages only; broadcasts are untouched
+    RetentionPolicy keep_all;
+    RetentionPolicy keep_ten;
+    keep_ten.max_messages = 10;
+    MessageCompactor compactor(store, keep_all, keep_ten, std::chrono::milliseconds(1000), 0);
+    uint64_t removed = compactor.runOnce();
+    EXPECT_GT(removed, 0u);
+    EXPECT_EQ(compactor.removedTotal(), removed);
+    EXPECT_EQ(store.recentBroadcasts(100).size(), 60u);
+    auto thread = store.conversation(1, 2, UINT64_MAX, 100);
+    EXPECT_GE(thread.size(), 10u);
+    EXPECT_EQ(thread.size(), 60u - removed);
+    EXPECT_EQ(thread.front().content, "private number 60");
+
+    // Age limit on broadcasts: everything older than the 30th second goes
+    RetentionPolicy recent;
+    recent.max_age_ms = 30 * 1000;
+    RateLimiter unlimited(0, 0);
+    EXPECT_GT(store.removeExpired(recent, keep_all, start + 60 * 1000, unlimited), 0u);
+    auto broadcasts = store.recentBroadcasts(100);
+    ASSERT_FALSE(broadcasts.empty());
+    EXPECT_LT(broadcasts.size(), 60u);
+    EXPECT_EQ(broadcasts.back().seq, 60u);
+    std::filesystem::remove_all(dir);
+
+    // SQLite: batched deletes by id range, private messages only, on a
+    // scratch database so the server's own messages are left alone
+    const std::filesystem::path db_dir = std::filesystem::temp_directory_path() / ("chat_retention_test_" + std::to_string(getpid()));
+    std::filesystem::remove_all(db_dir);
+    std::filesystem::create_directories(db_dir);
+    {
+        Database db((db_dir / "retention.db").string());
+        db.createUser("retention_a", "pw");
+        db.createUser("retention_b", "pw");
+        int a = db.getUserID("retention_a");
+        int b = db.getUserID("retention_b");
+        for (int i = 0; i < 5; ++i) {
+            ASSERT_TRUE(db.storeMessage(a, b, "expiring " + std::to_string(i)));
+        }
+        uint64_t cutoff = db.retentionCutoff(false, 0, 2);
+        ASSERT_GT(cutoff, 0u);
+        while (db.deleteMessagesThrough(false, cutoff, 2) == 2) {
+        }
+        auto remaining = db.loadConversation(a, b, UINT64_MAX, 10);
+        ASSERT_EQ(remaining.size(), 2u);
+        EXPECT_EQ(remaining[0].content, "expiring 4");
+        EXPECT_EQ(db.retentionCutoff(false, 0, 2), 0u);
+    }
+    std::filesystem::remove_all(db_dir);
+}
+
+// Test that latency histogram buckets bound their values and give accurate percentiles
+TEST_F(ServerTest, LatencyHistogramTest) {
+    // Buckets are contiguous and bounded by ~3% relative error
+    for (uint64_t value : {0ULL, 1ULL, 63ULL, 64ULL, 65ULL, 1000ULL, 123456ULL, 1ULL << 39}) {
+        size_t index = latency_buckets::index_of(value);
+        EXPECT_LE(latency_buckets::lower_bound(index), value);
+        EXPECT_GE(latency_buckets::upper_bound(index), value);
+        EXPECT_LE(latency_buckets::upper_bound(index) - latency_buckets::lower_bound(index), value / 32 + 1);
+    }
+    EXPECT_EQ(latency_buckets::index_of(UINT64_MAX), latency_buckets::COUNT - 1);
+
+    LatencyHistogram histogram;
+    for (uint64_t us = 1; us <= 10000; ++us) {
+        histogram.record(us);
+    }
+    HistogramSnapshot snapshot;
+    histogram.merge_into(snapshot);
+    EXPECT_EQ(snapshot.count, 10000u);
+    EXPECT_EQ(snapshot.max, 10000u);
+    EXPECT_NEAR(snapshot.percentile(0.50), 5000, 5000 * 0.03);
+    EXPECT_NEAR(snapshot.percentile(0.99), 9900, 9900 * 0.03);
+    EXPECT_NEAR(snapshot.mean(), 5000.5, 0.01);
+}
+
+// Test that sharded metrics lose no updates under concurrent writers
+TEST_F(ServerTest, ShardedMetricsTest) {
+    ServerMetrics local;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t) {
+        threads.emplace_back([&local, t]() {
+            for (int i = 0; i < 1000; ++i) {
+                local.record_message("metrics_test", (t + 1) * 0.5);
+                local.record_message("metrics_count_only");
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    EXPECT_EQ(local.get_total_messages(), 16000u);
+    auto types = local.get_message_types();
+    EXPECT_EQ(types["metrics_test"], 8000u);
+    EXPECT_EQ(types["metrics_count_only"], 8000u);
+    for (const auto& stats : local.get_type_stats()) {
+        if (stats.type == "metrics_test") {
+            EXPECT_EQ(stats.latency.count, 8000u);
+            EXPECT_EQ(stats.latency.max, 4000u);  // 4 ms in microseconds
+            EXPECT_NEAR(stats.latency.percentile(0.5), 2000, 2000 * 0.03);
+        } else {
+            EXPECT_EQ(stats.latency.count, 0u);
+        }
+    }
+    EXPECT_NEAR(local.get_average_latency(), 2.25, 0.001);
+}
+
+static std::string http_get(int port, const std::string& path) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        close(fd);
+        return "";
+    }
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    send(fd, request.data(), request.size(), 0);
+    std::string response;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        response.append(buffer, static_cast<size_t>(n));
+    }
+    close(fd);
+    return response;
+}
+
+// Test that the admin port serves metrics in the Prometheus text format
+TEST_F(ServerTest, PrometheusEndpointTest) {
+    metrics.record_message("prometheus_test", 1.5);
+    metrics.record_drop(DropLane::Oversize);
+
+    AdminServer admin("127.0.0.1", 0);
+    ASSERT_TRUE(admin.start());
+    std::string response = http_get(admin.port(), "/metrics");
+    EXPECT_EQ(response.rfind("HTTP/1.1 200 OK", 0), 0u);
+    EXPECT_NE(response.find("text/plain; version=0.0.4"), std::string::npos);
+    EXPECT_NE(response.find("# TYPE chat_message_queue_depth gauge"), std::string::npos);
+    EXPECT_NE(response.find("chat_messages_by_type_total{type=\"prometheus_test\"}"), std::string::npos);
+    EXPECT_NE(response.find("chat_message_latency_seconds_bucket{type=\"prometheus_test\",le=\"0.0025\"} 1"),
+              std::string::npos);
+    EXPECT_NE(response.find("chat_message_latency_seconds_bucket{type=\"prometheus_test\",le=\"0.001\"} 0"),
+              std::string::npos);
+    EXPECT_NE(response.find("chat_messages_dropped_total{lane=\"oversize\"}"), std::string::npos);
+    EXPECT_NE(response.find("chat_store_flush_latency_seconds_count"), std::string::npos);
+
+    EXPECT_EQ(http_get(admin.port(), "/").rfind("HTTP/1.1 404", 0), 0u);
+    admin.stop();
+}
+
+// Test that message traces stamp each stage and feed per-stage latencies and samples
+TEST_F(ServerTest, MessageTraceTest) {
+    // The queue stamps enqueue and dequeue
+    MessageQueue queue(4);
+    Message queued;
+    queued.sender_socket = 1;
+    queued.content = "traced";
+    queued.trace.recv_ns = trace_now();
+    ASSERT_TRUE(queue.push(queued));
+    Message popped = queue.pop();
+    EXPECT_GE(popped.trace.enqueue_ns, popped.trace.recv_ns);
+    EXPECT_GE(popped.trace.dequeue_ns, popped.trace.enqueue_ns);
+
+    MessageTracer tracer(4);
+    for (int64_t i = 0; i < 10; ++i) {
+        MessageTrace trace;
+        trace.recv_ns = 1000000;
+        trace.enqueue_ns = trace.recv_ns + 10000;           // 10 us
+        trace.dequeue_ns = trace.enqueue_ns + 100000;       // 100 us
+        trace.persist_ns = trace.dequeue_ns + 50000 * (i + 1);
+        trace.first_send_ns = trace.persist_ns + 5000;
+        trace.last_send_ns = trace.first_send_ns + 20000;
+        tracer.record(trace);
+    }
+    MessageTrace command_only;  // commands never reach persist or send
+    command_only.recv_ns = 1000;
+    command_only.enqueue_ns = 2000;
+    command_only.dequeue_ns = 3000;
+    tracer.record(command_only);
+
+    EXPECT_EQ(tracer.traced(), 11u);
+    EXPECT_EQ(tracer.stage_latency(TraceStage::QueueWait).count, 11u);
+    EXPECT_EQ(tracer.stage_latency(TraceStage::Persist).count, 10u);
+    EXPECT_EQ(tracer.stage_latency(TraceStage::Persist).max, 500u);
+    EXPECT_EQ(tracer.stage_latency(TraceStage::Enqueue).max, 10u);
+    EXPECT_EQ(tracer.stage_latency(TraceStage::Fanout).max, 20u);
+    EXPECT_EQ(tracer.stage_latency(TraceStage::Total).count, 10u);
+
+    // Every 4th trace is sampled: records 0, 4 and 8, newest first
+    auto samples = tracer.recent_samples(10);
+    ASSERT_EQ(samples.size(), 3u);
+    EXPECT_EQ(samples[0].persist_ns - samples[0].dequeue_ns, 450000);
+    EXPECT_EQ(samples[2].persist_ns - samples[2].dequeue_ns, 50000);
+}
+
+// Test asynchronous logger ordering, levels, repeat suppression and shutdown
+TEST_F(ServerTest, AsyncLoggerTest) {
+    FILE* sink = tmpfile();
+    ASSERT_NE(sink, nullptr);
+    auto read_sink = [sink]() {
+        std::string text;
+        fseek(sink, 0, SEEK_SET);
+        char chunk[4096];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), sink)) > 0) {
+            text.append(chunk, n);
+        }
+        fseek(sink, 0, SEEK_END);
+        return text;
+    };
+    auto count_of = [](const std::string& text, const std::string& needle) {
+        size_t count = 0;
+        for (size_t pos = text.find(needle); pos != std::string::npos; pos = text.find(needle, pos + 1)) {
+            ++count;
+        }
+        return count;
+    };
+
+    {
+        Logger logger(sink);
+        logger.log(LogLevel::Debug, "hidden debug");
+        logger.log(LogLevel::Info, "first line");
+        logger.log(LogLevel::Error, "broken thing");
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&logger, t]() {
+                for (int i = 0; i < 50; ++i) {
+                    logger.log(LogLevel::Info, "thread " + std::to_string(t) + " line " + std::to_string(i));
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        logger.flush();
+
+        std::string text = read_sink();
+        EXPECT_EQ(text.find("hidden debug"), std::string::npos);
+        EXPECT_NE(text.find("] first line\n"), std::string::npos);
+        EXPECT_NE(text.find("] ERROR: broken thing\n"), std::string::npos);
+        EXPECT_EQ(count_of(text, "\n"), 202u);
+        // Each thread's lines keep their order
+        for (int t = 0; t < 4; ++t) {
+            size_t previous = 0;
+            for (int i = 0; i < 50; ++i) {
+                size_t pos = text.find("thread " + std::to_string(t) + " line " + std::to_string(i) + "\n");
+                ASSERT_NE(pos, std::string::npos);
+                EXPECT_GT(pos, previous);
+                previous = pos;
+            }
+        }
+
+        // Identical lines beyond the per-second limit are summarised, each
+        // summary at the level of the line they stand for
+        for (int i = 0; i < LOG_REPEAT_LIMIT + 20; ++i) {
+            logger.log(LogLevel::Warn, "disk almost full");
+            logger.log(LogLevel::Info, "cache miss");
+        }
+        logger.shutdown();
+        text = read_sink();
+        EXPECT_LE(count_of(text, "WARN: disk almost full\n"), static_cast<size_t>(2 * LOG_REPEAT_LIMIT));  // may straddle a second
+        EXPECT_NE(text.find("WARN: suppressed "), std::string::npos);
+        EXPECT_NE(text.find(" repeats of: disk almost full"), std::string::npos);
+        EXPECT_NE(text.find(" repeats of: cache miss"), std::string::npos);
+        EXPECT_EQ(count_of(text, "WARN: suppressed "), count_of(text, " repeats of: disk almost full"));
+
+        // After shutdown records are written synchronously
+        logger.log(LogLevel::Info, "after shutdown");
+        EXPECT_NE(read_sink().find("] after shutdown\n"), std::string::npos);
+        EXPECT_EQ(logger.dropped(), 0u);
+    }
+    fclose(sink);
+}
+
+// Test per-connection traffic counters and stall accounting
+TEST_F(ServerTest, ConnectionTrafficTest) {
+    int sv[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    Connection* conn = get_available_connection();
+    ASSERT_NE(conn, nullptr);
+    attach_socket(conn, sv[0]);
+    {
+        std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+        conn->username = "traffic_tester";
+    }
+    ASSERT_EQ(traffic_for_socket(sv[0]), &conn->traffic);
+
+    const size_t bytes_before = metrics.total_bytes_transferred.load();
+    EXPECT_EQ(send_to_client(sv[0], "hello\n"), 6);
+    EXPECT_EQ(send_to_client(sv[0], "world!!\n"), 8);
+    conn->traffic.record_in(42);
+    EXPECT_EQ(metrics.total_bytes_transferred.load() - bytes_before, 14u);
+
+    auto find_tester = []() {
+        for (const auto& snapshot : snapshot_connections()) {
+            if (snapshot.username == "traffic_tester") {
+                return snapshot;
+            }
+        }
+        return ConnectionSnapshot{};
+    };
+    ConnectionSnapshot snapshot = find_tester();
+    EXPECT_EQ(snapshot.bytes_out, 14u);
+    EXPECT_EQ(snapshot.messages_out, 2u);
+    EXPECT_EQ(snapshot.bytes_in, 42u);
+    EXPECT_EQ(snapshot.messages_in, 1u);
+    EXPECT_LT(snapshot.idle_seconds, 5.0);
+
+    // A peer that never reads fills the buffer: writes stall, then fail
+    ASSERT_TRUE(set_socket_nonblocking(sv[0]));
+    std::string chunk(64 * 1024, 'x');
+    ssize_t result = 0;
+    for (int i = 0; i < 64 && result >= 0; ++i) {
+        result = send_to_client(sv[0], chunk, 0, 1);
+    }
+    EXPECT_EQ(result, -1);
+    snapshot = find_tester();
+    EXPECT_GE(snapshot.send_stalls, 1u);
+    EXPECT_EQ(snapshot.send_failures, 1u);
+
+    release_connection(conn);
+    EXPECT_EQ(traffic_for_socket(sv[0]), nullptr);
+    close(sv[1]);
+}
+
+// Test named lock acquisition, contention and hold-time accounting
+TEST_F(ServerTest, InstrumentedMutexTest) {
+    auto find_stats = [](const std::string& name) {
+        for (auto& stats : lock_stats_snapshot()) {
+            if (stats.name == name) {
+                return stats;
+            }
+        }
+        return LockStatsSnapshot{};
+    };
+
+    InstrumentedMutex mutex("test_lock");
+    std::atomic<bool> held{false};
+    std::thread holder([&]() {
+        std::lock_guard<InstrumentedMutex> lock(mutex);
+        held = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    });
+    while (!held) {
+        std::this_thread::yield();
+    }
+    {
+        std::lock_guard<InstrumentedMutex> lock(mutex);  // waits for the holder
+    }
+    holder.join();
+    EXPECT_TRUE(mutex.try_lock());
+    mutex.unlock();
+
+    LockStatsSnapshot stats = find_stats("test_lock");
+    EXPECT_EQ(stats.acquisitions, 3u);
+    EXPECT_EQ(stats.contended, 1u);
+    EXPECT_EQ(stats.wait_ns.count, 3u);
+    EXPECT_GE(stats.wait_ns.max, 5000000u);
+    EXPECT_GE(stats.hold_ns.max, 20000000u);
+
+    // Same name, same stats; with timing off only acquisitions are counted
+    InstrumentedMutex alias("test_lock");
+    set_lock_instrumentation(false);
+    {
+        std::lock_guard<InstrumentedMutex> lock(alias);
+    }
+    set_lock_instrumentation(true);
+    stats = find_stats("test_lock");
+    EXPECT_EQ(stats.acquisitions, 4u);
+    EXPECT_EQ(stats.hold_ns.count, 3u);
+
+    std::string body = render_prometheus_metrics();
+    EXPECT_NE(body.find("chat_lock_acquisitions_total{lock=\"pool\"}"), std::string::npos);
+    EXPECT_NE(body.find("chat_lock_hold_seconds_count{lock=\"test_lock\"} 3"), std::string::npos);
+    EXPECT_NE(body.find("chat_lock_wait_seconds_bucket{lock=\"message_queue\",le=\"+Inf\"}"), std::string::npos);
+}
+
+// Test flight recorder rings wrap per thread and dump every thread's events
+TEST_F(ServerTest, FlightRecorderTest) {
+    const int socket_id = 987654;
+    flight_record(FlightEvent::Accept, socket_id, 42);  // claims this thread's ring first
+    std::thread worker([&]() {
+        for (int i = 0; i < FLIGHT_RECORDER_EVENTS_PER_THREAD + 10; ++i) {
+            flight_record(FlightEvent::Enqueue, socket_id, static_cast<uint64_t>(i));
+        }
+    });
+    worker.join();
+
+    const std::string path = "test_flight_recorder.bin";
+    ASSERT_TRUE(dump_flight_recorder(path.c_str()));
+    FILE* file = fopen(path.c_str(), "rb");
+    ASSERT_NE(file, nullptr);
+    std::vector<char> data;
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        data.insert(data.end(), chunk, chunk + n);
+    }
+    fclose(file);
+    std::remove(path.c_str());
+
+    const size_t header_bytes = 40;
+    const size_t ring_bytes = 16 + FLIGHT_RECORDER_EVENTS_PER_THREAD * sizeof(FlightRecord);
+    ASSERT_GE(data.size(), header_bytes);
+    EXPECT_EQ(std::string(data.data(), 8), "CHATFLT1");
+    uint32_t ring_count;
+    std::memcpy(&ring_count, data.data() + 20, sizeof(ring_count));
+    ASSERT_GE(ring_count, 2u);
+    ASSERT_EQ(data.size(), header_bytes + ring_count * ring_bytes);
+
+    // The worker ring kept only its newest events; the accept is in another ring
+    uint64_t oldest_enqueue = UINT64_MAX, newest_enqueue = 0, enqueues = 0, accepts = 0;
+    for (uint32_t ring = 0; ring < ring_count; ++ring) {
+        const char* records = data.data() + header_bytes + ring * ring_bytes + 16;
+        for (size_t i = 0; i < FLIGHT_RECORDER_EVENTS_PER_THREAD; ++i) {
+            FlightRecord record;
+            std::memcpy(&record, records + i * sizeof(FlightRecord), sizeof(record));
+            if (record.socket != socket_id) {
+                continue;
+            }
+            if (record.event == static_cast<uint16_t>(FlightEvent::Enqueue)) {
+                ++enqueues;
+                oldest_enqueue = std::min(oldest_enqueue, record.arg);
+                newest_enqueue = std::max(newest_enqueue, record.arg);
+            } else if (record.event == static_cast<uint16_t>(FlightEvent::Accept)) {
+                ++accepts;
+                EXPECT_EQ(record.arg, 42u);
+            }
+        }
+    }
+    EXPECT_EQ(enqueues, static_cast<uint64_t>(FLIGHT_RECORDER_EVENTS_PER_THREAD));
+    EXPECT_EQ(oldest_enqueue, 10u);
+    EXPECT_EQ(newest_enqueue, static_cast<uint64_t>(FLIGHT_RECORDER_EVENTS_PER_THREAD + 9));
+    EXPECT_EQ(accepts, 1u);
+}
+
+// Message workers for tests that drive the whole pipeline; they live for the
+// rest of the process
+static void start_test_workers() {
+    static std::once_flag workers_started;
+    std::call_once(workers_started, []() {
+        for (int i = 0; i < 2; ++i) {
+            std::thread(message_worker).detach();
+        }
+        std::thread(room_batch_ticker).detach();
+    });
+}
+
+// Test the in-memory transport, then drive the whole server pipeline through it
+TEST_F(ServerTest, MemoryTransportTest) {
+    MemoryTransport pipe(8);
+    int id = pipe.connect();
+    EXPECT_TRUE(pipe.client_send(id, "hello"));
+    EXPECT_TRUE(pipe.client_send(id, "world"));
+    char buffer[16];
+    ASSERT_EQ(pipe.recv(id, buffer, sizeof(buffer)), 5);  // one recv per client_send
+    EXPECT_EQ(std::string(buffer, 5), "hello");
+    ASSERT_EQ(pipe.recv(id, buffer, 3), 3);
+    ASSERT_EQ(pipe.recv(id, buffer + 3, sizeof(buffer)), 2);
+    EXPECT_EQ(std::string(buffer, 5), "world");
+
+    // The server side blocks once the client has 8 unread bytes
+    EXPECT_EQ(pipe.send(id, "0123456789", 10, 0), 8);
+    EXPECT_EQ(pipe.outbound_queued(id), 8u);
+    EXPECT_EQ(pipe.send(id, "89", 2, 0), -1);
+    EXPECT_EQ(errno, EAGAIN);
+    EXPECT_EQ(pipe.client_receive(id), "01234567");
+    EXPECT_EQ(pipe.client_receive(id, std::chrono::milliseconds(10)), "");
+
+    pipe.client_close(id);
+    EXPECT_EQ(pipe.recv(id, buffer, sizeof(buffer)), 0);
+    EXPECT_FALSE(pipe.server_closed(id));
+    pipe.close(id);
+    EXPECT_EQ(pipe.connection_count(), 0u);
+
+    // Full pipeline: handle_client, the message queue, workers and fan-out,
+    // with no sockets
+    static MemoryTransport memory;
+    start_test_workers();
+    set_transport(&memory);
+
+    const std::vector<std::string> users = {"mt_alice", "mt_bob", "mt_carol"};
+    std::vector<int> clients;
+    for (const auto& user : users) {
+        Database::getInstance().createUser(user, "pw");
+        int client = memory.connect();
+        std::thread(handle_client, client).detach();
+        ASSERT_TRUE(memory.client_send(client, "/login " + user + " pw"));
+        EXPECT_NE(memory.client_receive_until(client, "Login successful!", std::chrono::seconds(5)), "");
+        clients.push_back(client);
+    }
+
+    ASSERT_TRUE(memory.client_send(clients[0], "hello over memory"));
+    for (size_t i = 1; i < clients.size(); ++i) {
+        EXPECT_NE(memory.client_receive_until(clients[i], "mt_alice: hello over memory", std::chrono::seconds(5)), "");
+    }
+    EXPECT_EQ(memory.client_receive(clients[0], std::chrono::milliseconds(50)), "");  // no echo to the sender
+
+    ASSERT_TRUE(memory.client_send(clients[0], "/msg mt_bob psst"));
+    EXPECT_NE(memory.client_receive_until(clients[1], "(private from mt_alice) psst", std::chrono::seconds(5)), "");
+    EXPECT_EQ(memory.client_receive(clients[2], std::chrono::milliseconds(50)), "");
+
+    // Closing the client releases its connection, which closes the server side
+    for (int client : clients) {
+        memory.client_close(client);
+    }
+    for (int i = 0; i < 500 && memory.connection_count() > 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(memory.connection_count(), 0u);
+    EXPECT_EQ(username_for_socket(clients[0]), "");
+    set_transport(nullptr);
+}
+
+// Test that a capture records a session without its password and reads back
+TEST_F(ServerTest, TrafficCaptureTest) {
+    const std::filesystem::path capture_dir = std::filesystem::temp_directory_path() /
+                                              ("chat_capture_test_" + std::to_string(getpid()));
+    std::filesystem::remove_all(capture_dir);
+    std::filesystem::create_directories(capture_dir);
+    const std::string path = (capture_dir / "traffic.cap").string();
+    MemoryTransport memory;
+    start_test_workers();
+    set_transport(&memory);
+    Database::getInstance().createUser("cap_user", "cap_secret");
+
+    TrafficCapture& capture = TrafficCapture::instance();
+    ASSERT_TRUE(capture.start(path));
+    int client = memory.connect();
+    std::thread handler(handle_client, client);
+    ASSERT_TRUE(memory.client_send(client, "/login cap_user wrong"));
+    EXPECT_NE(memory.client_receive_until(client, "Login failed.", std::chrono::seconds(5)), "");
+    ASSERT_TRUE(memory.client_send(client, "/login cap_user cap_secret"));
+    EXPECT_NE(memory.client_receive_until(client, "Login successful!", std::chrono::seconds(5)), "");
+    ASSERT_TRUE(memory.client_send(client, "captured hello"));
+    ASSERT_TRUE(memory.client_send(client, "/list"));
+    EXPECT_NE(memory.client_receive_until(client, "Active users:", std::chrono::seconds(5)), "");
+    memory.client_close(client);
+    handler.join();
+    EXPECT_TRUE(capture.active());
+    EXPECT_EQ(capture.stop(), 6u);
+    EXPECT_FALSE(capture.active());
+    set_transport(nullptr);
+
+    std::ifstream file(path, std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(bytes.find("cap_secret"), std::string::npos);
+    EXPECT_EQ(bytes.find("wrong"), std::string::npos);
+
+    std::vector<CaptureRecord> records;
+    int64_t started_us = 0;
+    ASSERT_TRUE(read_traffic_capture(path, records, &started_us));
+    EXPECT_GT(started_us, 0);
+    ASSERT_EQ(records.size(), 6u);
+    EXPECT_EQ(records[0].event, CaptureEvent::Open);
+    EXPECT_EQ(records[1].event, CaptureEvent::Auth);
+    EXPECT_EQ(records[1].auth, CaptureAuth::Login);
+    EXPECT_FALSE(records[1].auth_ok);
+    EXPECT_EQ(records[1].data, "cap_user");
+    EXPECT_EQ(records[2].event, CaptureEvent::Auth);
+    EXPECT_TRUE(records[2].auth_ok);
+    EXPECT_EQ(records[3].event, CaptureEvent::Message);
+    EXPECT_EQ(records[3].data, "captured hello");
+    EXPECT_EQ(records[4].data, "/list");
+    EXPECT_EQ(records[5].event, CaptureEvent::Close);
+    for (size_t i = 0; i < records.size(); ++i) {
+        EXPECT_EQ(records[i].connection, 1u);
+        if (i > 0) {
+            EXPECT_GE(records[i].offset_us, records[i - 1].offset_us);
+        }
+    }
+
+    // A capture never overwrites an existing file
+    EXPECT_FALSE(capture.start(path));
+    EXPECT_FALSE(capture.active());
+    ASSERT_TRUE(read_traffic_capture(path, records));
+    EXPECT_EQ(records.size(), 6u);
+
+    // A capture cut off mid-record still yields the records before the cut
+    truncate(path.c_str(), static_cast<off_t>(bytes.size() - 1));
+    ASSERT_TRUE(read_traffic_capture(path, records));
+    EXPECT_EQ(records.size(), 5u);
+
+    // Binary clients can log in with a Command frame; its password stays out too
+    const std::string binary_path = (capture_dir / "traffic_binary.cap").string();
+    set_transport(&memory);
+    ASSERT_TRUE(capture.start(binary_path));
+    client = memory.connect();
+    std::thread binary_handler(handle_client, client);
+    ASSERT_TRUE(memory.client_send(client, encode_hello(WIRE_PROTOCOL_VERSION) +
+                                               encode_frame(FrameType::Command, "/login cap_user cap_secret")));
+    EXPECT_NE(memory.client_receive_until(client, "Login successful!", std::chrono::seconds(5)), "");
+    memory.client_close(client);
+    binary_handler.join();
+    EXPECT_EQ(capture.stop(), 3u);
+    set_transport(nullptr);
+    std::ifstream binary_file(binary_path, std::ios::binary);
+    bytes.assign(std::istreambuf_iterator<char>(binary_file), std::istreambuf_iterator<char>());
+    EXPECT_EQ(bytes.find("cap_secret"), std::string::npos);
+    ASSERT_TRUE(read_traffic_capture(binary_path, records));
+    ASSERT_EQ(records.size(), 3u);
+    EXPECT_EQ(records[1].event, CaptureEvent::Auth);
+    EXPECT_TRUE(records[1].auth_ok);
+    std::filesystem::remove_all(capture_dir);
+
+    // Named captures stay inside the capture directory
+    EXPECT_EQ(capture_file_path("nightly-1"), std::string(TRAFFIC_CAPTURE_DIR) + "/nightly-1.cap");
+    EXPECT_EQ(capture_file_path("chat_server.db"), "");
+    EXPECT_EQ(capture_file_path("../escape"), "");
+    EXPECT_EQ(capture_file_path(std::string(65, 'a')), "");
+    const std::string generated = capture_file_path("");
+    EXPECT_EQ(generated.rfind(std::string(TRAFFIC_CAPTURE_DIR) + "/traffic-", 0), 0u);
+    EXPECT_EQ(generated.substr(generated.size() - 4), ".cap");
+    rmdir(TRAFFIC_CAPTURE_DIR);
+}
+
+
+// Test frame encoding and the in-place decoder
+TEST_F(ServerTest, WireProtocolTest) {
+    uint8_t version = 0;
+    EXPECT_EQ(parse_hello("/login a b", version), HelloStatus::Text);
+    EXPECT_EQ(parse_hello(std::string_view(WIRE_HELLO_MAGIC, 2), version), HelloStatus::Incomplete);
+    EXPECT_EQ(parse_hello(encode_hello(3), version), HelloStatus::Binary);
+    EXPECT_EQ(version, 3);
+
+    std::string stream = encode_chat(42, 1700000000123, "alice", "hi there") +
+                         encode_credentials(FrameType::Login, "bob", "secret") + encode_error(WireError::Busy, "later");
+    WireFrame frame;
+    size_t consumed = 0;
+    ASSERT_EQ(decode_frame(stream, frame, consumed, 64), DecodeStatus::Complete);
+    EXPECT_EQ(frame.type, FrameType::ChatMessage);
+    EXPECT_EQ(frame.payload.data(), stream.data() + WIRE_HEADER_BYTES);  // parsed in place
+    WireReader chat(frame.payload);
+    uint64_t seq = 0, timestamp_ms = 0;
+    std::string_view sender;
+    ASSERT_TRUE(chat.read_u64(seq) && chat.read_u64(timestamp_ms) && chat.read_string(sender));
+    EXPECT_EQ(seq, 42u);
+    EXPECT_EQ(timestamp_ms, 1700000000123u);
+    EXPECT_EQ(sender, "alice");
+    EXPECT_EQ(chat.remaining(), "hi there");
+
+    std::string_view rest = std::string_view(stream).substr(consumed);
+    ASSERT_EQ(decode_frame(rest, frame, consumed, 64), DecodeStatus::Complete);
+    EXPECT_EQ(frame.type, FrameType::Login);
+    WireReader credentials(frame.payload);
+    std::string_view username, password;
+    ASSERT_TRUE(credentials.read_string(username) && credentials.read_string(password));
+    EXPECT_EQ(username, "bob");
+    EXPECT_EQ(password, "secret");
+    uint8_t extra = 0;
+    EXPECT_FALSE(credentials.read_u8(extra));
+
+    rest = rest.substr(consumed);
+    for (size_t cut = 0; cut < rest.size(); ++cut) {
+        EXPECT_EQ(decode_frame(rest.substr(0, cut), frame, consumed, 64), DecodeStatus::Incomplete);
+    }
+    ASSERT_EQ(decode_frame(rest, frame, consumed, 64), DecodeStatus::Complete);
+    EXPECT_EQ(consumed, rest.size());
+    WireReader error(frame.payload);
+    uint16_t code = 0;
+    ASSERT_TRUE(error.read_u16(code));
+    EXPECT_EQ(code, static_cast<uint16_t>(WireError::Busy));
+    EXPECT_EQ(error.remaining(), "later");
+
+    // The length is checked before waiting for the payload
+    EXPECT_EQ(decode_frame(encode_frame(FrameType::Chat, std::string(65, 'x')).substr(0, WIRE_HEADER_BYTES), frame,
+                           consumed, 64),
+              DecodeStatus::TooLarge);
+
+    // A truncated length-prefixed string leaves the reader where it was
+    std::string short_string = encode_private(FrameType::Private, "carol", "").substr(WIRE_HEADER_BYTES, 4);
+    WireReader truncated(short_string);
+    std::string_view peer;
+    EXPECT_FALSE(truncated.read_string(peer));
+    EXPECT_EQ(truncated.remaining().size(), 4u);
+}
+
+// Reads a binary client's frames until one of `type` arrives
+static bool receive_frame(MemoryTransport& memory, int client, std::string& pending, FrameType type,
+                          std::string& payload) {
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (std::chrono::steady_clock::now() < deadline) {
+        WireFrame frame;
+        size_t consumed = 0;
+        while (decode_frame(pending, frame, consumed, SIZE_MAX) == DecodeStatus::Complete) {
+            const bool found = frame.type == type;
+            if (found) {
+                payload.assign(frame.payload.data(), frame.payload.size());
+            }
+            pending.erase(0, consumed);
+            if (found) {
+                return true;
+            }
+        }
+        pending += memory.client_receive(client, std::chrono::milliseconds(50));
+    }
+    return false;
+}
+
+// Test a binary client and a text client talking through the same server
+TEST_F(ServerTest, BinaryProtocolTest) {
+    MemoryTransport memory;
+    start_test_workers();
+    set_transport(&memory);
+    Database::getInstance().createUser("wp_alice", "pw");
+    Database::getInstance().createUser("wp_bob", "pw");
+
+    // The hello and the start of the login frame share a read; the rest of
+    // the frame arrives in the next one
+    int alice = memory.connect();
+    std::thread alice_handler(handle_client, alice);
+    std::string login = encode_credentials(FrameType::Login, "wp_alice", "pw");
+    ASSERT_TRUE(memory.client_send(alice, encode_hello(WIRE_PROTOCOL_VERSION) + login.substr(0, 3)));
+    ASSERT_TRUE(memory.client_send(alice, login.substr(3)));
+    std::string pending = memory.client_receive_until(alice, std::string(WIRE_HELLO_MAGIC, 4), std::chrono::seconds(5));
+    ASSERT_GE(pending.size(), WIRE_HELLO_BYTES);
+    EXPECT_EQ(pending.substr(0, WIRE_HELLO_BYTES), encode_hello(WIRE_PROTOCOL_VERSION));
+    pending.erase(0, WIRE_HELLO_BYTES);
+
+    std::string payload;
+    ASSERT_TRUE(receive_frame(memory, alice, pending, FrameType::AuthResult, payload));
+    ASSERT_GE(payload.size(), 2u);
+    EXPECT_EQ(payload[0], static_cast<char>(WireAuth::Login));
+    EXPECT_EQ(payload[1], 1);
+    EXPECT_EQ(payload.substr(2), "Login successful!\n");
+
+    int bob = memory.connect();
+    std::thread bob_handler(handle_client, bob);
+    ASSERT_TRUE(memory.client_send(bob, "/login wp_bob pw"));
+    EXPECT_NE(memory.client_receive_until(bob, "Login successful!", std::chrono::seconds(5)), "");
+    ASSERT_TRUE(receive_frame(memory, alice, pending, FrameType::Presence, payload));
+    EXPECT_EQ(payload, std::string("\x01") + "wp_bob");
+
+    // Broadcasts reach each client in its own protocol
+    ASSERT_TRUE(memory.client_send(bob, "hello binary"));
+    ASSERT_TRUE(receive_frame(memory, alice, pending, FrameType::ChatMessage, payload));
+    WireReader chat(payload);
+    uint64_t seq = 0, timestamp_ms = 0;
+    std::string_view sender;
+    ASSERT_TRUE(chat.read_u64(seq) && chat.read_u64(timestamp_ms) && chat.read_string(sender));
+    EXPECT_EQ(seq, chat_history.last_seq());
+    EXPECT_GT(timestamp_ms, 0u);
+    EXPECT_EQ(sender, "wp_bob");
+    EXPECT_EQ(chat.remaining(), "hello binary");
+
+    ASSERT_TRUE(memory.client_send(alice, encode_frame(FrameType::Chat, "/not a command")));
+    EXPECT_NE(memory.client_receive_until(bob, "wp_alice: /not a command", std::chrono::seconds(5)), "");
+
+    const int alice_id = Database::getInstance().getUserID("wp_alice");
+    const int bob_id = Database::getInstance().getUserID("wp_bob");
+    const std::string nonce = std::to_string(trace_now());  // tells this run's messages from earlier ones
+    ASSERT_TRUE(memory.client_send(alice, encode_private(FrameType::Private, "wp_bob", "psst " + nonce)));
+    EXPECT_NE(memory.client_receive_until(bob, "(private from wp_alice) psst " + nonce, std::chrono::seconds(5)), "");
+    ASSERT_TRUE(memory.client_send(bob, "/msg wp_alice hi " + nonce));
+    ASSERT_TRUE(receive_frame(memory, alice, pending, FrameType::PrivateMessage, payload));
+    EXPECT_EQ(payload, encode_private(FrameType::PrivateMessage, "wp_bob", "hi " + nonce).substr(WIRE_HEADER_BYTES));
+    // Both directions are stored once delivered
+    std::vector<std::string> stored;
+    for (int i = 0; i < 500; ++i) {
+        stored.clear();
+        for (const auto& message : message_store().conversation(alice_id, bob_id, UINT64_MAX, 2)) {
+            stored.push_back(message.content);
+        }
+        std::sort(stored.begin(), stored.end());
+        if (stored == std::vector<std::string>{"hi " + nonce, "psst " + nonce}) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(stored, (std::vector<std::string>{"hi " + nonce, "psst " + nonce}));
+
+    // Command replies and errors are typed
+    ASSERT_TRUE(memory.client_send(alice, encode_frame(FrameType::Command, "/list")));
+    ASSERT_TRUE(receive_frame(memory, alice, pending, FrameType::CommandReply, payload));
+    EXPECT_NE(payload.find("wp_bob"), std::string::npos);
+    ASSERT_TRUE(memory.client_send(alice, encode_private(FrameType::Private, "wp_nobody", "hello?")));
+    ASSERT_TRUE(receive_frame(memory, alice, pending, FrameType::Error, payload));
+    EXPECT_EQ(payload, encode_error(WireError::UserNotFound, "User not found.\n").substr(WIRE_HEADER_BYTES));
+    ASSERT_TRUE(memory.client_send(alice, encode_frame(FrameType::Command, "/nope")));
+    ASSERT_TRUE(receive_frame(memory, alice, pending, FrameType::Error, payload));
+    EXPECT_EQ(payload, encode_error(WireError::UnknownCommand, "Unknown command.\n").substr(WIRE_HEADER_BYTES));
+
+    memory.client_close(bob);
+    bob_handler.join();
+    ASSERT_TRUE(receive_frame(memory, alice, pending, FrameType::Presence, payload));
+    EXPECT_EQ(payload, std::string("\x00", 1) + "wp_bob");
+
+    // An oversized frame is refused and the connection closed
+    ASSERT_TRUE(memory.client_send(alice, encode_frame(FrameType::Chat, std::string(WIRE_MAX_FRAME_PAYLOAD + 1, 'x'))));
+    ASSERT_TRUE(receive_frame(memory, alice, pending, FrameType::Error, payload));
+    EXPECT_EQ(payload.substr(0, 2), encode_error(WireError::TooLarge, "").substr(WIRE_HEADER_BYTES));
+    alice_handler.join();
+    EXPECT_TRUE(memory.server_closed(alice));
+
+    // Version 0 is not a version
+    int legacy = memory.connect();
+    std::thread legacy_handler(handle_client, legacy);
+    ASSERT_TRUE(memory.client_send(legacy, encode_hello(0)));
+    legacy_handler.join();
+    pending = memory.client_receive(legacy, std::chrono::seconds(1));
+    ASSERT_TRUE(receive_frame(memory, legacy, pending, FrameType::Error, payload));
+    EXPECT_EQ(payload.substr(0, 2), encode_error(WireError::UnsupportedVersion, "").substr(WIRE_HEADER_BYTES));
+    memory.client_close(legacy);
+    set_transport(nullptr);
+}
+
+// Test the compile-time command table and whitespace-split arguments
+TEST_F(ServerTest, CommandTableTest) {
+    using Table = PerfectHashTable<int, 4>;
+    static constexpr Table table({{{"/a", 1}, {"/ab", 2}, {"/abc", 3}, {"/b", 4}}});
+    static_assert(table.valid(), "no seed found");
+    static_assert(table.find("/abc") && *table.find("/abc") == 3, "lookups work at compile time");
+    EXPECT_EQ(*table.find("/a"), 1);
+    EXPECT_EQ(*table.find("/ab"), 2);
+    EXPECT_EQ(*table.find(std::string("/b")), 4);
+    EXPECT_EQ(table.find(""), nullptr);
+    EXPECT_EQ(table.find("/abcd"), nullptr);
+    EXPECT_EQ(table.find("/c"), nullptr);
+
+    chat_history.append("[10:00:00] alice: a");
+    chat_history.append("[10:00:01] bob: b");
+    int sv[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    Connection* conn = get_available_connection();
+    ASSERT_NE(conn, nullptr);
+    {
+        std::lock_guard<InstrumentedMutex> lock(pool_mtx);
+        conn->socket = sv[0];
+        conn->username = "table_tester";
+        conn->authenticated = true;
+    }
+    auto reply_to = [&](const std::string& command) {
+        process_command(Message{sv[0], command});
+        char buffer[BUFFER_SIZE];
+        ssize_t received = recv(sv[1], buffer, sizeof(buffer) - 1, 0);
+        return received > 0 ? std::string(buffer, static_cast<size_t>(received)) : std::string();
+    };
+
+    // Any run of whitespace separates arguments, as with the text client's
+    // trailing newline
+    std::string reply = reply_to("/history 1\t  1\r\n");
+    EXPECT_NE(reply.find("History (1 messages)"), std::string::npos);
+    EXPECT_NE(reply.find("#2 [10:00:01] bob: b"), std::string::npos);
+    EXPECT_EQ(reply_to("/history 1 1 1").rfind("Usage: /history", 0), 0u);
+    EXPECT_EQ(reply_to("/history x").rfind("Usage: /history", 0), 0u);
+    EXPECT_EQ(reply_to("/trace -1").rfind("Usage: /trace", 0), 0u);
+    EXPECT_EQ(reply_to("/search before:x hello").rfind("Usage: /search", 0), 0u);
+    EXPECT_EQ(reply_to("/search 5").rfind("Usage: /search", 0), std::string::npos);  // a lone number is a term
+    EXPECT_EQ(reply_to("/historyx").rfind("Unknown command.", 0), 0u);
+    EXPECT_EQ(reply_to("/msg nobody_here hi").rfind("User not found.", 0), 0u);
+
+    release_connection(conn);
+    close(sv[1]);
+}
+
+// Test room membership, targeted fan-out and per-room history
+TEST_F(ServerTest, ChatRoomTest) {
+    EXPECT_TRUE(valid_room_name("#dev-ops_2"));
+    EXPECT_FALSE(valid_room_name("dev"));
+    EXPECT_FALSE(valid_room_name("#"));
+    EXPECT_FALSE(valid_room_name("#a b"));
+    EXPECT_FALSE(valid_room_name("#" + std::string(ROOM_NAME_MAX_LENGTH, 'a')));
+
+    // The registry alone, on sockets no connection uses
+    RoomRegistry& registry = RoomRegistry::instance();
+    const int fake = 1 << 20;
+    for (int i = 0; i < MAX_ROOMS_PER_CONNECTION; ++i) {
+        EXPECT_EQ(registry.join(1000 + i, "#cap" + std::to_string(i), fake), RoomJoin::Joined);
+    }
+    EXPECT_EQ(registry.join(999, "#cap_over", fake), RoomJoin::TooManyRooms);
+    EXPECT_EQ(registry.join(1000, "#cap0", fake), RoomJoin::AlreadyMember);
+    EXPECT_EQ(registry.join(1000, "#cap0", fake + 1), RoomJoin::Joined);
+    EXPECT_EQ(registry.member_room_id("#cap0", fake + 1), 1000u);
+    EXPECT_EQ(registry.member_room_id("#cap1", fake + 1), 0u);
+    registry.leave_all(fake);
+    EXPECT_EQ(registry.member_room_id("#cap0", fake), 0u);
+    EXPECT_EQ(registry.member_room_id("#cap0", fake + 1), 1000u);
+    EXPECT_TRUE(registry.leave("#cap0", fake + 1));
+    EXPECT_FALSE(registry.leave("#cap0", fake + 1));
+    for (const auto& room : registry.list(fake)) {
+        EXPECT_NE(room.name.rfind("#cap", 0), 0u);  // empty rooms are forgotten
+    }
+
+    // A claimed delivery is sent outside the registry lock; leaving waits
+    // for it, but the registry does not
+    EXPECT_EQ(registry.join(998, "#inflight", fake), RoomJoin::Joined);
+    std::optional<RoomDelivery> delivery;
+    ASSERT_TRUE(registry.with_members("#inflight", fake, [&](RoomState& state) {
+        delivery.emplace(claim_room_delivery("#inflight", state, false));
+    }));
+    EXPECT_EQ(delivery->members, std::vector<int>{fake});
+    std::atomic<bool> left{false};
+    std::thread leaver([&]() {
+        registry.leave_all(fake);
+        left = true;
+    });
+    for (int i = 0; i < 500 && registry.member_room_id("#inflight", fake) != 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(registry.member_room_id("#inflight", fake), 0u);
+    EXPECT_EQ(registry.join(997, "#other", fake + 2), RoomJoin::Joined);
+    EXPECT_TRUE(registry.leave("#other", fake + 2));
+    EXPECT_FALSE(left);
+    delivery->wait_turn();
+    delivery.reset();
+    leaver.join();
+    EXPECT_TRUE(left);
+
+    // Text members alice and carol, binary member bob, outsider dave
+    MemoryTransport memory;
+    start_test_workers();
+    set_transport(&memory);
+    const std::string room = "#rt" + std::to_string(trace_now() % 1000000000);  // fresh history each run
+    std::map<std::string, int> clients;
+    std::vector<std::thread> handlers;
+    for (const std::string user : {"rt_alice", "rt_carol", "rt_dave"}) {
+        Database::getInstance().createUser(user, "pw");
+        clients[user] = memory.connect();
+        handlers.emplace_back(handle_client, clients[user]);
+        ASSERT_TRUE(memory.client_send(clients[user], "/login " + user + " pw"));
+        EXPECT_NE(memory.client_receive_until(clients[user], "End of history", std::chrono::seconds(5)), "");
+    }
+    Database::getInstance().createUser("rt_bob", "pw");
+    const int bob = memory.connect();
+    handlers.emplace_back(handle_client, bob);
+    ASSERT_TRUE(memory.client_send(bob, encode_hello(WIRE_PROTOCOL_VERSION) +
+                                            encode_credentials(FrameType::Login, "rt_bob", "pw")));
+    std::string pending = memory.client_receive_until(bob, std::string(WIRE_HELLO_MAGIC, 4), std::chrono::seconds(5));
+    ASSERT_GE(pending.size(), WIRE_HELLO_BYTES);
+    pending.erase(0, pending.find(std::string(WIRE_HELLO_MAGIC, 4)) + WIRE_HELLO_BYTES);
+    std::string payload;
+    ASSERT_TRUE(receive_frame(memory, bob, pending, FrameType::AuthResult, payload));
+
+    const int alice = clients["rt_alice"], carol = clients["rt_carol"], dave = clients["rt_dave"];
+    ASSERT_TRUE(memory.client_send(alice, "/join " + room));
+    EXPECT_NE(memory.client_receive_until(alice, "End of room history", std::chrono::seconds(5)).find(
+                  "Joined " + room + ".\nHistory of " + room + " (0 messages):\n"),
+              std::string::npos);
+    ASSERT_TRUE(memory.client_send(carol, "/join " + room));
+    EXPECT_NE(memory.client_receive_until(carol, "End of room history", std::chrono::seconds(5)), "");
+    ASSERT_TRUE(memory.client_send(bob, encode_frame(FrameType::Command, "/join " + room)));
+    do {  // the first reply may be the history replayed on login
+        ASSERT_TRUE(receive_frame(memory, bob, pending, FrameType::CommandReply, payload));
+    } while (payload.rfind("History (", 0) == 0);
+    EXPECT_EQ(payload.rfind("Joined " + room, 0), 0u);
+
+    // Only the other members hear a room message, each in its own protocol
+    ASSERT_TRUE(memory.client_send(alice, "/say " + room + " hello room"));
+    EXPECT_NE(memory.client_receive_until(carol, room + " rt_alice: hello room", std::chrono::seconds(5)), "");
+    ASSERT_TRUE(receive_frame(memory, bob, pending, FrameType::RoomMessage, payload));
+    WireReader frame(payload);
+    uint64_t timestamp_ms = 0;
+    std::string_view frame_room, sender;
+    ASSERT_TRUE(frame.read_u64(timestamp_ms) && frame.read_string(frame_room) && frame.read_string(sender));
+    EXPECT_GT(timestamp_ms, 0u);
+    EXPECT_EQ(frame_room, room);
+    EXPECT_EQ(sender, "rt_alice");
+    EXPECT_EQ(frame.remaining(), "hello room");
+    EXPECT_EQ(memory.client_receive(alice, std::chrono::milliseconds(50)), "");
+    EXPECT_EQ(memory.client_receive(dave, std::chrono::milliseconds(50)), "");
+
+    ASSERT_TRUE(memory.client_send(dave, "/say " + room + " let me in"));
+    EXPECT_NE(memory.client_receive_until(dave, "You are not in " + room + ".", std::chrono::seconds(5)), "");
+    ASSERT_TRUE(memory.client_send(dave, "/roomhistory " + room));
+    EXPECT_NE(memory.client_receive_until(dave, "You are not in " + room + ".", std::chrono::seconds(5)), "");
+    ASSERT_TRUE(memory.client_send(dave, "/join nohash"));
+    EXPECT_NE(memory.client_receive_until(dave, "Usage: /join", std::chrono::seconds(5)), "");
+    ASSERT_TRUE(memory.client_send(dave, "/rooms"));
+    EXPECT_NE(memory.client_receive_until(dave, room + ": 3 members\n", std::chrono::seconds(5)), "");
+
+    // History is stored under the room and paged like /dmhistory
+    const int room_id = Database::getInstance().getRoomID(room);
+    ASSERT_GT(room_id, 0);
+    size_t stored = 0;
+    for (int i = 0; i < 500 && stored == 0; ++i) {
+        stored = message_store().roomHistory(static_cast<uint32_t>(room_id), UINT64_MAX, 10).size();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(stored, 1u);
+    ASSERT_TRUE(memory.client_send(carol, "/roomhistory " + room));
+    EXPECT_NE(memory.client_receive_until(carol, "rt_alice: hello room\nEnd of room history", std::chrono::seconds(5)),
+              "");
+
+    // Disconnecting leaves every room
+    memory.client_close(bob);
+    handlers.back().join();
+    handlers.pop_back();
+    ASSERT_TRUE(memory.client_send(alice, "/rooms"));
+    EXPECT_NE(memory.client_receive_until(alice, room + ": 2 members (joined)\n", std::chrono::seconds(5)), "");
+    ASSERT_TRUE(memory.client_send(alice, "/leave " + room));
+    EXPECT_NE(memory.client_receive_until(alice, "Left " + room + ".", std::chrono::seconds(5)), "");
+    ASSERT_TRUE(memory.client_send(alice, "/leave " + room));
+    EXPECT_NE(memory.client_receive_until(alice, "You are not in " + room + ".", std::chrono::seconds(5)), "");
+
+    for (const auto& client : clients) {
+        memory.client_close(client.second);
+    }
+    for (auto& handler : handlers) {
+        handler.join();
+    }
+    set_transport(nullptr);
+
+    // The log store keeps room messages in their own log and index
+    const std::string dir = "test_room_log";
+    std::filesystem::remove_all(dir);
+    {
+        LogMessageStore store(dir, test_log_options(""));
+        ASSERT_TRUE(store.isOpen());
+        for (int i = 0; i < 10; ++i) {
+            StoredMessage message;
+            message.timestamp_ms = current_time_ms();
+            message.sender_id = 1;
+            message.room_id = i % 2 == 0 ? 7 : 8;
+            message.sender_name = "alice";
+            message.content = "room " + std::to_string(i);
+            ASSERT_TRUE(store.append(message));
+        }
+        auto page = store.roomHistory(7, UINT64_MAX, 3);
+        ASSERT_EQ(page.size(), 3u);
+        EXPECT_EQ(page.front().content, "room 8");
+        EXPECT_EQ(page.front().room_id, 7u);
+        EXPECT_EQ(page.front().receiver_id, 0);
+        EXPECT_EQ(store.roomHistory(7, page.back().seq, 10).size(), 2u);
+        EXPECT_TRUE(store.recentBroadcasts(10).empty());
+        EXPECT_TRUE(store.search(1, "room", UINT64_MAX, 10).messages.empty());
+    }
+    LogMessageStore reopened(dir, test_log_options(""));
+    EXPECT_EQ(reopened.roomHistory(8, UINT64_MAX, 10).size(), 5u);
+    std::filesystem::remove_all(dir);
+}
+
+// Test that a batched room gathers messages and delivers them in one write
+// per member, leaving out each member's own messages
+TEST_F(ServerTest, RoomBatchTest) {
+    MemoryTransport memory;
+    start_test_workers();
+    set_transport(&memory);
+    const std::string room = "#rb" + std::to_string(trace_now() % 1000000000);
+    std::map<std::string, int> clients;
+    std::vector<std::thread> handlers;
+    for (const std::string user : {"rb_alice", "rb_carol", "rb_dave"}) {
+        Database::getInstance().createUser(user, "pw");
+        if (user != "rb_carol") {
+            // Only admins may set a room's batching window
+            sqlite3* admin_db = nullptr;
+            ASSERT_EQ(sqlite3_open("chat_server.db", &admin_db), SQLITE_OK);  // Database::getInstance()
+            const std::string grant = "UPDATE users SET is_admin = 1 WHERE username = '" + user + "'";
+            EXPECT_EQ(sqlite3_exec(admin_db, grant.c_str(), nullptr, nullptr, nullptr), SQLITE_OK);
+            sqlite3_close(admin_db);
+        }
+        clients[user] = memory.connect();
+        handlers.emplace_back(handle_client, clients[user]);
+        ASSERT_TRUE(memory.client_send(clients[user], "/login " + user + " pw"));
+        EXPECT_NE(memory.client_receive_until(clients[user], "End of history", std::chrono::seconds(5)), "");
+    }
+    Database::getInstance().createUser("rb_bob", "pw");
+    const int bob = memory.connect();
+    handlers.emplace_back(handle_client, bob);
+    ASSERT_TRUE(memory.client_send(bob, encode_hello(WIRE_PROTOCOL_VERSION) +
+                                            encode_credentials(FrameType::Login, "rb_bob", "pw")));
+    std::string pending = memory.client_receive_until(bob, std::string(WIRE_HELLO_MAGIC, 4), std::chrono::seconds(5));
+    ASSERT_GE(pending.size(), WIRE_HELLO_BYTES);
+    pending.erase(0, pending.find(std::string(WIRE_HELLO_MAGIC, 4)) + WIRE_HELLO_BYTES);
+    std::string payload;
+    ASSERT_TRUE(receive_frame(memory, bob, pending, FrameType::AuthResult, payload));
+
+    const int alice = clients["rb_alice"], carol = clients["rb_carol"], dave = clients["rb_dave"];
+    for (int member : {alice, carol}) {
+        ASSERT_TRUE(memory.client_send(member, "/join " + room));
+        EXPECT_NE(memory.client_receive_until(member, "End of room history", std::chrono::seconds(5)), "");
+    }
+    ASSERT_TRUE(memory.client_send(bob, encode_frame(FrameType::Command, "/join " + room)));
+    do {
+        ASSERT_TRUE(receive_frame(memory, bob, pending, FrameType::CommandReply, payload));
+    } while (payload.rfind("Joined " + room, 0) != 0);
+
+    ASSERT_TRUE(memory.client_send(carol, "/roombatch " + room + " 10"));
+    EXPECT_NE(memory.client_receive_until(carol, "Permission denied.", std::chrono::seconds(5)), "");
+    ASSERT_TRUE(memory.client_send(dave, "/roombatch " + room + " 10"));
+    EXPECT_NE(memory.client_receive_until(dave, "You are not in " + room + ".", std::chrono::seconds(5)), "");
+    ASSERT_TRUE(memory.client_send(alice, "/roombatch " + room + " 0"));
+    EXPECT_NE(memory.client_receive_until(alice, "Usage: /roombatch", std::chrono::seconds(5)), "");
+    ASSERT_TRUE(memory.client_send(alice, "/roombatch " + room + " " + std::to_string(ROOM_BATCH_MAX_WINDOW_MS)));
+    EXPECT_NE(memory.client_receive_until(alice, "now delivers its messages every", std::chrono::seconds(5)), "");
+    ASSERT_TRUE(memory.client_send(dave, "/rooms"));
+    EXPECT_NE(memory.client_receive_until(dave, room + ": 3 members, batched every", std::chrono::seconds(5)), "");
+
+    // Sent straight from here so all four land in one window
+    ASSERT_TRUE(broadcast_room(alice, room, "one"));
+    ASSERT_TRUE(broadcast_room(carol, room, "two"));
+    ASSERT_TRUE(broadcast_room(alice, room, "three"));
+    ASSERT_TRUE(broadcast_room(bob, room, "four"));
+    EXPECT_FALSE(broadcast_room(dave, room, "outsider"));
+
+    std::string received = memory.client_receive_until(carol, "four", std::chrono::seconds(5));
+    EXPECT_NE(received.find(room + " rb_alice: one\n"), std::string::npos);
+    EXPECT_LT(received.find("rb_alice: one"), received.find("rb_alice: three"));
+    EXPECT_LT(received.find("rb_alice: three"), received.find("rb_bob: four"));
+    EXPECT_EQ(received.find("rb_carol: two"), std::string::npos);
+    received = memory.client_receive_until(alice, "four", std::chrono::seconds(5));
+    EXPECT_NE(received.find("rb_carol: two\n"), std::string::npos);
+    EXPECT_EQ(received.find("rb_alice"), std::string::npos);
+
+    ASSERT_TRUE(receive_frame(memory, bob, pending, FrameType::RoomBatch, payload));
+    WireReader frame(payload);
+    std::string_view frame_room;
+    ASSERT_TRUE(frame.read_string(frame_room));
+    EXPECT_EQ(frame_room, room);
+    std::vector<std::string> texts;
+    uint64_t timestamp_ms = 0;
+    std::string_view sender, text;
+    while (frame.read_u64(timestamp_ms) && frame.read_string(sender) && frame.read_string(text)) {
+        texts.push_back(std::string(sender) + ": " + std::string(text));
+    }
+    EXPECT_EQ(texts, (std::vector<std::string>{"rb_alice: one", "rb_carol: two", "rb_alice: three"}));
+    EXPECT_TRUE(frame.remaining().empty());
+
+    // Turning batching off delivers what was gathered before anything newer
+    ASSERT_TRUE(broadcast_room(carol, room, "five"));
+    ASSERT_TRUE(set_room_batch_window(alice, room, 0));
+    ASSERT_TRUE(broadcast_room(carol, room, "six"));
+    received = memory.client_receive_until(alice, "six", std::chrono::seconds(5));
+    EXPECT_LT(received.find("rb_carol: five"), received.find("rb_carol: six"));
+    ASSERT_TRUE(receive_frame(memory, bob, pending, FrameType::RoomBatch, payload));
+    EXPECT_NE(payload.find("five"), std::string::npos);
+    ASSERT_TRUE(receive_frame(memory, bob, pending, FrameType::RoomMessage, payload));
+    EXPECT_NE(payload.find("six"), std::string::npos);
+
+    for (const auto& client : clients) {
+        memory.client_close(client.second);
+    }
+    memory.client_close(bob);
+    for (auto& handler : handlers) {
+        handler.join();
+    }
+    set_transport(nullptr);
+}
+
+// Test that a large fan-out is split across threads and still reaches every
+// recipient once, in order
+TEST_F(ServerTest, ParallelFanoutTest) {
+    MemoryTransport memory;
+    set_transport(&memory);
+    std::vector<FanoutTarget> targets;
+    for (int i = 0; i < 40; ++i) {
+        targets.push_back(FanoutTarget{memory.connect(), i % 3 == 0});
+    }
+    memory.client_close(targets[5].socket);
+    memory.client_close(targets[31].socket);
+
+    FanoutPool pool(3, 16, 4);
+    const std::vector<FanoutTarget> few(targets.begin(), targets.begin() + 8);
+    FanoutResult small = pool.deliver(few, "t0\n", "b0\n");
+    EXPECT_FALSE(small.parallel);
+    EXPECT_EQ(small.failed, std::vector<size_t>{5});
+    for (int m = 1; m <= 20; ++m) {
+        const std::string n = std::to_string(m);
+        FanoutResult sent = pool.deliver(targets, "t" + n + "\n", "b" + n + "\n");
+        EXPECT_TRUE(sent.parallel);
+        EXPECT_EQ(sent.failed, (std::vector<size_t>{5, 31}));
+        EXPECT_GT(sent.first_send_ns, 0);
+        EXPECT_GE(sent.last_send_ns, sent.first_send_ns);
+    }
+    for (size_t i = 0; i < targets.size(); ++i) {
+        if (i == 5 || i == 31) {
+            continue;
+        }
+        const char* kind = targets[i].binary ? "b" : "t";
+        std::string expected = i < few.size() ? std::string(kind) + "0\n" : "";
+        for (int m = 1; m <= 20; ++m) {
+            expected += kind + std::to_string(m) + "\n";
+        }
+        EXPECT_EQ(memory.client_receive(targets[i].socket), expected) << "recipient " << i;
+    }
+
+    // Without helper threads everything runs inline
+    FanoutPool inline_pool(0, 1, 1);
+    EXPECT_FALSE(inline_pool.deliver(targets, "x", "y").parallel);
+    set_transport(nullptr);
+}
+
+// Records what a cluster node's peers send it
+class RecordingClusterHandler : public ClusterHandler {
+public:
+    explicit RecordingClusterHandler(std::vector<std::string> here) : here(std::move(here)) {}
+
+    void peer_broadcast(uint16_t, int64_t, const std::string& sender, const std::string& text) override {
+        record("broadcast " + sender + ": " + text);
+    }
+    bool peer_private(uint16_t, const std::string& sender, const std::string& recipient,
+                      const std::string& text) override {
+        if (std::find(here.begin(), here.end(), recipient) == here.end()) {
+            return false;
+        }
+        record("private " + sender + ">" + recipient + ": " + text);
+        return true;
+    }
+    void peer_presence(uint16_t node, const std::string& username, bool online) override {
+        record("presence " + username + "@" + std::to_string(node) + (online ? " on" : " off"));
+    }
+    std::vector<std::string> local_users() override { return here; }
+
+    std::vector<std::string> events() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return recorded;
+    }
+    bool saw(const std::string& event) {
+        auto all = events();
+        return std::find(all.begin(), all.end(), event) != all.end();
+    }
+
+private:
+    void record(std::string event) {
+        std::lock_guard<std::mutex> lock(mtx);
+        recorded.push_back(std::move(event));
+    }
+
+    const std::vector<std::string> here;
+    std::mutex mtx;
+    std::vector<std::string> recorded;
+};
+
+static bool eventually(const std::function<bool()>& condition) {
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!condition()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return true;
+}
+
+// Test the cluster directory, two linked nodes, and a server node
+// exchanging broadcasts, private messages and presence with a peer
+TEST_F(ServerTest, ClusterTest) {
+    PeerAddress peer;
+    EXPECT_TRUE(parse_peer_address("2@127.0.0.1:6555", peer));
+    EXPECT_EQ(peer.node, 2);
+    EXPECT_EQ(peer.host, "127.0.0.1");
+    EXPECT_EQ(peer.port, 6555);
+    EXPECT_FALSE(parse_peer_address("127.0.0.1:6555", peer));
+    EXPECT_FALSE(parse_peer_address("0@127.0.0.1:6555", peer));
+    EXPECT_FALSE(parse_peer_address("x@127.0.0.1:6555", peer));
+    EXPECT_FALSE(parse_peer_address("2@127.0.0.1", peer));
+    EXPECT_FALSE(parse_peer_address("2@localhost:6555", peer));
+    EXPECT_FALSE(parse_peer_address("2@127.0.0.1:70000", peer));
+    EXPECT_FALSE(parse_peer_address("2@127.0.0.1:65x", peer));
+
+    // A user on several nodes routes to the lowest-numbered one
+    ClusterDirectory directory;
+    EXPECT_TRUE(directory.add(5, "ann"));
+    EXPECT_FALSE(directory.add(5, "ann"));
+    EXPECT_TRUE(directory.add(2, "ann"));
+    EXPECT_EQ(directory.node_for("ann"), 2);
+    auto changed = directory.replace(2, {"ben", "cat"});
+    EXPECT_EQ(changed.size(), 3u);
+    EXPECT_EQ(directory.node_for("ann"), 5);
+    EXPECT_EQ(directory.node_for("cat"), 2);
+    EXPECT_TRUE(directory.replace(2, {"ben", "cat"}).empty());
+    EXPECT_TRUE(directory.remove(5, "ann"));
+    EXPECT_FALSE(directory.remove(5, "ann"));
+    EXPECT_EQ(directory.node_for("ann"), 0);
+    EXPECT_EQ(directory.drop(2), (std::vector<std::string>{"ben", "cat"}));
+    EXPECT_EQ(directory.size(), 0u);
+
+    // Two nodes linked both ways announce their users to each other
+    const std::string secret = "cluster test secret";
+    RecordingClusterHandler first_handler({"alice"});
+    RecordingClusterHandler second_handler({"bob"});
+    ClusterNode first(1, secret, first_handler);
+    ClusterNode second(2, secret, second_handler);
+    ASSERT_TRUE(first.start("127.0.0.1", 0, {}));
+    ASSERT_TRUE(second.start("127.0.0.1", 0, {PeerAddress{1, "127.0.0.1", first.port()}}));
+    first.add_peer(PeerAddress{2, "127.0.0.1", second.port()});
+    ASSERT_TRUE(eventually([&]() {
+        return first.directory().node_for("bob") == 2 && second.directory().node_for("alice") == 1;
+    }));
+    EXPECT_EQ(first.stats().peers_up, 1u);
+    EXPECT_TRUE(first_handler.saw("presence bob@2 on"));
+
+    // Broadcasts arrive in order; frames queued together share a write
+    for (int i = 0; i < 200; ++i) {
+        first.publish_broadcast(current_time_ms(), "alice", "line " + std::to_string(i));
+    }
+    ASSERT_TRUE(eventually([&]() { return second_handler.events().size() >= 201; }));
+    std::vector<std::string> events = second_handler.events();
+    for (int i = 0; i < 200; ++i) {
+        EXPECT_EQ(events[1 + i], "broadcast alice: line " + std::to_string(i));
+    }
+    ClusterStats stats = first.stats();
+    EXPECT_GE(stats.frames_sent, 201u);
+    EXPECT_LE(stats.writes, stats.frames_sent);
+    EXPECT_EQ(stats.frames_dropped, 0u);
+
+    EXPECT_TRUE(first.route_private("alice", "bob", "psst"));
+    EXPECT_FALSE(first.route_private("alice", "nobody", "psst"));
+    EXPECT_TRUE(eventually([&]() { return second_handler.saw("private alice>bob: psst"); }));
+
+    // Only configured node ids holding the secret get in, and nothing
+    // before the handshake is read
+    RecordingClusterHandler intruder_handler({"mallory"});
+    ClusterNode unknown_node(9, secret, intruder_handler);
+    ASSERT_TRUE(unknown_node.start("127.0.0.1", 0, {PeerAddress{1, "127.0.0.1", first.port()}}));
+    EXPECT_TRUE(eventually([&]() { return first.stats().links_refused >= 1; }));
+    unknown_node.stop();
+    EXPECT_EQ(unknown_node.stats().peers_up, 0u);
+
+    ClusterNode wrong_secret(2, "not the cluster secret", intruder_handler);
+    ASSERT_TRUE(wrong_secret.start("127.0.0.1", 0, {PeerAddress{1, "127.0.0.1", first.port()}}));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    EXPECT_EQ(wrong_secret.stats().peers_up, 0u);  // first's proof does not check out
+    wrong_secret.stop();
+
+    sockaddr_in first_address{};
+    first_address.sin_family = AF_INET;
+    first_address.sin_port = htons(static_cast<uint16_t>(first.port()));
+    inet_pton(AF_INET, "127.0.0.1", &first_address.sin_addr);
+    auto raw_link = [&](const std::string& frames) {
+        int raw = socket(AF_INET, SOCK_STREAM, 0);
+        timeval timeout{5, 0};
+        setsockopt(raw, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        EXPECT_EQ(connect(raw, reinterpret_cast<sockaddr*>(&first_address), sizeof(first_address)), 0);
+        EXPECT_EQ(send(raw, frames.data(), frames.size(), MSG_NOSIGNAL), static_cast<ssize_t>(frames.size()));
+        std::string reply;
+        char chunk[256];
+        ssize_t received;
+        while ((received = recv(raw, chunk, sizeof(chunk), 0)) > 0) {
+            reply.append(chunk, static_cast<size_t>(received));
+        }
+        EXPECT_EQ(received, 0);  // closed by first
+        close(raw);
+        return reply;
+    };
+    // A hello as node 2 without the secret gets a reply, but a bad proof ends it
+    const uint64_t refused = first.stats().links_refused;
+    std::string reply = raw_link(encode_peer_hello(2, std::string(16, 'n'), "") +
+                                 encode_peer_auth(std::string(32, 'p')) +
+                                 encode_peer_broadcast(current_time_ms(), "mallory", "forged"));
+    EXPECT_EQ(static_cast<uint8_t>(reply[0]), static_cast<uint8_t>(FrameType::PeerHello));
+    EXPECT_EQ(first.stats().links_refused, refused + 1);
+    // Frames before a hello close the link without a reply
+    EXPECT_EQ(raw_link(encode_peer_broadcast(current_time_ms(), "mallory", "forged")), "");
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_FALSE(first_handler.saw("broadcast mallory: forged"));
+    EXPECT_EQ(first.directory().node_for("bob"), 2);
+
+    ClusterNode short_secret(5, "short", intruder_handler);
+    EXPECT_FALSE(short_secret.start("127.0.0.1", 0, {}));
+
+    second.publish_presence("carol", true);
+    EXPECT_TRUE(eventually([&]() { return first.directory().node_for("carol") == 2; }));
+    second.publish_presence("carol", false);
+    EXPECT_TRUE(eventually([&]() { return first_handler.saw("presence carol@2 off"); }));
+    EXPECT_EQ(first.directory().node_for("carol"), 0);
+
+    // A node that goes away takes its users with it
+    second.stop();
+    EXPECT_TRUE(eventually([&]() { return first_handler.saw("presence bob@2 off"); }));
+    EXPECT_EQ(first.directory().node_for("bob"), 0);
+    first.stop();
+
+    // This server as node 3, next to a recorded node 4
+    MemoryTransport memory;
+    start_test_workers();
+    set_transport(&memory);
+    RecordingClusterHandler remote_handler({"cl_bob"});
+    ClusterNode local(3, secret, server_cluster_handler());
+    ClusterNode remote(4, secret, remote_handler);
+    ASSERT_TRUE(local.start("127.0.0.1", 0, {}));
+    ASSERT_TRUE(remote.start("127.0.0.1", 0, {PeerAddress{3, "127.0.0.1", local.port()}}));
+    local.add_peer(PeerAddress{4, "127.0.0.1", remote.port()});
+    set_cluster_node(&local);
+    ASSERT_TRUE(eventually([&]() { return local.directory().node_for("cl_bob") == 4 && remote.stats().peers_up == 1; }));
+
+    Database::getInstance().createUser("cl_alice", "pw");
+    const int alice = memory.connect();
+    std::thread handler(handle_client, alice);
+    ASSERT_TRUE(memory.client_send(alice, "/login cl_alice pw"));
+    EXPECT_NE(memory.client_receive_until(alice, "End of history", std::chrono::seconds(5)), "");
+    EXPECT_TRUE(eventually([&]() { return remote.directory().node_for("cl_alice") == 3; }));
+
+    ASSERT_TRUE(memory.client_send(alice, "hello cluster"));
+    EXPECT_TRUE(eventually([&]() { return remote_handler.saw("broadcast cl_alice: hello cluster"); }));
+    ASSERT_TRUE(memory.client_send(alice, "/msg cl_bob psst"));
+    EXPECT_TRUE(eventually([&]() { return remote_handler.saw("private cl_alice>cl_bob: psst"); }));
+    ASSERT_TRUE(memory.client_send(alice, "/list"));
+    EXPECT_NE(memory.client_receive_until(alice, "cl_bob (node 4)", std::chrono::seconds(5)), "");
+
+    // Node 4's cl_bob is cl_bob@4 here, whether or not cl_bob has an
+    // account here too; that account is never credited with their messages
+    Database::getInstance().createUser("cl_bob", "pw");
+    remote.publish_broadcast(current_time_ms(), "cl_bob", "hi from node 4");
+    EXPECT_NE(memory.client_receive_until(alice, "cl_bob@4: hi from node 4", std::chrono::seconds(5)), "");
+    EXPECT_TRUE(chat_history.snapshot().back()->text.find("cl_bob@4: hi from node 4") != std::string::npos);
+    broadcast_writer().drain();
+    auto stored = message_store().recentBroadcasts(1);
+    ASSERT_EQ(stored.size(), 1u);
+    EXPECT_EQ(stored[0].content, "hi from node 4");
+    EXPECT_EQ(stored[0].sender_name, "cl_bob@4");
+    EXPECT_EQ(stored[0].sender_id, 0);
+
+    ASSERT_TRUE(remote.route_private("cl_bob", "cl_alice", "hey"));
+    EXPECT_NE(memory.client_receive_until(alice, "(private from cl_bob@4) hey", std::chrono::seconds(5)), "");
+    ASSERT_TRUE(memory.client_send(alice, "/msg cl_bob@4 answered"));
+    EXPECT_TRUE(eventually([&]() { return remote_handler.saw("private cl_alice>cl_bob: answered"); }));
+    const int cl_alice_id = Database::getInstance().getUserID("cl_alice");
+    const int cl_bob_id = Database::getInstance().getUserID("cl_bob");
+    EXPECT_TRUE(message_store().conversation(cl_alice_id, cl_bob_id, UINT64_MAX, 10).empty());
+
+    const int mallory = memory.connect();
+    std::thread mallory_handler(handle_client, mallory);
+    ASSERT_TRUE(memory.client_send(mallory, "/register cl_bob@4 pw"));
+    EXPECT_NE(memory.client_receive_until(mallory, "cannot contain '@'", std::chrono::seconds(5)), "");
+    memory.client_close(mallory);
+    mallory_handler.join();
+
+    memory.client_close(alice);
+    handler.join();
+    EXPECT_TRUE(eventually([&]() { return remote_handler.saw("presence cl_alice@3 off"); }));
+    set_cluster_node(nullptr);
+    remote.stop();
+    local.stop();
+    set_transport(nullptr);
+}
+
 int main(int argc, char **argv) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();